@@ -0,0 +1,57 @@
+#!/bin/sh
+# Generate the trees served during `make bench`, unless they exist.
+#
+# Usage: fixtures.sh <dir> [large file size, default 1G] [wide dir entries, default 100000]
+#
+#   tiny/   1000 files of 128 bytes
+#   large/  one file of the given size, sparse so it costs no disk space
+#   wide/   a directory with the given number of empty files
+#   tree/   10 directories of 10 directories of 100 empty files, for poolbench
+#
+# Next to the trees, *.mix files list weighted paths for loadgen -f.
+
+set -e
+dir=$1
+large=${2:-1G}
+wide=${3:-100000}
+[ -n "$dir" ] || { echo "Usage: $0 <dir> [large size] [wide entries]" >&2; exit 1; }
+mkdir -p "$dir"
+cd "$dir"
+
+if [ ! -d tiny ]; then
+    mkdir tiny.tmp
+    i=0
+    while [ $i -lt 1000 ]; do
+        head -c 128 /dev/zero | tr '\0' 'x' > tiny.tmp/f$i.txt
+        i=$((i + 1))
+    done
+    mv tiny.tmp tiny
+fi
+if [ ! -d large ]; then
+    mkdir large.tmp
+    truncate -s "$large" large.tmp/file.bin
+    mv large.tmp large
+fi
+if [ ! -d wide ]; then
+    mkdir wide.tmp
+    (cd wide.tmp && seq -f 'e%.0f' 1 "$wide" | xargs touch)
+    mv wide.tmp wide
+fi
+if [ ! -d tree ]; then
+    mkdir tree.tmp
+    for a in 0 1 2 3 4 5 6 7 8 9; do
+        for b in 0 1 2 3 4 5 6 7 8 9; do
+            mkdir -p tree.tmp/d$a/d$b
+            (cd tree.tmp/d$a/d$b && seq -f 'f%.0f' 1 100 | xargs touch)
+        done
+    done
+    mv tree.tmp tree
+fi
+
+ls tiny | sed 's|^|1 /tiny/|' > tiny.mix
+{
+    sed 's/^1 /20 /' tiny.mix
+    echo "5 /tiny"
+    echo "5 /"
+    echo "1 /wide"
+} > mixed.mix
@@ -0,0 +1,139 @@
+/* htable_bench.c */
+
+/*
+    Benchmark for the header hash table.
+
+    Three workloads are measured:
+    - a request cycle: insert a typical set of request headers,
+      look a few of them up and clear the table, as handle_client() did;
+    - the same cycle with the perfect hash of htable/headers.c, which
+      replaced the table in the server: every name is looked up once
+      and its value kept by header_id, as parse_headers() does;
+    - a bulk run of insert/search/delete/clear over many random keys.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include "../htable/htable.c"
+#include "../htable/headers.c"
+
+#define BULK_KEYS       100000
+#define CYCLES          200000
+
+static const char* header_keys[] = {
+    "host", "user-agent", "accept", "accept-language", "accept-encoding",
+    "connection", "referer", "upgrade-insecure-requests", "if-none-match",
+    "if-modified-since", "cache-control", "sec-fetch-dest", "sec-fetch-mode",
+};
+static const char* header_values[] = {
+    "192.168.1.20:8080",
+    "Mozilla/5.0 (X11; Linux x86_64; rv:128.0) Gecko/20100101 Firefox/128.0",
+    "text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8",
+    "en-US,en;q=0.5", "gzip, deflate, br", "keep-alive",
+    "http://192.168.1.20:8080/music/", "1", "\"5f2a-1a2b\"",
+    "Sat, 12 Oct 2024 10:00:00 GMT", "max-age=0", "document", "navigate",
+};
+#define N_HEADERS (sizeof(header_keys) / sizeof(header_keys[0]))
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void report(const char* name, double ns, size_t ops)
+{
+    printf("%-24s %10zu ops %10.1f ns/op\n", name, ops, ns / ops);
+}
+
+static void bench_request_cycle(void)
+{
+    ht_htable* ht = ht_new();
+    volatile size_t found = 0;
+
+    double start = now_ns();
+    for (size_t i = 0; i < CYCLES; i++) {
+        for (size_t j = 0; j < N_HEADERS; j++)
+            ht_insert(ht, header_keys[j], header_values[j]);
+        found += ht_search(ht, "host") != NULL;
+        found += ht_search(ht, "content-length") != NULL;
+        found += ht_search(ht, "transfer-encoding") != NULL;
+        found += ht_search(ht, "connection") != NULL;
+        ht_clear(ht);
+    }
+    report("request cycle", now_ns() - start, CYCLES);
+    ht_del_htable(ht);
+}
+
+static void bench_lookup_cycle(void)
+{
+    slice values[HEADER_COUNT];
+    size_t key_lens[N_HEADERS];
+    for (size_t j = 0; j < N_HEADERS; j++)
+        key_lens[j] = strlen(header_keys[j]);
+    volatile size_t found = 0;
+
+    double start = now_ns();
+    for (size_t i = 0; i < CYCLES; i++) {
+        memset(values, 0, sizeof(values));
+        for (size_t j = 0; j < N_HEADERS; j++) {
+            header_id id = header_lookup(header_keys[j], key_lens[j]);
+            if (id != H_UNKNOWN)
+                values[id] = (slice) {header_values[j], strlen(header_values[j])};
+        }
+        found += values[H_HOST].ptr != NULL;
+        found += values[H_CONTENT_LENGTH].ptr != NULL;
+        found += values[H_TRANSFER_ENCODING].ptr != NULL;
+        found += values[H_CONNECTION].ptr != NULL;
+    }
+    report("header_lookup cycle", now_ns() - start, CYCLES);
+}
+
+static void bench_bulk(void)
+{
+    char (*keys)[16] = malloc(BULK_KEYS * sizeof(*keys));
+    if (!keys) return;
+    srand(42);
+    for (size_t i = 0; i < BULK_KEYS; i++)
+        snprintf(keys[i], sizeof(keys[i]), "k%08x%04x", rand(), (unsigned) i & 0xffff);
+
+    ht_htable* ht = ht_new();
+    volatile size_t found = 0;
+
+    double start = now_ns();
+    for (size_t i = 0; i < BULK_KEYS; i++)
+        ht_insert(ht, keys[i], keys[i]);
+    report("insert", now_ns() - start, BULK_KEYS);
+
+    start = now_ns();
+    for (size_t i = 0; i < BULK_KEYS; i++)
+        found += ht_search(ht, keys[i]) != NULL;
+    report("search hit", now_ns() - start, BULK_KEYS);
+
+    start = now_ns();
+    for (size_t i = 0; i < BULK_KEYS; i++)
+        found += ht_search(ht, keys[i] + 1) != NULL;
+    report("search miss", now_ns() - start, BULK_KEYS);
+
+    start = now_ns();
+    for (size_t i = 0; i < BULK_KEYS; i += 2)
+        ht_delete(ht, keys[i]);
+    report("delete", now_ns() - start, BULK_KEYS / 2);
+
+    start = now_ns();
+    ht_clear(ht);
+    report("clear", now_ns() - start, 1);
+
+    ht_del_htable(ht);
+    free(keys);
+}
+
+int main(void)
+{
+    bench_request_cycle();
+    bench_lookup_cycle();
+    bench_bulk();
+    return 0;
+}
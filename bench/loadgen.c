@@ -0,0 +1,559 @@
+/* loadgen.c */
+
+/*
+    HTTP/1.1 load generator for share.
+
+    Usage: loadgen [options] <host> <port>
+     -c <n>         connections (default 16)
+     -d <seconds>   run for this long (default 5)
+     -n <n>         stop after n responses instead
+     -p <depth>     requests in flight per connection (default 1)
+     -k <0|1>       keep connections alive (default 1); with 0 every
+                    request is sent with "Connection: close" on a new connection
+     -r <w>:<path>  request path with weight w, may be repeated (default 1:/)
+     -f <file>      read more weighted paths from file, one "<w> <path>" per line
+     -l <label>     name printed in front of the results
+
+    One thread drives all connections with epoll. Latency is measured
+    from the moment a request is queued to the moment its last response
+    byte is parsed, so with pipelining it includes queueing behind the
+    requests in front of it. Responses may use Content-Length, chunked
+    encoding or be delimited by closing the connection.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define MAX_DEPTH       64
+#define HEAD_SIZE       8192
+#define READ_SIZE       65536
+#define MAX_PATHS       4096
+
+enum parse_state {
+    P_HEAD,
+    P_BODY,             // Content-Length bytes left
+    P_UNTIL_CLOSE,      // no length, the body ends with the connection
+    P_CHUNK_SIZE,
+    P_CHUNK_DATA,
+    P_CHUNK_END,        // "\r\n" after the chunk data
+    P_TRAILER,
+};
+
+struct conn {
+    int fd;
+    bool close_after;   // the current response announced Connection: close
+    enum parse_state state;
+    char head[HEAD_SIZE];
+    size_t head_len;
+    char line[32];      // chunk size line
+    size_t line_len;
+    uint64_t left;
+    int status;
+
+    /* Requests sent and not yet answered, oldest first. */
+    uint64_t sent_at[MAX_DEPTH];
+    int first, inflight;
+
+    /* Bytes of queued requests not yet written. */
+    char* out;
+    size_t out_len, out_cap;
+};
+
+struct path {
+    char* request;      // full request text
+    size_t len;
+    unsigned weight;
+};
+
+static struct path paths[MAX_PATHS];
+static size_t n_paths;
+static uint64_t total_weight;
+
+static const char* host;
+static const char* port;
+static struct addrinfo* addr;
+static int depth = 1;
+static bool keep_alive = true;
+
+static uint32_t* latencies;
+static size_t n_latencies, cap_latencies;
+static uint64_t responses, errors, bad_status, bytes_in;
+static uint64_t max_responses;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* xorshift, seeded per run; the mix only needs to be roughly uniform. */
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL;
+static uint64_t rng(void)
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static void add_path(unsigned weight, const char* path)
+{
+    if (n_paths == MAX_PATHS || weight == 0)
+        return;
+    char buf[8192];
+    int len = snprintf(buf, sizeof(buf), "GET %s HTTP/1.1\r\nHost: %s:%s\r\n%s\r\n",
+                       path, host, port, keep_alive ? "" : "Connection: close\r\n");
+    if (len < 0 || (size_t) len >= sizeof(buf))
+        return;
+    paths[n_paths].request = strdup(buf);
+    paths[n_paths].len = len;
+    paths[n_paths].weight = weight;
+    total_weight += weight;
+    n_paths++;
+}
+
+/* "<w>:<path>" or a plain path with weight 1. */
+static void add_path_arg(const char* arg)
+{
+    char* end;
+    unsigned long w = strtoul(arg, &end, 10);
+    if (end != arg && *end == ':')
+        add_path(w, end + 1);
+    else
+        add_path(1, arg);
+}
+
+static bool add_path_file(const char* file)
+{
+    FILE* f = fopen(file, "r");
+    if (!f)
+        return false;
+    char line[8192], path[8192];
+    unsigned w;
+    while (fgets(line, sizeof(line), f))
+        if (sscanf(line, "%u %8191s", &w, path) == 2)
+            add_path(w, path);
+    fclose(f);
+    return true;
+}
+
+static const struct path* pick_path(void)
+{
+    uint64_t r = rng() % total_weight;
+    for (size_t i = 0; i < n_paths; i++) {
+        if (r < paths[i].weight)
+            return &paths[i];
+        r -= paths[i].weight;
+    }
+    return &paths[n_paths - 1];
+}
+
+static void record_latency(uint64_t ns)
+{
+    if (n_latencies == cap_latencies) {
+        size_t cap = cap_latencies ? cap_latencies * 2 : 65536;
+        uint32_t* tmp = realloc(latencies, cap * sizeof(uint32_t));
+        if (!tmp)
+            return;
+        latencies = tmp;
+        cap_latencies = cap;
+    }
+    uint64_t us = ns / 1000;
+    latencies[n_latencies++] = us > UINT32_MAX ? UINT32_MAX : us;
+}
+
+static bool queue_request(struct conn* c)
+{
+    const struct path* p = pick_path();
+    if (c->out_len + p->len > c->out_cap) {
+        size_t cap = (c->out_len + p->len) * 2;
+        char* tmp = realloc(c->out, cap);
+        if (!tmp)
+            return false;
+        c->out = tmp;
+        c->out_cap = cap;
+    }
+    memcpy(c->out + c->out_len, p->request, p->len);
+    c->out_len += p->len;
+    c->sent_at[(c->first + c->inflight) % MAX_DEPTH] = now_ns();
+    c->inflight++;
+    return true;
+}
+
+static void conn_close(int ep, struct conn* c)
+{
+    epoll_ctl(ep, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->fd = -1;
+}
+
+static bool conn_open(int ep, struct conn* c)
+{
+    c->fd = socket(addr->ai_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (c->fd < 0)
+        return false;
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(c->fd, addr->ai_addr, addr->ai_addrlen) < 0 && errno != EINPROGRESS) {
+        close(c->fd);
+        c->fd = -1;
+        return false;
+    }
+    c->close_after = false;
+    c->state = P_HEAD;
+    c->head_len = 0;
+    c->first = c->inflight = 0;
+    c->out_len = 0;
+
+    int n = keep_alive ? depth : 1;
+    for (int i = 0; i < n; i++)
+        queue_request(c);
+
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLOUT, .data.ptr = c};
+    if (epoll_ctl(ep, EPOLL_CTL_ADD, c->fd, &ev) < 0) {
+        close(c->fd);
+        c->fd = -1;
+        return false;
+    }
+    return true;
+}
+
+/* Parse the head in c->head, which ends with "\r\n\r\n". */
+static void parse_head(struct conn* c)
+{
+    c->head[c->head_len] = 0;
+    c->status = 0;
+    sscanf(c->head, "HTTP/%*d.%*d %d", &c->status);
+
+    bool chunked = false, has_length = false;
+    char* line = strstr(c->head, "\r\n");
+    while (line && line[2] != '\r') {
+        line += 2;
+        char* colon = strchr(line, ':');
+        char* eol = strstr(line, "\r\n");
+        if (colon && colon < eol) {
+            char* v = colon + 1;
+            while (*v == ' ')
+                v++;
+            size_t name_len = colon - line;
+            if (name_len == 14 && strncasecmp(line, "Content-Length", 14) == 0) {
+                has_length = true;
+                c->left = strtoull(v, NULL, 10);
+            } else if (name_len == 17 && strncasecmp(line, "Transfer-Encoding", 17) == 0)
+                chunked = strncasecmp(v, "chunked", 7) == 0;
+            else if (name_len == 10 && strncasecmp(line, "Connection", 10) == 0)
+                c->close_after = strncasecmp(v, "close", 5) == 0;
+        }
+        line = eol;
+    }
+
+    c->line_len = 0;
+    if (c->status == 304 || c->status == 204 || c->status < 200)
+        c->left = 0, c->state = P_BODY;
+    else if (chunked)
+        c->state = P_CHUNK_SIZE;
+    else if (has_length)
+        c->state = P_BODY;
+    else
+        c->state = P_UNTIL_CLOSE;
+}
+
+/* Consume n received bytes, return the number of responses completed. */
+static int parse(struct conn* c, const char* data, size_t n)
+{
+    int done = 0;
+    while (n > 0 || (c->state == P_BODY && c->left == 0)) {
+        switch (c->state) {
+        case P_HEAD: {
+            /* Copy up to the end of the head; the terminator may span reads. */
+            size_t i = 0;
+            while (i < n) {
+                if (c->head_len == HEAD_SIZE - 1)
+                    return -1;
+                c->head[c->head_len++] = data[i++];
+                if (c->head_len >= 4 && memcmp(c->head + c->head_len - 4, "\r\n\r\n", 4) == 0) {
+                    parse_head(c);
+                    break;
+                }
+            }
+            data += i;
+            n -= i;
+            break;
+        }
+        case P_BODY: {
+            size_t take = n < c->left ? n : c->left;
+            data += take;
+            n -= take;
+            c->left -= take;
+            if (c->left > 0)
+                break;
+            /* Response complete. */
+            if (c->inflight == 0)
+                return -1;
+            record_latency(now_ns() - c->sent_at[c->first]);
+            c->first = (c->first + 1) % MAX_DEPTH;
+            c->inflight--;
+            responses++;
+            if (c->status >= 400)
+                bad_status++;
+            done++;
+            c->state = P_HEAD;
+            c->head_len = 0;
+            if (c->close_after)
+                return done;
+            break;
+        }
+        case P_UNTIL_CLOSE:
+            return done;
+        case P_CHUNK_SIZE:
+        case P_TRAILER: {
+            char ch = *data++;
+            n--;
+            if (ch != '\n') {
+                if (c->line_len < sizeof(c->line) - 1)
+                    c->line[c->line_len++] = ch;
+                break;
+            }
+            c->line[c->line_len] = 0;
+            bool empty = c->line_len == 0 || (c->line_len == 1 && c->line[0] == '\r');
+            c->line_len = 0;
+            if (c->state == P_TRAILER) {
+                if (empty)
+                    c->left = 0, c->state = P_BODY;
+                break;
+            }
+            c->left = strtoull(c->line, NULL, 16);
+            c->state = c->left ? P_CHUNK_DATA : P_TRAILER;
+            break;
+        }
+        case P_CHUNK_DATA: {
+            size_t take = n < c->left ? n : c->left;
+            data += take;
+            n -= take;
+            c->left -= take;
+            if (c->left == 0) {
+                c->left = 2;
+                c->state = P_CHUNK_END;
+            }
+            break;
+        }
+        case P_CHUNK_END: {
+            size_t take = n < c->left ? n : c->left;
+            data += take;
+            n -= take;
+            c->left -= take;
+            if (c->left == 0)
+                c->state = P_CHUNK_SIZE;
+            break;
+        }
+        }
+    }
+    return done;
+}
+
+static bool flush_out(struct conn* c)
+{
+    while (c->out_len > 0) {
+        ssize_t w = send(c->fd, c->out, c->out_len, MSG_NOSIGNAL);
+        if (w < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK;
+        memmove(c->out, c->out + w, c->out_len - w);
+        c->out_len -= w;
+    }
+    return true;
+}
+
+static void update_events(int ep, struct conn* c)
+{
+    struct epoll_event ev = {.events = EPOLLIN | (c->out_len ? EPOLLOUT : 0), .data.ptr = c};
+    epoll_ctl(ep, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+/* The connection failed or ended; count what was lost and reconnect. */
+static void conn_restart(int ep, struct conn* c, bool error)
+{
+    if (error)
+        errors++;
+    conn_close(ep, c);
+    if (!conn_open(ep, c))
+        errors++;
+}
+
+static void handle_readable(int ep, struct conn* c)
+{
+    static char buf[READ_SIZE];
+    for (;;) {
+        ssize_t r = recv(c->fd, buf, sizeof(buf), 0);
+        if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (r <= 0) {
+            /* A body delimited by the end of the connection is complete now. */
+            if (c->state == P_UNTIL_CLOSE && c->inflight > 0) {
+                c->left = 0;
+                c->state = P_BODY;
+                parse(c, NULL, 0);
+                conn_restart(ep, c, false);
+            } else
+                conn_restart(ep, c, c->inflight > 0 || r < 0);
+            return;
+        }
+        bytes_in += r;
+        int done = parse(c, buf, r);
+        if (done < 0) {
+            conn_restart(ep, c, true);
+            return;
+        }
+        if (c->close_after && c->state == P_HEAD) {
+            conn_restart(ep, c, false);
+            return;
+        }
+        for (int i = 0; i < done && keep_alive; i++)
+            queue_request(c);
+        if (done > 0 && keep_alive) {
+            if (!flush_out(c)) {
+                conn_restart(ep, c, true);
+                return;
+            }
+            update_events(ep, c);
+        }
+    }
+}
+
+static int cmp_u32(const void* a, const void* b)
+{
+    uint32_t x = *(const uint32_t*) a, y = *(const uint32_t*) b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(double q)
+{
+    if (n_latencies == 0)
+        return 0;
+    return latencies[(size_t)(q * (n_latencies - 1))] / 1000.0;
+}
+
+static void usage(const char* name)
+{
+    fprintf(stderr, "Usage: %s [-c conns] [-d seconds] [-n responses] [-p depth] [-k 0|1]\n"
+                    "       [-r weight:path]... [-f file] [-l label] <host> <port>\n", name);
+}
+
+int main(int argc, char* argv[])
+{
+    int conns = 16, opt;
+    double duration = 5;
+    const char* label = NULL;
+    const char* files[16];
+    const char* args[MAX_PATHS];
+    int n_files = 0, n_args = 0;
+
+    while ((opt = getopt(argc, argv, "c:d:n:p:k:r:f:l:")) != -1) {
+        switch (opt) {
+            case 'c': conns = atoi(optarg); break;
+            case 'd': duration = atof(optarg); break;
+            case 'n': max_responses = strtoull(optarg, NULL, 10); break;
+            case 'p': depth = atoi(optarg); break;
+            case 'k': keep_alive = atoi(optarg) != 0; break;
+            case 'r': if (n_args < MAX_PATHS) args[n_args++] = optarg; break;
+            case 'f': if (n_files < 16) files[n_files++] = optarg; break;
+            case 'l': label = optarg; break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if (argc - optind != 2 || conns < 1 || depth < 1 || depth > MAX_DEPTH) {
+        usage(argv[0]);
+        return 1;
+    }
+    host = argv[optind];
+    port = argv[optind + 1];
+
+    struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+    int err = getaddrinfo(host, port, &hints, &addr);
+    if (err) {
+        fprintf(stderr, "%s: %s\n", host, gai_strerror(err));
+        return 1;
+    }
+
+    for (int i = 0; i < n_args; i++)
+        add_path_arg(args[i]);
+    for (int i = 0; i < n_files; i++)
+        if (!add_path_file(files[i])) {
+            perror(files[i]);
+            return 1;
+        }
+    if (n_paths == 0)
+        add_path(1, "/");
+    rng_state ^= now_ns();
+
+    signal(SIGPIPE, SIG_IGN);
+    int ep = epoll_create1(0);
+    struct conn* cs = calloc(conns, sizeof(struct conn));
+    if (ep < 0 || !cs) {
+        perror("loadgen");
+        return 1;
+    }
+    for (int i = 0; i < conns; i++)
+        if (!conn_open(ep, &cs[i]))
+            errors++;
+
+    struct epoll_event events[256];
+    uint64_t start = now_ns();
+    uint64_t stop = start + (uint64_t)(duration * 1e9);
+    for (;;) {
+        uint64_t now = now_ns();
+        if (max_responses ? responses >= max_responses : now >= stop)
+            break;
+        int timeout = max_responses ? 100 : (int)((stop - now) / 1000000) + 1;
+        int n = epoll_wait(ep, events, 256, timeout);
+        for (int i = 0; i < n; i++) {
+            struct conn* c = events[i].data.ptr;
+            if (c->fd < 0)
+                continue;
+            if (events[i].events & EPOLLOUT) {
+                if (!flush_out(c)) {
+                    conn_restart(ep, c, true);
+                    continue;
+                }
+                update_events(ep, c);
+            }
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                handle_readable(ep, c);
+        }
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+
+    qsort(latencies, n_latencies, sizeof(uint32_t), cmp_u32);
+    if (label)
+        printf("%-24s ", label);
+    printf("%10.0f req/s %9.2f MB/s  p50 %8.3fms  p99 %8.3fms  p999 %8.3fms  (%llu responses, %llu errors, %llu >= 400)\n",
+           responses / elapsed, bytes_in / elapsed / 1e6,
+           percentile(0.5), percentile(0.99), percentile(0.999),
+           (unsigned long long) responses, (unsigned long long) errors,
+           (unsigned long long) bad_status);
+
+    for (int i = 0; i < conns; i++) {
+        if (cs[i].fd >= 0)
+            close(cs[i].fd);
+        free(cs[i].out);
+    }
+    free(cs);
+    free(latencies);
+    freeaddrinfo(addr);
+    return 0;
+}
@@ -0,0 +1,71 @@
+/* log_bench.c */
+
+/*
+    Log calls per second with several processes logging at once, like
+    forked children of the server do. Usage: log_bench [processes] [calls]
+
+    The synchronous run writes through stdio like the logger used to,
+    the asynchronous one goes through the shared ring and writer process.
+    Log output goes to /dev/null, results are printed to stderr.
+
+    /dev/null never blocks, so this is the best case for the synchronous
+    run; see the comment at the top of logger/logger.c for the numbers
+    and what the ring is for.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include "../logger/logger.c"
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double run(int procs, long calls)
+{
+    pid_t pids[procs];
+    double start = now_s();
+    for (int p = 0; p < procs; p++) {
+        if ((pids[p] = fork()) == 0) {
+            for (long i = 0; i < calls; i++)
+                log_info("%s %s\n", "get", "music/albums/2019/cover.jpg");
+            fflush(stdout);
+            _exit(0);
+        }
+    }
+    /* Not wait(), the writer process is a child as well. */
+    for (int p = 0; p < procs; p++)
+        waitpid(pids[p], NULL, 0);
+    return now_s() - start;
+}
+
+int main(int argc, char* argv[])
+{
+    int procs = argc > 1 ? atoi(argv[1]) : 4;
+    long calls = argc > 2 ? atol(argv[2]) : 200000;
+    long total = procs * calls;
+
+    int null = open("/dev/null", O_WRONLY);
+    if (null < 0 || dup2(null, STDOUT_FILENO) < 0) {
+        perror("/dev/null");
+        return 1;
+    }
+
+    double sync = run(procs, calls);
+    fprintf(stderr, "sync   %d procs: %10.0f calls/s\n", procs, total / sync);
+
+    if (!log_start()) {
+        perror("log_start");
+        return 1;
+    }
+    double async = run(procs, calls);
+    size_t dropped = atomic_load(&log_ring->dropped);
+    fprintf(stderr, "async  %d procs: %10.0f calls/s (%zu of %ld dropped)\n",
+            procs, total / async, dropped, total);
+    return 0;
+}
@@ -0,0 +1,297 @@
+/* microbench.c */
+
+/*
+    Microbenchmarks of the hot path primitives.
+
+    Usage: microbench [filter]
+
+    Every benchmark is warmed up while its iteration count is doubled
+    until one run takes about TARGET_NS, then run REPETITIONS times. The
+    median and minimum time per operation are printed together with the
+    median TSC cycles per operation (x86 only) and the allocations per
+    operation, counted by wrapping malloc, calloc and realloc at link
+    time (see the microbench target of the Makefile).
+
+    Only benchmarks whose name contains filter are run.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "../helpers/safe_string.h"
+#include "../helpers/helpers.c"
+#include "../helpers/template.c"
+#include "../htable/htable.c"
+
+#define TARGET_NS       20000000.0
+#define REPETITIONS     7
+#define TEMPLATE_PATH   "static/template.html"
+#define LISTING_ENTRIES 100
+
+/* Allocation counting, the linker routes malloc() to __wrap_malloc(). */
+
+static size_t allocs;
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t n, size_t size);
+void* __real_realloc(void* p, size_t size);
+
+void* __wrap_malloc(size_t size)
+{
+    allocs++;
+    return __real_malloc(size);
+}
+
+void* __wrap_calloc(size_t n, size_t size)
+{
+    allocs++;
+    return __real_calloc(n, size);
+}
+
+void* __wrap_realloc(void* p, size_t size)
+{
+    allocs++;
+    return __real_realloc(p, size);
+}
+
+/* Inputs, shaped like what the server sees. */
+
+static const char* request_line = "GET /music/albums/2019/cover.jpg HTTP/1.1\r\n";
+static const char* uri_text = "music/albums/2019/../2020/./live/disc1/track07.flac";
+
+static const char* header_keys[] = {
+    "host", "user-agent", "accept", "accept-language", "accept-encoding",
+    "connection", "referer", "upgrade-insecure-requests", "if-none-match",
+    "if-modified-since", "cache-control", "sec-fetch-dest", "sec-fetch-mode",
+};
+static const char* header_values[] = {
+    "192.168.1.20:8080",
+    "Mozilla/5.0 (X11; Linux x86_64; rv:128.0) Gecko/20100101 Firefox/128.0",
+    "text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8",
+    "en-US,en;q=0.5", "gzip, deflate, br", "keep-alive",
+    "http://192.168.1.20:8080/music/", "1", "\"5f2a-1a2b\"",
+    "Sat, 12 Oct 2024 10:00:00 GMT", "max-age=0", "document", "navigate",
+};
+#define N_HEADERS (sizeof(header_keys) / sizeof(header_keys[0]))
+
+static string template;
+static string listing;
+static string uri;
+static string dir_uri;
+static string dir_files[LISTING_ENTRIES];
+static ht_htable* headers;
+static volatile size_t sink;
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static uint64_t cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+/* Benchmarks, each performs iters operations. */
+
+static void bench_scat(size_t iters)
+{
+    string s = snewlen(NULL, 4096);
+    supdatelen(s, 0);
+    for (size_t i = 0; i < iters; i++) {
+        if (sgetlen(s) > 4000)
+            supdatelen(s, 0);
+        s = scat(s, 16, "\r\nContent-type: ");
+    }
+    sink += sgetlen(s);
+    sfree(s);
+}
+
+static void bench_sreplace(size_t iters)
+{
+    for (size_t i = 0; i < iters; i++) {
+        string page = sreplace(template, 8, "#LISTING", sgetlen(listing), listing);
+        sink += sgetlen(page);
+        sfree(page);
+    }
+}
+
+static void bench_ssplit(size_t iters)
+{
+    for (size_t i = 0; i < iters; i++) {
+        size_t n;
+        string* parts = ssplit(uri, 1, "/", &n);
+        sink += n;
+        sfreearr(parts, n);
+    }
+}
+
+/* One operation bites method, uri and version off a request line. */
+static void bench_sbite(size_t iters)
+{
+    size_t len = strlen(request_line);
+    string buffer = snewlen(NULL, len);
+    for (size_t i = 0; i < iters; i++) {
+        memcpy(buffer, request_line, len + 1);
+        supdatelen(buffer, len);
+        string method = sbite(buffer, 1, " ");
+        string path = sbite(buffer, 1, " ");
+        string version = sbite(buffer, 2, "\r\n");
+        sink += sgetlen(method) + sgetlen(path) + sgetlen(version);
+        sfree(method);
+        sfree(path);
+        sfree(version);
+    }
+    sfree(buffer);
+}
+
+/* Inserts a request's worth of headers, then clears the table. */
+static void bench_ht_insert(size_t iters)
+{
+    ht_htable* ht = ht_new();
+    for (size_t i = 0; i < iters; i++) {
+        size_t j = i % N_HEADERS;
+        ht_insert(ht, header_keys[j], header_values[j]);
+        if (j == N_HEADERS - 1)
+            ht_clear(ht);
+    }
+    ht_del_htable(ht);
+}
+
+/* Alternates hits and misses. */
+static void bench_ht_search(size_t iters)
+{
+    static const char* misses[] = {"content-length", "transfer-encoding", "range", "expect"};
+    for (size_t i = 0; i < iters; i++) {
+        const char* key = i & 1 ? misses[(i >> 1) & 3] : header_keys[(i >> 1) % N_HEADERS];
+        sink += ht_search(headers, key) != NULL;
+    }
+}
+
+static void bench_add_links(size_t iters)
+{
+    for (size_t i = 0; i < iters; i++) {
+        string links = add_links(dir_uri, LISTING_ENTRIES, dir_files, NULL);
+        sink += sgetlen(links);
+        sfree(links);
+    }
+}
+
+/* normalize_uri() consumes its argument, so every operation copies the uri first. */
+static void bench_normalize_uri(size_t iters)
+{
+    for (size_t i = 0; i < iters; i++) {
+        string normalized = normalize_uri(sdup(uri));
+        sink += sgetlen(normalized);
+        sfree(normalized);
+    }
+}
+
+static const struct {
+    const char* name;
+    void (*run)(size_t iters);
+} benchmarks[] = {
+    {"scat",            bench_scat},
+    {"sreplace",        bench_sreplace},
+    {"ssplit",          bench_ssplit},
+    {"sbite",           bench_sbite},
+    {"ht_insert",       bench_ht_insert},
+    {"ht_search",       bench_ht_search},
+    {"add_links",       bench_add_links},
+    {"normalize_uri",   bench_normalize_uri},
+};
+
+static int cmp_double(const void* a, const void* b)
+{
+    double x = *(const double*) a, y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+static void run(const char* name, void (*fn)(size_t))
+{
+    /* Warm up while looking for an iteration count that takes TARGET_NS. */
+    size_t iters = 1;
+    double took;
+    for (;;) {
+        double t = now_ns();
+        fn(iters);
+        took = now_ns() - t;
+        if (took >= TARGET_NS / 2 || iters >= ((size_t) 1 << 40))
+            break;
+        iters *= 2;
+    }
+    if (took > 0)
+        iters = iters * (TARGET_NS / took) + 1;
+
+    double ns[REPETITIONS], cyc[REPETITIONS];
+    size_t allocated = 0;
+    for (int r = 0; r < REPETITIONS; r++) {
+        size_t a = allocs;
+        uint64_t c = cycles();
+        double t = now_ns();
+        fn(iters);
+        ns[r] = (now_ns() - t) / iters;
+        cyc[r] = (double)(cycles() - c) / iters;
+        allocated = allocs - a;
+    }
+    qsort(ns, REPETITIONS, sizeof(double), cmp_double);
+    qsort(cyc, REPETITIONS, sizeof(double), cmp_double);
+
+    printf("%-16s %12zu %12.1f %12.1f %12.1f %12.2f\n", name, iters,
+           ns[REPETITIONS / 2], ns[0], cyc[REPETITIONS / 2], (double) allocated / iters);
+}
+
+static bool setup(void)
+{
+    template = read_file(TEMPLATE_PATH);
+    if (!template) {
+        fprintf(stderr, "%s: run from the repository root\n", TEMPLATE_PATH);
+        return false;
+    }
+    uri = snew(uri_text);
+    dir_uri = snew("music/albums/2019");
+    for (size_t i = 0; i < LISTING_ENTRIES; i++) {
+        char name[64];
+        snprintf(name, sizeof(name), "%02zu - Track title number %zu.flac", i, i);
+        dir_files[i] = snew(name);
+    }
+    listing = add_links(dir_uri, LISTING_ENTRIES, dir_files, NULL);
+
+    headers = ht_new();
+    for (size_t j = 0; j < N_HEADERS; j++)
+        ht_insert(headers, header_keys[j], header_values[j]);
+    return template && uri && dir_uri && listing && headers;
+}
+
+int main(int argc, char* argv[])
+{
+    const char* filter = argc > 1 ? argv[1] : "";
+    if (!setup())
+        return 1;
+
+    printf("%-16s %12s %12s %12s %12s %12s\n", "benchmark", "ops/rep", "ns/op", "min ns/op",
+           "cycles/op", "allocs/op");
+    for (size_t i = 0; i < sizeof(benchmarks) / sizeof(benchmarks[0]); i++)
+        if (strstr(benchmarks[i].name, filter))
+            run(benchmarks[i].name, benchmarks[i].run);
+
+    sfree(template);
+    sfree(listing);
+    sfree(uri);
+    sfree(dir_uri);
+    for (size_t i = 0; i < LISTING_ENTRIES; i++)
+        sfree(dir_files[i]);
+    ht_del_htable(headers);
+    return 0;
+}
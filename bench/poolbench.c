@@ -0,0 +1,225 @@
+/* poolbench.c */
+
+/*
+    Walks a directory tree on the thread pool of helpers/pool.c, the way
+    a child does blocking file system work, once per thread count.
+
+    Usage: poolbench [-r runs] [-t threads,...] <dir>
+
+    Every directory is a task that reads its entries, submits a task per
+    subdirectory and stat()s its files in batches of BATCH, each a task
+    too. Before each run the kernel is asked to drop its dentry, inode
+    and page caches (/proc/sys/vm/drop_caches, which needs root), so the
+    stat()s go to the disk or the NAS; the run is marked warm if that
+    fails. For every thread count the median of the runs is printed with
+    the entries per second and the speedup over running the tasks in the
+    calling thread (0 threads).
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "../helpers/pool.c"
+
+#define BATCH           32
+#define MAX_THREADS     16
+#define MAX_RUNS        15
+
+struct batch {
+    struct pool_task task;
+    int dir;
+    char (*names)[256];
+    size_t from, to;
+};
+
+struct walk {
+    struct pool_task task;
+    int parent;                 // -1 for the root
+    char name[256];
+};
+
+static _Atomic uint64_t entries;
+
+static
+void stat_batch(struct pool_task* task)
+{
+    struct batch* b = (struct batch*) task;
+    for (size_t i = b->from; i < b->to; i++) {
+        struct stat st;
+        if (fstatat(b->dir, b->names[i], &st, AT_SYMLINK_NOFOLLOW) == 0)
+            atomic_fetch_add_explicit(&entries, 1, memory_order_relaxed);
+    }
+}
+
+static
+void walk_dir(struct pool_task* task)
+{
+    struct walk* w = (struct walk*) task;
+    int fd = openat(w->parent < 0 ? AT_FDCWD : w->parent, w->name, O_RDONLY | O_DIRECTORY);
+    DIR* dr = fd >= 0 ? fdopendir(fd) : NULL;
+    if (!dr) {
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+
+    size_t n = 0, cap = 256, nsub = 0, subcap = 16;
+    char (*names)[256] = malloc(cap * sizeof(*names));
+    struct walk* subs = malloc(subcap * sizeof(*subs));
+    struct dirent* de;
+    while (names && subs && (de = readdir(dr))) {
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+            continue;
+        if (de->d_type == DT_DIR) {
+            if (nsub == subcap && !(subs = realloc(subs, (subcap *= 2) * sizeof(*subs))))
+                break;
+            subs[nsub] = (struct walk) {.task.run = walk_dir, .parent = fd};
+            snprintf(subs[nsub++].name, sizeof(subs->name), "%s", de->d_name);
+            atomic_fetch_add_explicit(&entries, 1, memory_order_relaxed);
+        } else {
+            if (n == cap && !(names = realloc(names, (cap *= 2) * sizeof(*names))))
+                break;
+            snprintf(names[n++], sizeof(*names), "%s", de->d_name);
+        }
+    }
+
+    /* Subdirectories first, idle threads steal them while the files are stat()ed. */
+    struct pool_group group = {0};
+    size_t nbatch = (n + BATCH - 1) / BATCH;
+    struct batch* batches = names && subs ? malloc((nbatch + 1) * sizeof(*batches)) : NULL;
+    if (batches) {
+        for (size_t i = 0; i < nsub; i++)
+            pool_submit(&group, &subs[i].task);
+        for (size_t i = 0; i < nbatch; i++) {
+            batches[i] = (struct batch) {.task.run = stat_batch, .dir = fd, .names = names,
+                                         .from = i * BATCH, .to = (i + 1) * BATCH < n ? (i + 1) * BATCH : n};
+            pool_submit(&group, &batches[i].task);
+        }
+        pool_wait(&group);
+    }
+    free(batches);
+    free(names);
+    free(subs);
+    closedir(dr);
+}
+
+static
+bool drop_caches(void)
+{
+    sync();
+    FILE* f = fopen("/proc/sys/vm/drop_caches", "w");
+    if (!f)
+        return false;
+    bool ok = fputs("3\n", f) >= 0;
+    return fclose(f) == 0 && ok;
+}
+
+static
+double now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static
+int cmp_double(const void* a, const void* b)
+{
+    double x = *(const double*) a, y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+/*
+    The pool starts its workers once per process, so every thread count
+    is measured in a child of its own.
+*/
+static
+double run(const char* dir, uint32_t threads, bool* cold, uint64_t* n)
+{
+    int fds[2];
+    if (pipe(fds) < 0)
+        return -1;
+    pid_t pid = fork();
+    if (pid == 0) {
+        pool_threads = threads;
+        struct walk root = {.task.run = walk_dir, .parent = -1};
+        snprintf(root.name, sizeof(root.name), "%s", dir);
+        struct pool_group group = {0};
+        double result[3];
+        result[1] = drop_caches();
+        double start = now_ms();
+        pool_submit(&group, &root.task);
+        pool_wait(&group);
+        result[0] = now_ms() - start;
+        result[2] = atomic_load(&entries);
+        if (write(fds[1], result, sizeof(result)) < 0) {}
+        _exit(0);
+    }
+    close(fds[1]);
+    double result[3] = {-1, 0, 0};
+    if (pid < 0 || read(fds[0], result, sizeof(result)) != sizeof(result))
+        result[0] = -1;
+    close(fds[0]);
+    if (pid > 0)
+        waitpid(pid, NULL, 0);
+    *cold = result[1] != 0;
+    *n = result[2];
+    return result[0];
+}
+
+int main(int argc, char* argv[])
+{
+    uint32_t threads[MAX_THREADS] = {0, 1, 2, 4, 8, 16};
+    size_t nthreads = 6;
+    int runs = 3;
+    int opt;
+    while ((opt = getopt(argc, argv, "r:t:")) != -1) {
+        if (opt == 'r' && (runs = atoi(optarg)) > 0 && runs <= MAX_RUNS)
+            continue;
+        if (opt == 't') {
+            nthreads = 0;
+            for (char* p = strtok(optarg, ","); p && nthreads < MAX_THREADS; p = strtok(NULL, ","))
+                threads[nthreads++] = atoi(p);
+            if (nthreads)
+                continue;
+        }
+        optind = argc + 1;
+        break;
+    }
+    if (optind != argc - 1) {
+        fprintf(stderr, "Usage: %s [-r runs] [-t threads,...] <dir>\n", argv[0]);
+        return 1;
+    }
+
+    double base = 0;
+    for (size_t i = 0; i < nthreads; i++) {
+        double ms[MAX_RUNS];
+        bool cold = true;
+        uint64_t n = 0;
+        for (int r = 0; r < runs; r++) {
+            bool c;
+            if ((ms[r] = run(argv[optind], threads[i], &c, &n)) < 0) {
+                fprintf(stderr, "Could not walk %s\n", argv[optind]);
+                return 1;
+            }
+            cold &= c;
+        }
+        qsort(ms, runs, sizeof(double), cmp_double);
+        double median = ms[runs / 2];
+        if (i == 0)
+            base = median;
+        printf("%2u threads  %-4s  %8llu entries  %10.3fms  %12.0f entries/s  x%.2f\n",
+               threads[i], cold ? "cold" : "warm", (unsigned long long) n, median,
+               n / (median / 1e3), base / median);
+    }
+    return 0;
+}
@@ -0,0 +1,37 @@
+#!/bin/sh
+# Run the `make bench` scenarios against a share server started in the
+# fixture tree, one line of results per scenario.
+#
+# Usage: run.sh <share> <loadgen> <fixture dir> <port> <seconds per scenario>
+#               [<tag> [server options...]]
+# A tag is put in front of every label, the options are passed to share.
+
+set -e
+share=$(realpath "$1")
+loadgen=$(realpath "$2")
+dir=$3
+port=$4
+secs=$5
+tag=${6:+$6: }
+shift 5
+[ $# -gt 0 ] && shift
+
+cd "$dir"
+"$share" -l error "$@" localhost "$port" > /dev/null &
+server=$!
+trap 'kill $server 2> /dev/null' EXIT INT TERM
+sleep 1
+
+run() {
+    label=$tag$1
+    shift
+    "$loadgen" -l "$label" -d "$secs" "$@" localhost "$port"
+}
+
+run "tiny keep-alive"       -c 32 -f tiny.mix
+run "tiny pipelined x8"     -c 32 -p 8 -f tiny.mix
+run "tiny close"            -c 32 -k 0 -f tiny.mix
+run "listing 1k entries"    -c 8 -r /tiny
+run "listing wide dir"      -c 8 -r /wide
+run "mixed"                 -c 32 -f mixed.mix
+"$loadgen" -l "${tag}large file" -c 1 -n 2 -r /large/file.bin localhost "$port"
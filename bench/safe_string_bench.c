@@ -0,0 +1,244 @@
+/* safe_string_bench.c */
+
+/*
+    Compare the scanning functions of safe_string.c against the byte by
+    byte implementations they replaced, on inputs shaped like the ones
+    the server sees: a browser request, a URI and a rendered listing.
+    Both versions must agree, otherwise the benchmark aborts.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include "../helpers/safe_string.h"
+
+#define ITERATIONS      200000
+
+static const char* request_text =
+    "GET /music/albums/2019/cover.jpg HTTP/1.1\r\n"
+    "Host: 192.168.1.20:8080\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) Gecko/20100101 Firefox/128.0\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Connection: keep-alive\r\n"
+    "Referer: http://192.168.1.20:8080/music/albums/2019\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "\r\n";
+
+static const char* uri_text = "music/albums/2019/../2020/./live/disc1/track07.flac";
+
+/* Previous implementations, kept verbatim for comparison. */
+
+static ssize_t sfind_ref(string s, size_t plen, const char* pattern) {
+    size_t n = sgetlen(s);
+    if (plen > n || plen == 0)
+        return -1;
+    for (size_t idx = 0; idx <= n - plen; idx++) {
+        if (s[idx] == pattern[0] && memcmp(s + idx, pattern, plen) == 0)
+            return idx;
+    }
+    return -1;
+}
+
+static ssize_t scount_ref(string s, size_t plen, const char* pattern) {
+    size_t count = 0;
+    for (size_t idx = 0; idx <= sgetlen(s) - plen; idx++) {
+        if (s[idx] == pattern[0] && memcmp(s + idx, pattern, plen) == 0)
+            count++;
+    }
+    return count;
+}
+
+static size_t scount_private_ref(const string s, size_t plen, const char* pattern) {
+    size_t count = 0;
+    size_t idx = 0;
+    while (idx <= sgetlen(s) - plen) {
+        if (s[idx] == pattern[0] && memcmp(s + idx, pattern, plen) == 0) {
+            count++;
+            idx += plen;
+        } else
+            idx++;
+    }
+    return count;
+}
+
+static string* ssplit_ref(const string s, size_t seplen, const char* sep, size_t* n) {
+    size_t count = scount_private_ref(s, seplen, sep);
+    string* arr = malloc((count + 1) * sizeof(string));
+    size_t elem = 0;
+    size_t start = 0;
+    for (size_t idx = 0; idx <= sgetlen(s) - seplen; idx++) {
+        if (s[idx] == sep[0] && (seplen == 1 || memcmp(s + idx, sep, seplen) == 0)) {
+            arr[elem++] = snewlen(s + start, idx - start);
+            idx += seplen - 1;
+            start = idx + 1;
+        }
+    }
+    arr[elem] = snewlen(s + start, sgetlen(s) - start);
+    *n = elem + 1;
+    return arr;
+}
+
+static bool sltrimchar_ref(string s, size_t c_size, char* c_arr) {
+    size_t slen = sgetlen(s);
+    size_t counter = 0;
+    for (size_t idx = 0; idx < slen; ++idx) {
+        bool found = false;
+        for (size_t c_idx = 0; c_idx < c_size; ++c_idx) {
+            if (s[idx] == c_arr[c_idx]) {
+                ++counter;
+                found = true;
+                break;
+            }
+        }
+        if (!found)
+            break;
+    }
+    memmove(s, s + counter, slen - counter);
+    supdatelen(s, slen - counter);
+    s[slen - counter] = 0;
+    return true;
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void report(const char* name, double ref_ns, double new_ns)
+{
+    printf("%-28s %10.1f ns/op %10.1f ns/op %6.2fx\n",
+           name, ref_ns / ITERATIONS, new_ns / ITERATIONS, ref_ns / new_ns);
+}
+
+static void check(bool ok, const char* what)
+{
+    if (!ok) {
+        fprintf(stderr, "mismatch: %s\n", what);
+        exit(1);
+    }
+}
+
+/* Build a listing page like send_template() does for a 500 entry directory. */
+static string make_listing(void)
+{
+    string page = snew("<!DOCTYPE html>\n<html lang=\"en\">\n<head>\n<title>#TITLE</title>\n"
+                       "<link rel=stylesheet href=\"/PATH_TO_TEMPLATE_DIR/style.css\">\n"
+                       "</head>\n<body>\n<h1>#TITLE</h1>\n<ul>\n");
+    char line[128];
+    for (int i = 0; i < 500; i++) {
+        int len = snprintf(line, sizeof(line),
+                           "<li><a href=\"/photos/2024/IMG_%04d.jpg\">IMG_%04d.jpg</a></li>\n", i, i);
+        page = scat(page, len, line);
+    }
+    page = scat(page, 30, "#LISTING\n</ul>\n</body>\n</html>");
+    return page;
+}
+
+int main(void)
+{
+    string request = snew(request_text);
+    string uri = snew(uri_text);
+    string listing = make_listing();
+    volatile ssize_t sink = 0;
+    double t0, t1, t2;
+
+    printf("%-28s %16s %16s %7s\n", "function", "previous", "current", "speedup");
+
+#define COMPARE(name, ref_expr, new_expr) \
+    do { \
+        check((ref_expr) == (new_expr), name); \
+        t0 = now_ns(); \
+        for (size_t i = 0; i < ITERATIONS; i++) sink += (ref_expr); \
+        t1 = now_ns(); \
+        for (size_t i = 0; i < ITERATIONS; i++) sink += (new_expr); \
+        t2 = now_ns(); \
+        report(name, t1 - t0, t2 - t1); \
+    } while (0)
+
+    COMPARE("sfind request \"\\r\\n\\r\\n\"",
+            sfind_ref(request, 4, "\r\n\r\n"), sfind(request, 4, "\r\n\r\n"));
+    COMPARE("sfind request '\\n'",
+            sfind_ref(request, 1, "\n"), sfind(request, 1, "\n"));
+    COMPARE("sfind listing \"#LISTING\"",
+            sfind_ref(listing, 8, "#LISTING"), sfind(listing, 8, "#LISTING"));
+    COMPARE("scount listing \"PATH\"",
+            scount_ref(listing, 4, "PATH"), scount(listing, 4, "PATH"));
+    COMPARE("scount request '\\n'",
+            scount_ref(request, 1, "\n"), scount(request, 1, "\n"));
+
+    size_t n_ref, n_new;
+    string* a = ssplit_ref(uri, 1, "/", &n_ref);
+    string* b = ssplit(uri, 1, "/", &n_new);
+    check(n_ref == n_new, "ssplit uri");
+    for (size_t i = 0; i < n_ref; i++)
+        check(strcmp(a[i], b[i]) == 0, "ssplit uri");
+    sfreearr(a, n_ref);
+    sfreearr(b, n_new);
+
+    t0 = now_ns();
+    for (size_t i = 0; i < ITERATIONS; i++) {
+        a = ssplit_ref(uri, 1, "/", &n_ref);
+        sfreearr(a, n_ref);
+    }
+    t1 = now_ns();
+    for (size_t i = 0; i < ITERATIONS; i++) {
+        b = ssplit(uri, 1, "/", &n_new);
+        sfreearr(b, n_new);
+    }
+    t2 = now_ns();
+    report("ssplit uri '/'", t1 - t0, t2 - t1);
+
+    a = ssplit_ref(listing, 4, "PATH", &n_ref);
+    b = ssplit(listing, 4, "PATH", &n_new);
+    check(n_ref == n_new, "ssplit listing");
+    sfreearr(a, n_ref);
+    sfreearr(b, n_new);
+
+    t0 = now_ns();
+    for (size_t i = 0; i < ITERATIONS / 100; i++) {
+        a = ssplit_ref(listing, 4, "PATH", &n_ref);
+        sfreearr(a, n_ref);
+    }
+    t1 = now_ns();
+    for (size_t i = 0; i < ITERATIONS / 100; i++) {
+        b = ssplit(listing, 4, "PATH", &n_new);
+        sfreearr(b, n_new);
+    }
+    t2 = now_ns();
+    report("ssplit listing \"PATH\"", (t1 - t0) * 100, (t2 - t1) * 100);
+
+    string crlf = snew("\r\n\r\n\n\rGET / HTTP/1.1\r\n");
+    string x = sdup(crlf), y = sdup(crlf);
+    sltrimchar_ref(x, 2, "\r\n");
+    sltrimchar(y, 2, "\r\n");
+    check(strcmp(x, y) == 0 && sgetlen(x) == sgetlen(y), "sltrimchar");
+    sfree(x);
+    sfree(y);
+
+    t0 = now_ns();
+    for (size_t i = 0; i < ITERATIONS; i++) {
+        x = sdup(crlf);
+        sltrimchar_ref(x, 2, "\r\n");
+        sfree(x);
+    }
+    t1 = now_ns();
+    for (size_t i = 0; i < ITERATIONS; i++) {
+        y = sdup(crlf);
+        sltrimchar(y, 2, "\r\n");
+        sfree(y);
+    }
+    t2 = now_ns();
+    report("sltrimchar \"\\r\\n\"", t1 - t0, t2 - t1);
+
+    sfree(crlf);
+    sfree(request);
+    sfree(uri);
+    sfree(listing);
+    return 0;
+}
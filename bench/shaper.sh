@@ -0,0 +1,38 @@
+#!/bin/sh
+# Check that small responses under a total bandwidth cap (share -B
+# total=<rate>) reach the configured rate: a 128 byte file is fetched
+# over 8 kept-alive connections for every rate, and the check fails
+# unless the bytes sent per second land within 20% of it. The rates
+# must be below what the machine serves without a cap.
+#
+# Usage: shaper.sh <share> <loadgen> <port> <seconds per rate> <rate in MB/s>...
+
+set -e
+share=$(realpath "$1")
+loadgen=$(realpath "$2")
+port=$3
+secs=$4
+shift 4
+
+dir=$(mktemp -d)
+trap 'kill $server 2> /dev/null || true; rm -rf "$dir"' EXIT INT TERM
+head -c 128 /dev/urandom > "$dir/small.bin"
+cd "$dir"
+
+failed=0
+for rate in "$@"; do
+    "$share" -l error -A per_ip=0,conns=0,backlog=0 -B total="$rate" localhost "$port" > /dev/null 2>&1 &
+    server=$!
+    sleep 1
+    line=$("$loadgen" -l "total=$rate" -c 8 -d "$secs" -r /small.bin localhost "$port")
+    kill $server
+    wait $server 2> /dev/null || true
+    echo "$line"
+    got=$(echo "$line" | awk '{for (i = 1; i < NF; i++) if ($(i + 1) == "MB/s") print $i}')
+    if ! awk -v got="$got" -v rate="$rate" 'BEGIN { exit !(got >= rate * 0.8 && got <= rate * 1.2) }'; then
+        echo "total=$rate: $got MB/s is not within 20% of $rate MB/s" >&2
+        failed=1
+    fi
+    port=$((port + 1))
+done
+exit $failed
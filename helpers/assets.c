@@ -0,0 +1,106 @@
+#ifndef HTTPD_ASSETS
+#define HTTPD_ASSETS
+
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include "assets.h"
+#include "safe_string.h"
+#include "helpers.c"
+
+/*
+    Static assets are requested as /PATH_TO_TEMPLATE_DIR/<name>. They are
+    served from the copies embedded at build time, unless static_dir is
+    set, in which case they are read from that directory on every request
+    so the UI can be customized without recompiling.
+*/
+
+#define ASSET_PREFIX            "PATH_TO_TEMPLATE_DIR/"
+#define ASSET_PREFIX_LEN        21
+#define TEMPLATE_FILE_NAME      "template.html"
+
+/* Directory to read assets from instead of the embedded copies. */
+char* static_dir = NULL;
+
+/* The embedded template with versioned asset URLs, see assets_init(). */
+static string asset_template;
+
+/* Return the asset name if uri refers to an asset, otherwise NULL. */
+const char* asset_name(const char* uri)
+{
+    if (!uri || strncmp(uri, ASSET_PREFIX, ASSET_PREFIX_LEN) != 0)
+        return NULL;
+    return uri + ASSET_PREFIX_LEN;
+}
+
+const struct Asset* asset_find(const char* name)
+{
+    for (size_t i = 0; i < n_assets; i++) {
+        if (strcmp(assets[i].name, name) == 0)
+            return &assets[i];
+    }
+    return NULL;
+}
+
+static
+string asset_path(const char* name)
+{
+    string path = snew(static_dir);
+    path = scat(path, 1, "/");
+    return scat(path, strlen(name), (char*) name);
+}
+
+bool asset_exists(const char* name)
+{
+    if (!static_dir)
+        return asset_find(name) != NULL;
+    string path = asset_path(name);
+    bool exists = path && isdir(path) == 0;
+    sfree(path);
+    return exists;
+}
+
+/* Return a new string with the contents of the asset or NULL. */
+string asset_read(const char* name)
+{
+    if (static_dir) {
+        string path = asset_path(name);
+        string file = path ? read_file(path) : NULL;
+        sfree(path);
+        return file;
+    }
+    if (asset_template && strcmp(name, TEMPLATE_FILE_NAME) == 0)
+        return sdup(asset_template);
+    const struct Asset* asset = asset_find(name);
+    return asset ? snewlen(asset->data, asset->len) : NULL;
+}
+
+/*
+    Rewrite "/PATH_TO_TEMPLATE_DIR/<name>" references in the embedded
+    template to "/PATH_TO_TEMPLATE_DIR/<name>?v=<version>", once. Such
+    URLs change whenever the asset does, so they can be cached forever.
+*/
+bool assets_init(void)
+{
+    if (static_dir)
+        return true;
+    const struct Asset* template = asset_find(TEMPLATE_FILE_NAME);
+    if (!template)
+        return false;
+    asset_template = snewlen(template->data, template->len);
+
+    for (size_t i = 0; asset_template && i < n_assets; i++) {
+        char old[256], new[300];
+        int olen = snprintf(old, sizeof(old), "\"/%s%s\"", ASSET_PREFIX, assets[i].name);
+        int nlen = snprintf(new, sizeof(new), "\"/%s%s?v=%s\"", ASSET_PREFIX,
+                            assets[i].name, assets[i].version);
+        if (olen >= (int) sizeof(old) || nlen >= (int) sizeof(new)
+            || sfind(asset_template, olen, old) == -1)
+            continue;
+        string tmp = asset_template;
+        asset_template = sreplace(tmp, olen, old, nlen, new);
+        sfree(tmp);
+    }
+    return asset_template != NULL;
+}
+#endif
@@ -0,0 +1,28 @@
+/* assets.h */
+
+#ifndef HTTPD_ASSETS_H
+#define HTTPD_ASSETS_H
+
+#include <stddef.h>
+
+/*
+    A file of static/ compiled into the binary by tools/embed.c.
+
+    data is null-terminated for convenience, len does not include it.
+    gz is NULL if compression did not make the file smaller.
+    version is a hex digest of data; it is used as the ETag and as the
+    cache-busting query in URLs of the template.
+*/
+struct Asset {
+    const char* name;
+    const unsigned char* data;
+    size_t len;
+    const unsigned char* gz;
+    size_t gz_len;
+    const char* version;
+};
+
+extern const struct Asset assets[];
+extern const size_t n_assets;
+
+#endif
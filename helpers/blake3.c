@@ -0,0 +1,229 @@
+#ifndef HTTPD_BLAKE3
+#define HTTPD_BLAKE3
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+/*
+    BLAKE3, unkeyed with a 32 byte output, portable C.
+
+    The input is split into chunks of 1 KB whose chaining values are
+    the leaves of a binary tree. A complete subtree of 2^k chunks can be
+    hashed on its own with blake3_init_at() and blake3_subtree(), and
+    its chaining value appended with blake3_push_subtree(); this is how
+    a large file is hashed on several threads (see helpers/hashdb.c).
+    The hasher keeps the chaining values of the complete subtrees left
+    of its position on a stack, merged as soon as two have the same
+    size, the same as the reference implementation.
+*/
+
+#define BLAKE3_LEN              32
+#define BLAKE3_BLOCK_LEN        64
+#define BLAKE3_CHUNK_LEN        1024
+#define BLAKE3_MAX_DEPTH        54
+
+enum {
+    BLAKE3_CHUNK_START  = 1 << 0,
+    BLAKE3_CHUNK_END    = 1 << 1,
+    BLAKE3_PARENT       = 1 << 2,
+    BLAKE3_ROOT         = 1 << 3,
+};
+
+struct blake3 {
+    uint32_t cv[8];             // of the current chunk
+    uint64_t chunk;             // index of the current chunk
+    uint8_t block[BLAKE3_BLOCK_LEN];
+    uint8_t block_len;
+    uint8_t blocks;             // compressed blocks of the current chunk
+    uint8_t stack_len;
+    uint32_t stack[BLAKE3_MAX_DEPTH][8];
+};
+
+static const uint32_t blake3_iv[8] = {
+    0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+};
+
+static const uint8_t blake3_schedule[7][16] = {
+    {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+    {2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8},
+    {3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1},
+    {10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6},
+    {12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4},
+    {9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7},
+    {11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13},
+};
+
+#define BLAKE3_ROR(x, n)        ((x) >> (n) | (x) << (32 - (n)))
+
+#define BLAKE3_G(a, b, c, d, x, y)                      \
+    do {                                                \
+        s[a] = s[a] + s[b] + (x);                       \
+        s[d] = BLAKE3_ROR(s[d] ^ s[a], 16);             \
+        s[c] = s[c] + s[d];                             \
+        s[b] = BLAKE3_ROR(s[b] ^ s[c], 12);             \
+        s[a] = s[a] + s[b] + (y);                       \
+        s[d] = BLAKE3_ROR(s[d] ^ s[a], 8);              \
+        s[c] = s[c] + s[d];                             \
+        s[b] = BLAKE3_ROR(s[b] ^ s[c], 7);              \
+    } while (0)
+
+/* The first 8 words of the compression of block under cv, which is all a 32 byte output needs. */
+static
+void blake3_compress(uint32_t out[8], const uint32_t cv[8], const uint8_t block[BLAKE3_BLOCK_LEN],
+                     uint64_t counter, uint32_t block_len, uint32_t flags)
+{
+    uint32_t m[16];
+    for (int i = 0; i < 16; i++)
+        m[i] = (uint32_t) block[4 * i] | (uint32_t) block[4 * i + 1] << 8
+               | (uint32_t) block[4 * i + 2] << 16 | (uint32_t) block[4 * i + 3] << 24;
+    uint32_t s[16] = {
+        cv[0], cv[1], cv[2], cv[3], cv[4], cv[5], cv[6], cv[7],
+        blake3_iv[0], blake3_iv[1], blake3_iv[2], blake3_iv[3],
+        (uint32_t) counter, (uint32_t)(counter >> 32), block_len, flags,
+    };
+    for (int r = 0; r < 7; r++) {
+        const uint8_t* k = blake3_schedule[r];
+        BLAKE3_G(0, 4, 8, 12, m[k[0]], m[k[1]]);
+        BLAKE3_G(1, 5, 9, 13, m[k[2]], m[k[3]]);
+        BLAKE3_G(2, 6, 10, 14, m[k[4]], m[k[5]]);
+        BLAKE3_G(3, 7, 11, 15, m[k[6]], m[k[7]]);
+        BLAKE3_G(0, 5, 10, 15, m[k[8]], m[k[9]]);
+        BLAKE3_G(1, 6, 11, 12, m[k[10]], m[k[11]]);
+        BLAKE3_G(2, 7, 8, 13, m[k[12]], m[k[13]]);
+        BLAKE3_G(3, 4, 9, 14, m[k[14]], m[k[15]]);
+    }
+    for (int i = 0; i < 8; i++)
+        out[i] = s[i] ^ s[i + 8];
+}
+
+static
+void blake3_parent(uint32_t out[8], const uint32_t left[8], const uint32_t right[8], uint32_t flags)
+{
+    uint8_t block[BLAKE3_BLOCK_LEN];
+    for (int i = 0; i < 8; i++)
+        for (int j = 0; j < 4; j++) {
+            block[4 * i + j] = left[i] >> (8 * j);
+            block[32 + 4 * i + j] = right[i] >> (8 * j);
+        }
+    blake3_compress(out, blake3_iv, block, 0, BLAKE3_BLOCK_LEN, BLAKE3_PARENT | flags);
+}
+
+static inline
+uint32_t blake3_start_flag(const struct blake3* b)
+{
+    return b->blocks == 0 ? BLAKE3_CHUNK_START : 0;
+}
+
+/* Start a new chunk with index chunk. */
+static
+void blake3_chunk_reset(struct blake3* b, uint64_t chunk)
+{
+    memcpy(b->cv, blake3_iv, sizeof(b->cv));
+    b->chunk = chunk;
+    b->block_len = 0;
+    b->blocks = 0;
+}
+
+static inline
+size_t blake3_chunk_len(const struct blake3* b)
+{
+    return (size_t) b->blocks * BLAKE3_BLOCK_LEN + b->block_len;
+}
+
+/* Push the chaining value of a complete subtree that ends after total subtrees of its size. */
+static
+void blake3_push(struct blake3* b, uint32_t cv[8], uint64_t total)
+{
+    while ((total & 1) == 0) {
+        blake3_parent(cv, b->stack[--b->stack_len], cv, 0);
+        total >>= 1;
+    }
+    memcpy(b->stack[b->stack_len++], cv, 8 * sizeof(uint32_t));
+}
+
+/* Start hashing at chunk, which must be a multiple of the size of the subtree that is hashed. */
+void blake3_init_at(struct blake3* b, uint64_t chunk)
+{
+    blake3_chunk_reset(b, chunk);
+    b->stack_len = 0;
+}
+
+void blake3_init(struct blake3* b)
+{
+    blake3_init_at(b, 0);
+}
+
+void blake3_update(struct blake3* b, const void* data, size_t len)
+{
+    const uint8_t* p = data;
+    while (len > 0) {
+        /* A full chunk is only finished once more input follows, the last one is the root's. */
+        if (blake3_chunk_len(b) == BLAKE3_CHUNK_LEN) {
+            uint32_t cv[8];
+            blake3_compress(cv, b->cv, b->block, b->chunk, b->block_len,
+                            blake3_start_flag(b) | BLAKE3_CHUNK_END);
+            uint64_t total = b->chunk + 1;
+            blake3_push(b, cv, total);
+            blake3_chunk_reset(b, total);
+        }
+        if (b->block_len == BLAKE3_BLOCK_LEN) {
+            blake3_compress(b->cv, b->cv, b->block, b->chunk, BLAKE3_BLOCK_LEN, blake3_start_flag(b));
+            b->blocks++;
+            b->block_len = 0;
+        }
+        size_t n = BLAKE3_BLOCK_LEN - b->block_len;
+        n = n < len ? n : len;
+        memcpy(b->block + b->block_len, p, n);
+        b->block_len += n;
+        p += n;
+        len -= n;
+    }
+}
+
+/* Merge the current chunk with the stack, the root if flags is BLAKE3_ROOT. */
+static
+void blake3_merge(struct blake3* b, uint32_t out[8], uint32_t flags)
+{
+    memset(b->block + b->block_len, 0, BLAKE3_BLOCK_LEN - b->block_len);
+    uint32_t chunk_flags = blake3_start_flag(b) | BLAKE3_CHUNK_END;
+    if (b->stack_len == 0) {
+        blake3_compress(out, b->cv, b->block, b->chunk, b->block_len, chunk_flags | flags);
+        return;
+    }
+    uint32_t cv[8];
+    blake3_compress(cv, b->cv, b->block, b->chunk, b->block_len, chunk_flags);
+    for (int i = b->stack_len - 1; i >= 0; i--)
+        blake3_parent(cv, b->stack[i], cv, i == 0 ? flags : 0);
+    memcpy(out, cv, sizeof(cv));
+}
+
+/* The chaining value of the complete subtree fed since blake3_init_at(). */
+void blake3_subtree(struct blake3* b, uint32_t cv[8])
+{
+    blake3_merge(b, cv, 0);
+}
+
+/*
+    Append the chaining value of a complete subtree of 2^log_chunks
+    chunks. Nothing may have been fed since the last subtree, and the
+    chunks before it must be a multiple of its size.
+*/
+void blake3_push_subtree(struct blake3* b, const uint32_t cv[8], unsigned log_chunks)
+{
+    uint32_t c[8];
+    memcpy(c, cv, sizeof(c));
+    uint64_t end = b->chunk + ((uint64_t) 1 << log_chunks);
+    blake3_push(b, c, end >> log_chunks);
+    blake3_chunk_reset(b, end);
+}
+
+void blake3_final(struct blake3* b, uint8_t out[BLAKE3_LEN])
+{
+    uint32_t h[8];
+    blake3_merge(b, h, BLAKE3_ROOT);
+    for (int i = 0; i < 8; i++)
+        for (int j = 0; j < 4; j++)
+            out[4 * i + j] = h[i] >> (8 * j);
+}
+#endif
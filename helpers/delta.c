@@ -0,0 +1,459 @@
+#ifndef HTTPD_DELTA
+#define HTTPD_DELTA
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "blake3.c"
+#include "pool.c"
+
+/*
+    Delta transfer in the manner of rsync, for POST <file>?delta (see
+    send_delta() in share.c) and tools/delta.c.
+
+    The client has an old version of the file. It splits it into blocks
+    of block_size bytes and sends a signature for each full block: a
+    weak checksum that can be rolled along a byte at a time and the
+    first DELTA_STRONG bytes of the block's BLAKE3. The server looks for
+    these blocks at every offset of its version, confirming a weak match
+    with the strong hash, and answers with the blocks of the old file to
+    copy and the literal bytes between them. The response starts with
+    the BLAKE3 of the whole new file, so the client can check what it
+    rebuilt. Bytes sent grow with the size of the change, plus about
+    DELTA_SIG bytes per block for the signatures.
+
+    The server's own block signatures are cached per file version: one
+    file per served file and block size in delta_cache_dir (share -S),
+    holding the size and modification time they were computed for. When
+    the block of the new file at an aligned offset has the signature of
+    a client block it is copied without reading the file, so a file with
+    a few blocks changed in place is only read around the changes.
+    Signatures are computed on the thread pool, see helpers/pool.c.
+
+    Everything on the wire is little endian:
+
+    request     "SDS1" block_size:u32 count:u32 0:u32, then count times
+                weak:u32 strong:DELTA_STRONG
+    response    "SDD1" block_size:u32 size:u64 blake3:32, then
+                'C' first:u32 count:u32    copy count old blocks
+                'L' len:u32 bytes          literal bytes
+                'E'                        the end
+*/
+
+#define DELTA_REQUEST_MAGIC     "SDS1"
+#define DELTA_RESPONSE_MAGIC    "SDD1"
+#define DELTA_CACHE_MAGIC       0x31434453u     // "SDC1"
+#define DELTA_STRONG            16
+#define DELTA_SIG               (4 + DELTA_STRONG)
+#define DELTA_HEADER            16
+#define DELTA_RESPONSE_HEADER   48
+#define DELTA_MIN_BLOCK         512
+#define DELTA_MAX_BLOCK         (1 << 20)
+#define DELTA_MAX_BODY          (64 << 20)
+#define DELTA_LITERAL_MAX       65536
+#define DELTA_BUFFER            (2 * DELTA_MAX_BLOCK + DELTA_LITERAL_MAX)
+#define DELTA_TASK_BLOCKS       256
+#define DELTA_CACHE_DIR         "/tmp/share-signatures" // followed by -<uid>, see private_dir()
+
+struct delta_sig {
+    uint32_t weak;
+    uint8_t strong[DELTA_STRONG];
+};
+
+/* Where the server keeps its signatures, NULL to compute them for every request. */
+const char* delta_cache_dir;
+
+static inline
+void delta_put32(uint8_t* p, uint32_t v)
+{
+    for (int i = 0; i < 4; i++)
+        p[i] = v >> (8 * i);
+}
+
+static inline
+uint32_t delta_get32(const uint8_t* p)
+{
+    return (uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static inline
+void delta_put64(uint8_t* p, uint64_t v)
+{
+    delta_put32(p, v);
+    delta_put32(p + 4, v >> 32);
+}
+
+static inline
+uint64_t delta_get64(const uint8_t* p)
+{
+    return delta_get32(p) | (uint64_t) delta_get32(p + 4) << 32;
+}
+
+/* The rolling checksum of rsync: a is the sum of the bytes, b the sum of the prefix sums. */
+struct delta_roll {
+    uint32_t a, b;
+    uint32_t len;
+};
+
+static
+void delta_roll_init(struct delta_roll* r, const uint8_t* p, uint32_t len)
+{
+    r->a = r->b = 0;
+    r->len = len;
+    for (uint32_t i = 0; i < len; i++) {
+        r->a += p[i];
+        r->b += r->a;
+    }
+}
+
+/* Slide the window a byte, dropping out and taking in. */
+static inline
+void delta_roll(struct delta_roll* r, uint8_t out, uint8_t in)
+{
+    r->a += in - out;
+    r->b += r->a - r->len * out;
+}
+
+static inline
+uint32_t delta_weak(const struct delta_roll* r)
+{
+    return (r->a & 0xffff) | r->b << 16;
+}
+
+static
+void delta_strong(const uint8_t* p, size_t len, uint8_t out[DELTA_STRONG])
+{
+    struct blake3 b;
+    uint8_t full[BLAKE3_LEN];
+    blake3_init(&b);
+    blake3_update(&b, p, len);
+    blake3_final(&b, full);
+    memcpy(out, full, DELTA_STRONG);
+}
+
+/* Signatures of a range of blocks, computed by a pool task. */
+struct delta_sign_task {
+    struct pool_task task;
+    int fd;
+    uint32_t block_size;
+    uint64_t first, count;
+    struct delta_sig* sigs;
+    bool ok;
+};
+
+static
+void delta_sign_range(struct pool_task* task)
+{
+    struct delta_sign_task* t = (struct delta_sign_task*) task;
+    uint8_t* buf = malloc(t->block_size);
+    t->ok = buf != NULL;
+    for (uint64_t i = t->first; t->ok && i < t->first + t->count; i++) {
+        size_t have = 0;
+        ssize_t n = 1;
+        while (have < t->block_size && n > 0)
+            if ((n = pread(t->fd, buf + have, t->block_size - have, i * t->block_size + have)) > 0)
+                have += n;
+        t->ok = have == t->block_size;
+        struct delta_roll r;
+        delta_roll_init(&r, buf, t->block_size);
+        t->sigs[i].weak = delta_weak(&r);
+        delta_strong(buf, t->block_size, t->sigs[i].strong);
+    }
+    free(buf);
+}
+
+/* Signatures of the count full blocks of fd, computed on the thread pool. */
+bool delta_sign(int fd, uint32_t block_size, struct delta_sig* sigs, uint64_t count)
+{
+    uint64_t ntasks = (count + DELTA_TASK_BLOCKS - 1) / DELTA_TASK_BLOCKS;
+    struct delta_sign_task* tasks = malloc((ntasks ? ntasks : 1) * sizeof(*tasks));
+    if (!tasks)
+        return false;
+    struct pool_group group = {0};
+    for (uint64_t i = 0; i < ntasks; i++) {
+        uint64_t first = i * DELTA_TASK_BLOCKS;
+        tasks[i] = (struct delta_sign_task) {
+            .task.run = delta_sign_range, .fd = fd, .block_size = block_size, .sigs = sigs, .first = first,
+            .count = count - first < DELTA_TASK_BLOCKS ? count - first : DELTA_TASK_BLOCKS,
+        };
+        pool_submit(&group, &tasks[i].task);
+    }
+    pool_wait(&group);
+    bool ok = true;
+    for (uint64_t i = 0; i < ntasks; i++)
+        ok &= tasks[i].ok;
+    free(tasks);
+    return ok;
+}
+
+struct delta_cache_header {
+    uint32_t magic;
+    uint32_t block_size;
+    uint64_t count;
+    int64_t size;
+    int64_t mtime;      // ns
+};
+
+/*
+    Signatures of the full blocks of the file fd with metadata st, from
+    the cache if they were computed for this version, otherwise computed
+    and cached. *count is set to their number. NULL if they could not be
+    computed.
+*/
+struct delta_sig* delta_signatures(int fd, const struct stat* st, uint32_t block_size, uint64_t* count)
+{
+    struct delta_cache_header want = {
+        .magic = DELTA_CACHE_MAGIC, .block_size = block_size, .count = st->st_size / block_size,
+        .size = st->st_size, .mtime = (int64_t) st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec,
+    };
+    *count = want.count;
+    struct delta_sig* sigs = malloc((want.count ? want.count : 1) * sizeof(*sigs));
+    if (!sigs)
+        return NULL;
+
+    char path[512];
+    if (delta_cache_dir) {
+        snprintf(path, sizeof(path), "%s/%llx-%llx-%x", delta_cache_dir, (unsigned long long) st->st_dev,
+                 (unsigned long long) st->st_ino, block_size);
+        int cfd = open(path, O_RDONLY | O_CLOEXEC);
+        struct delta_cache_header have;
+        size_t len = want.count * sizeof(*sigs);
+        bool hit = cfd >= 0 && pread(cfd, &have, sizeof(have), 0) == sizeof(have)
+                   && memcmp(&have, &want, sizeof(have)) == 0
+                   && pread(cfd, sigs, len, sizeof(have)) == (ssize_t) len;
+        if (cfd >= 0)
+            close(cfd);
+        if (hit)
+            return sigs;
+    }
+
+    if (!delta_sign(fd, block_size, sigs, want.count)) {
+        free(sigs);
+        return NULL;
+    }
+    if (delta_cache_dir) {
+        /* Written aside and renamed, so readers see a whole file or the previous version. */
+        char tmp[544];
+        snprintf(tmp, sizeof(tmp), "%s.%d", path, (int) getpid());
+        int cfd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        size_t len = want.count * sizeof(*sigs);
+        bool ok = cfd >= 0 && write(cfd, &want, sizeof(want)) == sizeof(want)
+                  && write(cfd, sigs, len) == (ssize_t) len;
+        if (cfd >= 0)
+            close(cfd);
+        if (!ok || rename(tmp, path) < 0)
+            unlink(tmp);
+    }
+    return sigs;
+}
+
+/* Where delta_match() sends its instructions. */
+struct delta_sink {
+    bool (*copy)(void* ctx, uint32_t first, uint32_t count);
+    bool (*literal)(void* ctx, const uint8_t* data, size_t len);
+    void* ctx;
+};
+
+/* The client's blocks by weak checksum: heads of chains through next. */
+struct delta_index {
+    const struct delta_sig* sigs;
+    uint32_t* heads;
+    uint32_t* next;
+    uint32_t mask;
+};
+
+#define DELTA_NONE              UINT32_MAX
+
+static
+bool delta_index_init(struct delta_index* x, const struct delta_sig* sigs, uint32_t n)
+{
+    uint32_t size = 1024;
+    while (size < 2 * n)
+        size *= 2;
+    x->sigs = sigs;
+    x->mask = size - 1;
+    x->heads = malloc(size * sizeof(uint32_t));
+    x->next = malloc((n ? n : 1) * sizeof(uint32_t));
+    if (!x->heads || !x->next) {
+        free(x->heads);
+        free(x->next);
+        return false;
+    }
+    memset(x->heads, 0xff, size * sizeof(uint32_t));
+    /* In reverse, so chains list blocks in order. */
+    for (uint32_t i = n; i-- > 0;) {
+        uint32_t h = (sigs[i].weak * 2654435761u) & x->mask;
+        x->next[i] = x->heads[h];
+        x->heads[h] = i;
+    }
+    return true;
+}
+
+/*
+    A client block with weak checksum weak whose strong hash is strong,
+    or the one at hint if it matches too. strong is only computed, by
+    calling fill, once a weak checksum matches. DELTA_NONE if none.
+*/
+static
+uint32_t delta_lookup(const struct delta_index* x, uint32_t weak, uint32_t hint,
+                      uint8_t strong[DELTA_STRONG], const uint8_t* window, uint32_t len)
+{
+    bool filled = window == NULL;
+    uint32_t found = DELTA_NONE;
+    for (uint32_t i = x->heads[(weak * 2654435761u) & x->mask]; i != DELTA_NONE; i = x->next[i]) {
+        if (x->sigs[i].weak != weak)
+            continue;
+        if (!filled) {
+            delta_strong(window, len, strong);
+            filled = true;
+        }
+        if (memcmp(x->sigs[i].strong, strong, DELTA_STRONG))
+            continue;
+        if (i == hint)
+            return i;
+        if (found == DELTA_NONE)
+            found = i;
+    }
+    return found;
+}
+
+/* Instructions waiting to be sent: a run of copied blocks. */
+struct delta_state {
+    const struct delta_sink* sink;
+    uint32_t run_first, run_count;
+    bool ok;
+};
+
+static
+void delta_flush_copy(struct delta_state* s)
+{
+    if (s->run_count && s->ok)
+        s->ok = s->sink->copy(s->sink->ctx, s->run_first, s->run_count);
+    s->run_count = 0;
+}
+
+static
+void delta_copy(struct delta_state* s, uint32_t block)
+{
+    if (s->run_count && s->run_first + s->run_count == block) {
+        s->run_count++;
+        return;
+    }
+    delta_flush_copy(s);
+    s->run_first = block;
+    s->run_count = 1;
+}
+
+/* Send bytes [from, to) of fd as literals, from buf (file bytes from base) where it has them. */
+static
+void delta_literal(struct delta_state* s, int fd, const uint8_t* buf, off_t base, off_t buffered,
+                   off_t from, off_t to)
+{
+    if (from >= to || !s->ok)
+        return;
+    delta_flush_copy(s);
+    if (from >= base && to <= base + buffered) {
+        for (off_t p = from; p < to && s->ok; p += DELTA_LITERAL_MAX) {
+            size_t n = to - p < DELTA_LITERAL_MAX ? to - p : DELTA_LITERAL_MAX;
+            s->ok = s->sink->literal(s->sink->ctx, buf + (p - base), n);
+        }
+        return;
+    }
+    uint8_t* tmp = malloc(DELTA_LITERAL_MAX);
+    s->ok = tmp != NULL;
+    for (off_t p = from; p < to && s->ok; ) {
+        ssize_t n = pread(fd, tmp, to - p < DELTA_LITERAL_MAX ? to - p : DELTA_LITERAL_MAX, p);
+        s->ok = n > 0 && s->sink->literal(s->sink->ctx, tmp, n);
+        p += n;
+    }
+    free(tmp);
+}
+
+/*
+    Send sink the instructions that rebuild the size bytes of fd from
+    the n client blocks in sigs. own holds the signatures of the m full
+    blocks of fd, or is NULL. Return false on read or sink errors.
+*/
+bool delta_match(int fd, off_t size, uint32_t block_size, const struct delta_sig* sigs, uint32_t n,
+                 const struct delta_sig* own, uint64_t m, const struct delta_sink* sink)
+{
+    struct delta_index x;
+    uint8_t* buf = malloc(DELTA_BUFFER);
+    if (!buf || !delta_index_init(&x, sigs, n)) {
+        free(buf);
+        return false;
+    }
+    struct delta_state s = {.sink = sink, .ok = true};
+    off_t pos = 0, lit = 0, base = 0, buffered = 0;
+    struct delta_roll r;
+    bool rolling = false;
+    uint8_t strong[DELTA_STRONG];
+
+    while (s.ok && n > 0 && pos + block_size <= size) {
+        uint32_t hint = s.run_count ? s.run_first + s.run_count : DELTA_NONE;
+        /* An aligned block whose cached signature is a client block needs no read. */
+        if (own && pos % block_size == 0 && (uint64_t)(pos / block_size) < m) {
+            const struct delta_sig* sig = &own[pos / block_size];
+            uint32_t k = delta_lookup(&x, sig->weak, hint, (uint8_t*) sig->strong, NULL, 0);
+            if (k != DELTA_NONE) {
+                delta_literal(&s, fd, buf, base, buffered, lit, pos);
+                delta_copy(&s, k);
+                pos += block_size;
+                lit = pos;
+                rolling = false;
+                continue;
+            }
+        }
+
+        if (pos + block_size > base + buffered) {
+            /* Literals are sent before their bytes leave the buffer. */
+            delta_literal(&s, fd, buf, base, buffered, lit, pos);
+            lit = pos;
+            base = pos;
+            buffered = 0;
+            ssize_t got = 1;
+            while (buffered < DELTA_BUFFER && base + buffered < size && got > 0)
+                if ((got = pread(fd, buf + buffered, DELTA_BUFFER - buffered, base + buffered)) > 0)
+                    buffered += got;
+            if (pos + block_size > base + buffered) {
+                s.ok = false;
+                break;
+            }
+        }
+        const uint8_t* window = buf + (pos - base);
+        if (!rolling) {
+            delta_roll_init(&r, window, block_size);
+            rolling = true;
+        }
+        uint32_t k = delta_lookup(&x, delta_weak(&r), hint, strong, window, block_size);
+        if (k != DELTA_NONE) {
+            delta_literal(&s, fd, buf, base, buffered, lit, pos);
+            delta_copy(&s, k);
+            pos += block_size;
+            lit = pos;
+            rolling = false;
+            continue;
+        }
+        if (pos + block_size < base + buffered)
+            delta_roll(&r, window[0], window[block_size]);
+        else
+            rolling = false;
+        pos++;
+        if (pos - lit >= DELTA_LITERAL_MAX) {
+            delta_literal(&s, fd, buf, base, buffered, lit, pos);
+            lit = pos;
+        }
+    }
+    delta_literal(&s, fd, buf, base, buffered, lit, size);
+    delta_flush_copy(&s);
+    free(buf);
+    free(x.heads);
+    free(x.next);
+    return s.ok;
+}
+#endif
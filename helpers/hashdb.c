@@ -0,0 +1,308 @@
+#ifndef HTTPD_HASHDB
+#define HTTPD_HASHDB
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "sha256.c"
+#include "blake3.c"
+#include "pool.c"
+#include "../logger/metrics.c"
+
+/*
+    Content hashes of served files, for ?hash (see send_hash() in
+    share.c), and the database that keeps them.
+
+    A file is read once, in HASH_READ pieces, and hashed on the thread
+    pool (see helpers/pool.c). SHA-256 is one streaming pass; BLAKE3
+    splits files larger than HASH_SUBTREE into subtrees hashed on
+    separate threads and merged in order (see helpers/blake3.c).
+
+    The database is a table of HASHDB_SLOTS entries in a file mapped
+    with MAP_SHARED by the main process before it forks, set with
+    share -H; without one it is anonymous shared memory and lives as
+    long as the server. An entry is found by device, inode and
+    algorithm and holds the size and modification time the digest was
+    computed for, so a file that changed is hashed again and a file
+    that did not is never read. Each entry is a seqlock: a writer makes
+    its sequence odd with a compare and swap while it writes, readers
+    retry or give up when the sequence is odd or changed under them,
+    so children read and write without a lock. A lookup probes
+    HASHDB_PROBES slots; a store takes a free or outdated one and
+    otherwise replaces the first, the table is a cache.
+*/
+
+#define HASHDB_MAGIC            0x31424448u     // "HDB1"
+#define HASHDB_SLOTS            65536           // must be a power of two
+#define HASHDB_PROBES           8
+#define HASH_LEN                32
+#define HASH_READ               65536
+#define HASH_SUBTREE_LOG        10              // chunks of BLAKE3 hashed per thread, 2^10 KB
+#define HASH_SUBTREE            ((off_t) BLAKE3_CHUNK_LEN << HASH_SUBTREE_LOG)
+#define HASH_TASK_SUBTREES      8
+
+enum hash_algo {
+    HASH_SHA256,
+    HASH_BLAKE3,
+    HASH_COUNT,
+};
+
+static const char* hash_names[HASH_COUNT] = {
+    "sha256", "blake3"
+};
+
+struct hashdb_entry {
+    _Atomic uint32_t seq;       // odd while written, 0 for never written
+    uint32_t algo;
+    uint64_t dev;
+    uint64_t ino;
+    int64_t size;
+    int64_t mtime;              // ns
+    uint8_t digest[HASH_LEN];
+};
+
+struct hashdb {
+    uint32_t magic;
+    uint32_t slots;
+    struct hashdb_entry entries[HASHDB_SLOTS];
+};
+
+static struct hashdb* hashdb;
+
+/*
+    Map the database file path, creating it if needed, or anonymous
+    memory if path is NULL. A file written by another version is
+    cleared. Return false if that fails; digests are then not kept.
+*/
+bool hashdb_open(const char* path)
+{
+    struct hashdb* db;
+    if (!path) {
+        db = mmap(NULL, sizeof(struct hashdb), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (db == MAP_FAILED)
+            return false;
+    } else {
+        int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0)
+            return false;
+        struct stat st;
+        uint32_t header[2] = {0};
+        bool valid = fstat(fd, &st) == 0 && st.st_size == sizeof(struct hashdb)
+                     && pread(fd, header, sizeof(header), 0) == sizeof(header)
+                     && header[0] == HASHDB_MAGIC && header[1] == HASHDB_SLOTS;
+        if (!valid && (ftruncate(fd, 0) < 0 || ftruncate(fd, sizeof(struct hashdb)) < 0)) {
+            close(fd);
+            return false;
+        }
+        db = mmap(NULL, sizeof(struct hashdb), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+        if (db == MAP_FAILED)
+            return false;
+        /* Entries a killed server was writing. */
+        for (uint32_t i = 0; valid && i < HASHDB_SLOTS; i++)
+            if (atomic_load_explicit(&db->entries[i].seq, memory_order_relaxed) & 1)
+                memset(&db->entries[i], 0, sizeof(db->entries[i]));
+    }
+    db->magic = HASHDB_MAGIC;
+    db->slots = HASHDB_SLOTS;
+    hashdb = db;
+    return true;
+}
+
+static inline
+uint32_t hashdb_slot(const struct stat* st, enum hash_algo algo)
+{
+    uint64_t h = (st->st_ino * 0x9e3779b97f4a7c15ULL) ^ (st->st_dev * 0xc2b2ae3d27d4eb4fULL) ^ algo;
+    return (h ^ h >> 29) & (HASHDB_SLOTS - 1);
+}
+
+static inline
+int64_t hashdb_mtime(const struct stat* st)
+{
+    return (int64_t) st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+/* Copy the digest of the file st describes into digest if the database has it. */
+bool hashdb_get(const struct stat* st, enum hash_algo algo, uint8_t digest[HASH_LEN])
+{
+    if (!hashdb)
+        return false;
+    uint32_t h = hashdb_slot(st, algo);
+    for (uint32_t i = 0; i < HASHDB_PROBES; i++) {
+        struct hashdb_entry* e = &hashdb->entries[(h + i) & (HASHDB_SLOTS - 1)];
+        uint32_t seq = atomic_load_explicit(&e->seq, memory_order_acquire);
+        if (seq == 0)
+            return false;
+        if (seq & 1)
+            continue;
+        struct hashdb_entry copy;
+        memcpy(&copy, e, sizeof(copy));
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&e->seq, memory_order_relaxed) != seq)
+            continue;
+        if (copy.algo == algo && copy.dev == st->st_dev && copy.ino == st->st_ino) {
+            if (copy.size != st->st_size || copy.mtime != hashdb_mtime(st))
+                return false;
+            memcpy(digest, copy.digest, HASH_LEN);
+            return true;
+        }
+    }
+    return false;
+}
+
+void hashdb_put(const struct stat* st, enum hash_algo algo, const uint8_t digest[HASH_LEN])
+{
+    if (!hashdb)
+        return;
+    uint32_t h = hashdb_slot(st, algo);
+    struct hashdb_entry* slot = &hashdb->entries[h];
+    for (uint32_t i = 0; i < HASHDB_PROBES; i++) {
+        struct hashdb_entry* e = &hashdb->entries[(h + i) & (HASHDB_SLOTS - 1)];
+        if (atomic_load_explicit(&e->seq, memory_order_relaxed) == 0
+            || (e->algo == algo && e->dev == st->st_dev && e->ino == st->st_ino)) {
+            slot = e;
+            break;
+        }
+    }
+
+    uint32_t seq = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+    if ((seq & 1) || !atomic_compare_exchange_strong_explicit(&slot->seq, &seq, seq + 1,
+                                                              memory_order_acquire, memory_order_relaxed))
+        return;
+    atomic_thread_fence(memory_order_release);
+    slot->algo = algo;
+    slot->dev = st->st_dev;
+    slot->ino = st->st_ino;
+    slot->size = st->st_size;
+    slot->mtime = hashdb_mtime(st);
+    memcpy(slot->digest, digest, HASH_LEN);
+    atomic_store_explicit(&slot->seq, seq + 2, memory_order_release);
+}
+
+/* Feed bytes [from, to) of fd to the hash in state, sha256 or blake3. */
+static
+bool hash_read(int fd, off_t from, off_t to, enum hash_algo algo, void* state, char* buf)
+{
+    while (from < to) {
+        size_t want = to - from < HASH_READ ? to - from : HASH_READ;
+        ssize_t n = pread(fd, buf, want, from);
+        if (n <= 0)
+            return false;
+        if (algo == HASH_SHA256)
+            sha256_update(state, buf, n);
+        else
+            blake3_update(state, buf, n);
+        from += n;
+    }
+    return true;
+}
+
+/* HASH_TASK_SUBTREES subtrees of BLAKE3 at most, from the first. */
+struct hash_subtrees {
+    struct pool_task task;
+    int fd;
+    uint64_t first, count;
+    uint32_t (*cvs)[8];
+    bool ok;
+};
+
+static
+void hash_subtrees(struct pool_task* task)
+{
+    struct hash_subtrees* t = (struct hash_subtrees*) task;
+    char* buf = malloc(HASH_READ);
+    t->ok = buf != NULL;
+    for (uint64_t i = t->first; t->ok && i < t->first + t->count; i++) {
+        struct blake3 b;
+        blake3_init_at(&b, i << HASH_SUBTREE_LOG);
+        t->ok = hash_read(t->fd, i * HASH_SUBTREE, (i + 1) * HASH_SUBTREE, HASH_BLAKE3, &b, buf);
+        blake3_subtree(&b, t->cvs[i]);
+    }
+    free(buf);
+}
+
+/* BLAKE3 of the size bytes of fd, with all but the last subtree on the pool. */
+static
+bool hash_blake3(int fd, off_t size, uint8_t digest[HASH_LEN], char* buf)
+{
+    struct blake3 b;
+    blake3_init(&b);
+    uint64_t subtrees = size > 0 ? (size - 1) / HASH_SUBTREE : 0;
+    if (subtrees > 0) {
+        uint64_t ntasks = (subtrees + HASH_TASK_SUBTREES - 1) / HASH_TASK_SUBTREES;
+        uint32_t (*cvs)[8] = malloc(subtrees * sizeof(*cvs));
+        struct hash_subtrees* tasks = malloc(ntasks * sizeof(*tasks));
+        bool ok = cvs && tasks;
+        struct pool_group group = {0};
+        for (uint64_t i = 0; ok && i < ntasks; i++) {
+            uint64_t first = i * HASH_TASK_SUBTREES;
+            tasks[i] = (struct hash_subtrees) {
+                .task.run = hash_subtrees, .fd = fd, .first = first, .cvs = cvs,
+                .count = subtrees - first < HASH_TASK_SUBTREES ? subtrees - first : HASH_TASK_SUBTREES,
+            };
+            pool_submit(&group, &tasks[i].task);
+        }
+        pool_wait(&group);
+        for (uint64_t i = 0; ok && i < ntasks; i++)
+            ok = tasks[i].ok;
+        for (uint64_t i = 0; ok && i < subtrees; i++)
+            blake3_push_subtree(&b, cvs[i], HASH_SUBTREE_LOG);
+        free(cvs);
+        free(tasks);
+        if (!ok)
+            return false;
+    }
+    if (!hash_read(fd, subtrees * HASH_SUBTREE, size, HASH_BLAKE3, &b, buf))
+        return false;
+    blake3_final(&b, digest);
+    return true;
+}
+
+/*
+    Digest of the regular file at path relative to dir (a descriptor or
+    AT_FDCWD) with algo, from the database if the file has not changed
+    since it was last hashed. st is set to the file's metadata. Return
+    false if the file is not a regular file or cannot be read.
+*/
+bool hash_file(int dir, const char* path, enum hash_algo algo, uint8_t digest[HASH_LEN], struct stat* st)
+{
+    int fd = openat(dir, path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    if (fstat(fd, st) < 0 || !S_ISREG(st->st_mode)) {
+        close(fd);
+        return false;
+    }
+    bool hit = hashdb_get(st, algo, digest);
+    metrics_cache(MC_HASH, hit);
+    if (hit) {
+        close(fd);
+        return true;
+    }
+
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    char* buf = malloc(HASH_READ);
+    bool ok = buf != NULL;
+    if (ok && algo == HASH_SHA256) {
+        struct sha256 s;
+        sha256_init(&s);
+        ok = hash_read(fd, 0, st->st_size, algo, &s, buf);
+        sha256_final(&s, digest);
+    } else if (ok)
+        ok = hash_blake3(fd, st->st_size, digest, buf);
+    free(buf);
+    /* Store only what was computed for the file as it still is. */
+    struct stat after;
+    if (ok && fstat(fd, &after) == 0 && after.st_size == st->st_size && hashdb_mtime(&after) == hashdb_mtime(st))
+        hashdb_put(st, algo, digest);
+    close(fd);
+    return ok;
+}
+#endif
@@ -7,14 +7,24 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <sys/stat.h>
+#include <sys/sendfile.h>
 #include "safe_string.h"
 #include <stdlib.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include "mime.c"
+#include "../logger/metrics.c"
+#include "../net/shaper.c"
+#include "pool.c"
+#include "prefetch.c"
 
 #define MAX_PATH_LEN            8000
 #define MAX_DIR_SIZE            1024
 #define CHUNK_SIZE              65536
 #define ISDIR_INVALID           -1
+#define LISTDIR_BATCH           32      // entries stat()ed by one pool task
 
 string normalize_uri(string uri)
 {
@@ -89,38 +99,55 @@ int isdir(const char *path)
     return S_ISDIR(statbuf.st_mode);
 }
 
+/*
+    Create directory path for files only this user may read, or take it
+    if it is there. Return false unless it then is a directory, not a
+    symbolic link, owned by the effective user with mode 0700: in a
+    directory all users share, like /tmp, anyone could have made it first.
+*/
+bool private_dir(const char* path)
+{
+    struct stat st;
+    if (mkdir(path, 0700) < 0 && errno != EEXIST)
+        return false;
+    return lstat(path, &st) == 0 && S_ISDIR(st.st_mode) && st.st_uid == geteuid() && (st.st_mode & 07777) == 0700;
+}
+
+/* ext is the extension including the dot, as returned by getext(). */
 char* getconttype(const char* ext)
 {
     if (!ext) {
-        return "application/octet-stream";
+        return MIME_DEFAULT_TYPE;
     }
-    if (strcmp(ext, ".html") == 0 || strcmp(ext, ".htm") == 0) {
-        return "text/html";
-    } else if (strcmp(ext, ".css") == 0) {
-        return "text/css";
-    } else if (strcmp(ext, ".js") == 0) {
-        return "application/javascript";
-    } else if (strcmp(ext, ".json") == 0) {
-        return "application/json";
-    } else if (strcmp(ext, ".jpg") == 0 || strcmp(ext, ".jpeg") == 0) {
-        return "image/jpeg";
-    } else if (strcmp(ext, ".png") == 0) {
-        return "image/png";
-    } else if (strcmp(ext, ".gif") == 0) {
-        return "image/gif";
-    } else if (strcmp(ext, ".svg") == 0) {
-        return "image/svg+xml";
-    } else if (strcmp(ext, ".txt") == 0) {
-        return "text/plain";
-    } else if (strcmp(ext, ".pdf") == 0) {
-        return "application/pdf";
-    } else if (strcmp(ext, ".c") == 0 || strcmp(ext, ".py") == 0 || 
-               strcmp(ext, ".sh") == 0 || strcmp(ext, ".h") == 0) {
-        return "text/plain";
+    return (char*) mime_lookup(ext + 1);
+}
+
+/* A range of the entries of a listing whose type readdir() did not report. */
+struct listdir_batch {
+    struct pool_task task;
+    int dir;
+    string* names;
+    bool* keep;
+    size_t from, to;
+};
+
+static
+void listdir_stat(struct pool_task* task)
+{
+    struct listdir_batch* b = (struct listdir_batch*) task;
+    for (size_t i = b->from; i < b->to; i++) {
+        struct stat st;
+        b->keep[i] = fstatat(b->dir, b->names[i], &st, AT_SYMLINK_NOFOLLOW) == 0
+                     && (S_ISDIR(st.st_mode) || S_ISREG(st.st_mode));
     }
-    return "application/octet-stream";
 }
 
+/*
+    Directories and regular files in path, at most MAX_DIR_SIZE. File
+    systems that do not report the type in readdir(), NFS among them,
+    need a stat() per entry; these are done in batches on the thread
+    pool, see helpers/pool.c.
+*/
 string* listdir(const char* path, size_t* n)
 {
     struct dirent *de;
@@ -133,18 +160,54 @@ string* listdir(const char* path, size_t* n)
     if (!dr) return NULL; 
 
     string* arr = malloc(MAX_DIR_SIZE * sizeof(string));
-    if (!arr) return NULL;
+    bool* keep = malloc(MAX_DIR_SIZE * sizeof(bool));
+    if (!arr || !keep) {
+        free(arr);
+        free(keep);
+        closedir(dr);
+        return NULL;
+    }
 
-    size_t idx = 0;
+    size_t idx = 0, unknown = 0;
     while ((de = readdir(dr)) && idx < MAX_DIR_SIZE)
     {
-        if (de->d_type == DT_DIR || de->d_type == DT_REG) {
+        if (de->d_type == DT_DIR || de->d_type == DT_REG || de->d_type == DT_UNKNOWN) {
             arr[idx] = snew(de->d_name);
             if (!arr[idx]) goto cleanup;
+            keep[idx] = de->d_type != DT_UNKNOWN;
+            unknown += !keep[idx];
             idx++;
         }
     }
+
+    if (unknown) {
+        struct listdir_batch batches[MAX_DIR_SIZE / LISTDIR_BATCH];
+        struct pool_group group = {0};
+        size_t nb = 0;
+        for (size_t i = 0; i < idx; i = batches[nb++].to) {
+            while (i < idx && keep[i])
+                i++;
+            if (i == idx)
+                break;
+            batches[nb] = (struct listdir_batch) {
+                .task.run = listdir_stat, .dir = dirfd(dr), .names = arr, .keep = keep,
+                .from = i, .to = i + LISTDIR_BATCH < idx ? i + LISTDIR_BATCH : idx,
+            };
+            pool_submit(&group, &batches[nb].task);
+        }
+        pool_wait(&group);
+
+        size_t kept = 0;
+        for (size_t i = 0; i < idx; i++) {
+            if (keep[i])
+                arr[kept++] = arr[i];
+            else
+                sfree(arr[i]);
+        }
+        idx = kept;
+    }
     closedir(dr);
+    free(keep);
     *n = idx;
     return arr;
 
@@ -152,6 +215,8 @@ cleanup:
     for (size_t i = 0; i < idx; i++)
         sfree(arr[i]);
     free(arr);
+    free(keep);
+    closedir(dr);
     return NULL;
 }
 
@@ -163,6 +228,9 @@ string read_file(const char* file_name)
 
     FILE* file = fopen(file_name, "rb");
     if (!file) return NULL;
+    struct stat st;
+    if (fstat(fileno(file), &st) == 0)
+        prefetch_stream(fileno(file), st.st_size);
 
     string ret = snewlen("", 0);
     while ((bytes_read = fread(buf, 1, CHUNK_SIZE, file)) > 0)
@@ -173,6 +241,49 @@ string read_file(const char* file_name)
     return ret;
 }
 
+/*
+    Write all len bytes, retrying on short writes.
+    Everything sent to clients goes through here and is counted in the access log,
+    and waits for bandwidth if it is limited (see net/shaper.c).
+    A write that times out (see SO_SNDTIMEO in handle_client()) fails with EAGAIN.
+*/
+bool write_all(int c, const char* buf, size_t len)
+{
+    while (len > 0) {
+        size_t allowed = shaper_acquire(len);
+        ssize_t n = write(c, buf, allowed);
+        shaper_unused(allowed - (n > 0 ? n : 0));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            metrics_timeout(MT_SEND);
+        if (n <= 0)
+            return false;
+        access_sent(n);
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+/* Send the bytes of file fd from *offset up to end like write_all(), with sendfile(). */
+bool sendfile_all(int c, int fd, off_t* offset, off_t end)
+{
+    while (*offset < end) {
+        size_t allowed = shaper_acquire(end - *offset);
+        ssize_t n = sendfile(c, fd, offset, allowed);
+        shaper_unused(allowed - (n > 0 ? n : 0));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            metrics_timeout(MT_SEND);
+        if (n <= 0)
+            return false;
+        access_sent(n);
+    }
+    return true;
+}
+
 bool send_chunked_file(int c, string buf)
 {
     size_t bytes_read;
@@ -183,17 +294,15 @@ bool send_chunked_file(int c, string buf)
     {
         bytes_read = len - n >= CHUNK_SIZE ? CHUNK_SIZE : len - n;
         snprintf(chunk_header, sizeof(chunk_header), "%zx\r\n", bytes_read);
-        if (write(c, chunk_header, strlen(chunk_header)) < 0)
+        if (!write_all(c, chunk_header, strlen(chunk_header)))
             return false;
-        if (write(c, buf + n, bytes_read) < 0)
+        if (!write_all(c, buf + n, bytes_read))
             return false;
-        if (write(c, "\r\n", 2) < 0)
+        if (!write_all(c, "\r\n", 2))
             return false;
         n += bytes_read;
     }
-    if (write(c, "0\r\n\r\n", 5) < 0)
-        return false;
-    return true;
+    return write_all(c, "0\r\n\r\n", 5);
 }
 
 #endif
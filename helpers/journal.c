@@ -0,0 +1,221 @@
+#ifndef HTTPD_JOURNAL
+#define HTTPD_JOURNAL
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include "watch.c"
+
+/*
+    The change journal behind ?changes_since=<version> (see send_changes()
+    in share.c): paths under the shared root that were added, removed or
+    modified, each with a version one higher than the last.
+
+    The main process appends what helpers/watch.c reports; children read
+    it. It lives in shared memory mapped before any child is forked: a
+    ring of JOURNAL_BYTES holding records one after the other, and a
+    ring of JOURNAL_RECORDS offsets to find a record by version. The
+    oldest records are overwritten as new ones arrive, and first, the
+    oldest version still held, moves past them before their bytes are
+    reused; a reader copies what it wants and checks first again after,
+    so it never returns a record that changed under it. A client whose
+    version is older than first, or from another run of the server
+    (versions start at the time the server started, in microseconds),
+    is told to list the tree again. Lost events reset the journal the
+    same way.
+
+    Records are written as the events of a batch from watch_read() are
+    reported, and only published, made visible to readers, by
+    journal_publish() once the batch is done. The same path modified
+    again with nothing in between is recorded once, but only within the
+    batch: a record a client may have read is never merged into, so the
+    rest of a write that was read halfway gets a record of its own.
+*/
+
+#define JOURNAL_BYTES           (16 << 20)      // must be a power of two
+#define JOURNAL_RECORDS         (1 << 18)       // must be a power of two
+#define JOURNAL_ALIGN           8
+
+enum journal_change {
+    JOURNAL_ADDED,
+    JOURNAL_REMOVED,
+    JOURNAL_MODIFIED,
+};
+
+static const char* journal_names[] = {
+    "added", "removed", "modified"
+};
+
+struct journal_record {
+    uint64_t version;
+    uint16_t len;               // of the path
+    uint8_t change;
+    uint8_t dir;
+    char path[];
+};
+
+struct journal {
+    _Atomic uint64_t version;   // of the last record
+    _Atomic uint64_t first;     // oldest version held, version + 1 when there is none
+    uint64_t head;              // bytes written so far, only read by the main process
+    uint64_t last;              // version of the last record written, only read by the main process
+    uint64_t offsets[JOURNAL_RECORDS];
+    char data[JOURNAL_BYTES];
+};
+
+static struct journal* journal;
+
+/* Map the journal. Return false if that fails; there is no journal then. */
+bool journal_init(void)
+{
+    journal = mmap(NULL, sizeof(struct journal), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (journal == MAP_FAILED) {
+        journal = NULL;
+        return false;
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    uint64_t start = (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    journal->last = start;
+    atomic_store(&journal->version, start);
+    atomic_store(&journal->first, start + 1);
+    return true;
+}
+
+static inline
+size_t journal_size(size_t len)
+{
+    return (sizeof(struct journal_record) + len + JOURNAL_ALIGN - 1) & ~(size_t)(JOURNAL_ALIGN - 1);
+}
+
+/* Copy len bytes of the ring from offset at, wrapping around its end. */
+static
+void journal_copy(void* out, uint64_t at, size_t len)
+{
+    size_t from = at & (JOURNAL_BYTES - 1);
+    size_t n = JOURNAL_BYTES - from < len ? JOURNAL_BYTES - from : len;
+    memcpy(out, journal->data + from, n);
+    memcpy((char*) out + n, journal->data, len - n);
+}
+
+/* Append a record. Only the main process writes. */
+void journal_add(enum journal_change change, const char* path, bool dir)
+{
+    if (!journal)
+        return;
+    size_t len = strlen(path);
+    if (len > UINT16_MAX)
+        return;
+    uint64_t version = journal->last;
+    uint64_t first = atomic_load_explicit(&journal->first, memory_order_relaxed);
+
+    /* Only a record of this batch, not published yet, can take another. */
+    if (change == JOURNAL_MODIFIED && first <= version
+        && version > atomic_load_explicit(&journal->version, memory_order_relaxed)) {
+        struct journal_record last;
+        uint64_t at = journal->offsets[version & (JOURNAL_RECORDS - 1)];
+        journal_copy(&last, at, sizeof(last));
+        char last_path[len + 1];
+        if (last.change == change && last.len == len) {
+            journal_copy(last_path, at + sizeof(last), len);
+            if (!memcmp(last_path, path, len))
+                return;
+        }
+    }
+
+    /* Make room: the records whose bytes or offset slot are reused are dropped first. */
+    size_t size = journal_size(len);
+    uint64_t old = first;
+    while (first <= version && (journal->head + size - journal->offsets[first & (JOURNAL_RECORDS - 1)] > JOURNAL_BYTES
+                                || version + 1 - first >= JOURNAL_RECORDS))
+        first++;
+    if (first != old) {
+        atomic_store_explicit(&journal->first, first, memory_order_relaxed);
+        atomic_thread_fence(memory_order_release);
+    }
+
+    struct journal_record r = {.version = version + 1, .len = len, .change = change, .dir = dir};
+    uint64_t at = journal->head;
+    size_t from = at & (JOURNAL_BYTES - 1);
+    char buf[size];
+    memcpy(buf, &r, sizeof(r));
+    memcpy(buf + sizeof(r), path, len);
+    size_t n = JOURNAL_BYTES - from < size ? JOURNAL_BYTES - from : size;
+    memcpy(journal->data + from, buf, n);
+    memcpy(journal->data, buf + n, size - n);
+    journal->offsets[(version + 1) & (JOURNAL_RECORDS - 1)] = at;
+    journal->head = at + size;
+    journal->last = version + 1;
+}
+
+/* Make the records written since the last call visible to readers, after a batch of events. */
+void journal_publish(void)
+{
+    if (journal)
+        atomic_store_explicit(&journal->version, journal->last, memory_order_release);
+}
+
+/* Forget everything, clients list the tree again. */
+void journal_reset(void)
+{
+    if (!journal)
+        return;
+    atomic_store(&journal->first, journal->last + 1);
+    journal_publish();
+}
+
+/* Record what helpers/watch.c reports, see watch_read(). */
+void journal_watch(enum watch_change change, const char* path, bool dir)
+{
+    if (change == WATCH_OVERFLOW)
+        journal_reset();
+    else
+        journal_add((enum journal_change) change, path, dir);
+}
+
+/*
+    Call fn for every record after version since, up to *version, which
+    is set to the last one. Only records under prefix (a directory
+    path, "" for all) are passed. Return false if since is too old or
+    unknown and the client has to list the tree again; fn may have been
+    called then too.
+*/
+bool journal_read(uint64_t since, const char* prefix, uint64_t* version,
+                  bool (*fn)(void* ctx, const struct journal_record* r), void* ctx)
+{
+    if (!journal)
+        return false;
+    *version = atomic_load_explicit(&journal->version, memory_order_acquire);
+    uint64_t first = atomic_load_explicit(&journal->first, memory_order_acquire);
+    if (since + 1 < first || since > *version)
+        return false;
+
+    size_t plen = strlen(prefix);
+    struct journal_record* r = malloc(sizeof(*r) + UINT16_MAX + 1);
+    if (!r)
+        return false;
+    bool ok = true;
+    for (uint64_t v = since + 1; ok && v <= *version; v++) {
+        uint64_t at = journal->offsets[v & (JOURNAL_RECORDS - 1)];
+        journal_copy(r, at, sizeof(*r));
+        size_t len = r->len;
+        journal_copy(r->path, at + sizeof(*r), len);
+        r->path[len] = 0;
+        atomic_thread_fence(memory_order_acquire);
+        /* Overwritten while it was copied. */
+        if (atomic_load_explicit(&journal->first, memory_order_relaxed) > v || r->version != v) {
+            ok = false;
+            break;
+        }
+        if (plen && (len < plen || memcmp(r->path, prefix, plen) || (len > plen && r->path[plen] != '/')))
+            continue;
+        ok = fn(ctx, r);
+    }
+    free(r);
+    return ok;
+}
+#endif
@@ -0,0 +1,283 @@
+#ifndef HTTPD_MIME
+#define HTTPD_MIME
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+/*
+    Content type lookup by file extension.
+
+    The built-in table is compiled in. mime_init() turns it, optionally
+    extended with a mime.types file, into an open-addressing hash table
+    that is never modified afterwards, so forked children share it
+    copy-on-write. A lookup lowercases the extension while hashing it
+    and usually costs a single probe.
+*/
+
+#define MIME_DEFAULT_TYPE       "application/octet-stream"
+#define MIME_MAX_EXT            16
+
+typedef struct {
+    const char* ext;
+    const char* type;
+} mime_entry;
+
+/* Alphabetical. These win over entries loaded from a mime.types file. */
+static const mime_entry mime_defaults[] = {
+    {"3gp",     "video/3gpp"},
+    {"7z",      "application/x-7z-compressed"},
+    {"aac",     "audio/aac"},
+    {"apng",    "image/apng"},
+    {"avi",     "video/x-msvideo"},
+    {"avif",    "image/avif"},
+    {"bmp",     "image/bmp"},
+    {"bz2",     "application/x-bzip2"},
+    {"c",       "text/plain"},
+    {"cc",      "text/plain"},
+    {"cfg",     "text/plain"},
+    {"conf",    "text/plain"},
+    {"cpp",     "text/plain"},
+    {"css",     "text/css"},
+    {"csv",     "text/csv"},
+    {"deb",     "application/vnd.debian.binary-package"},
+    {"diff",    "text/plain"},
+    {"doc",     "application/msword"},
+    {"docx",    "application/vnd.openxmlformats-officedocument.wordprocessingml.document"},
+    {"epub",    "application/epub+zip"},
+    {"flac",    "audio/flac"},
+    {"gif",     "image/gif"},
+    {"go",      "text/plain"},
+    {"gz",      "application/gzip"},
+    {"h",       "text/plain"},
+    {"heic",    "image/heic"},
+    {"hpp",     "text/plain"},
+    {"htm",     "text/html"},
+    {"html",    "text/html"},
+    {"ico",     "image/vnd.microsoft.icon"},
+    {"ics",     "text/calendar"},
+    {"ini",     "text/plain"},
+    {"iso",     "application/x-iso9660-image"},
+    {"jar",     "application/java-archive"},
+    {"java",    "text/plain"},
+    {"jpeg",    "image/jpeg"},
+    {"jpg",     "image/jpeg"},
+    {"js",      "application/javascript"},
+    {"json",    "application/json"},
+    {"jsonl",   "application/jsonl"},
+    {"log",     "text/plain"},
+    {"m3u",     "audio/x-mpegurl"},
+    {"m3u8",    "application/vnd.apple.mpegurl"},
+    {"m4a",     "audio/mp4"},
+    {"m4v",     "video/mp4"},
+    {"md",      "text/plain"},
+    {"mid",     "audio/midi"},
+    {"midi",    "audio/midi"},
+    {"mjs",     "application/javascript"},
+    {"mkv",     "video/x-matroska"},
+    {"mov",     "video/quicktime"},
+    {"mp3",     "audio/mpeg"},
+    {"mp4",     "video/mp4"},
+    {"mpeg",    "video/mpeg"},
+    {"mpg",     "video/mpeg"},
+    {"oga",     "audio/ogg"},
+    {"ogg",     "audio/ogg"},
+    {"ogv",     "video/ogg"},
+    {"odp",     "application/vnd.oasis.opendocument.presentation"},
+    {"ods",     "application/vnd.oasis.opendocument.spreadsheet"},
+    {"odt",     "application/vnd.oasis.opendocument.text"},
+    {"opus",    "audio/opus"},
+    {"otf",     "font/otf"},
+    {"patch",   "text/plain"},
+    {"pdf",     "application/pdf"},
+    {"png",     "image/png"},
+    {"ppt",     "application/vnd.ms-powerpoint"},
+    {"pptx",    "application/vnd.openxmlformats-officedocument.presentationml.presentation"},
+    {"py",      "text/plain"},
+    {"rar",     "application/vnd.rar"},
+    {"rs",      "text/plain"},
+    {"rtf",     "application/rtf"},
+    {"sh",      "text/plain"},
+    {"srt",     "text/plain"},
+    {"svg",     "image/svg+xml"},
+    {"tar",     "application/x-tar"},
+    {"tif",     "image/tiff"},
+    {"tiff",    "image/tiff"},
+    {"toml",    "text/plain"},
+    {"ts",      "video/mp2t"},
+    {"ttf",     "font/ttf"},
+    {"txt",     "text/plain"},
+    {"vtt",     "text/vtt"},
+    {"wasm",    "application/wasm"},
+    {"wav",     "audio/wav"},
+    {"weba",    "audio/webm"},
+    {"webm",    "video/webm"},
+    {"webmanifest", "application/manifest+json"},
+    {"webp",    "image/webp"},
+    {"woff",    "font/woff"},
+    {"woff2",   "font/woff2"},
+    {"xhtml",   "application/xhtml+xml"},
+    {"xls",     "application/vnd.ms-excel"},
+    {"xlsx",    "application/vnd.openxmlformats-officedocument.spreadsheetml.sheet"},
+    {"xml",     "application/xml"},
+    {"xz",      "application/x-xz"},
+    {"yaml",    "text/plain"},
+    {"yml",     "text/plain"},
+    {"zip",     "application/zip"},
+    {"zst",     "application/zstd"},
+};
+#define MIME_N_DEFAULTS (sizeof(mime_defaults) / sizeof(mime_defaults[0]))
+
+typedef struct {
+    uint64_t hash;
+    const char* ext;
+    const char* type;
+} mime_slot;
+
+static mime_slot* mime_table;
+static size_t mime_mask;
+/* mime.types contents, entries of the table point into it. */
+static char* mime_file_buf;
+
+/* FNV-1a over the lowercased extension, which is written to 'lower'. */
+static inline
+uint64_t mime_hash(const char* ext, size_t len, char* lower)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        lower[i] = tolower((unsigned char) ext[i]);
+        hash ^= (unsigned char) lower[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/* Add ext unless it is already present. ext must be lowercase. */
+static
+void mime_add(const char* ext, const char* type)
+{
+    char lower[MIME_MAX_EXT];
+    size_t len = strlen(ext);
+    if (len == 0 || len >= MIME_MAX_EXT)
+        return;
+    uint64_t hash = mime_hash(ext, len, lower);
+    size_t i = hash & mime_mask;
+    while (mime_table[i].ext) {
+        if (mime_table[i].hash == hash && strcmp(mime_table[i].ext, ext) == 0)
+            return;
+        i = (i + 1) & mime_mask;
+    }
+    mime_table[i].hash = hash;
+    mime_table[i].ext = ext;
+    mime_table[i].type = type;
+}
+
+/* Read a mime.types file into mime_file_buf, return the number of extensions. */
+static
+size_t mime_read_file(const char* path)
+{
+    FILE* f = fopen(path, "rb");
+    if (!f)
+        return 0;
+    if (fseek(f, 0, SEEK_END) != 0) {
+        fclose(f);
+        return 0;
+    }
+    long size = ftell(f);
+    rewind(f);
+    if (size <= 0 || !(mime_file_buf = malloc(size + 1))) {
+        fclose(f);
+        return 0;
+    }
+    size_t len = fread(mime_file_buf, 1, size, f);
+    mime_file_buf[len] = 0;
+    fclose(f);
+
+    size_t words = 0;
+    for (size_t i = 0; i < len; i++)
+        words += !isspace((unsigned char) mime_file_buf[i]) &&
+                 (i == 0 || isspace((unsigned char) mime_file_buf[i - 1]));
+    return words;
+}
+
+/*
+    Lines look like "video/mp4   mp4 mp4v mpg4". Tokens are null-terminated
+    in place and extensions lowercased, comments start with '#'.
+*/
+static
+void mime_parse_file(void)
+{
+    char* line = mime_file_buf;
+    while (line) {
+        char* next = strchr(line, '\n');
+        if (next)
+            *next++ = 0;
+        char* hash = strchr(line, '#');
+        if (hash)
+            *hash = 0;
+
+        char* save;
+        char* type = strtok_r(line, " \t\r", &save);
+        char* ext;
+        while (type && (ext = strtok_r(NULL, " \t\r", &save))) {
+            for (char* p = ext; *p; p++)
+                *p = tolower((unsigned char) *p);
+            mime_add(ext, type);
+        }
+        line = next;
+    }
+}
+
+/*
+    Build the lookup table from the defaults and, if path is not NULL
+    and readable, the extensions listed in that mime.types file.
+    Return false if memory could not be allocated.
+*/
+bool mime_init(const char* path)
+{
+    size_t n = MIME_N_DEFAULTS;
+    if (path)
+        n += mime_read_file(path);
+
+    size_t size = 64;
+    while (size < n * 2)
+        size <<= 1;
+    mime_table = calloc(size, sizeof(mime_slot));
+    if (!mime_table) {
+        free(mime_file_buf);
+        mime_file_buf = NULL;
+        return false;
+    }
+    mime_mask = size - 1;
+
+    for (size_t i = 0; i < MIME_N_DEFAULTS; i++)
+        mime_add(mime_defaults[i].ext, mime_defaults[i].type);
+    if (mime_file_buf)
+        mime_parse_file();
+    return true;
+}
+
+/* Content type for an extension without the dot, of any case. */
+const char* mime_lookup(const char* ext)
+{
+    if (!mime_table && !mime_init(NULL))
+        return MIME_DEFAULT_TYPE;
+
+    char lower[MIME_MAX_EXT];
+    size_t len = strnlen(ext, MIME_MAX_EXT);
+    if (len == 0 || len == MIME_MAX_EXT)
+        return MIME_DEFAULT_TYPE;
+    uint64_t hash = mime_hash(ext, len, lower);
+    size_t i = hash & mime_mask;
+    while (mime_table[i].ext) {
+        if (mime_table[i].hash == hash && memcmp(mime_table[i].ext, lower, len) == 0
+            && mime_table[i].ext[len] == 0)
+            return mime_table[i].type;
+        i = (i + 1) & mime_mask;
+    }
+    return MIME_DEFAULT_TYPE;
+}
+#endif
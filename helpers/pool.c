@@ -0,0 +1,263 @@
+#ifndef HTTPD_POOL
+#define HTTPD_POOL
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+/*
+    Work-stealing thread pool for blocking file system work: stat() of
+    directory entries, reading files to hash them, walking trees. The
+    main process never touches the file system, its children do, so
+    the pool belongs to a child and offloads work from the request it
+    is serving: the child splits the work into tasks of a group,
+    submits them and waits for the group, running tasks itself while it
+    waits. The results are in the tasks once pool_wait() returns.
+
+    Every thread, the child's own as number 0, owns a deque of tasks
+    (Chase and Lev). Its owner pushes and pops at the bottom without
+    contention; other threads steal from the top with a compare and
+    swap, the oldest and so usually the largest task first. No lock is
+    shared by the threads; tasks may submit more tasks, which go to the
+    deque of the thread running them. A task that finds its deque full
+    runs at once in the submitting thread.
+
+    Workers that find nothing to steal sleep on a futex and are woken by
+    the next submit. They are started by the first submit of a process.
+    fork() copies only the calling thread, so a child forked by a main
+    process that used the pool, to walk the tree for the search index
+    (see helpers/search.c), starts over and gets workers of its own.
+    With pool_threads set to 0 (share -P 0) tasks run in the child.
+*/
+
+#define POOL_MAX_THREADS        64
+#define POOL_DEQUE              1024        // must be a power of two
+#define POOL_SPINS              64          // rounds of stealing before a worker sleeps
+
+struct pool_group;
+
+/* Embedded first in the caller's own task structures. */
+struct pool_task {
+    void (*run)(struct pool_task* task);
+    struct pool_group* group;
+};
+
+struct pool_group {
+    _Atomic uint32_t pending;   // submitted and not finished, a futex word
+};
+
+struct pool_deque {
+    _Atomic int64_t top;
+    _Atomic int64_t bottom;
+    struct pool_task* _Atomic tasks[POOL_DEQUE];
+} __attribute__((aligned(64)));
+
+/* Worker threads of a child, set with share -P. */
+uint32_t pool_threads = 4;
+
+static struct pool_deque pool_deques[POOL_MAX_THREADS + 1];
+static _Atomic uint32_t pool_started;           // workers running
+static bool pool_starting = true;               // no submit yet
+static _Atomic uint32_t pool_signal;            // bumped to wake sleeping workers, a futex word
+static _Atomic uint32_t pool_sleepers;
+static _Thread_local uint32_t pool_self;        // index of this thread's deque
+
+static inline
+void pool_futex_wait(_Atomic uint32_t* word, uint32_t value)
+{
+    syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+}
+
+static inline
+void pool_futex_wake(_Atomic uint32_t* word, int n)
+{
+    syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+/* Owner only. False if the deque is full. */
+static
+bool pool_push(struct pool_deque* d, struct pool_task* task)
+{
+    int64_t b = atomic_load_explicit(&d->bottom, memory_order_relaxed);
+    int64_t t = atomic_load_explicit(&d->top, memory_order_acquire);
+    if (b - t >= POOL_DEQUE)
+        return false;
+    atomic_store_explicit(&d->tasks[b & (POOL_DEQUE - 1)], task, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    return true;
+}
+
+/* Owner only. The newest task, NULL if there is none. */
+static
+struct pool_task* pool_pop(struct pool_deque* d)
+{
+    int64_t b = atomic_load_explicit(&d->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&d->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t t = atomic_load_explicit(&d->top, memory_order_relaxed);
+    if (t > b) {
+        atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+        return NULL;
+    }
+    struct pool_task* task = atomic_load_explicit(&d->tasks[b & (POOL_DEQUE - 1)], memory_order_relaxed);
+    if (t == b) {
+        /* The last task, a thief may be taking it too. */
+        if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+                                                     memory_order_seq_cst, memory_order_relaxed))
+            task = NULL;
+        atomic_store_explicit(&d->bottom, b + 1, memory_order_relaxed);
+    }
+    return task;
+}
+
+/* Any thread. The oldest task, NULL if there is none or another thread took it. */
+static
+struct pool_task* pool_steal(struct pool_deque* d)
+{
+    int64_t t = atomic_load_explicit(&d->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t b = atomic_load_explicit(&d->bottom, memory_order_acquire);
+    if (t >= b)
+        return NULL;
+    struct pool_task* task = atomic_load_explicit(&d->tasks[t & (POOL_DEQUE - 1)], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&d->top, &t, t + 1,
+                                                 memory_order_seq_cst, memory_order_relaxed))
+        return NULL;
+    return task;
+}
+
+static
+void pool_run(struct pool_task* task)
+{
+    struct pool_group* group = task->group;
+    task->run(task);
+    /* The task may be freed by the waiter from here on. */
+    if (atomic_fetch_sub_explicit(&group->pending, 1, memory_order_acq_rel) == 1)
+        pool_futex_wake(&group->pending, INT_MAX);
+}
+
+/* A task of this thread's deque or one stolen from another, NULL if there is none. */
+static
+struct pool_task* pool_find(uint32_t* seed)
+{
+    struct pool_task* task = pool_pop(&pool_deques[pool_self]);
+    if (task || pool_started == 0)
+        return task;
+    /* Victims from a random start, so thieves spread over the deques. */
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 17;
+    *seed ^= *seed << 5;
+    uint32_t n = pool_started + 1;
+    for (uint32_t k = 0, v = *seed % n; k < n; k++, v = (v + 1) % n)
+        if (v != pool_self && (task = pool_steal(&pool_deques[v])))
+            return task;
+    return NULL;
+}
+
+static
+void* pool_worker(void* arg)
+{
+    pool_self = (uint32_t)(uintptr_t) arg;
+    uint32_t seed = pool_self * 2654435761u;
+    while (1) {
+        struct pool_task* task = NULL;
+        for (int i = 0; i < POOL_SPINS && !task; i++)
+            task = pool_find(&seed);
+        if (task) {
+            pool_run(task);
+            continue;
+        }
+        /* Look once more after announcing the sleep, a submit in between bumps the signal. */
+        uint32_t signal = atomic_load_explicit(&pool_signal, memory_order_acquire);
+        atomic_fetch_add_explicit(&pool_sleepers, 1, memory_order_seq_cst);
+        if ((task = pool_find(&seed))) {
+            atomic_fetch_sub_explicit(&pool_sleepers, 1, memory_order_relaxed);
+            pool_run(task);
+            continue;
+        }
+        pool_futex_wait(&pool_signal, signal);
+        atomic_fetch_sub_explicit(&pool_sleepers, 1, memory_order_relaxed);
+    }
+    return NULL;
+}
+
+/* In a forked child, whose copies of the workers do not run. */
+static
+void pool_after_fork(void)
+{
+    pool_started = 0;
+    pool_starting = true;
+    pool_sleepers = 0;
+    pool_signal = 0;
+    for (uint32_t i = 0; i <= POOL_MAX_THREADS; i++)
+        pool_deques[i].top = pool_deques[i].bottom = 0;
+}
+
+/* Start the workers, with every signal blocked so they stay with the child's thread. */
+static
+void pool_start(void)
+{
+    pthread_atfork(NULL, NULL, pool_after_fork);
+    uint32_t n = pool_threads < POOL_MAX_THREADS ? pool_threads : POOL_MAX_THREADS;
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize(&attr, 256 * 1024);
+    for (uint32_t i = 1; i <= n; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, &attr, pool_worker, (void*)(uintptr_t) i) != 0)
+            break;
+        pool_started = i;
+    }
+    pthread_attr_destroy(&attr);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/* Run task in group on some thread of the pool. task must live until pool_wait() on group returns. */
+void pool_submit(struct pool_group* group, struct pool_task* task)
+{
+    if (pool_starting && pool_self == 0) {
+        pool_starting = false;
+        if (pool_threads > 0)
+            pool_start();
+    }
+    task->group = group;
+    atomic_fetch_add_explicit(&group->pending, 1, memory_order_relaxed);
+    if (pool_started == 0 || !pool_push(&pool_deques[pool_self], task)) {
+        pool_run(task);
+        return;
+    }
+    /* Pairs with a worker announcing its sleep before it looks for tasks a last time. */
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&pool_sleepers, memory_order_relaxed)) {
+        atomic_fetch_add_explicit(&pool_signal, 1, memory_order_release);
+        pool_futex_wake(&pool_signal, 1);
+    }
+}
+
+/* Run tasks until every task of group has finished. */
+void pool_wait(struct pool_group* group)
+{
+    uint32_t seed = (pool_self + 1) * 2246822519u;
+    uint32_t pending;
+    while ((pending = atomic_load_explicit(&group->pending, memory_order_acquire))) {
+        struct pool_task* task = pool_find(&seed);
+        if (task)
+            pool_run(task);
+        else
+            pool_futex_wait(&group->pending, pending);
+    }
+}
+#endif
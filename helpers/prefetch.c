@@ -0,0 +1,249 @@
+#ifndef HTTPD_PREFETCH
+#define HTTPD_PREFETCH
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "safe_string.h"
+#include "pool.c"
+#include "../logger/metrics.c"
+
+/*
+    Warming the page cache for the files a client is about to fetch.
+
+    Whoever opens a directory of photos fetches its files in the order
+    of the listing next, so once a listing is sent its first small files
+    are read ahead with POSIX_FADV_WILLNEED: the disk reads them while
+    the client is still rendering the page, and the requests that follow
+    find them in memory instead of waiting for a seek each. The hints go
+    out on the thread pool (see helpers/pool.c) without being waited
+    for; the child only waits for them before it exits. Files that are
+    read whole to be sent are hinted POSIX_FADV_SEQUENTIAL, and large
+    ones POSIX_FADV_NOREUSE too, so streaming them does not push the
+    warmed files out.
+
+    How many files are warmed is tuned by directory. A history slot,
+    found by the hash of the directory's path, remembers how many files
+    its last listing warmed, how many of those were then fetched and how
+    many fetched files had not been warmed. When the directory is listed
+    again, the depth doubles if at least half of the warmed files were
+    fetched and some were missed, and halves if fewer than an eighth
+    were, between PREFETCH_MIN_DEPTH and PREFETCH_MAX_DEPTH files.
+    Warmed files are remembered in a table by the hash of their path,
+    so fetching one counts as a hit once, and a fetch of a file in a
+    directory with history that was not warmed as a miss.
+
+    The history lives in memory mapped MAP_SHARED before any child is
+    forked, updated with relaxed atomics by whichever child lists or
+    serves; both tables are direct-mapped and a collision overwrites an
+    older entry, which only costs the history some accuracy. The hits
+    and misses and the time to first byte of each are in the metrics.
+*/
+
+#define PREFETCH_DIRS           4096            // history slots, must be a power of two
+#define PREFETCH_FILES          65536           // warmed files remembered, must be a power of two
+#define PREFETCH_SMALL          (16 << 20)      // files up to this size are warmed
+#define PREFETCH_LARGE          (64 << 20)      // files from this size are streamed without being kept
+#define PREFETCH_BUDGET         (256 << 20)     // bytes warmed for one listing at most
+#define PREFETCH_MIN_DEPTH      4
+#define PREFETCH_START_DEPTH    16
+#define PREFETCH_MAX_DEPTH      512
+#define PREFETCH_BATCH          16              // files one pool task warms
+
+struct prefetch_dir {
+    _Atomic uint64_t key;       // hash of the path, 0 for a free slot
+    _Atomic uint32_t depth;     // files to warm at the next listing
+    _Atomic uint32_t warmed;    // files the last listing warmed
+    _Atomic uint32_t used;      // of those, fetched since
+    _Atomic uint32_t missed;    // files fetched since that were not warmed
+};
+
+struct prefetch_file {
+    _Atomic uint64_t key;       // hash of the path, 0 for a free slot
+    _Atomic uint32_t dir;       // history slot of its directory
+};
+
+struct prefetch {
+    struct prefetch_dir dirs[PREFETCH_DIRS];
+    struct prefetch_file files[PREFETCH_FILES];
+};
+
+/* A batch of files of a listing to warm. */
+struct prefetch_task {
+    struct pool_task task;
+    uint32_t dir;
+    size_t n;
+    string paths[PREFETCH_BATCH];
+};
+
+static struct prefetch* prefetch;
+static struct pool_group prefetch_group;
+static _Atomic int64_t prefetch_budget;         // bytes the current listing may still warm
+static int prefetch_outcome = -1;               // of the current request: -1 none, 0 miss, 1 hit
+
+/* Map the history. Return false if that fails; nothing is warmed then. */
+bool prefetch_init(void)
+{
+    prefetch = mmap(NULL, sizeof(struct prefetch), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (prefetch == MAP_FAILED) {
+        prefetch = NULL;
+        return false;
+    }
+    return true;
+}
+
+/* FNV-1a of the len bytes of path, never 0. */
+static inline
+uint64_t prefetch_hash(const char* path, size_t len)
+{
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (unsigned char) path[i]) * 1099511628211ULL;
+    return h ? h : 1;
+}
+
+static
+void prefetch_run(struct pool_task* task)
+{
+    struct prefetch_task* t = (struct prefetch_task*) task;
+    for (size_t i = 0; i < t->n; i++) {
+        int fd = open(t->paths[i], O_RDONLY | O_CLOEXEC);
+        struct stat st;
+        if (fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 && st.st_size <= PREFETCH_SMALL
+            && atomic_fetch_sub_explicit(&prefetch_budget, st.st_size, memory_order_relaxed) >= st.st_size
+            && posix_fadvise(fd, 0, st.st_size, POSIX_FADV_WILLNEED) == 0) {
+            uint64_t key = prefetch_hash(t->paths[i], sgetlen(t->paths[i]));
+            struct prefetch_file* f = &prefetch->files[key & (PREFETCH_FILES - 1)];
+            atomic_store_explicit(&f->dir, t->dir, memory_order_relaxed);
+            atomic_store_explicit(&f->key, key, memory_order_relaxed);
+            atomic_fetch_add_explicit(&prefetch->dirs[t->dir].warmed, 1, memory_order_relaxed);
+            metrics_prefetched(st.st_size);
+        }
+        if (fd >= 0)
+            close(fd);
+        sfree(t->paths[i]);
+    }
+    free(t);
+}
+
+/* The depth for the history slot d of the directory with hash key, after what its last listing achieved. */
+static
+uint32_t prefetch_depth(struct prefetch_dir* d, uint64_t key)
+{
+    if (atomic_exchange_explicit(&d->key, key, memory_order_relaxed) != key) {
+        atomic_store_explicit(&d->depth, PREFETCH_START_DEPTH, memory_order_relaxed);
+        atomic_store_explicit(&d->warmed, 0, memory_order_relaxed);
+        atomic_store_explicit(&d->used, 0, memory_order_relaxed);
+        atomic_store_explicit(&d->missed, 0, memory_order_relaxed);
+        return PREFETCH_START_DEPTH;
+    }
+    uint32_t depth = atomic_load_explicit(&d->depth, memory_order_relaxed);
+    uint32_t warmed = atomic_exchange_explicit(&d->warmed, 0, memory_order_relaxed);
+    uint32_t used = atomic_exchange_explicit(&d->used, 0, memory_order_relaxed);
+    uint32_t missed = atomic_exchange_explicit(&d->missed, 0, memory_order_relaxed);
+    if (warmed && used * 2 >= warmed && missed)
+        depth = depth * 2 < PREFETCH_MAX_DEPTH ? depth * 2 : PREFETCH_MAX_DEPTH;
+    else if (warmed && used * 8 < warmed)
+        depth = depth / 2 > PREFETCH_MIN_DEPTH ? depth / 2 : PREFETCH_MIN_DEPTH;
+    atomic_store_explicit(&d->depth, depth, memory_order_relaxed);
+    return depth;
+}
+
+/*
+    The listing of directory dir, the n entries in names, was sent: warm
+    the first of its files, in the order of the listing, on the pool.
+*/
+void prefetch_listed(const char* dir, string* names, size_t n)
+{
+    if (!prefetch || !names)
+        return;
+    size_t len = strlen(dir);
+    uint64_t key = prefetch_hash(dir, len);
+    uint32_t slot = key & (PREFETCH_DIRS - 1);
+    uint32_t depth = prefetch_depth(&prefetch->dirs[slot], key);
+    atomic_store_explicit(&prefetch_budget, PREFETCH_BUDGET, memory_order_relaxed);
+
+    struct prefetch_task* t = NULL;
+    for (size_t i = 0; i < n && depth > 0; i++) {
+        if (!strcmp(names[i], ".") || !strcmp(names[i], ".."))
+            continue;
+        if (!t) {
+            if (!(t = malloc(sizeof(*t))))
+                return;
+            t->dir = slot;
+            t->n = 0;
+        }
+        size_t size = len + 2 + sgetlen(names[i]);
+        string path = snewlen(NULL, size);
+        if (!path)
+            break;
+        snprintf(path, size, "%s%s%s", dir, len ? "/" : "", names[i]);
+        supdatelen(path, strlen(path));
+        t->paths[t->n++] = path;
+        depth--;
+        if (t->n == PREFETCH_BATCH) {
+            t->task.run = prefetch_run;
+            pool_submit(&prefetch_group, &t->task);
+            t = NULL;
+        }
+    }
+    if (t && t->n) {
+        t->task.run = prefetch_run;
+        pool_submit(&prefetch_group, &t->task);
+    } else
+        free(t);
+}
+
+/* File path is about to be sent: count whether it was warmed, if its directory has a history. */
+void prefetch_served(const char* path)
+{
+    prefetch_outcome = -1;
+    if (!prefetch)
+        return;
+    uint64_t key = prefetch_hash(path, strlen(path));
+    struct prefetch_file* f = &prefetch->files[key & (PREFETCH_FILES - 1)];
+    uint64_t expected = key;
+    if (atomic_compare_exchange_strong_explicit(&f->key, &expected, 0, memory_order_relaxed, memory_order_relaxed)) {
+        uint32_t dir = atomic_load_explicit(&f->dir, memory_order_relaxed);
+        atomic_fetch_add_explicit(&prefetch->dirs[dir].used, 1, memory_order_relaxed);
+        prefetch_outcome = 1;
+        return;
+    }
+    const char* slash = strrchr(path, '/');
+    uint64_t dir_key = prefetch_hash(path, slash ? (size_t) (slash - path) : 0);
+    struct prefetch_dir* d = &prefetch->dirs[dir_key & (PREFETCH_DIRS - 1)];
+    if (atomic_load_explicit(&d->key, memory_order_relaxed) == dir_key) {
+        atomic_fetch_add_explicit(&d->missed, 1, memory_order_relaxed);
+        prefetch_outcome = 0;
+    }
+}
+
+/* The request is over; its time to first byte, in microseconds, goes to the metrics if it was counted. */
+void prefetch_end(uint32_t first_us)
+{
+    if (prefetch_outcome >= 0)
+        metrics_prefetch(prefetch_outcome, first_us);
+    prefetch_outcome = -1;
+}
+
+/* fd is about to be read whole, size bytes: hint the kernel, see above. */
+void prefetch_stream(int fd, off_t size)
+{
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    if (size >= PREFETCH_LARGE)
+        posix_fadvise(fd, 0, 0, POSIX_FADV_NOREUSE);
+}
+
+/* Let the warming of the last listings finish, before the child exits. */
+void prefetch_wait(void)
+{
+    pool_wait(&prefetch_group);
+}
+#endif
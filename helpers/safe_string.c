@@ -8,6 +8,10 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <ctype.h>
+#if defined(__SSE2__) && (defined(__GNUC__) || defined(__clang__))
+#define SS_SIMD
+#include <immintrin.h>
+#endif
 
 /* Definitions */
 #define H_TYPE_8 0
@@ -600,6 +604,175 @@ ssize_t sfind_advanced(string s, size_t plen, const char* pattern) {
     return -1;
 }
 
+/*
+    Scanning kernels.
+
+    sscan() returns the index of the first match of a pattern in s[0..n)
+    or n if there is none, scount_byte() counts the occurrences of a byte.
+    On x86 an SSE2 or AVX2 kernel is picked at runtime, elsewhere the
+    scalar version is used.
+
+    Single bytes are left to memchr(), which the C library already
+    implements with the widest vectors the CPU offers. Longer patterns
+    first skip ahead with memchr() on their first byte. Once that byte
+    proves common (SS_SKIP_MISSES false candidates, e.g. '<' in HTML
+    or '\r' in headers) the SIMD kernel takes over: it compares a block
+    of candidate first bytes and a block of candidate last bytes at once,
+    and only positions where both agree are confirmed with memcmp().
+*/
+
+#define SS_SKIP_MISSES 4
+
+static inline
+size_t sscan_byte(const char* s, size_t n, char c) {
+    const char* p = memchr(s, c, n);
+    return p ? (size_t)(p - s) : n;
+}
+
+/*
+    Every false candidate costs one unit of *budget. If it runs out,
+    the index to resume from is returned and *budget is 0.
+*/
+static inline
+size_t sscan_skip(const char* s, size_t n, const char* p, size_t plen, size_t* budget) {
+    size_t idx = 0;
+    while (idx + plen <= n && *budget > 0) {
+        idx += sscan_byte(s + idx, n - plen + 1 - idx, p[0]);
+        if (idx + plen > n)
+            return n;
+        if (memcmp(s + idx + 1, p + 1, plen - 1) == 0)
+            return idx;
+        idx++;
+        (*budget)--;
+    }
+    return idx + plen <= n ? idx : n;
+}
+
+static inline
+size_t scount_byte_scalar(const char* s, size_t n, char c) {
+    size_t count = 0;
+    for (size_t i = 0; i < n; i++)
+        count += s[i] == c;
+    return count;
+}
+
+#ifdef SS_SIMD
+static
+size_t sscan_sse2(const char* s, size_t n, const char* p, size_t plen) {
+    const __m128i first = _mm_set1_epi8(p[0]);
+    const __m128i last = _mm_set1_epi8(p[plen - 1]);
+    size_t i = 0;
+    for (; i + 16 + plen - 1 <= n; i += 16) {
+        __m128i bf = _mm_loadu_si128((const __m128i*)(s + i));
+        __m128i bl = _mm_loadu_si128((const __m128i*)(s + i + plen - 1));
+        unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(bf, first),
+                                                         _mm_cmpeq_epi8(bl, last)));
+        while (mask) {
+            unsigned bit = __builtin_ctz(mask);
+            if (memcmp(s + i + bit + 1, p + 1, plen - 2) == 0)
+                return i + bit;
+            mask &= mask - 1;
+        }
+    }
+    for (; i + plen <= n; i++)
+        if (s[i] == p[0] && memcmp(s + i, p, plen) == 0) return i;
+    return n;
+}
+
+static
+size_t scount_byte_sse2(const char* s, size_t n, char c) {
+    const __m128i needle = _mm_set1_epi8(c);
+    size_t count = 0;
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i block = _mm_loadu_si128((const __m128i*)(s + i));
+        count += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(block, needle)));
+    }
+    return count + scount_byte_scalar(s + i, n - i, c);
+}
+
+/* Two blocks per iteration, so the common no-candidate case costs one branch. */
+__attribute__((target("avx2")))
+static
+size_t sscan_avx2(const char* s, size_t n, const char* p, size_t plen) {
+    const __m256i first = _mm256_set1_epi8(p[0]);
+    const __m256i last = _mm256_set1_epi8(p[plen - 1]);
+    size_t i = 0;
+    for (; i + 64 + plen - 1 <= n; i += 64) {
+        __m256i m0 = _mm256_and_si256(
+            _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(s + i)), first),
+            _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(s + i + plen - 1)), last));
+        __m256i m1 = _mm256_and_si256(
+            _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(s + i + 32)), first),
+            _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(s + i + 32 + plen - 1)), last));
+        __m256i any = _mm256_or_si256(m0, m1);
+        if (_mm256_testz_si256(any, any))
+            continue;
+        uint64_t mask = (uint32_t) _mm256_movemask_epi8(m0)
+                      | (uint64_t)(uint32_t) _mm256_movemask_epi8(m1) << 32;
+        while (mask) {
+            unsigned bit = __builtin_ctzll(mask);
+            if (memcmp(s + i + bit + 1, p + 1, plen - 2) == 0)
+                return i + bit;
+            mask &= mask - 1;
+        }
+    }
+    return i + sscan_sse2(s + i, n - i, p, plen);
+}
+
+__attribute__((target("avx2,popcnt")))
+static
+size_t scount_byte_avx2(const char* s, size_t n, char c) {
+    const __m256i needle = _mm256_set1_epi8(c);
+    size_t count = 0;
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i block = _mm256_loadu_si256((const __m256i*)(s + i));
+        count += __builtin_popcount(_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, needle)));
+    }
+    return count + scount_byte_sse2(s + i, n - i, c);
+}
+
+static inline
+bool shas_avx2(void) {
+    static int has_avx2 = -1;
+    if (has_avx2 == -1)
+        has_avx2 = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt");
+    return has_avx2;
+}
+#endif
+
+static inline
+size_t sscan(const char* s, size_t n, const char* p, size_t plen) {
+    if (plen > n)
+        return n;
+    if (plen == 1)
+        return sscan_byte(s, n, p[0]);
+#ifdef SS_SIMD
+    size_t budget = SS_SKIP_MISSES;
+    size_t idx = sscan_skip(s, n, p, plen, &budget);
+    if (budget > 0 || idx == n)
+        return idx;
+    if (shas_avx2())
+        return idx + sscan_avx2(s + idx, n - idx, p, plen);
+    return idx + sscan_sse2(s + idx, n - idx, p, plen);
+#else
+    size_t budget = SIZE_MAX;
+    return sscan_skip(s, n, p, plen, &budget);
+#endif
+}
+
+static inline
+size_t scount_byte(const char* s, size_t n, char c) {
+#ifdef SS_SIMD
+    if (shas_avx2())
+        return scount_byte_avx2(s, n, c);
+    return scount_byte_sse2(s, n, c);
+#else
+    return scount_byte_scalar(s, n, c);
+#endif
+}
+
 /*
     Find the starting index of the first substring matching the 'pattern'.
 
@@ -616,18 +789,8 @@ ssize_t sfind(string s, size_t plen, const char* pattern) {
     size_t n = sgetlen(s);
     if (plen > n || plen == 0)
         return -1;
-    if (plen == 1) {
-        for (size_t idx = 0; idx <= n - plen; idx++) {
-            if (s[idx] == pattern[0])
-                return idx;
-        }
-    } else {
-        for (size_t idx = 0; idx <= n - plen; idx++) {
-            if (s[idx] == pattern[0] && memcmp(s + idx, pattern, plen) == 0)
-                return idx;
-        }
-    } 
-    return -1;
+    size_t idx = sscan(s, n, pattern, plen);
+    return idx == n ? -1 : (ssize_t) idx;
 }
 
 /*
@@ -663,19 +826,16 @@ ssize_t srfind(string s, size_t plen, const char* pattern) {
 ssize_t scount(string s, size_t plen, const char* pattern) {
     if (s == NULL || pattern == NULL)
         return -1;
-    if (plen > sgetlen(s) || plen == 0)
+    size_t n = sgetlen(s);
+    if (plen > n || plen == 0)
         return -1;
+    if (plen == 1)
+        return scount_byte(s, n, pattern[0]);
     size_t count = 0;
-    if (plen == 1) {
-        for (size_t idx = 0; idx <= sgetlen(s) - plen; idx++) {
-            if (s[idx] == pattern[0])
-                count++;
-        }
-    } else {
-        for (size_t idx = 0; idx <= sgetlen(s) - plen; idx++) {
-            if (s[idx] == pattern[0] && memcmp(s + idx, pattern, plen) == 0)
-                count++;
-        }
+    size_t idx = 0;
+    while ((idx += sscan(s + idx, n - idx, pattern, plen)) < n) {
+        count++;
+        idx++;
     }
     return count;
 }
@@ -776,27 +936,6 @@ string sbite(string s, size_t plen, const char* pattern) {
     return new;
 }
 
-static inline
-size_t scount_private(const string s, size_t plen, const char* pattern) {
-    size_t count = 0;
-    if (plen == 1) {
-        for (size_t idx = 0; idx <= sgetlen(s) - plen; idx++) {
-            if (s[idx] == pattern[0])
-                count++;
-        }
-    } else {
-        size_t idx = 0;
-        while (idx <= sgetlen(s) - plen) {
-            if (s[idx] == pattern[0] && memcmp(s + idx, pattern, plen) == 0) {
-                count++;
-                idx += plen;
-            } else 
-                idx++;
-        }
-    }
-    return count;
-}
-
 /*
     Split a string using the given separator into an array of n substrings.
 
@@ -808,29 +947,36 @@ size_t scount_private(const string s, size_t plen, const char* pattern) {
 string* ssplit(const string s, size_t seplen, const char* sep, size_t* n) {
     if (!s || !sep || !n)
         return NULL;
-    if (seplen > sgetlen(s) || seplen == 0)
-        return NULL;
-    size_t count = scount_private(s, seplen, sep);
-    size_t size_to_alloc = (count + 1) * sizeof(string);
-    if (size_to_alloc / sizeof(string) != count + 1)
+    size_t len = sgetlen(s);
+    if (seplen > len || seplen == 0)
         return NULL;
-    string* arr = malloc(size_to_alloc);
+
+    /* One pass: the array grows as separators are found. */
+    size_t cap = 16;
+    string* arr = malloc(cap * sizeof(string));
     if (!arr)
         return NULL;
 
     size_t elem = 0;
     size_t start = 0;
-    for (size_t idx = 0; idx <= sgetlen(s) - seplen; idx++) {
-        if (s[idx] == sep[0] && (seplen == 1 || memcmp(s + idx, sep, seplen) == 0)) {
-            arr[elem] = snewlen(s + start, idx - start);
-            if (!arr[elem]) goto cleanup;
-            elem++;
-            idx += seplen - 1;
-            start = idx + 1;
+    for (;;) {
+        size_t idx = start + sscan(s + start, len - start, sep, seplen);
+        if (elem + 1 == cap) {
+            if (cap > SIZE_MAX / 2 / sizeof(string)) goto cleanup;
+            string* tmp = realloc(arr, cap * 2 * sizeof(string));
+            if (!tmp) goto cleanup;
+            arr = tmp;
+            cap *= 2;
         }
+        if (idx == len)
+            break;
+        arr[elem] = snewlen(s + start, idx - start);
+        if (!arr[elem]) goto cleanup;
+        elem++;
+        start = idx + seplen;
     }
-    arr[elem] = snewlen(s + start, sgetlen(s) - start);
-    if (!arr[elem] || elem != count) goto cleanup;
+    arr[elem] = snewlen(s + start, len - start);
+    if (!arr[elem]) goto cleanup;
     *n = elem + 1;
     return arr;
 
@@ -864,20 +1010,23 @@ void sfreearr(string* arr, size_t n) {
 bool sltrimchar(string s, size_t c_size, char* c_arr) {
     if (!s || !c_arr || !c_size)
         return false;
+    /* Character class as a 256 bit set. */
+    uint64_t class[4] = {0};
+    for (size_t c_idx = 0; c_idx < c_size; ++c_idx) {
+        unsigned char c = c_arr[c_idx];
+        class[c >> 6] |= 1ULL << (c & 63);
+    }
+
     size_t slen = sgetlen(s);
     size_t counter = 0;
-    for (size_t idx = 0; idx < slen; ++idx) {
-        bool found = false;
-        for (size_t c_idx = 0; c_idx < c_size; ++c_idx) {
-            if (s[idx] == c_arr[c_idx]) {
-                ++counter;
-                found = true;
-                break;
-            }
-        }
-        if (!found)
+    while (counter < slen) {
+        unsigned char c = s[counter];
+        if (!(class[c >> 6] & (1ULL << (c & 63))))
             break;
+        ++counter;
     }
+    if (!counter)
+        return true;
     memmove(s, s + counter, slen - counter);
     ssetlen(s, slen - counter);
     s[slen - counter] = 0;
@@ -0,0 +1,1160 @@
+#ifndef HTTPD_SEARCH
+#define HTTPD_SEARCH
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/stat.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "blake3.c"
+#include "pool.c"
+#include "watch.c"
+
+/*
+    The index behind ?search= (see send_search() in share.c): every file
+    and directory under the shared root, found by the name or a part of
+    it, ignoring ASCII case. It also holds the size of every file and
+    the total size and number of files under every directory, for the
+    listings and ?du (see send_du()).
+
+    The main process builds it at startup with a walk of the tree on the
+    thread pool, a task per directory, and keeps it up to date with what
+    helpers/watch.c reports; children get it with fork(), as it was when
+    they were forked. Each entry is its parent's number and its name in
+    a pool of names, so a path costs its last component; entries are
+    numbered in the order they are added, parents first. A table by
+    parent and name finds the entry of a path.
+
+    A task of the walk opens its directory relative to the root with
+    openat(), reads it with getdents64() and takes the size of each file
+    with statx() relative to the directory; the totals are summed once
+    the walk is done, children before their parents. A change after
+    that is looked at again with statx() and the difference goes up
+    the chain of directories above it. Files linked more than once are
+    counted once per name, sizes are the apparent ones.
+
+    Every trigram (three bytes, ASCII lowercased) of a name has a list
+    of the entries whose names contain it: their numbers in increasing
+    order, each stored as the difference to the one before in a
+    varint, mostly one byte. A query intersects the lists of its
+    trigrams, shortest first, and checks the names that are left;
+    queries under three bytes scan all names. A removed entry, and
+    everything under a removed directory, is only marked. Once more than
+    half of the entries are removed the index is built again from the
+    rest.
+
+    The walk runs on a thread of its own, so the server answers from
+    the start: with the index it saved last time, if there is one, and
+    with 503 until the walk is done otherwise. What the watches report
+    meanwhile goes to the old index and is kept to be applied to the
+    new one as well, which then replaces it; lost events start another
+    walk the same way. The thread adds the watches of the tree too
+    (see helpers/watch.c), before it walks it.
+
+    Each walk saves the index to a snapshot file, set with share -X,
+    whose sections are the arrays of the index as they are in memory,
+    the lists pointing at their data by offset. At startup the file is
+    mapped privately and checked against its BLAKE3, on the thread
+    pool; the arrays are used where they are, copied out only when
+    they grow, and a page is copied only when it is written. A snapshot
+    of another version of the format or of another root is ignored.
+*/
+
+#define SEARCH_NONE             UINT32_MAX
+#define SEARCH_DIR              1
+#define SEARCH_REMOVED          2
+#define SEARCH_MAX_DEPTH        2048
+#define SEARCH_COMPACT_MIN      4096    // entries before removed ones are worth compacting
+#define SEARCH_LIMIT            1000    // matches returned by default
+#define SEARCH_MAX_LIMIT        100000
+#define SEARCH_MAGIC            0x31584953u     // "SIX1"
+#define SEARCH_FORMAT           2               // of the snapshot, bumped when the structures change
+#define SEARCH_SNAPSHOT_DIR     "/tmp/share-index"      // followed by -<uid>, see private_dir()
+#define SEARCH_SUBTREE_LOG      10              // chunks of BLAKE3 checked per subtree, 2^10 KB
+#define SEARCH_SUBTREE          ((uint64_t) BLAKE3_CHUNK_LEN << SEARCH_SUBTREE_LOG)
+#define SEARCH_TASK_SUBTREES    8
+#define SEARCH_DENTS            65536           // bytes of directory entries read at a time
+#define SEARCH_PENDING_MAX      (1 << 20)       // changes kept during a walk before it is started over
+
+struct search_entry {
+    uint32_t parent;            // SEARCH_NONE for the root
+    uint32_t name;              // offset in the pool of names
+    uint32_t files;             // regular files it is or holds, at any depth
+    uint16_t len;
+    uint8_t flags;
+    uint64_t bytes;             // their size
+};
+
+/* Entries whose names contain a trigram. */
+struct search_list {
+    uint32_t trigram;
+    uint32_t last;              // the last entry added
+    uint32_t len, cap;          // bytes
+    uint8_t* data;
+};
+
+struct search_index {
+    char* names;
+    size_t names_len, names_cap;
+    struct search_entry* entries;
+    uint32_t count, cap, removed;
+    uint32_t* paths;            // entries by parent and name, open addressing
+    uint32_t paths_mask;
+    struct search_list* lists;
+    uint32_t nlists, lists_cap;
+    uint32_t* trigrams;         // lists by trigram, open addressing
+    uint32_t trigrams_mask;
+    char* map;                  // the snapshot the arrays may point into
+    size_t map_size;
+};
+
+/* The head of a snapshot, followed by the sections of the index, each padded to 8 bytes. */
+struct search_header {
+    uint32_t magic;
+    uint32_t format;
+    uint64_t size;              // of the file
+    uint64_t dev, ino;          // of the shared root
+    uint32_t count, removed;
+    uint32_t paths_size, nlists, trigrams_size;         // table sizes, 0 for no table
+    uint32_t pad;
+    uint64_t names_len, postings_len;
+    uint8_t checksum[BLAKE3_LEN];       // of everything after the head
+};
+
+/* A change reported while the index is walked, applied to the new index after. */
+struct search_change {
+    enum watch_change change;
+    bool dir;
+    char* path;
+};
+
+static struct search_index search_index;
+bool search_on;                 // the index is kept, see search_start()
+bool search_ready;              // and can be searched
+int search_done_fd = -1;        // readable when a walk is done, see search_walked()
+double search_walk_ms;          // the time the last walk took
+const char* search_snapshot_dir; // NULL to not save the index
+static pthread_t search_thread;
+static bool search_walking, search_again;
+static struct search_index* search_walked_index;
+static struct search_change* search_pending;
+static uint32_t search_npending, search_pending_cap;
+
+static inline
+uint8_t search_fold(uint8_t ch)
+{
+    return ch >= 'A' && ch <= 'Z' ? ch + 32 : ch;
+}
+
+static inline
+uint32_t search_hash(uint32_t parent, const char* name, size_t len)
+{
+    uint32_t h = 2166136261u ^ parent * 2654435761u;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (uint8_t) name[i]) * 16777619u;
+    return h ^ h >> 15;
+}
+
+static inline
+uint32_t search_mix(uint32_t trigram)
+{
+    trigram *= 0x9e3779b1u;
+    return trigram ^ trigram >> 16;
+}
+
+/* Whether p points into the snapshot x is mapped from. */
+static inline
+bool search_mapped(const struct search_index* x, const void* p)
+{
+    return x && x->map && (const char*) p >= x->map && (const char*) p < x->map + x->map_size;
+}
+
+/* realloc(), or malloc() and a copy of the len bytes there are if p is in the snapshot. */
+static
+void* search_realloc(const struct search_index* x, void* p, size_t len, size_t size)
+{
+    if (!search_mapped(x, p))
+        return realloc(p, size);
+    void* copy = malloc(size);
+    if (copy)
+        memcpy(copy, p, len);
+    return copy;
+}
+
+/* Make room for need more items of size bytes in *p, which holds *len of *cap, in x if it is not NULL. */
+static
+bool search_reserve(const struct search_index* x, void** p, uint32_t* cap, uint64_t len, uint64_t need, size_t size)
+{
+    if (len + need <= *cap)
+        return true;
+    uint64_t n = *cap ? *cap : 1024;
+    while (n < len + need)
+        n *= 2;
+    if (n > UINT32_MAX)
+        return false;
+    void* grown = search_realloc(x, *p, len * size, n * size);
+    if (!grown)
+        return false;
+    *p = grown;
+    *cap = n;
+    return true;
+}
+
+/* Double an open addressing table of numbers with hash h(x, i) once it is half full. */
+static
+bool search_grow_table(const struct search_index* x, uint32_t** table, uint32_t* mask, uint32_t used,
+                       uint32_t (*h)(const struct search_index*, uint32_t))
+{
+    if (*table && used < (*mask + 1) / 2)
+        return true;
+    uint32_t size = *table ? (*mask + 1) * 2 : 4096;
+    uint32_t* t = malloc((size_t) size * sizeof(uint32_t));
+    if (!t)
+        return false;
+    memset(t, 0xff, (size_t) size * sizeof(uint32_t));
+    for (uint32_t i = 0; *table && i <= *mask; i++) {
+        if ((*table)[i] == SEARCH_NONE)
+            continue;
+        uint32_t j = h(x, (*table)[i]) & (size - 1);
+        while (t[j] != SEARCH_NONE)
+            j = (j + 1) & (size - 1);
+        t[j] = (*table)[i];
+    }
+    if (!search_mapped(x, *table))
+        free(*table);
+    *table = t;
+    *mask = size - 1;
+    return true;
+}
+
+static
+uint32_t search_path_hash(const struct search_index* x, uint32_t id)
+{
+    const struct search_entry* e = &x->entries[id];
+    return search_hash(e->parent, x->names + e->name, e->len);
+}
+
+static
+uint32_t search_list_hash(const struct search_index* x, uint32_t list)
+{
+    return search_mix(x->lists[list].trigram);
+}
+
+/* The entry named name in directory parent that is not removed, or SEARCH_NONE. */
+static
+uint32_t search_child(const struct search_index* x, uint32_t parent, const char* name, size_t len)
+{
+    if (!x->paths)
+        return SEARCH_NONE;
+    for (uint32_t i = search_hash(parent, name, len) & x->paths_mask; x->paths[i] != SEARCH_NONE;
+         i = (i + 1) & x->paths_mask) {
+        const struct search_entry* e = &x->entries[x->paths[i]];
+        if (e->parent == parent && e->len == len && !(e->flags & SEARCH_REMOVED)
+            && !memcmp(x->names + e->name, name, len))
+            return x->paths[i];
+    }
+    return SEARCH_NONE;
+}
+
+/* The entry of path, relative to the root, or SEARCH_NONE. */
+static
+uint32_t search_find(const struct search_index* x, const char* path)
+{
+    if (x->count == 0)
+        return SEARCH_NONE;
+    uint32_t id = 0;
+    while (*path && id != SEARCH_NONE) {
+        size_t len = strcspn(path, "/");
+        if (len > 0)
+            id = search_child(x, id, path, len);
+        path += len + (path[len] == '/');
+    }
+    return id;
+}
+
+static
+bool search_add_trigram(struct search_index* x, uint32_t trigram, uint32_t id)
+{
+    if (!search_grow_table(x, &x->trigrams, &x->trigrams_mask, x->nlists, search_list_hash))
+        return false;
+    uint32_t i = search_mix(trigram) & x->trigrams_mask;
+    while (x->trigrams[i] != SEARCH_NONE && x->lists[x->trigrams[i]].trigram != trigram)
+        i = (i + 1) & x->trigrams_mask;
+    if (x->trigrams[i] == SEARCH_NONE) {
+        if (!search_reserve(x, (void**) &x->lists, &x->lists_cap, x->nlists, 1, sizeof(struct search_list)))
+            return false;
+        x->lists[x->nlists] = (struct search_list) {.trigram = trigram};
+        x->trigrams[i] = x->nlists++;
+    }
+    struct search_list* l = &x->lists[x->trigrams[i]];
+    if (l->len && l->last == id)
+        return true;
+    if (l->len + 5 > l->cap) {
+        uint32_t cap = l->cap ? l->cap * 2 : 8;
+        while (cap < l->len + 5)
+            cap *= 2;
+        uint8_t* data = search_realloc(x, l->data, l->len, cap);
+        if (!data)
+            return false;
+        l->data = data;
+        l->cap = cap;
+    }
+    uint32_t delta = l->len ? id - l->last : id;
+    for (; delta >= 0x80; delta >>= 7)
+        l->data[l->len++] = delta | 0x80;
+    l->data[l->len++] = delta;
+    l->last = id;
+    return true;
+}
+
+/* Add name to directory parent, or find it if it is there. SEARCH_NONE if memory runs out. */
+static
+uint32_t search_insert(struct search_index* x, uint32_t parent, const char* name, size_t len, bool dir)
+{
+    uint32_t id = parent == SEARCH_NONE ? SEARCH_NONE : search_child(x, parent, name, len);
+    if (id != SEARCH_NONE || len > UINT16_MAX)
+        return id;
+    if (!search_reserve(x, (void**) &x->entries, &x->cap, x->count, 1, sizeof(struct search_entry))
+        || !search_grow_table(x, &x->paths, &x->paths_mask, x->count, search_path_hash))
+        return SEARCH_NONE;
+    if (x->names_len + len > x->names_cap) {
+        size_t cap = x->names_cap ? x->names_cap : 65536;
+        while (cap < x->names_len + len)
+            cap *= 2;
+        char* names = search_realloc(x, x->names, x->names_len, cap);
+        if (!names)
+            return SEARCH_NONE;
+        x->names = names;
+        x->names_cap = cap;
+    }
+    id = x->count++;
+    x->entries[id] = (struct search_entry) {
+        .parent = parent, .name = x->names_len, .len = len, .flags = dir ? SEARCH_DIR : 0,
+    };
+    memcpy(x->names + x->names_len, name, len);
+    x->names_len += len;
+    uint32_t i = search_hash(parent, name, len) & x->paths_mask;
+    while (x->paths[i] != SEARCH_NONE)
+        i = (i + 1) & x->paths_mask;
+    x->paths[i] = id;
+
+    const uint8_t* p = (const uint8_t*) name;
+    for (size_t k = 0; k + 3 <= len; k++)
+        if (!search_add_trigram(x, search_fold(p[k]) << 16 | search_fold(p[k + 1]) << 8 | search_fold(p[k + 2]), id))
+            return SEARCH_NONE;
+    return id;
+}
+
+static
+void search_free(struct search_index* x)
+{
+    void* arrays[] = {x->names, x->entries, x->paths, x->lists, x->trigrams};
+    for (uint32_t i = 0; i < x->nlists; i++)
+        if (!search_mapped(x, x->lists[i].data))
+            free(x->lists[i].data);
+    for (size_t i = 0; i < sizeof(arrays) / sizeof(*arrays); i++)
+        if (!search_mapped(x, arrays[i]))
+            free(arrays[i]);
+    if (x->map)
+        munmap(x->map, x->map_size);
+    memset(x, 0, sizeof(*x));
+}
+
+/* The entries of a directory, read by a pool task. */
+/* An entry a walk found. */
+struct search_found {
+    uint64_t size;              // 0 for a directory
+    bool dir;
+};
+
+struct search_walk {
+    struct pool_task task;
+    int root;                   // the shared root, the path is opened relative to it
+    char* path;                 // relative to the root, "" for the root
+    char* names;                // each followed by a NUL
+    size_t names_len, names_cap;
+    struct search_found* found;
+    uint32_t count, cap;
+    struct search_walk** subdirs;
+    uint32_t nsub, subs_cap;
+    bool ok;
+};
+
+/* As returned by getdents64(), which glibc does not declare. */
+struct search_dirent {
+    uint64_t ino;
+    int64_t off;
+    uint16_t reclen;
+    uint8_t type;
+    char name[];
+};
+
+static
+void search_walk_free(struct search_walk* w)
+{
+    for (uint32_t i = 0; i < w->nsub; i++)
+        if (w->subdirs[i])
+            search_walk_free(w->subdirs[i]);
+    free(w->path);
+    free(w->names);
+    free(w->found);
+    free(w->subdirs);
+    free(w);
+}
+
+/* Type and size of name in directory dir, without following a symbolic link. */
+static
+bool search_statx(int dir, const char* name, struct statx* stx)
+{
+    return syscall(SYS_statx, dir, name, AT_SYMLINK_NOFOLLOW, STATX_TYPE | STATX_SIZE, stx) == 0;
+}
+
+static
+void search_walk_dir(struct pool_task* task);
+
+/* Add an entry of w, starting a task for it if it is a directory. */
+static
+bool search_walk_entry(struct search_walk* w, const char* name, bool dir, uint64_t size)
+{
+    size_t len = strlen(name);
+    if (w->names_len + len + 1 > w->names_cap) {
+        size_t cap = w->names_cap ? w->names_cap * 2 : 4096;
+        while (cap < w->names_len + len + 1)
+            cap *= 2;
+        char* names = realloc(w->names, cap);
+        if (!names)
+            return false;
+        w->names = names;
+        w->names_cap = cap;
+    }
+    if (!search_reserve(NULL, (void**) &w->found, &w->cap, w->count, 1, sizeof(*w->found)))
+        return false;
+    memcpy(w->names + w->names_len, name, len + 1);
+    w->names_len += len + 1;
+    w->found[w->count++] = (struct search_found) {.size = size, .dir = dir};
+    if (!dir)
+        return true;
+
+    struct search_walk* sub = calloc(1, sizeof(*sub));
+    if (!sub || !search_reserve(NULL, (void**) &w->subdirs, &w->subs_cap, w->nsub, 1, sizeof(*w->subdirs))
+        || !(sub->path = malloc(strlen(w->path) + len + 2))) {
+        free(sub);
+        return false;
+    }
+    sprintf(sub->path, "%s%s%s", w->path, *w->path ? "/" : "", name);
+    sub->root = w->root;
+    sub->task.run = search_walk_dir;
+    w->subdirs[w->nsub++] = sub;
+    pool_submit(w->task.group, &sub->task);
+    return true;
+}
+
+/*
+    Read a directory with getdents64() into a large buffer, fewer calls
+    than readdir() makes, and get the size of every regular file with
+    statx() relative to the directory, asking for nothing else.
+*/
+static
+void search_walk_dir(struct pool_task* task)
+{
+    struct search_walk* w = (struct search_walk*) task;
+    int fd = openat(w->root, *w->path ? w->path : ".", O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    char* buf = fd >= 0 ? malloc(SEARCH_DENTS) : NULL;
+    long n = buf ? 1 : -1;
+    while (n > 0 && (n = syscall(SYS_getdents64, fd, buf, SEARCH_DENTS)) > 0) {
+        for (long at = 0; n > 0 && at < n; at += ((struct search_dirent*)(buf + at))->reclen) {
+            const struct search_dirent* de = (const struct search_dirent*)(buf + at);
+            if (!strcmp(de->name, ".") || !strcmp(de->name, ".."))
+                continue;
+            struct statx stx = {0};
+            bool dir = de->type == DT_DIR;
+            if (de->type == DT_REG || de->type == DT_UNKNOWN) {
+                if (!search_statx(fd, de->name, &stx) || !(S_ISREG(stx.stx_mode) || S_ISDIR(stx.stx_mode)))
+                    continue;
+                dir = S_ISDIR(stx.stx_mode);
+            } else if (!dir)
+                continue;
+            if (!search_walk_entry(w, de->name, dir, dir ? 0 : stx.stx_size))
+                n = -1;
+        }
+    }
+    w->ok = n == 0;
+    free(buf);
+    if (fd >= 0)
+        close(fd);
+}
+
+/* Add what the walk w of directory id found, subdirectories in the order they were found. */
+static
+bool search_add_walk(struct search_index* x, struct search_walk* w, uint32_t id)
+{
+    const char* name = w->names;
+    uint32_t sub = 0;
+    for (uint32_t i = 0; i < w->count; i++) {
+        size_t len = strlen(name);
+        uint32_t child = search_insert(x, id, name, len, w->found[i].dir);
+        if (child == SEARCH_NONE)
+            return false;
+        x->entries[child].bytes = w->found[i].size;
+        x->entries[child].files = !w->found[i].dir;
+        if (w->found[i].dir && !search_add_walk(x, w->subdirs[sub++], child))
+            return false;
+        name += len + 1;
+    }
+    return true;
+}
+
+/* Walk the tree under the current directory, the shared root, into x, and total the directories. */
+static
+bool search_walk(struct search_index* x)
+{
+    struct search_walk* root = calloc(1, sizeof(*root));
+    if (!root || !(root->path = strdup("")) || (root->root = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+        if (root)
+            free(root->path);
+        free(root);
+        return false;
+    }
+    root->task.run = search_walk_dir;
+    struct pool_group group = {0};
+    pool_submit(&group, &root->task);
+    pool_wait(&group);
+    close(root->root);
+    bool ok = root->ok && search_insert(x, SEARCH_NONE, "", 0, true) == 0 && search_add_walk(x, root, 0);
+    search_walk_free(root);
+    /* Children have larger numbers than their parents, so a directory is complete when it is reached. */
+    for (uint32_t i = ok ? x->count - 1 : 0; i > 0; i--) {
+        struct search_entry* parent = &x->entries[x->entries[i].parent];
+        parent->bytes += x->entries[i].bytes;
+        parent->files += x->entries[i].files;
+    }
+    return ok;
+}
+
+/* Build *x again from the entries that are left. */
+static
+void search_compact(struct search_index* x)
+{
+    struct search_index fresh = {0};
+    uint32_t* map = malloc((size_t) x->count * sizeof(uint32_t));
+    bool ok = map != NULL;
+    for (uint32_t i = 0; ok && i < x->count; i++) {
+        const struct search_entry* e = &x->entries[i];
+        uint32_t parent = e->parent == SEARCH_NONE ? SEARCH_NONE : map[e->parent];
+        map[i] = SEARCH_NONE;
+        if ((e->flags & SEARCH_REMOVED) || (i > 0 && parent == SEARCH_NONE))
+            continue;
+        ok = (map[i] = search_insert(&fresh, parent, x->names + e->name, e->len, e->flags & SEARCH_DIR)) != SEARCH_NONE;
+        if (ok) {
+            fresh.entries[map[i]].bytes = e->bytes;
+            fresh.entries[map[i]].files = e->files;
+        }
+    }
+    free(map);
+    if (!ok) {
+        search_free(&fresh);
+        return;
+    }
+    search_free(x);
+    *x = fresh;
+}
+
+/* Add bytes and files to the directories above entry id. */
+static
+void search_account(struct search_index* x, uint32_t id, int64_t bytes, int64_t files)
+{
+    for (uint32_t i = x->entries[id].parent; i != SEARCH_NONE; i = x->entries[i].parent) {
+        x->entries[i].bytes += bytes;
+        x->entries[i].files += files;
+    }
+}
+
+/*
+    Apply a change helpers/watch.c reported to x. What was added or
+    modified is looked at again for its type and size, and the
+    difference is added to the totals of the directories above it.
+*/
+static
+void search_apply(struct search_index* x, enum watch_change change, const char* path, bool dir)
+{
+    if (change == WATCH_REMOVED) {
+        uint32_t id = search_find(x, path);
+        if (id != SEARCH_NONE && id != 0) {
+            struct search_entry* e = &x->entries[id];
+            e->flags |= SEARCH_REMOVED;
+            search_account(x, id, -(int64_t) e->bytes, -(int64_t) e->files);
+            if (++x->removed > x->count / 2 && x->count > SEARCH_COMPACT_MIN)
+                search_compact(x);
+        }
+        return;
+    }
+    struct statx stx;
+    if (!search_statx(AT_FDCWD, path, &stx) || !(S_ISREG(stx.stx_mode) || S_ISDIR(stx.stx_mode)))
+        return;
+    dir = S_ISDIR(stx.stx_mode);
+    const char* slash = strrchr(path, '/');
+    uint32_t parent = 0;
+    if (slash) {
+        char dirname[slash - path + 1];
+        memcpy(dirname, path, slash - path);
+        dirname[slash - path] = 0;
+        parent = search_find(x, dirname);
+    }
+    const char* name = slash ? slash + 1 : path;
+    uint32_t count = x->count;
+    uint32_t id = parent == SEARCH_NONE ? SEARCH_NONE : search_insert(x, parent, name, strlen(name), dir);
+    if (id == SEARCH_NONE || (x->entries[id].flags & SEARCH_DIR))
+        return;
+    struct search_entry* e = &x->entries[id];
+    int64_t grown = (int64_t) stx.stx_size - (int64_t) e->bytes;
+    e->bytes = stx.stx_size;
+    e->files = 1;
+    search_account(x, id, grown, id >= count);
+}
+
+/* Offsets of the sections of a snapshot with head h. Return its size, 0 if it is larger than max. */
+static
+uint64_t search_layout(const struct search_header* h, uint64_t off[6], uint64_t max)
+{
+    uint64_t sizes[6] = {
+        (uint64_t) h->count * sizeof(struct search_entry), (uint64_t) h->paths_size * sizeof(uint32_t),
+        (uint64_t) h->nlists * sizeof(struct search_list), (uint64_t) h->trigrams_size * sizeof(uint32_t),
+        h->names_len, h->postings_len,
+    };
+    uint64_t at = sizeof(*h);
+    for (int i = 0; i < 6; i++) {
+        if (sizes[i] > max || at + sizes[i] > max)
+            return 0;
+        off[i] = at;
+        at += (sizes[i] + 7) & ~(uint64_t) 7;
+    }
+    return at;
+}
+
+/* Write len bytes to fd and feed them to b. */
+static
+bool search_write(int fd, struct blake3* b, const void* data, size_t len)
+{
+    blake3_update(b, data, len);
+    for (const char* p = data; len > 0;) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+/* Write a section of a snapshot, padded to 8 bytes. */
+static
+bool search_section(int fd, struct blake3* b, const void* data, size_t len)
+{
+    static const char zeros[8];
+    return search_write(fd, b, data, len) && search_write(fd, b, zeros, -len & 7);
+}
+
+/* The snapshot of the index of the tree whose root is st, in search_snapshot_dir. */
+static
+bool search_snapshot_path(char path[PATH_MAX], const struct stat* st)
+{
+    return search_snapshot_dir && snprintf(path, PATH_MAX, "%s/%llx-%llx", search_snapshot_dir,
+                                           (unsigned long long) st->st_dev, (unsigned long long) st->st_ino) < PATH_MAX;
+}
+
+/* Save x to its snapshot, through a temporary file renamed over it. */
+static
+bool search_save(const struct search_index* x)
+{
+    struct stat root;
+    char path[PATH_MAX], tmp[PATH_MAX + 32];
+    if (stat(".", &root) < 0 || !search_snapshot_path(path, &root))
+        return false;
+    snprintf(tmp, sizeof(tmp), "%s.%d", path, (int) getpid());
+    struct search_list* lists = malloc((x->nlists ? x->nlists : 1) * sizeof(*lists));
+    int fd = lists ? open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600) : -1;
+    if (fd < 0) {
+        free(lists);
+        return false;
+    }
+    struct search_header h = {
+        .magic = SEARCH_MAGIC, .format = SEARCH_FORMAT, .dev = root.st_dev, .ino = root.st_ino,
+        .count = x->count, .removed = x->removed, .paths_size = x->paths ? x->paths_mask + 1 : 0,
+        .nlists = x->nlists, .trigrams_size = x->trigrams ? x->trigrams_mask + 1 : 0, .names_len = x->names_len,
+    };
+    for (uint32_t i = 0; i < x->nlists; i++) {
+        lists[i] = x->lists[i];
+        lists[i].cap = 0;
+        lists[i].data = (uint8_t*)(uintptr_t) h.postings_len;
+        h.postings_len += x->lists[i].len;
+    }
+    uint64_t off[6];
+    h.size = search_layout(&h, off, UINT64_MAX / 2);
+
+    struct blake3 b;
+    blake3_init(&b);
+    bool ok = lseek(fd, sizeof(h), SEEK_SET) == sizeof(h)
+              && search_section(fd, &b, x->entries, (size_t) x->count * sizeof(*x->entries))
+              && search_section(fd, &b, x->paths, (size_t) h.paths_size * sizeof(uint32_t))
+              && search_section(fd, &b, lists, (size_t) x->nlists * sizeof(*lists))
+              && search_section(fd, &b, x->trigrams, (size_t) h.trigrams_size * sizeof(uint32_t))
+              && search_section(fd, &b, x->names, x->names_len);
+    for (uint32_t i = 0; ok && i < x->nlists; i++)
+        ok = search_write(fd, &b, x->lists[i].data, x->lists[i].len);
+    ok = ok && search_write(fd, &b, (const char[8]) {0}, -h.postings_len & 7)
+         && lseek(fd, 0, SEEK_CUR) == (off_t) h.size;
+    blake3_final(&b, h.checksum);
+    ok = ok && pwrite(fd, &h, sizeof(h), 0) == sizeof(h);
+    free(lists);
+    if (close(fd) < 0 || !ok || rename(tmp, path) < 0) {
+        unlink(tmp);
+        return false;
+    }
+    return true;
+}
+
+/* SEARCH_TASK_SUBTREES subtrees of the BLAKE3 of a snapshot at most, from the first. */
+struct search_subtrees {
+    struct pool_task task;
+    const char* data;
+    uint64_t first, count;
+    uint32_t (*cvs)[8];
+};
+
+static
+void search_subtrees(struct pool_task* task)
+{
+    struct search_subtrees* t = (struct search_subtrees*) task;
+    for (uint64_t i = t->first; i < t->first + t->count; i++) {
+        struct blake3 b;
+        blake3_init_at(&b, i << SEARCH_SUBTREE_LOG);
+        blake3_update(&b, t->data + i * SEARCH_SUBTREE, SEARCH_SUBTREE);
+        blake3_subtree(&b, t->cvs[i]);
+    }
+}
+
+/* BLAKE3 of the len bytes at data, with all but the last subtree on the pool, as in helpers/hashdb.c. */
+static
+bool search_checksum(const char* data, uint64_t len, uint8_t digest[BLAKE3_LEN])
+{
+    struct blake3 b;
+    blake3_init(&b);
+    uint64_t subtrees = len > 0 ? (len - 1) / SEARCH_SUBTREE : 0;
+    if (subtrees > 0) {
+        uint64_t ntasks = (subtrees + SEARCH_TASK_SUBTREES - 1) / SEARCH_TASK_SUBTREES;
+        uint32_t (*cvs)[8] = malloc(subtrees * sizeof(*cvs));
+        struct search_subtrees* tasks = malloc(ntasks * sizeof(*tasks));
+        bool ok = cvs && tasks;
+        struct pool_group group = {0};
+        for (uint64_t i = 0; ok && i < ntasks; i++) {
+            uint64_t first = i * SEARCH_TASK_SUBTREES;
+            tasks[i] = (struct search_subtrees) {
+                .task.run = search_subtrees, .data = data, .first = first, .cvs = cvs,
+                .count = subtrees - first < SEARCH_TASK_SUBTREES ? subtrees - first : SEARCH_TASK_SUBTREES,
+            };
+            pool_submit(&group, &tasks[i].task);
+        }
+        pool_wait(&group);
+        for (uint64_t i = 0; ok && i < subtrees; i++)
+            blake3_push_subtree(&b, cvs[i], SEARCH_SUBTREE_LOG);
+        free(cvs);
+        free(tasks);
+        if (!ok)
+            return false;
+    }
+    blake3_update(&b, data + subtrees * SEARCH_SUBTREE, len - subtrees * SEARCH_SUBTREE);
+    blake3_final(&b, digest);
+    return true;
+}
+
+/*
+    Whether the index x taken from a snapshot points only inside itself:
+    a checksum that matches only shows the file is whole, not that it
+    was written by this server. Names must lie in the pool, parents come
+    before their children, so that walks up the tree end, the tables
+    must hold valid indices and an empty slot to end probes, and every
+    posting list must decode to ascending entries ending at its last.
+*/
+static
+bool search_check(const struct search_index* x)
+{
+    if (x->removed > x->count || x->entries[0].parent != SEARCH_NONE)
+        return false;
+    for (uint32_t i = 0; i < x->count; i++) {
+        const struct search_entry* e = &x->entries[i];
+        if (e->name > x->names_len || e->len > x->names_len - e->name || (i > 0 && e->parent >= i))
+            return false;
+    }
+    uint32_t used = 0;
+    for (uint32_t i = 0; i <= x->paths_mask; i++)
+        if (x->paths[i] != SEARCH_NONE && (x->paths[i] >= x->count || ++used > x->count))
+            return false;
+    used = 0;
+    for (uint32_t i = 0; x->trigrams && i <= x->trigrams_mask; i++)
+        if (x->trigrams[i] != SEARCH_NONE && (x->trigrams[i] >= x->nlists || ++used > x->nlists))
+            return false;
+    for (uint32_t i = 0; i < x->nlists; i++) {
+        const struct search_list* l = &x->lists[i];
+        uint64_t id = 0;
+        for (uint32_t at = 0; at < l->len;) {
+            uint64_t delta = 0;
+            bool first = at == 0;
+            for (int shift = 0; ; shift += 7) {
+                if (at == l->len || shift > 28)
+                    return false;
+                uint8_t b = l->data[at++];
+                delta |= (uint64_t)(b & 0x7f) << shift;
+                if (!(b & 0x80))
+                    break;
+            }
+            if ((!first && delta == 0) || (id += delta) >= x->count)
+                return false;
+        }
+        if (l->len && id != l->last)
+            return false;
+    }
+    return true;
+}
+
+/* Map the snapshot of the index into x. Return false if there is none or it does not check out. */
+static
+bool search_load(struct search_index* x)
+{
+    struct stat root, st;
+    char path[PATH_MAX];
+    int fd = stat(".", &root) == 0 && search_snapshot_path(path, &root) ? open(path, O_RDONLY | O_CLOEXEC) : -1;
+    if (fd < 0)
+        return false;
+    char* map = fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof(struct search_header)
+                ? mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (map == MAP_FAILED)
+        return false;
+    const struct search_header* h = (const struct search_header*) map;
+    uint64_t off[6] = {0};
+    bool ok = h->magic == SEARCH_MAGIC && h->format == SEARCH_FORMAT && h->size == (uint64_t) st.st_size
+              && h->dev == (uint64_t) root.st_dev && h->ino == (uint64_t) root.st_ino && h->count > 0
+              && h->paths_size > h->count && !(h->paths_size & (h->paths_size - 1))
+              && !(h->trigrams_size & (h->trigrams_size - 1)) && h->trigrams_size >= (h->nlists ? h->nlists + 1 : 0)
+              && search_layout(h, off, h->size) == h->size;
+    uint8_t checksum[BLAKE3_LEN];
+    ok = ok && search_checksum(map + sizeof(*h), h->size - sizeof(*h), checksum)
+         && !memcmp(checksum, h->checksum, BLAKE3_LEN);
+    struct search_list* lists = (struct search_list*)(map + off[2]);
+    for (uint32_t i = 0; ok && i < h->nlists; i++) {
+        uint64_t at = (uintptr_t) lists[i].data;
+        ok = at <= h->postings_len && lists[i].len <= h->postings_len - at;
+        lists[i].data = (uint8_t*) map + off[5] + at;
+        lists[i].cap = 0;
+    }
+    struct search_index loaded;
+    if (ok)
+        loaded = (struct search_index) {
+        .names = map + off[4], .names_len = h->names_len, .names_cap = h->names_len,
+        .entries = (struct search_entry*)(map + off[0]), .count = h->count, .cap = h->count, .removed = h->removed,
+        .paths = (uint32_t*)(map + off[1]), .paths_mask = h->paths_size - 1,
+        .lists = lists, .nlists = h->nlists, .lists_cap = h->nlists,
+        .trigrams = h->trigrams_size ? (uint32_t*)(map + off[3]) : NULL, .trigrams_mask = h->trigrams_size - 1,
+        .map = map, .map_size = st.st_size,
+    };
+    if (!ok || !search_check(&loaded)) {
+        munmap(map, st.st_size);
+        return false;
+    }
+    *x = loaded;
+    return true;
+}
+
+/*
+    The thread that walks the tree into a new index and saves it, the
+    first time after it adds the watches of the tree. The main process
+    takes the index with search_walked().
+*/
+static
+void* search_walk_thread(void* arg)
+{
+    bool first = arg != NULL;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (first && watch_fd >= 0)
+        watch_tree("", NULL);
+    struct search_index* x = calloc(1, sizeof(*x));
+    if (x && !search_walk(x)) {
+        search_free(x);
+        free(x);
+        x = NULL;
+    }
+    if (x)
+        search_save(x);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    search_walk_ms = (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6;
+    search_walked_index = x;
+    uint64_t one = 1;
+    if (write(search_done_fd, &one, sizeof(one)) < 0) {}
+    return NULL;
+}
+
+/* Start a walk with every signal blocked, so they stay with the main thread. */
+static
+bool search_walk_start(bool first)
+{
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    search_walking = pthread_create(&search_thread, NULL, search_walk_thread, (void*)(uintptr_t) first) == 0;
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    search_again = false;
+    return search_walking;
+}
+
+/*
+    Keep the index: take the snapshot if there is one, then walk the
+    tree in the background, adding the watches of the tree first if
+    watch_fd is open. Set *loaded if the snapshot was taken. Return
+    false if the walk cannot be started; there is no index then.
+*/
+bool search_start(bool* loaded)
+{
+    *loaded = search_load(&search_index);
+    search_ready = *loaded;
+    if ((search_done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0 || !search_walk_start(true)) {
+        search_free(&search_index);
+        search_ready = false;
+        return false;
+    }
+    search_on = true;
+    return true;
+}
+
+/* Take the index a walk built, when search_done_fd is readable. Return true if there was one. */
+bool search_walked(void)
+{
+    uint64_t n;
+    if (read(search_done_fd, &n, sizeof(n)) != sizeof(n) || !search_walking)
+        return false;
+    pthread_join(search_thread, NULL);
+    search_walking = false;
+    struct search_index* x = search_walked_index;
+    for (uint32_t i = 0; i < search_npending; i++) {
+        if (x)
+            search_apply(x, search_pending[i].change, search_pending[i].path, search_pending[i].dir);
+        free(search_pending[i].path);
+    }
+    search_npending = 0;
+    if (x) {
+        search_free(&search_index);
+        search_index = *x;
+        free(x);
+        search_ready = true;
+    }
+    if (search_again)
+        search_walk_start(false);
+    return x != NULL;
+}
+
+/* Forget the changes kept for the walk, another one follows it. */
+static
+void search_restart(void)
+{
+    for (uint32_t i = 0; i < search_npending; i++)
+        free(search_pending[i].path);
+    search_npending = 0;
+    search_again = true;
+}
+
+/* Keep the index up to date with what helpers/watch.c reports, see watch_read(). */
+void search_watch(enum watch_change change, const char* path, bool dir)
+{
+    if (!search_on)
+        return;
+    if (change == WATCH_OVERFLOW) {
+        if (search_walking)
+            search_restart();
+        else
+            search_walk_start(false);
+        return;
+    }
+    if (search_ready)
+        search_apply(&search_index, change, path, dir);
+    if (!search_walking || search_again)
+        return;
+    char* copy = search_npending < SEARCH_PENDING_MAX ? strdup(path) : NULL;
+    if (!copy || !search_reserve(NULL, (void**) &search_pending, &search_pending_cap, search_npending, 1,
+                                 sizeof(*search_pending))) {
+        free(copy);
+        search_restart();
+        return;
+    }
+    search_pending[search_npending++] = (struct search_change) {.change = change, .dir = dir, .path = copy};
+}
+
+/* Whether the name of e contains query, lowercase, of len bytes. */
+static
+bool search_match(const struct search_index* x, const struct search_entry* e, const char* query, size_t len)
+{
+    const uint8_t* name = (const uint8_t*) x->names + e->name;
+    for (size_t i = 0; i + len <= e->len; i++) {
+        size_t k = 0;
+        while (k < len && search_fold(name[i + k]) == (uint8_t) query[k])
+            k++;
+        if (k == len)
+            return true;
+    }
+    return false;
+}
+
+/*
+    The path of entry id, if neither it nor a directory above it was
+    removed and it is under directory within. NULL otherwise.
+*/
+static
+char* search_path(const struct search_index* x, uint32_t id, uint32_t within, char path[PATH_MAX])
+{
+    uint32_t chain[SEARCH_MAX_DEPTH];
+    size_t depth = 0;
+    bool inside = within == 0;
+    for (uint32_t i = id; i != 0; i = x->entries[i].parent) {
+        if ((x->entries[i].flags & SEARCH_REMOVED) || depth == SEARCH_MAX_DEPTH)
+            return NULL;
+        inside |= i == within;
+        chain[depth++] = i;
+    }
+    if (!inside || id == within)
+        return NULL;
+    size_t len = 0;
+    while (depth-- > 0) {
+        const struct search_entry* e = &x->entries[chain[depth]];
+        if (len + e->len + 2 > PATH_MAX)
+            return NULL;
+        memcpy(path + len, x->names + e->name, e->len);
+        len += e->len;
+        path[len++] = depth ? '/' : 0;
+    }
+    return path;
+}
+
+static
+uint32_t search_read_varint(const uint8_t** p)
+{
+    uint32_t v = 0;
+    for (int shift = 0; ; shift += 7) {
+        uint8_t b = *(*p)++;
+        v |= (uint32_t)(b & 0x7f) << shift;
+        if (!(b & 0x80))
+            return v;
+    }
+}
+
+static
+int search_by_len(const void* a, const void* b)
+{
+    const struct search_list* x = *(const struct search_list* const*) a;
+    const struct search_list* y = *(const struct search_list* const*) b;
+    return (x->len > y->len) - (x->len < y->len);
+}
+
+/*
+    Call fn with the path of every file and directory under directory
+    dir whose name contains query, ignoring ASCII case, in the order
+    they were added, limit at most or until fn returns false. Return
+    the number of calls.
+*/
+uint32_t search_query(const char* dir, const char* query, uint32_t limit,
+                      bool (*fn)(void* ctx, const char* path, const struct search_entry* e), void* ctx)
+{
+    const struct search_index* x = &search_index;
+    uint32_t within = search_find(x, dir);
+    size_t len = strlen(query);
+    if (within == SEARCH_NONE || len == 0 || len > UINT16_MAX || limit == 0)
+        return 0;
+    char* folded = malloc(len + 1);
+    if (!folded)
+        return 0;
+    for (size_t i = 0; i <= len; i++)
+        folded[i] = search_fold(query[i]);
+
+    /* The candidates: every entry, or those in all the lists of the query's trigrams. */
+    uint32_t* ids = NULL;
+    uint32_t n = 0;
+    bool all = len < 3;
+    if (!all) {
+        size_t nt = len - 2;
+        const struct search_list** lists = malloc(nt * sizeof(*lists));
+        bool missing = lists == NULL;
+        for (size_t k = 0; !missing && k < nt; k++) {
+            const uint8_t* p = (const uint8_t*) folded + k;
+            uint32_t trigram = p[0] << 16 | p[1] << 8 | p[2];
+            uint32_t i = x->trigrams ? search_mix(trigram) & x->trigrams_mask : 0;
+            while (x->trigrams && x->trigrams[i] != SEARCH_NONE && x->lists[x->trigrams[i]].trigram != trigram)
+                i = (i + 1) & x->trigrams_mask;
+            missing = !x->trigrams || x->trigrams[i] == SEARCH_NONE;
+            if (!missing)
+                lists[k] = &x->lists[x->trigrams[i]];
+        }
+        if (!missing) {
+            qsort(lists, nt, sizeof(*lists), search_by_len);
+            ids = malloc((lists[0]->len ? lists[0]->len : 1) * sizeof(uint32_t));
+        }
+        if (ids) {
+            const uint8_t* p = lists[0]->data;
+            for (uint32_t id = 0; p < lists[0]->data + lists[0]->len; ids[n++] = id)
+                id += search_read_varint(&p);
+            for (size_t k = 1; k < nt && n > 0; k++) {
+                p = lists[k]->data;
+                uint32_t id = 0, kept = 0;
+                for (uint32_t j = 0; j < n && p < lists[k]->data + lists[k]->len;) {
+                    id += search_read_varint(&p);
+                    while (j < n && ids[j] < id)
+                        j++;
+                    if (j < n && ids[j] == id)
+                        ids[kept++] = ids[j++];
+                }
+                n = kept;
+            }
+        }
+        free(lists);
+    }
+
+    char path[PATH_MAX];
+    uint32_t found = 0;
+    uint32_t total = all ? x->count : n;
+    for (uint32_t k = 0; k < total && found < limit; k++) {
+        uint32_t id = all ? k : ids[k];
+        const struct search_entry* e = &x->entries[id];
+        if (!search_match(x, e, folded, len) || !search_path(x, id, within, path))
+            continue;
+        found++;
+        if (!fn(ctx, path, e))
+            break;
+    }
+    free(ids);
+    free(folded);
+    return found;
+}
+/* The entry of path, relative to the root, with its totals if it is a directory. NULL if it has none. */
+const struct search_entry* search_entry(const char* path)
+{
+    uint32_t id = search_ready ? search_find(&search_index, path) : SEARCH_NONE;
+    return id == SEARCH_NONE ? NULL : &search_index.entries[id];
+}
+
+/* The entry of name in directory dir, see search_entry(). */
+const struct search_entry* search_entry_in(const struct search_entry* dir, const char* name)
+{
+    uint32_t id = search_child(&search_index, dir - search_index.entries, name, strlen(name));
+    return id == SEARCH_NONE ? NULL : &search_index.entries[id];
+}
+#endif
@@ -1,4 +1,6 @@
 #include "safe_string.h"
+#include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 
 string add_title(string template, string uri) {
@@ -10,8 +12,9 @@ string add_title(string template, string uri) {
     return with_title;
 }
 
-string add_links(string uri, size_t n, string* dir_file) {
-    string li = snew("<li><a href=\"/PATH\">PATH</a></li>\n");
+/* notes, if not NULL, holds what to show after each link, or NULL for nothing. */
+string add_links(string uri, size_t n, string* dir_file, string* notes) {
+    string li = snew("<li><a href=\"/PATH\">PATH</a>#NOTE</li>\n");
 
     string first_link = snew("/");
     first_link = scat(first_link, sgetlen(uri), uri);
@@ -26,14 +29,30 @@ string add_links(string uri, size_t n, string* dir_file) {
         
         string full_link = scats(first_link, dir_file[i]);
 
-        string new_full_path = sreplace(li, 5, "/PATH", sgetlen(full_link), full_link);
+        size_t note_len = notes && notes[i] ? sgetlen(notes[i]) : 0;
+        string with_note = sreplace(li, 5, "#NOTE", note_len, note_len ? notes[i] : "");
+        string new_full_path = sreplace(with_note, 5, "/PATH", sgetlen(full_link), full_link);
         string link = sreplace(new_full_path, 4, "PATH", sgetlen(dir_file[i]), dir_file[i]);
 
         string tmp = links;
         links = scats(links, link);
 
-        sfree(full_link); sfree(new_full_path); sfree(link); sfree(tmp);
+        sfree(full_link); sfree(with_note); sfree(new_full_path); sfree(link); sfree(tmp);
     }
     sfree(li);
     return links;
 }
+
+/* bytes with a unit, e.g. "1.5 MB". */
+string format_size(uint64_t bytes) {
+    static const char* units[] = {"B", "KB", "MB", "GB", "TB", "PB", "EB"};
+    double size = bytes;
+    int unit = 0;
+    while (size >= 1024 && unit < 6) {
+        size /= 1024;
+        unit++;
+    }
+    char buf[32];
+    snprintf(buf, sizeof(buf), unit && size < 10 ? "%.1f %s" : "%.0f %s", size, units[unit]);
+    return snew(buf);
+}
@@ -0,0 +1,192 @@
+#ifndef HTTPD_WATCH
+#define HTTPD_WATCH
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+
+/*
+    Changes under the shared root, from inotify, for the change journal
+    (see helpers/journal.c).
+
+    inotify watches one directory at a time, so every directory of the
+    tree gets a watch, found by a walk at startup and added as
+    directories are created or moved in. A directory that appears is
+    walked too, and everything already in it is reported as added:
+    files created in it before its watch was in place would be missed
+    otherwise. A directory moved out loses the watches of its subtree.
+    Watch descriptors are small increasing numbers, so their paths are
+    kept in an array indexed by them.
+
+    Paths are relative to the root, without a leading slash. The main
+    process reads the events in its event loop (see main() in share.c);
+    children never touch the watches. The walk that adds the watches
+    at startup may run on another thread (see helpers/search.c), so the
+    array is only used under a lock. Directories left without a watch
+    when fs.inotify.max_user_watches runs out are reported as lost
+    events.
+*/
+
+#define WATCH_EVENTS    (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY | IN_CLOSE_WRITE \
+                         | IN_ATTRIB | IN_ONLYDIR | IN_DONT_FOLLOW | IN_EXCL_UNLINK)
+#define WATCH_BUFFER    65536
+
+enum watch_change {
+    WATCH_ADDED,
+    WATCH_REMOVED,
+    WATCH_MODIFIED,
+    WATCH_OVERFLOW,             // events were lost, path is NULL
+};
+
+typedef void (*watch_fn)(enum watch_change change, const char* path, bool dir);
+
+int watch_fd = -1;
+static char** watch_paths;      // by watch descriptor
+static size_t watch_size;
+static pthread_mutex_t watch_lock = PTHREAD_MUTEX_INITIALIZER;
+bool watch_full;                // ran out of watches, see /proc/sys/fs/inotify/max_user_watches
+
+/* Watch directory path. Running out of watches is reported to fn as lost events. */
+static
+bool watch_add(const char* path, watch_fn fn)
+{
+    pthread_mutex_lock(&watch_lock);
+    int wd = inotify_add_watch(watch_fd, *path ? path : ".", WATCH_EVENTS);
+    if (wd < 0) {
+        bool full = errno == ENOSPC;
+        watch_full |= full;
+        pthread_mutex_unlock(&watch_lock);
+        if (full && fn)
+            fn(WATCH_OVERFLOW, NULL, false);
+        return false;
+    }
+    bool ok = true;
+    if ((size_t) wd >= watch_size) {
+        size_t size = watch_size ? watch_size : 1024;
+        while (size <= (size_t) wd)
+            size *= 2;
+        char** paths = realloc(watch_paths, size * sizeof(char*));
+        if (paths) {
+            memset(paths + watch_size, 0, (size - watch_size) * sizeof(char*));
+            watch_paths = paths;
+            watch_size = size;
+        }
+        ok = paths != NULL;
+    }
+    if (ok) {
+        free(watch_paths[wd]);
+        ok = (watch_paths[wd] = strdup(path)) != NULL;
+    }
+    pthread_mutex_unlock(&watch_lock);
+    return ok;
+}
+
+/* Watch directory path and everything under it, reporting its entries to fn if it is not NULL. */
+static
+void watch_tree(const char* path, watch_fn fn)
+{
+    if (!watch_add(path, fn))
+        return;
+    DIR* dr = opendir(*path ? path : ".");
+    if (!dr)
+        return;
+    struct dirent* de;
+    char sub[PATH_MAX];
+    while ((de = readdir(dr))) {
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+            continue;
+        if (snprintf(sub, sizeof(sub), "%s%s%s", path, *path ? "/" : "", de->d_name) >= (int) sizeof(sub))
+            continue;
+        bool dir = de->d_type == DT_DIR;
+        if (de->d_type == DT_UNKNOWN) {
+            struct stat st;
+            dir = lstat(sub, &st) == 0 && S_ISDIR(st.st_mode);
+        }
+        if (fn)
+            fn(WATCH_ADDED, sub, dir);
+        if (dir)
+            watch_tree(sub, fn);
+    }
+    closedir(dr);
+}
+
+/* Drop the watches of directory path and of everything under it. */
+static
+void watch_forget(const char* path)
+{
+    size_t len = strlen(path);
+    pthread_mutex_lock(&watch_lock);
+    for (size_t wd = 0; wd < watch_size; wd++)
+        if (watch_paths[wd] && !strncmp(watch_paths[wd], path, len)
+            && (watch_paths[wd][len] == 0 || watch_paths[wd][len] == '/')) {
+            inotify_rm_watch(watch_fd, wd);
+            free(watch_paths[wd]);
+            watch_paths[wd] = NULL;
+        }
+    pthread_mutex_unlock(&watch_lock);
+}
+
+/* Open the inotify instance, without watches yet. */
+bool watch_open(void)
+{
+    return (watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) >= 0;
+}
+
+/* Watch the current directory, the shared root, and everything under it. */
+bool watch_start(void)
+{
+    if (!watch_open())
+        return false;
+    watch_tree("", NULL);
+    return true;
+}
+
+/* Read the pending events and report them to fn. */
+void watch_read(watch_fn fn)
+{
+    char buf[WATCH_BUFFER] __attribute__((aligned(__alignof__(struct inotify_event))));
+    char path[PATH_MAX];
+    ssize_t n;
+    while ((n = read(watch_fd, buf, sizeof(buf))) > 0) {
+        for (char* p = buf; p < buf + n; p += sizeof(struct inotify_event) + ((struct inotify_event*) p)->len) {
+            const struct inotify_event* e = (const struct inotify_event*) p;
+            if (e->mask & IN_Q_OVERFLOW) {
+                fn(WATCH_OVERFLOW, NULL, false);
+                continue;
+            }
+            pthread_mutex_lock(&watch_lock);
+            const char* dir = e->wd >= 0 && (size_t) e->wd < watch_size ? watch_paths[e->wd] : NULL;
+            bool known = dir && e->len && !(e->mask & IN_IGNORED)
+                         && snprintf(path, sizeof(path), "%s%s%s", dir, *dir ? "/" : "", e->name) < (int) sizeof(path);
+            if (e->mask & IN_IGNORED && dir) {
+                free(watch_paths[e->wd]);
+                watch_paths[e->wd] = NULL;
+            }
+            pthread_mutex_unlock(&watch_lock);
+            if (!known)
+                continue;
+            bool is_dir = e->mask & IN_ISDIR;
+            if (e->mask & (IN_CREATE | IN_MOVED_TO)) {
+                fn(WATCH_ADDED, path, is_dir);
+                if (is_dir)
+                    watch_tree(path, fn);
+            } else if (e->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                if (is_dir)
+                    watch_forget(path);
+                fn(WATCH_REMOVED, path, is_dir);
+            } else
+                fn(WATCH_MODIFIED, path, is_dir);
+        }
+    }
+}
+#endif
@@ -0,0 +1,143 @@
+// headers.c
+#ifndef HTTPD_HEADERS
+#define HTTPD_HEADERS
+
+#include <stddef.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <stdbool.h>
+
+/*
+    Perfect hash for the request header fields the server acts on.
+
+    hash(name) = len + asso[name[0]] + asso[name[len - 1]]
+
+    The association values were found with a brute-force search in the
+    manner of gperf, so every known field maps to its own slot of
+    header_wordlist and a lookup costs one table probe and one
+    case-insensitive compare. Characters that never start or end a known
+    field have no association value, which rejects most unknown fields
+    before any compare. Adding a field means searching for new values.
+*/
+
+typedef enum {
+    H_HOST,
+    H_CONNECTION,
+    H_RANGE,
+    H_IF_RANGE,
+    H_IF_NONE_MATCH,
+    H_IF_MODIFIED_SINCE,
+    H_ACCEPT,
+    H_ACCEPT_ENCODING,
+    H_CONTENT_LENGTH,
+    H_TRANSFER_ENCODING,
+    H_USER_AGENT,
+    H_REFERER,
+    H_EXPECT,
+    H_UPGRADE,
+    H_CACHE_CONTROL,
+    H_LAST_EVENT_ID,
+    HEADER_COUNT,
+    H_UNKNOWN = -1
+} header_id;
+
+/* A view into the request buffer. Not null-terminated. */
+typedef struct {
+    const char* ptr;
+    size_t len;
+} slice;
+
+#define HEADER_MIN_LEN          4
+#define HEADER_MAX_LEN          17
+#define HEADER_MAX_HASH         32
+
+/* Association values are stored off by one, 0 means "no known field". */
+static const unsigned char header_asso[256] = {
+    ['a'] = 9,  ['A'] = 9,
+    ['c'] = 9,  ['C'] = 9,
+    ['d'] = 3,  ['D'] = 3,
+    ['e'] = 8,  ['E'] = 8,
+    ['g'] = 6,  ['G'] = 6,
+    ['h'] = 5,  ['H'] = 5,
+    ['i'] = 2,  ['I'] = 2,
+    ['l'] = 10, ['L'] = 10,
+    ['n'] = 12, ['N'] = 12,
+    ['r'] = 1,  ['R'] = 1,
+    ['t'] = 10, ['T'] = 10,
+    ['u'] = 14, ['U'] = 14,
+};
+
+static const struct {
+    const char* name;
+    header_id id;
+} header_wordlist[HEADER_MAX_HASH + 1] = {
+    [7]  = {"referer",              H_REFERER},
+    [12] = {"range",                H_RANGE},
+    [16] = {"if-range",             H_IF_RANGE},
+    [17] = {"host",                 H_HOST},
+    [18] = {"if-none-match",        H_IF_NONE_MATCH},
+    [22] = {"expect",               H_EXPECT},
+    [23] = {"accept",               H_ACCEPT},
+    [24] = {"last-event-id",        H_LAST_EVENT_ID},
+    [25] = {"if-modified-since",    H_IF_MODIFIED_SINCE},
+    [26] = {"content-length",       H_CONTENT_LENGTH},
+    [27] = {"upgrade",              H_UPGRADE},
+    [28] = {"accept-encoding",      H_ACCEPT_ENCODING},
+    [29] = {"connection",           H_CONNECTION},
+    [30] = {"cache-control",        H_CACHE_CONTROL},
+    [31] = {"transfer-encoding",    H_TRANSFER_ENCODING},
+    [32] = {"user-agent",           H_USER_AGENT},
+};
+
+/* Map a field name of any case to its header_id or H_UNKNOWN. */
+static inline
+header_id header_lookup(const char* name, size_t len)
+{
+    if (len < HEADER_MIN_LEN || len > HEADER_MAX_LEN)
+        return H_UNKNOWN;
+    unsigned first = header_asso[(unsigned char) name[0]];
+    unsigned last = header_asso[(unsigned char) name[len - 1]];
+    if (!first || !last)
+        return H_UNKNOWN;
+
+    size_t key = len + first - 1 + last - 1;
+    if (key > HEADER_MAX_HASH || !header_wordlist[key].name)
+        return H_UNKNOWN;
+    const char* s = header_wordlist[key].name;
+    if (strlen(s) != len || strncasecmp(s, name, len) != 0)
+        return H_UNKNOWN;
+    return header_wordlist[key].id;
+}
+
+/* Compare a slice with a C string ignoring case. */
+static inline
+bool slice_eqi(slice s, const char* str)
+{
+    size_t len = strlen(str);
+    return s.ptr && s.len == len && strncasecmp(s.ptr, str, len) == 0;
+}
+
+/* Check whether a comma separated field value lists token, ignoring case. */
+static inline
+bool slice_has_token(slice s, const char* token)
+{
+    size_t tlen = strlen(token);
+    size_t i = 0;
+    while (s.ptr && i < s.len) {
+        while (i < s.len && (s.ptr[i] == ' ' || s.ptr[i] == '\t' || s.ptr[i] == ','))
+            i++;
+        size_t start = i;
+        while (i < s.len && s.ptr[i] != ',' && s.ptr[i] != ';')
+            i++;
+        size_t end = i;
+        while (end > start && (s.ptr[end - 1] == ' ' || s.ptr[end - 1] == '\t'))
+            end--;
+        if (end - start == tlen && strncasecmp(s.ptr + start, token, tlen) == 0)
+            return true;
+        while (i < s.len && s.ptr[i] != ',')
+            i++;
+    }
+    return false;
+}
+#endif
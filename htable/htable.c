@@ -2,209 +2,285 @@
 #ifndef HTTPD_HTABLE
 #define HTTPD_HTABLE
 
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <stdlib.h>
 #include <string.h>
-#include <math.h>
-#include "prime.c"
 #include <stdio.h>
 
-#define HT_INITIAL_BASE_SIZE 17
-#define HT_PRIME_1 163
-#define HT_PRIME_2 157
+/*
+    Open-addressing hash table with Robin Hood linear probing.
 
+    Items live inline in a single flat array, so a lookup touches one
+    contiguous run of slots instead of chasing a pointer per probe.
+    Keys and values are copied into an arena owned by the table; the
+    arena is only rewound by ht_clear() and released by ht_del_htable(),
+    therefore pointers returned by ht_search() stay valid until then.
+
+    The server no longer uses it: request headers are looked up by the
+    perfect hash in htable/headers.c, which replaced it there. It is
+    kept for bench/htable_bench.c, which compares the two on the same
+    request headers, and bench/microbench.c, which times it alone.
+*/
+
+#define HT_INITIAL_SIZE         32      // must be a power of two
+#define HT_MAX_LOAD             70      // percent, grow above it
+#define HT_MIN_LOAD             10      // percent, shrink below it
+#define HT_ARENA_BLOCK_SIZE     4096
+
+#define HT_FNV_OFFSET           14695981039346656037ULL
+#define HT_FNV_PRIME            1099511628211ULL
+
+typedef struct ht_block {
+    struct ht_block* next;
+    size_t used;
+    size_t size;
+    char data[];
+} ht_block;
+
+/* An empty slot has key == NULL. dist is the distance from the home slot. */
 typedef struct {
+    uint64_t hash;
     char* key;
     char* value;
+    uint32_t key_len;
+    uint32_t dist;
 } ht_item;
 
 typedef struct {
-    int size;
-    int count;
-    ht_item** items;
-    int base_size;
+    size_t size;
+    size_t count;
+    ht_item* items;
+    ht_block* arena;
 } ht_htable;
 
-ht_item HT_DELETED_ITEM = {NULL, NULL};
-
-void ht_resize(ht_htable* ht, const int base_size);
+bool ht_resize(ht_htable* ht, size_t size);
 ht_htable* ht_new(void);
 void ht_del_htable(ht_htable* ht);
-void ht_insert(ht_htable* ht, const char* key, const char* value);
+bool ht_insert(ht_htable* ht, const char* key, const char* value);
 char* ht_search(ht_htable* ht, const char* key);
 void ht_delete(ht_htable* ht, const char* key);
 
-ht_item* ht_new_item(const char* k, const char* v) {
-    ht_item* i = malloc(sizeof(ht_item));
-    i->key = strdup(k);
-    i->value = strdup(v);
-    return i;
+/* 64-bit FNV-1a. */
+static inline
+uint64_t ht_hash(const char* s, const size_t len) {
+    uint64_t hash = HT_FNV_OFFSET;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char) s[i];
+        hash *= HT_FNV_PRIME;
+    }
+    return hash;
 }
 
-void ht_del_item(ht_item* i) {
-    free(i->key);
-    free(i->value);
-    free(i);
+static
+ht_block* ht_new_block(const size_t size) {
+    ht_block* b = malloc(sizeof(ht_block) + size);
+    if (!b) return NULL;
+    b->next = NULL;
+    b->used = 0;
+    b->size = size;
+    return b;
 }
 
-void ht_clear(ht_htable* ht) {
-    for (int i = 0; i < ht->size; i++) {
-        ht_item* item = ht->items[i];
-        if (item != NULL) {
-            if (item != &HT_DELETED_ITEM) {
-                ht_del_item(item);
-            }
-            ht->items[i] = NULL;
+/* Copy len bytes of s into the arena and null-terminate them. */
+static
+char* ht_arena_strdup(ht_htable* ht, const char* s, const size_t len) {
+    ht_block* b = ht->arena;
+    if (!b || b->size - b->used < len + 1) {
+        size_t size = len + 1 > HT_ARENA_BLOCK_SIZE ? len + 1 : HT_ARENA_BLOCK_SIZE;
+        b = ht_new_block(size);
+        if (!b) return NULL;
+        b->next = ht->arena;
+        ht->arena = b;
+    }
+    char* p = b->data + b->used;
+    memcpy(p, s, len);
+    p[len] = 0;
+    b->used += len + 1;
+    return p;
+}
+
+static inline
+size_t ht_round_size(size_t size) {
+    size_t n = HT_INITIAL_SIZE;
+    while (n < size)
+        n <<= 1;
+    return n;
+}
+
+/* Place an item with a fresh key, displacing richer items on the way. */
+static
+void ht_place(ht_item* items, const size_t size, ht_item item) {
+    const size_t mask = size - 1;
+    size_t index = item.hash & mask;
+    item.dist = 0;
+    while (items[index].key != NULL) {
+        if (items[index].dist < item.dist) {
+            ht_item tmp = items[index];
+            items[index] = item;
+            item = tmp;
         }
+        index = (index + 1) & mask;
+        item.dist++;
     }
-    ht->count = 0;
+    items[index] = item;
 }
 
-ht_htable* ht_new_sized(const int base_size) {
-    ht_htable* ht = malloc(sizeof(ht_htable));
-    ht->base_size = base_size;
+/* Return the slot index of key or -1 if it is absent. */
+static
+ssize_t ht_find(ht_htable* ht, const char* key, const size_t len, const uint64_t hash) {
+    const size_t mask = ht->size - 1;
+    size_t index = hash & mask;
+    for (uint32_t dist = 0; ; dist++) {
+        ht_item* item = &ht->items[index];
+        if (item->key == NULL || item->dist < dist)
+            return -1;
+        if (item->hash == hash && item->key_len == len && memcmp(item->key, key, len) == 0)
+            return index;
+        index = (index + 1) & mask;
+    }
+}
 
-    ht->size = next_prime(ht->base_size);
+void ht_clear(ht_htable* ht) {
+    memset(ht->items, 0, ht->size * sizeof(ht_item));
+    ht->count = 0;
+    if (!ht->arena)
+        return;
+    /* Keep the newest block around so the next request does not malloc. */
+    ht_block* b = ht->arena->next;
+    while (b) {
+        ht_block* next = b->next;
+        free(b);
+        b = next;
+    }
+    ht->arena->next = NULL;
+    ht->arena->used = 0;
+}
 
+ht_htable* ht_new_sized(const size_t size) {
+    ht_htable* ht = malloc(sizeof(ht_htable));
+    if (!ht) return NULL;
+    ht->size = ht_round_size(size);
     ht->count = 0;
-    ht->items = calloc((size_t)ht->size, sizeof(ht_item*));
+    ht->arena = NULL;
+    ht->items = calloc(ht->size, sizeof(ht_item));
+    if (!ht->items) {
+        free(ht);
+        return NULL;
+    }
     return ht;
 }
 
-
 ht_htable* ht_new(void) {
-    return ht_new_sized(HT_INITIAL_BASE_SIZE);
+    return ht_new_sized(HT_INITIAL_SIZE);
 }
 
 void ht_del_htable(ht_htable* ht) {
-    for (int i = 0; i < ht->size; i++) {
-        ht_item* item = ht->items[i];
-        if (item != NULL && item != &HT_DELETED_ITEM) {
-            ht_del_item(item);
-        }
+    if (!ht) return;
+    ht_block* b = ht->arena;
+    while (b) {
+        ht_block* next = b->next;
+        free(b);
+        b = next;
     }
     free(ht->items);
     free(ht);
 }
 
-size_t ht_hash(const char* s, const int a, const int m) {
-    size_t hash = 0;
-    const int len_s = strlen(s);
-    for (int i = 0; i < len_s; i++)
-        hash += pow(a, len_s - (i+1)) * s[i];
-    hash = hash % m;
-    return hash;
+/*
+    Rehash all items into a table of the given size; strings are not
+    copied. Return false if the items would not fit or memory is short,
+    leaving the table unchanged.
+*/
+bool ht_resize(ht_htable* ht, size_t size) {
+    size = ht_round_size(size);
+    if (size * HT_MAX_LOAD / 100 < ht->count)
+        return false;
+    ht_item* items = calloc(size, sizeof(ht_item));
+    if (!items) return false;
+    for (size_t i = 0; i < ht->size; i++) {
+        if (ht->items[i].key != NULL)
+            ht_place(items, size, ht->items[i]);
+    }
+    free(ht->items);
+    ht->items = items;
+    ht->size = size;
+    return true;
 }
 
-size_t ht_get_hash(const char* s, const int num_buckets, const int attempt) {
-    const size_t hash_a = ht_hash(s, HT_PRIME_1, num_buckets);
-    size_t hash_b = ht_hash(s, HT_PRIME_2, num_buckets);
-    if (hash_b % num_buckets == 0)
-        hash_b = 1;
-    return (hash_a + (attempt * hash_b)) % num_buckets;
+bool ht_resize_up(ht_htable* ht) {
+    return ht_resize(ht, ht->size * 2);
 }
 
-void ht_resize_up(ht_htable* ht) {
-    int new_size = ht->base_size * 2;
-    ht_resize(ht, new_size);
+void ht_resize_down(ht_htable* ht) {
+    ht_resize(ht, ht->size / 2);
 }
 
+/* Return false if memory is short; the table is unchanged then. */
+bool ht_insert(ht_htable* ht, const char* key, const char* value) {
+    const size_t key_len = strlen(key);
+    const uint64_t hash = ht_hash(key, key_len);
 
-void ht_resize_down(ht_htable* ht) {
-    int new_size = ht->base_size / 2;
-    ht_resize(ht, new_size);
-}
-
-void ht_resize(ht_htable* ht, int base_size) {
-    if (base_size < HT_INITIAL_BASE_SIZE)
-        base_size = HT_INITIAL_BASE_SIZE;
-    ht_htable* new_ht = ht_new_sized(base_size);
-    for (int i = 0; i < ht->size; i++) {
-        ht_item* item = ht->items[i];
-        if (item != NULL && item != &HT_DELETED_ITEM) {
-            ht_insert(new_ht, item->key, item->value);
-        }
+    ssize_t index = ht_find(ht, key, key_len, hash);
+    if (index != -1) {
+        char* v = ht_arena_strdup(ht, value, strlen(value));
+        if (!v) return false;
+        ht->items[index].value = v;
+        return true;
     }
 
-    ht->base_size = new_ht->base_size;
-    ht->count = new_ht->count;
-
-    // To delete new_ht, we give it ht's size and items 
-    const int tmp_size = ht->size;
-    ht->size = new_ht->size;
-    new_ht->size = tmp_size;
-
-    ht_item** tmp_items = ht->items;
-    ht->items = new_ht->items;
-    new_ht->items = tmp_items;
-
-    ht_del_htable(new_ht);
-}
-
-void ht_insert(ht_htable* ht, const char* key, const char* value) {
-    const int load = ht->count * 100 / ht->size;
-    if (load > 70)
-        ht_resize_up(ht);
-    ht_item* item = ht_new_item(key, value);
-    size_t index = ht_get_hash(item->key, ht->size, 0);
-    ht_item* cur_item = ht->items[index];
-    int i = 1;
-    while (cur_item != NULL) {
-        if (cur_item != &HT_DELETED_ITEM) {
-            if (strcmp(cur_item->key, key) == 0) {
-                ht_del_item(cur_item);
-                ht->items[index] = item;
-                return;
-            }
-        }
-        index = ht_get_hash(item->key, ht->size, i);
-        cur_item = ht->items[index];
-        i++;
-    }
-    ht->items[index] = item;
+    /* Past the load limit probes grow long, and a full table would never end one. */
+    if ((ht->count + 1) * 100 / ht->size > HT_MAX_LOAD && !ht_resize_up(ht))
+        return false;
+
+    ht_item item;
+    item.hash = hash;
+    item.key_len = key_len;
+    item.key = ht_arena_strdup(ht, key, key_len);
+    item.value = ht_arena_strdup(ht, value, strlen(value));
+    if (!item.key || !item.value)
+        return false;
+    ht_place(ht->items, ht->size, item);
     ht->count++;
+    return true;
 }
 
 char* ht_search(ht_htable* ht, const char* key) {
-    size_t index = ht_get_hash(key, ht->size, 0);
-    ht_item* item = ht->items[index];
-    int i = 1;
-    while (item != NULL) {
-        if (item != &HT_DELETED_ITEM && strcmp(item->key, key) == 0)
-            return item->value;
-        index = ht_get_hash(key, ht->size, i);
-        item = ht->items[index];
-        i++;
-    } 
-    return NULL;
+    const size_t len = strlen(key);
+    ssize_t index = ht_find(ht, key, len, ht_hash(key, len));
+    return index == -1 ? NULL : ht->items[index].value;
 }
 
+/* Delete with backward shifting, so no tombstones are left behind. */
 void ht_delete(ht_htable* ht, const char* key) {
-    const int load = ht->count * 100 / ht->size;
-    if (load < 30)
+    const size_t len = strlen(key);
+    ssize_t found = ht_find(ht, key, len, ht_hash(key, len));
+    if (found == -1)
+        return;
+
+    const size_t mask = ht->size - 1;
+    size_t index = found;
+    size_t next = (index + 1) & mask;
+    while (ht->items[next].key != NULL && ht->items[next].dist > 0) {
+        ht->items[index] = ht->items[next];
+        ht->items[index].dist--;
+        index = next;
+        next = (next + 1) & mask;
+    }
+    memset(&ht->items[index], 0, sizeof(ht_item));
+    ht->count--;
+
+    if (ht->size > HT_INITIAL_SIZE && ht->count * 100 / ht->size < HT_MIN_LOAD)
         ht_resize_down(ht);
-    size_t index = ht_get_hash(key, ht->size, 0);
-    ht_item* item = ht->items[index];
-    int i = 1;
-    while (item != NULL) {
-        if (item != &HT_DELETED_ITEM) {
-            if (strcmp(item->key, key) == 0) {
-                ht_del_item(item);
-                ht->items[index] = &HT_DELETED_ITEM;
-                ht->count--;
-                return;
-            }
-        }
-        index = ht_get_hash(key, ht->size, i);
-        item = ht->items[index];
-        i++;
-    } 
 }
 
 void ht_print_table(ht_htable* table) {
-    for (int i = 0; i < table->size; i++) {
-        ht_item* item = table->items[i];
-        if (item == NULL)
+    for (size_t i = 0; i < table->size; i++) {
+        ht_item* item = &table->items[i];
+        if (item->key == NULL)
             printf("(NULL)->(NULL)\n");
-        else 
+        else
             printf("%s->%s\n", item->key, item->value);
     }
 }
@@ -0,0 +1,220 @@
+#ifndef HTTPD_ACCESS
+#define HTTPD_ACCESS
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include "logger.c"
+
+/*
+    Access log.
+
+    Every request produces one record with the client, status, bytes
+    sent and the time at which it passed each stage, in microseconds on
+    the monotonic clock since the request started. A request starts when
+    its connection is accepted, or for later requests on a keep-alive
+    connection, when its first byte arrives, so the time the client
+    took to send it is not counted (see access_restart()).
+
+    Records go to stdout through the logger as text lines, or to a file
+    opened with access_open(), either as text lines or as fixed-size
+    binary records after an access_header. Every record is written with
+    one write() to a descriptor opened with O_APPEND, so records of
+    different children never interleave. Only binary records cut the URI
+    to ACCESS_URI_SIZE; text lines carry all of it, as far as a log
+    entry holds on stdout (see LOG_ENTRY_SIZE in logger/logger.c).
+*/
+
+#define ACCESS_MAGIC            "SHACCESS"
+#define ACCESS_VERSION          1
+#define ACCESS_METHOD_SIZE      8
+#define ACCESS_URI_SIZE         76
+#define ACCESS_TEXT_SIZE        512
+#define ACCESS_NONE             UINT32_MAX     // stage not reached
+
+enum access_stage {
+    AS_READ,            // first byte of the request read
+    AS_PARSE,           // request line and headers parsed
+    AS_LOOKUP,          // file metadata looked up
+    AS_FIRST_SENT,      // first byte of the response sent
+    AS_LAST_SENT,       // last byte of the response sent
+    AS_COUNT,
+};
+
+static const char* access_stage_names[AS_COUNT] = {
+    "read", "parse", "lookup", "first", "last"
+};
+
+/* Start of a binary access log. */
+struct access_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+};
+
+/* Binary record, in host byte order except for client. */
+struct access_record {
+    uint64_t time;                      // start, microseconds since the epoch
+    uint32_t client;                    // IPv4 address in network byte order
+    uint16_t status;
+    uint16_t index;                     // request number on the connection
+    uint64_t bytes;                     // bytes sent, headers included
+    uint32_t stages[AS_COUNT];          // microseconds since the start
+    char method[ACCESS_METHOD_SIZE];
+    char uri[ACCESS_URI_SIZE];          // normalized path, truncated, null-terminated
+};
+_Static_assert(sizeof(struct access_record) == 128, "access records are 128 bytes");
+
+static int access_fd = -1;
+static bool access_binary;
+
+/* Record of the request this process is serving. */
+static struct access_record access_cur;
+static uint64_t access_start;
+
+static inline
+uint64_t access_clock(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Monotonic time in nanoseconds, for access_begin(). */
+static inline
+uint64_t access_now(void)
+{
+    return access_clock(CLOCK_MONOTONIC);
+}
+
+/*
+    Log to path instead of stdout, in binary records if binary is set.
+    The header of a binary log is written only if the file is empty.
+    Return false if the file could not be opened.
+*/
+bool access_open(const char* path, bool binary)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0)
+        return false;
+    if (binary && lseek(fd, 0, SEEK_END) == 0) {
+        struct access_header header = {.version = ACCESS_VERSION,
+                                       .record_size = sizeof(struct access_record)};
+        memcpy(header.magic, ACCESS_MAGIC, sizeof(header.magic));
+        if (write(fd, &header, sizeof(header)) != sizeof(header)) {
+            close(fd);
+            return false;
+        }
+    }
+    access_fd = fd;
+    access_binary = binary;
+    return true;
+}
+
+/* Count the stages of the current request from monotonic time start on. */
+void access_restart(uint64_t start)
+{
+    uint64_t now = access_now();
+    access_start = start < now ? start : now;
+    access_cur.time = (access_clock(CLOCK_REALTIME) - (now - access_start)) / 1000;
+}
+
+/*
+    Start the record of a request that started at monotonic time start,
+    or that starts when its first byte arrives if start is 0; then
+    access_restart() is called at that time.
+*/
+void access_begin(uint64_t start, const char* client, uint16_t index)
+{
+    memset(&access_cur, 0, sizeof(access_cur));
+    for (int i = 0; i < AS_COUNT; i++)
+        access_cur.stages[i] = ACCESS_NONE;
+    inet_pton(AF_INET, client, &access_cur.client);
+    access_cur.index = index;
+    access_restart(start ? start : access_now());
+}
+
+/* Note that the request has reached stage, unless it was noted already. */
+void access_mark(enum access_stage stage)
+{
+    if (access_cur.stages[stage] != ACCESS_NONE)
+        return;
+    uint64_t us = (access_now() - access_start) / 1000;
+    access_cur.stages[stage] = us < ACCESS_NONE ? us : ACCESS_NONE - 1;
+}
+
+/* Account for n bytes of the response having been sent. */
+void access_sent(size_t n)
+{
+    access_mark(AS_FIRST_SENT);
+    access_cur.stages[AS_LAST_SENT] = ACCESS_NONE;
+    access_mark(AS_LAST_SENT);
+    access_cur.bytes += n;
+}
+
+/*
+    Format a record as a text line, with the start time in front if
+    with_time is set, and with uri instead of the record's own, which
+    may be cut, unless it is NULL. Return the length of the line.
+*/
+int access_text(const struct access_record* r, const char* uri, bool with_time, char* buf, size_t size)
+{
+    char client[INET_ADDRSTRLEN] = "-";
+    inet_ntop(AF_INET, &r->client, client, sizeof(client));
+
+    int len = 0;
+    if (with_time) {
+        time_t sec = r->time / 1000000;
+        struct tm tm_info;
+        localtime_r(&sec, &tm_info);
+        len = strftime(buf, size, "[%Y-%m-%d %H:%M:%S] ", &tm_info);
+    }
+    if (uri)
+        len += snprintf(buf + len, size - len, "%s %.*s /%s %u %llu",
+                        client, ACCESS_METHOD_SIZE, r->method[0] ? r->method : "-", uri,
+                        r->status, (unsigned long long) r->bytes);
+    else
+        len += snprintf(buf + len, size - len, "%s %.*s %.*s %u %llu",
+                        client, ACCESS_METHOD_SIZE, r->method[0] ? r->method : "-",
+                        ACCESS_URI_SIZE, r->uri[0] ? r->uri : "-",
+                        r->status, (unsigned long long) r->bytes);
+    for (int i = 0; i < AS_COUNT && (size_t) len < size; i++) {
+        if (r->stages[i] == ACCESS_NONE)
+            len += snprintf(buf + len, size - len, " %s=-", access_stage_names[i]);
+        else
+            len += snprintf(buf + len, size - len, " %s=%uus", access_stage_names[i], r->stages[i]);
+    }
+    if ((size_t) len >= size - 1)
+        len = size - 2;
+    buf[len++] = '\n';
+    buf[len] = 0;
+    return len;
+}
+
+/* Complete the record of the current request, write it out and return it. */
+const struct access_record* access_end(size_t status, const char* method, const char* uri)
+{
+    access_cur.status = status;
+    if (method)
+        strncpy(access_cur.method, method, ACCESS_METHOD_SIZE - 1);
+    if (uri)
+        snprintf(access_cur.uri, ACCESS_URI_SIZE, "/%s", uri);
+
+    if (access_fd >= 0 && access_binary) {
+        if (write(access_fd, &access_cur, sizeof(access_cur)) < 0) {}
+        return &access_cur;
+    }
+    char line[ACCESS_TEXT_SIZE + (uri ? strlen(uri) : 0)];
+    int len = access_text(&access_cur, uri, access_fd >= 0, line, sizeof(line));
+    if (access_fd >= 0) {
+        if (write(access_fd, line, len) < 0) {}
+    } else
+        log_info("%s", line);
+    return &access_cur;
+}
+#endif
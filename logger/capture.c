@@ -0,0 +1,115 @@
+#ifndef HTTPD_CAPTURE
+#define HTTPD_CAPTURE
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+
+/*
+    Traffic capture.
+
+    With a capture file opened by capture_open(), every connection adds
+    an open event when it is accepted, a data event with the raw bytes of
+    every read() from the client and a close event when it ends. The file
+    starts with a capture_header; each event is a capture_record followed
+    by len bytes, written with one writev() to a descriptor opened with
+    O_APPEND so events of different children stay whole.
+    tools/replay.c plays captures back against a server.
+*/
+
+#define CAPTURE_MAGIC           "SHCAPTUR"
+#define CAPTURE_VERSION         1
+
+enum capture_type {
+    CAPTURE_OPEN,
+    CAPTURE_DATA,
+    CAPTURE_CLOSE,
+};
+
+struct capture_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t reserved;
+};
+
+struct capture_record {
+    uint64_t time;      // microseconds since the epoch
+    uint64_t conn;      // unique per connection and server process
+    uint32_t type;      // enum capture_type
+    uint32_t len;       // bytes that follow
+};
+
+static int capture_fd = -1;
+
+/* Id of the connection this process serves, see capture_begin(). */
+static uint64_t capture_conn;
+
+/*
+    Append captured traffic to path, writing the header if the file is
+    empty. Return false if the file could not be opened.
+*/
+bool capture_open(const char* path)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0)
+        return false;
+    if (lseek(fd, 0, SEEK_END) == 0) {
+        struct capture_header header = {.version = CAPTURE_VERSION};
+        memcpy(header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+        if (write(fd, &header, sizeof(header)) != sizeof(header)) {
+            close(fd);
+            return false;
+        }
+    }
+    capture_fd = fd;
+    return true;
+}
+
+static
+void capture_event(enum capture_type type, const char* data, size_t len)
+{
+    if (capture_fd < 0)
+        return;
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    struct capture_record record = {
+        .time = (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000,
+        .conn = capture_conn,
+        .type = type,
+        .len = len,
+    };
+    struct iovec iov[2] = {{&record, sizeof(record)}, {(void*) data, len}};
+    if (writev(capture_fd, iov, len ? 2 : 1) < 0) {}
+}
+
+/*
+    Make the connection with the given id the one this process records.
+    The id is the pid of the main server process and the number of
+    connections it accepted before this one.
+*/
+void capture_use(uint32_t server, uint32_t number)
+{
+    capture_conn = (uint64_t) server << 32 | number;
+}
+
+/* Record the opening of a connection, see capture_use(). */
+void capture_begin(uint32_t server, uint32_t number)
+{
+    capture_use(server, number);
+    capture_event(CAPTURE_OPEN, NULL, 0);
+}
+
+void capture_data(const char* data, size_t len)
+{
+    capture_event(CAPTURE_DATA, data, len);
+}
+
+void capture_end(void)
+{
+    capture_event(CAPTURE_CLOSE, NULL, 0);
+}
+#endif
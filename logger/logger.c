@@ -5,39 +5,327 @@
 #include <stdarg.h>
 #include <string.h>
 #include <time.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <sched.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+/*
+    Asynchronous logger.
+
+    Every process of the server formats its messages on its own stack and
+    pushes them into a ring buffer that lives in shared memory, so it is
+    shared by all forked children. A dedicated writer process started by
+    log_start() drains the ring in batches with writev(), which keeps
+    stdio buffering and slow terminals out of the request path and lines
+    of different children from interleaving.
+
+    The ring is a bounded multi-producer queue in the manner of Vyukov:
+    each slot carries a sequence number telling whether it is free for
+    position pos (seq == pos) or holds the message of position pos
+    (seq == pos + 1). Producers claim positions with a CAS and never
+    block; if the ring stays full after yielding to the writer a few
+    times, the message is dropped and counted.
+
+    Before log_start() is called, or if it fails, messages are written
+    synchronously as before.
+
+    The ring does not make a call cheaper: bench/log_bench.c logs about
+    1.1M calls/s through it with 4 processes on one CPU, 1.5M with one,
+    against 3-4M for stdio writing to /dev/null, since every message is
+    copied twice and may wake the writer. What it buys is that a call
+    never waits for the output: when a terminal, pipe or disk stalls, a
+    synchronous call blocks in write() for as long as it does, while
+    pushing still costs under a microsecond, or drops the message once
+    the ring is full.
+*/
+
+#define LOG_SLOTS               1024    // must be a power of two
+#define LOG_ENTRY_SIZE          496
+#define LOG_BATCH               64
+#define LOG_FULL_RETRIES        16
+#define LOG_TIME_SIZE           26
 
+enum {
+    LOG_LEVEL_DEBUG,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_ERR,
+};
+
+struct log_slot {
+    _Atomic size_t seq;
+    uint16_t len;
+    uint8_t fd;
+    char data[LOG_ENTRY_SIZE];
+};
+
+struct log_ring {
+    _Alignas(64) _Atomic size_t enqueue_pos;
+    _Alignas(64) _Atomic uint32_t epoch;
+    _Atomic int sleeping;
+    _Atomic size_t dropped;
+    _Alignas(64) struct log_slot slots[LOG_SLOTS];
+};
+
+/* Messages below this level are discarded. */
+int log_level = LOG_LEVEL_INFO;
+
+static struct log_ring* log_ring;
+
+/* The writer process, 0 if there is none. */
+pid_t log_writer_pid;
+
+/* Local time of the current second, reformatted at most once a second. */
 static inline
 void get_cur_time(char* time_buffer, size_t size)
 {
-    time_t now;
-    struct tm *tm_info;
+    static time_t cached_sec = -1;
+    static char cached[LOG_TIME_SIZE];
+    time_t now = time(NULL);
 
-    time(&now);
-    tm_info = localtime(&now);
-    strftime(time_buffer, size, "%Y-%m-%d %H:%M:%S", tm_info);
+    if (now != cached_sec) {
+        struct tm tm_info;
+        localtime_r(&now, &tm_info);
+        strftime(cached, sizeof(cached), "%Y-%m-%d %H:%M:%S", &tm_info);
+        cached_sec = now;
+    }
+    snprintf(time_buffer, size, "%s", cached);
 }
 
-void log_info(char* msg, ...) {
-    va_list ap;
+/*
+    Sleep until a producer wakes the writer, unless the message at pos
+    arrived meanwhile; return false then. The fence keeps the store to
+    sleeping from passing the load of the slot, and the one in log_wake()
+    keeps the store to the slot from passing the load of sleeping, so
+    either the writer sees the message or its producer sees it sleeping.
+*/
+static inline
+bool log_wait(struct log_ring* ring, size_t pos)
+{
+    uint32_t epoch = atomic_load(&ring->epoch);
+    atomic_store_explicit(&ring->sleeping, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&ring->slots[pos & (LOG_SLOTS - 1)].seq, memory_order_acquire) == pos + 1)
+        return false;
+#ifdef __linux__
+    struct timespec timeout = {.tv_sec = 1, .tv_nsec = 0};
+    syscall(SYS_futex, &ring->epoch, FUTEX_WAIT, epoch, &timeout, NULL, 0);
+#else
+    (void) epoch;
+    usleep(1000);
+#endif
+    return true;
+}
+
+static inline
+void log_wake(struct log_ring* ring)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    if (!atomic_load_explicit(&ring->sleeping, memory_order_relaxed))
+        return;
+    atomic_store(&ring->sleeping, 0);
+    atomic_fetch_add(&ring->epoch, 1);
+#ifdef __linux__
+    syscall(SYS_futex, &ring->epoch, FUTEX_WAKE, 1, NULL, NULL, 0);
+#endif
+}
 
-    char time_buffer[26];
+/* Try to queue a formatted message, return false if the ring is full. */
+static
+bool log_push(struct log_ring* ring, int fd, const char* data, size_t len)
+{
+    size_t pos = atomic_load_explicit(&ring->enqueue_pos, memory_order_relaxed);
+    struct log_slot* slot;
+    int retries = 0;
+    for (;;) {
+        slot = &ring->slots[pos & (LOG_SLOTS - 1)];
+        size_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t) seq - (intptr_t) pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&ring->enqueue_pos, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            /* Full: give the writer a few chances to catch up, then drop. */
+            if (retries++ == LOG_FULL_RETRIES) {
+                atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+                return false;
+            }
+            log_wake(ring);
+            sched_yield();
+            pos = atomic_load_explicit(&ring->enqueue_pos, memory_order_relaxed);
+        } else
+            pos = atomic_load_explicit(&ring->enqueue_pos, memory_order_relaxed);
+    }
+    memcpy(slot->data, data, len);
+    slot->len = len;
+    slot->fd = fd;
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+    log_wake(ring);
+    return true;
+}
+
+static
+bool writev_all(int fd, struct iovec* iov, int n)
+{
+    while (n > 0) {
+        ssize_t w = writev(fd, iov, n);
+        if (w < 0 && errno == EINTR)
+            continue;
+        if (w < 0)
+            return false;
+        while (n > 0 && (size_t) w >= iov->iov_len) {
+            w -= iov->iov_len;
+            iov++;
+            n--;
+        }
+        if (n > 0) {
+            iov->iov_base = (char*) iov->iov_base + w;
+            iov->iov_len -= w;
+        }
+    }
+    return true;
+}
+
+/* Body of the writer process. Exits once the server process is gone. */
+static
+void log_writer(struct log_ring* ring, pid_t parent)
+{
+    size_t pos = 0;
+    size_t reported = 0;
+    time_t reported_at = 0;
+    struct iovec iov[LOG_BATCH];
+
+    for (;;) {
+        int n = 0;
+        while (n < LOG_BATCH) {
+            struct log_slot* slot = &ring->slots[(pos + n) & (LOG_SLOTS - 1)];
+            if (atomic_load_explicit(&slot->seq, memory_order_acquire) != pos + n + 1)
+                break;
+            n++;
+        }
+
+        if (n == 0) {
+            if (log_wait(ring, pos) && getppid() != parent)
+                _exit(0);
+            continue;
+        }
+
+        /* Write runs of messages going to the same descriptor at once. */
+        int start = 0;
+        for (int i = 0; i <= n; i++) {
+            struct log_slot* slot = &ring->slots[(pos + i) & (LOG_SLOTS - 1)];
+            if (i < n) {
+                iov[i].iov_base = slot->data;
+                iov[i].iov_len = slot->len;
+            }
+            struct log_slot* first = &ring->slots[(pos + start) & (LOG_SLOTS - 1)];
+            if (i == n || slot->fd != first->fd) {
+                writev_all(first->fd, iov + start, i - start);
+                start = i;
+            }
+        }
+        for (int i = 0; i < n; i++) {
+            struct log_slot* slot = &ring->slots[(pos + i) & (LOG_SLOTS - 1)];
+            atomic_store_explicit(&slot->seq, pos + i + LOG_SLOTS, memory_order_release);
+        }
+        pos += n;
+
+        /* Report drops at most once a second. */
+        size_t dropped = atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+        time_t now = time(NULL);
+        if (dropped != reported && now != reported_at) {
+            char msg[64];
+            int len = snprintf(msg, sizeof(msg), "[logger] %zu messages dropped\n", dropped - reported);
+            if (write(STDERR_FILENO, msg, len) < 0) {}
+            reported = dropped;
+            reported_at = now;
+        }
+    }
+}
+
+/*
+    Map the shared ring and fork the writer process.
+    Return false if either fails; logging then stays synchronous.
+*/
+bool log_start(void)
+{
+    struct log_ring* ring = mmap(NULL, sizeof(struct log_ring), PROT_READ | PROT_WRITE,
+                                 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (ring == MAP_FAILED)
+        return false;
+    for (size_t i = 0; i < LOG_SLOTS; i++)
+        atomic_init(&ring->slots[i].seq, i);
+
+    fflush(stdout);
+    fflush(stderr);
+    pid_t parent = getpid();
+    pid_t pid = fork();
+    if (pid == -1) {
+        munmap(ring, sizeof(struct log_ring));
+        return false;
+    }
+    if (pid == 0)
+        log_writer(ring, parent);
+    log_ring = ring;
+    log_writer_pid = pid;
+    return true;
+}
+
+static
+void log_write(int level, FILE* f, char* msg, va_list ap)
+{
+    if (level < log_level)
+        return;
+
+    char buf[LOG_ENTRY_SIZE];
+    char time_buffer[LOG_TIME_SIZE];
     get_cur_time(time_buffer, sizeof(time_buffer));
 
-    printf("[%s] ", time_buffer);
+    int len = snprintf(buf, sizeof(buf), "[%s] ", time_buffer);
+    int n = vsnprintf(buf + len, sizeof(buf) - len, msg, ap);
+    if (n < 0)
+        return;
+    if ((size_t)(len + n) >= sizeof(buf)) {
+        len = sizeof(buf) - 1;
+        buf[len - 1] = '\n';
+    } else
+        len += n;
+
+    int fd = fileno(f);
+    if (!log_ring || (fd != STDOUT_FILENO && fd != STDERR_FILENO)) {
+        fwrite(buf, 1, len, f);
+        return;
+    }
+    log_push(log_ring, fd, buf, len);
+}
+
+void log_debug(char* msg, ...) {
+    va_list ap;
     va_start(ap, msg);
-    vfprintf(stdout, msg, ap);
+    log_write(LOG_LEVEL_DEBUG, stdout, msg, ap);
     va_end(ap);
 }
 
-void log_err(FILE* f, char* msg, ...) {
+void log_info(char* msg, ...) {
     va_list ap;
-    
-    char time_buffer[26];
-    get_cur_time(time_buffer, sizeof(time_buffer));
+    va_start(ap, msg);
+    log_write(LOG_LEVEL_INFO, stdout, msg, ap);
+    va_end(ap);
+}
 
-    fprintf(f, "[%s] ", time_buffer);
+void log_err(FILE* f, char* msg, ...) {
+    va_list ap;
     va_start(ap, msg);
-    vfprintf(f, msg, ap);
+    log_write(LOG_LEVEL_ERR, f, msg, ap);
     va_end(ap);
 }
 #endif
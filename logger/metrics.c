@@ -0,0 +1,472 @@
+#ifndef HTTPD_METRICS
+#define HTTPD_METRICS
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include "access.c"
+#include "../helpers/safe_string.h"
+
+/*
+    Server metrics in the Prometheus text format.
+
+    The counters live in a region mapped MAP_SHARED by metrics_init()
+    before the server forks, so every child adds to the same counters
+    with relaxed atomic operations and any child can render the totals.
+    Until metrics_init() succeeds every update is a no-op.
+
+    Latencies of the access log stages are kept in log-linear histograms
+    in the manner of HdrHistogram: every power of two is split into
+    METRICS_SUB_BUCKETS linear buckets, so any value from 1us to over an
+    hour is recorded with a relative error below 1/METRICS_SUB_BUCKETS.
+    They are exported as Prometheus histograms with power-of-two bounds,
+    which line up with bucket edges, plus precomputed quantiles.
+*/
+
+#define METRICS_PATH            ".well-known/metrics"
+#define METRICS_SUB_BITS        3
+#define METRICS_SUB_BUCKETS     (1 << METRICS_SUB_BITS)
+#define METRICS_BUCKETS         ((32 - METRICS_SUB_BITS + 1) * METRICS_SUB_BUCKETS)
+#define METRICS_MAX_STATUS      600
+#define METRICS_MAX_LE          26      // largest exported bound is 2^26us, about 67s
+
+enum metrics_method {
+    MM_GET,
+    MM_HEAD,
+    MM_POST,
+    MM_PUT,
+    MM_DELETE,
+    MM_OPTIONS,
+    MM_PATCH,
+    MM_OTHER,
+    MM_COUNT,
+};
+
+static const char* metrics_method_names[MM_COUNT] = {
+    "GET", "HEAD", "POST", "PUT", "DELETE", "OPTIONS", "PATCH", "other"
+};
+
+/* Caches whose hits and misses are counted. */
+enum metrics_cache {
+    MC_ASSET,           // static files served from the embedded copies rather than read from disk
+    MC_HASH,            // digests found in the hash database rather than computed, see helpers/hashdb.c
+    MC_PREFETCH,        // files fetched after a listing warmed them, see helpers/prefetch.c
+    MC_COUNT,
+};
+
+static const char* metrics_cache_names[MC_COUNT] = {
+    "asset", "hash", "prefetch"
+};
+
+/* Connections closed because a timeout expired, see net/timeouts.c. */
+enum metrics_timeout {
+    MT_HEADER,          // the request head was not complete in time
+    MT_IDLE,            // no next request on a kept-alive connection
+    MT_SEND,            // a write made no progress
+    MT_COUNT,
+};
+
+static const char* metrics_timeout_names[MT_COUNT] = {
+    "header", "idle", "send"
+};
+
+/* Connections answered with 503 by admission control, see net/admission.c. */
+enum metrics_shed {
+    MS_CONNS,           // too many open connections
+    MS_PER_IP,          // too many open connections from the client's address
+    MS_WAIT,            // waited too long for a child to serve it
+    MS_BACKLOG,         // the accept queue was too long
+    MS_MEMORY,          // too little memory available
+    MS_FORK,            // fork() failed
+    MS_COUNT,
+};
+
+static const char* metrics_shed_names[MS_COUNT] = {
+    "conns", "per_ip", "wait", "backlog", "memory", "fork"
+};
+
+/* Gauges set by the main process. */
+enum metrics_gauge {
+    MG_PARKED,          // idle kept-alive connections it holds
+    MG_CHILDREN,        // children serving connections
+    MG_WAITING,         // readable connections waiting for a child
+    MG_BACKLOG,         // connections in the accept queue
+    MG_SUBSCRIBERS,     // subscribers to ?events and followers of ?follow it holds
+    MG_COUNT,
+};
+
+struct metrics_histogram {
+    _Atomic uint64_t buckets[METRICS_BUCKETS];
+    _Atomic uint64_t sum;               // microseconds
+};
+
+struct metrics {
+    _Atomic uint64_t by_status[METRICS_MAX_STATUS];
+    _Atomic uint64_t by_method[MM_COUNT];
+    _Atomic uint64_t bytes_in;
+    _Atomic uint64_t bytes_out;
+    _Atomic int64_t active_connections;
+    _Atomic uint64_t connections;
+    _Atomic uint64_t reused_requests;   // requests after the first on a connection
+    _Atomic int64_t gauges[MG_COUNT];
+    _Atomic uint64_t timeouts[MT_COUNT];
+    _Atomic uint64_t shed[MS_COUNT];
+    _Atomic uint64_t throttled;         // microseconds writes waited for bandwidth
+    _Atomic uint64_t cache_hits[MC_COUNT];
+    _Atomic uint64_t cache_misses[MC_COUNT];
+    _Atomic uint64_t prefetched_files;
+    _Atomic uint64_t prefetched_bytes;
+    _Atomic uint64_t prefetch_first[2];         // microseconds to first byte, of misses and hits
+    _Atomic uint64_t prefetch_first_count[2];
+    struct metrics_histogram stages[AS_COUNT];
+};
+
+/* Normalized path the metrics are served at, NULL to disable them. */
+char* metrics_path = METRICS_PATH;
+
+static struct metrics* metrics;
+
+/* Map the shared counters. Return false if that fails; metrics stay off. */
+bool metrics_init(void)
+{
+    struct metrics* m = mmap(NULL, sizeof(struct metrics), PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (m == MAP_FAILED)
+        return false;
+    metrics = m;
+    return true;
+}
+
+bool metrics_is_path(const char* uri)
+{
+    return metrics && metrics_path && uri && strcmp(uri, metrics_path) == 0;
+}
+
+static inline
+void metrics_add(_Atomic uint64_t* counter, uint64_t n)
+{
+    atomic_fetch_add_explicit(counter, n, memory_order_relaxed);
+}
+
+static inline
+uint64_t metrics_get(_Atomic uint64_t* counter)
+{
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+/* Index of the bucket holding value v. */
+static inline
+size_t metrics_bucket(uint32_t v)
+{
+    if (v < METRICS_SUB_BUCKETS)
+        return v;
+    int e = 31 - __builtin_clz(v);
+    size_t sub = (v >> (e - METRICS_SUB_BITS)) & (METRICS_SUB_BUCKETS - 1);
+    return (e - METRICS_SUB_BITS + 1) * METRICS_SUB_BUCKETS + sub;
+}
+
+/* Smallest value that does not fit into bucket i. */
+static inline
+uint64_t metrics_bucket_end(size_t i)
+{
+    if (i < METRICS_SUB_BUCKETS)
+        return i + 1;
+    int e = i / METRICS_SUB_BUCKETS + METRICS_SUB_BITS - 1;
+    uint64_t sub = i % METRICS_SUB_BUCKETS;
+    return (METRICS_SUB_BUCKETS + sub + 1) << (e - METRICS_SUB_BITS);
+}
+
+/* A connection was opened (delta 1) or closed (delta -1). */
+void metrics_connection(int delta)
+{
+    if (!metrics)
+        return;
+    atomic_fetch_add_explicit(&metrics->active_connections, delta, memory_order_relaxed);
+    if (delta > 0)
+        metrics_add(&metrics->connections, 1);
+}
+
+void metrics_gauge(enum metrics_gauge gauge, int64_t n)
+{
+    if (metrics)
+        atomic_store_explicit(&metrics->gauges[gauge], n, memory_order_relaxed);
+}
+
+void metrics_timeout(enum metrics_timeout kind)
+{
+    if (metrics)
+        metrics_add(&metrics->timeouts[kind], 1);
+}
+
+void metrics_shed(enum metrics_shed reason)
+{
+    if (metrics)
+        metrics_add(&metrics->shed[reason], 1);
+}
+
+void metrics_throttled(uint64_t us)
+{
+    if (metrics)
+        metrics_add(&metrics->throttled, us);
+}
+
+void metrics_received(size_t n)
+{
+    if (metrics)
+        metrics_add(&metrics->bytes_in, n);
+}
+
+void metrics_cache(enum metrics_cache cache, bool hit)
+{
+    if (metrics)
+        metrics_add(hit ? &metrics->cache_hits[cache] : &metrics->cache_misses[cache], 1);
+}
+
+/* A listing warmed a file of size bytes. */
+void metrics_prefetched(uint64_t size)
+{
+    if (!metrics)
+        return;
+    metrics_add(&metrics->prefetched_files, 1);
+    metrics_add(&metrics->prefetched_bytes, size);
+}
+
+/* A file was fetched that a listing had warmed (hit) or not, its first byte first_us after the request. */
+void metrics_prefetch(bool hit, uint32_t first_us)
+{
+    if (!metrics)
+        return;
+    metrics_cache(MC_PREFETCH, hit);
+    if (first_us == ACCESS_NONE)
+        return;
+    metrics_add(&metrics->prefetch_first[hit], first_us);
+    metrics_add(&metrics->prefetch_first_count[hit], 1);
+}
+
+static
+enum metrics_method metrics_method_id(const char* method)
+{
+    if (!method)
+        return MM_OTHER;
+    for (int i = 0; i < MM_OTHER; i++)
+        if (strcasecmp(method, metrics_method_names[i]) == 0)
+            return i;
+    return MM_OTHER;
+}
+
+/* Count a completed request from its access record. */
+void metrics_request(const struct access_record* r, const char* method)
+{
+    if (!metrics)
+        return;
+    metrics_add(&metrics->by_status[r->status < METRICS_MAX_STATUS ? r->status : 0], 1);
+    metrics_add(&metrics->by_method[metrics_method_id(method)], 1);
+    metrics_add(&metrics->bytes_out, r->bytes);
+    if (r->index > 0)
+        metrics_add(&metrics->reused_requests, 1);
+
+    for (int s = 0; s < AS_COUNT; s++) {
+        if (r->stages[s] == ACCESS_NONE)
+            continue;
+        struct metrics_histogram* h = &metrics->stages[s];
+        metrics_add(&h->buckets[metrics_bucket(r->stages[s])], 1);
+        metrics_add(&h->sum, r->stages[s]);
+    }
+}
+
+static
+string metrics_printf(string buf, const char* fmt, ...)
+{
+    char line[256];
+    va_list ap;
+    va_start(ap, fmt);
+    int len = vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    if (!buf || len < 0)
+        return buf;
+    return scat(buf, (size_t) len < sizeof(line) ? (size_t) len : sizeof(line) - 1, line);
+}
+
+static
+string metrics_header(string buf, const char* name, const char* type, const char* help)
+{
+    return metrics_printf(buf, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+/* Upper bound of the bucket holding the q-th quantile, in microseconds. */
+static
+uint64_t metrics_quantile(const uint64_t* counts, uint64_t total, double q)
+{
+    uint64_t rank = (uint64_t)(q * (total - 1)) + 1;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < METRICS_BUCKETS; i++) {
+        seen += counts[i];
+        if (seen >= rank)
+            return metrics_bucket_end(i);
+    }
+    return metrics_bucket_end(METRICS_BUCKETS - 1);
+}
+
+static
+string metrics_render_histograms(string buf)
+{
+    static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+    uint64_t counts[AS_COUNT][METRICS_BUCKETS];
+    uint64_t totals[AS_COUNT], sums[AS_COUNT];
+
+    /* Snapshot first, children keep updating while this renders. */
+    for (int s = 0; s < AS_COUNT; s++) {
+        totals[s] = 0;
+        for (size_t i = 0; i < METRICS_BUCKETS; i++)
+            totals[s] += counts[s][i] = metrics_get(&metrics->stages[s].buckets[i]);
+        sums[s] = metrics_get(&metrics->stages[s].sum);
+    }
+
+    buf = metrics_header(buf, "share_request_stage_seconds", "histogram",
+                         "Time from the start of a request until it reached a stage.");
+    for (int s = 0; s < AS_COUNT; s++) {
+        uint64_t cumulative = 0;
+        size_t i = 0;
+        for (int k = 0; k <= METRICS_MAX_LE; k++) {
+            for (; i < METRICS_BUCKETS && metrics_bucket_end(i) <= (1ULL << k); i++)
+                cumulative += counts[s][i];
+            buf = metrics_printf(buf, "share_request_stage_seconds_bucket{stage=\"%s\",le=\"%g\"} %llu\n",
+                                 access_stage_names[s], (double)(1ULL << k) / 1e6,
+                                 (unsigned long long) cumulative);
+        }
+        buf = metrics_printf(buf, "share_request_stage_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n",
+                             access_stage_names[s], (unsigned long long) totals[s]);
+        buf = metrics_printf(buf, "share_request_stage_seconds_sum{stage=\"%s\"} %g\n",
+                             access_stage_names[s], sums[s] / 1e6);
+        buf = metrics_printf(buf, "share_request_stage_seconds_count{stage=\"%s\"} %llu\n",
+                             access_stage_names[s], (unsigned long long) totals[s]);
+    }
+
+    buf = metrics_header(buf, "share_request_stage_quantile_seconds", "gauge",
+                         "Quantiles of share_request_stage_seconds from the full resolution histogram.");
+    for (int s = 0; s < AS_COUNT; s++) {
+        if (totals[s] == 0)
+            continue;
+        for (size_t q = 0; q < sizeof(quantiles) / sizeof(quantiles[0]); q++)
+            buf = metrics_printf(buf, "share_request_stage_quantile_seconds{stage=\"%s\",quantile=\"%g\"} %g\n",
+                                 access_stage_names[s], quantiles[q],
+                                 metrics_quantile(counts[s], totals[s], quantiles[q]) / 1e6);
+    }
+    return buf;
+}
+
+/* Render all metrics, return NULL if memory could not be allocated. */
+string metrics_render(void)
+{
+    string buf = snewlen(NULL, 16384);
+    if (!buf || !metrics)
+        return buf;
+    supdatelen(buf, 0);
+
+    uint64_t requests = 0;
+    buf = metrics_header(buf, "share_requests_total", "counter", "Requests served, by status code.");
+    for (size_t i = 0; i < METRICS_MAX_STATUS; i++) {
+        uint64_t n = metrics_get(&metrics->by_status[i]);
+        requests += n;
+        if (n)
+            buf = metrics_printf(buf, "share_requests_total{code=\"%zu\"} %llu\n", i, (unsigned long long) n);
+    }
+
+    buf = metrics_header(buf, "share_requests_by_method_total", "counter", "Requests served, by method.");
+    for (int i = 0; i < MM_COUNT; i++)
+        buf = metrics_printf(buf, "share_requests_by_method_total{method=\"%s\"} %llu\n",
+                             metrics_method_names[i], (unsigned long long) metrics_get(&metrics->by_method[i]));
+
+    buf = metrics_header(buf, "share_received_bytes_total", "counter", "Bytes read from clients.");
+    buf = metrics_printf(buf, "share_received_bytes_total %llu\n", (unsigned long long) metrics_get(&metrics->bytes_in));
+    buf = metrics_header(buf, "share_sent_bytes_total", "counter", "Bytes sent to clients, headers included.");
+    buf = metrics_printf(buf, "share_sent_bytes_total %llu\n", (unsigned long long) metrics_get(&metrics->bytes_out));
+
+    buf = metrics_header(buf, "share_connections_active", "gauge", "Open connections, being served or parked.");
+    buf = metrics_printf(buf, "share_connections_active %lld\n",
+                         (long long) atomic_load_explicit(&metrics->active_connections, memory_order_relaxed));
+    buf = metrics_header(buf, "share_connections_parked", "gauge",
+                         "Idle kept-alive connections held by the main process, included in share_connections_active.");
+    buf = metrics_printf(buf, "share_connections_parked %lld\n",
+                         (long long) atomic_load_explicit(&metrics->gauges[MG_PARKED], memory_order_relaxed));
+    buf = metrics_header(buf, "share_connections_waiting", "gauge",
+                         "Readable connections waiting for a child, included in share_connections_active.");
+    buf = metrics_printf(buf, "share_connections_waiting %lld\n",
+                         (long long) atomic_load_explicit(&metrics->gauges[MG_WAITING], memory_order_relaxed));
+    buf = metrics_header(buf, "share_event_subscribers", "gauge",
+                         "Subscribers to ?events and followers of ?follow held by the main process, "
+                         "included in share_connections_active.");
+    buf = metrics_printf(buf, "share_event_subscribers %lld\n",
+                         (long long) atomic_load_explicit(&metrics->gauges[MG_SUBSCRIBERS], memory_order_relaxed));
+    buf = metrics_header(buf, "share_children", "gauge", "Child processes serving connections.");
+    buf = metrics_printf(buf, "share_children %lld\n",
+                         (long long) atomic_load_explicit(&metrics->gauges[MG_CHILDREN], memory_order_relaxed));
+    buf = metrics_header(buf, "share_accept_queue_length", "gauge",
+                         "Connections waiting in the kernel's accept queue when last checked.");
+    buf = metrics_printf(buf, "share_accept_queue_length %lld\n",
+                         (long long) atomic_load_explicit(&metrics->gauges[MG_BACKLOG], memory_order_relaxed));
+    buf = metrics_header(buf, "share_connections_total", "counter", "Connections accepted.");
+    buf = metrics_printf(buf, "share_connections_total %llu\n", (unsigned long long) metrics_get(&metrics->connections));
+
+    buf = metrics_header(buf, "share_timeouts_total", "counter", "Connections closed by a timeout, by timeout.");
+    for (int i = 0; i < MT_COUNT; i++)
+        buf = metrics_printf(buf, "share_timeouts_total{timeout=\"%s\"} %llu\n",
+                             metrics_timeout_names[i], (unsigned long long) metrics_get(&metrics->timeouts[i]));
+
+    buf = metrics_header(buf, "share_shed_total", "counter",
+                         "Connections answered with 503 Service Unavailable by admission control, by reason.");
+    for (int i = 0; i < MS_COUNT; i++)
+        buf = metrics_printf(buf, "share_shed_total{reason=\"%s\"} %llu\n",
+                             metrics_shed_names[i], (unsigned long long) metrics_get(&metrics->shed[i]));
+
+    buf = metrics_header(buf, "share_send_throttled_seconds_total", "counter",
+                         "Time writes to clients waited for bandwidth, see share -B.");
+    buf = metrics_printf(buf, "share_send_throttled_seconds_total %g\n", metrics_get(&metrics->throttled) / 1e6);
+
+    uint64_t reused = metrics_get(&metrics->reused_requests);
+    buf = metrics_header(buf, "share_keepalive_requests_total", "counter",
+                         "Requests served on a connection that was kept alive after an earlier one.");
+    buf = metrics_printf(buf, "share_keepalive_requests_total %llu\n", (unsigned long long) reused);
+    buf = metrics_header(buf, "share_keepalive_reuse_ratio", "gauge",
+                         "Fraction of requests served on a kept-alive connection.");
+    buf = metrics_printf(buf, "share_keepalive_reuse_ratio %g\n", requests ? (double) reused / requests : 0.0);
+
+    buf = metrics_header(buf, "share_cache_hits_total", "counter", "Cache hits, by cache.");
+    for (int i = 0; i < MC_COUNT; i++)
+        buf = metrics_printf(buf, "share_cache_hits_total{cache=\"%s\"} %llu\n",
+                             metrics_cache_names[i], (unsigned long long) metrics_get(&metrics->cache_hits[i]));
+    buf = metrics_header(buf, "share_cache_misses_total", "counter", "Cache misses, by cache.");
+    for (int i = 0; i < MC_COUNT; i++)
+        buf = metrics_printf(buf, "share_cache_misses_total{cache=\"%s\"} %llu\n",
+                             metrics_cache_names[i], (unsigned long long) metrics_get(&metrics->cache_misses[i]));
+    buf = metrics_header(buf, "share_cache_hit_ratio", "gauge", "Fraction of cache lookups that hit, by cache.");
+    for (int i = 0; i < MC_COUNT; i++) {
+        uint64_t hits = metrics_get(&metrics->cache_hits[i]);
+        uint64_t lookups = hits + metrics_get(&metrics->cache_misses[i]);
+        buf = metrics_printf(buf, "share_cache_hit_ratio{cache=\"%s\"} %g\n",
+                             metrics_cache_names[i], lookups ? (double) hits / lookups : 0.0);
+    }
+
+    buf = metrics_header(buf, "share_prefetch_files_total", "counter", "Files listings warmed the page cache for.");
+    buf = metrics_printf(buf, "share_prefetch_files_total %llu\n",
+                         (unsigned long long) metrics_get(&metrics->prefetched_files));
+    buf = metrics_header(buf, "share_prefetch_bytes_total", "counter", "Bytes listings warmed the page cache for.");
+    buf = metrics_printf(buf, "share_prefetch_bytes_total %llu\n",
+                         (unsigned long long) metrics_get(&metrics->prefetched_bytes));
+    buf = metrics_header(buf, "share_prefetch_first_byte_seconds", "summary",
+                         "Time to first byte of files fetched from a listed directory, by whether they were warmed.");
+    for (int i = 1; i >= 0; i--) {
+        buf = metrics_printf(buf, "share_prefetch_first_byte_seconds_sum{prefetched=\"%s\"} %g\n",
+                             i ? "true" : "false", metrics_get(&metrics->prefetch_first[i]) / 1e6);
+        buf = metrics_printf(buf, "share_prefetch_first_byte_seconds_count{prefetched=\"%s\"} %llu\n",
+                             i ? "true" : "false", (unsigned long long) metrics_get(&metrics->prefetch_first_count[i]));
+    }
+
+    return metrics_render_histograms(buf);
+}
+#endif
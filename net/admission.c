@@ -0,0 +1,235 @@
+#ifndef HTTPD_ADMISSION
+#define HTTPD_ADMISSION
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "spec.c"
+
+/*
+    Admission control, set with share -A.
+
+    conns     open connections at most, parked ones included, 0 for no
+              limit
+    per_ip    open connections from one client address at most, 0 for
+              no limit
+    children  child processes serving at once at most; readable
+              connections beyond that wait in the main process
+    wait      seconds a readable connection may wait for a child
+    backlog   connections waiting in the kernel's accept queue that
+              make the server shed new ones, 0 for no limit
+    memory    MB of available memory below which new connections are
+              shed, 0 for no limit
+    retry     seconds sent in Retry-After
+
+    A connection over a limit is shed by the main process itself: it
+    reads what the client has sent, writes a fixed 503 response with a
+    Retry-After and closes the connection, without forking, so shedding
+    costs a few system calls. Connections are also shed when fork()
+    fails rather than logging the error for each one.
+
+    The open connection counts live in shared memory, so a child that
+    closes its connection releases it without telling the main process.
+    Per address counts are kept in an open addressing table. Only the
+    main process inserts; a slot whose count drops to zero keeps its
+    address and is reused by the next insert that probes it, so
+    lookups of other addresses are never cut short. A connection keeps
+    the index of its slot (see struct handoff).
+*/
+
+#define ADMISSION_SLOTS         4096    // must be a power of two
+#define ADMISSION_NO_SLOT       UINT32_MAX
+
+struct admission_limits {
+    uint32_t conns;
+    uint32_t per_ip;
+    uint32_t children;
+    uint32_t wait;          // milliseconds
+    uint32_t backlog;
+    uint32_t memory;        // MB
+    uint32_t retry;         // seconds
+};
+
+struct admission_limits limits = {
+    .conns = 4096,
+    .per_ip = 64,
+    .children = 256,
+    .wait = 2000,
+    .backlog = 96,
+    .memory = 32,
+    .retry = 2,
+};
+
+struct admission_slot {
+    _Atomic uint32_t ip;            // network order, 0 for never used
+    _Atomic int32_t count;
+};
+
+struct admission {
+    _Atomic int64_t open;
+    struct admission_slot slots[ADMISSION_SLOTS];
+};
+
+static struct admission* admission;
+
+/* The response to a shed connection, built by admission_init(). */
+static char admission_response[192];
+static size_t admission_response_len;
+
+/*
+    Map the shared counts and build the 503 response from the limits.
+    Return false if the mapping fails; connections are then only limited
+    by the children cap and the accept queue.
+*/
+bool admission_init(void)
+{
+    admission_response_len = snprintf(admission_response, sizeof(admission_response),
+                                      "HTTP/1.1 503 Service Unavailable\r\n"
+                                      "Retry-After: %u\r\n"
+                                      "Content-Type: text/plain\r\n"
+                                      "Content-Length: 20\r\n"
+                                      "Connection: close\r\n\r\n"
+                                      "Service Unavailable\n", limits.retry);
+    struct admission* a = mmap(NULL, sizeof(struct admission), PROT_READ | PROT_WRITE,
+                               MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (a == MAP_FAILED)
+        return false;
+    admission = a;
+    return true;
+}
+
+/*
+    Answer connection c with 503 without blocking. What the client has
+    sent is read first, as closing a socket with unread input resets the
+    connection and the client might never see the response. The caller
+    closes c.
+*/
+void admission_shed(int c)
+{
+    char buf[4096];
+    for (int i = 0; i < 4 && recv(c, buf, sizeof(buf), MSG_DONTWAIT) == sizeof(buf); i++)
+        ;
+    if (send(c, admission_response, admission_response_len, MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {}
+    shutdown(c, SHUT_WR);
+}
+
+/*
+    Apply the pairs of share -A, for example "conns=1000,wait=0.5":
+    counts, except wait and retry in seconds and memory in MB. Return
+    false if the list is malformed or leaves no child to serve; limits
+    set before the error are kept.
+*/
+bool admission_parse(const char* spec)
+{
+    static const struct spec_name names[] = {
+        {"conns",       &limits.conns,      NULL,   1,      0,  UINT32_MAX},
+        {"per_ip",      &limits.per_ip,     NULL,   1,      0,  UINT32_MAX},
+        {"children",    &limits.children,   NULL,   1,      0,  UINT32_MAX},
+        {"wait",        &limits.wait,       NULL,   1000,   0,  UINT32_MAX},
+        {"backlog",     &limits.backlog,    NULL,   1,      0,  UINT32_MAX},
+        {"memory",      &limits.memory,     NULL,   1,      0,  UINT32_MAX},
+        {"retry",       &limits.retry,      NULL,   1,      0,  UINT32_MAX},
+    };
+    return spec_parse(spec, names, sizeof(names) / sizeof(names[0])) && limits.children > 0;
+}
+
+/* Slot of ip, inserting it if needed. ADMISSION_NO_SLOT if the table is full. */
+static
+uint32_t admission_slot(uint32_t ip)
+{
+    uint32_t h = (ip * 2654435761u) >> 20;
+    uint32_t reuse = ADMISSION_NO_SLOT;
+    for (uint32_t i = 0; i < ADMISSION_SLOTS; i++) {
+        uint32_t s = (h + i) & (ADMISSION_SLOTS - 1);
+        uint32_t cur = atomic_load_explicit(&admission->slots[s].ip, memory_order_relaxed);
+        if (cur == ip)
+            return s;
+        if (cur == 0) {
+            if (reuse != ADMISSION_NO_SLOT)
+                break;
+            atomic_store_explicit(&admission->slots[s].ip, ip, memory_order_relaxed);
+            return s;
+        }
+        if (reuse == ADMISSION_NO_SLOT && atomic_load_explicit(&admission->slots[s].count, memory_order_relaxed) == 0)
+            reuse = s;
+    }
+    if (reuse != ADMISSION_NO_SLOT)
+        atomic_store_explicit(&admission->slots[reuse].ip, ip, memory_order_relaxed);
+    return reuse;
+}
+
+/* Count a connection from ip (network order), return its slot for admission_close(). */
+uint32_t admission_open(uint32_t ip)
+{
+    if (!admission)
+        return ADMISSION_NO_SLOT;
+    atomic_fetch_add_explicit(&admission->open, 1, memory_order_relaxed);
+    uint32_t s = admission_slot(ip);
+    if (s != ADMISSION_NO_SLOT)
+        atomic_fetch_add_explicit(&admission->slots[s].count, 1, memory_order_relaxed);
+    return s;
+}
+
+void admission_close(uint32_t slot)
+{
+    if (!admission)
+        return;
+    atomic_fetch_sub_explicit(&admission->open, 1, memory_order_relaxed);
+    if (slot != ADMISSION_NO_SLOT)
+        atomic_fetch_sub_explicit(&admission->slots[slot].count, 1, memory_order_relaxed);
+}
+
+int64_t admission_open_count(void)
+{
+    return admission ? atomic_load_explicit(&admission->open, memory_order_relaxed) : 0;
+}
+
+/* Open connections from the address of slot. */
+int32_t admission_count(uint32_t slot)
+{
+    if (!admission || slot == ADMISSION_NO_SLOT)
+        return 0;
+    return atomic_load_explicit(&admission->slots[slot].count, memory_order_relaxed);
+}
+
+/* Connections waiting in the accept queue of listening socket s. */
+uint32_t admission_backlog(int s)
+{
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    if (getsockopt(s, IPPROTO_TCP, TCP_INFO, &info, &len) < 0)
+        return 0;
+    /* For a listening socket the kernel reports the accept queue length here. */
+    return info.tcpi_unacked;
+}
+
+/* Whether available memory is below the limit, read at most once a second at monotonic time now (ns). */
+bool admission_memory_low(uint64_t now)
+{
+    static uint64_t checked_at;
+    static bool low;
+    if (limits.memory == 0)
+        return false;
+    if (checked_at && now - checked_at < 1000000000ULL)
+        return low;
+    checked_at = now;
+
+    FILE* f = fopen("/proc/meminfo", "r");
+    if (!f)
+        return low = false;
+    char line[128];
+    unsigned long long kb = 0;
+    while (fgets(line, sizeof(line), f))
+        if (sscanf(line, "MemAvailable: %llu kB", &kb) == 1)
+            break;
+    fclose(f);
+    return low = kb && kb / 1024 < limits.memory;
+}
+#endif
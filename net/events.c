@@ -0,0 +1,181 @@
+#ifndef HTTPD_EVENTS
+#define HTTPD_EVENTS
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include "handoff.c"
+#include "wheel.c"
+#include "shaper.c"
+
+/*
+    Subscribers to ?events on a directory: clients that are sent, as
+    server-sent events, what is added to, removed from or modified in
+    the directory, so a listing page updates itself instead of being
+    reloaded (see static/script.js).
+
+    A child answers the request and hands the connection to the main
+    process (see net/handoff.c), which holds the subscribers and feeds
+    them from the change journal after every batch of inotify events
+    (see publish_events() in share.c), so the one set of watches serves
+    them all and a subscriber costs a descriptor, not a process. They
+    are found through a hash table keyed by the path of their directory:
+    a change is formatted once and sent to the subscribers of the
+    directory it is in, with a non-blocking send(). A subscriber whose
+    socket buffer cannot take an event whole is dropped rather than
+    buffered for; its EventSource reconnects after EVENTS_RETRY ms with
+    the id of the last event it got and is sent what it missed from the
+    journal. A comment line every EVENTS_PING seconds finds the clients
+    that went away without closing.
+
+    Followers of ?follow on a file are held in the same table, keyed by
+    the path of their file, see net/follow.c; they are sent the file,
+    not events.
+*/
+
+#define EVENTS_BUCKETS          4096    // must be a power of two
+#define EVENTS_PING             30      // seconds
+#define EVENTS_RETRY            2000    // milliseconds
+#define EVENTS_RESYNC           "event: resync\ndata: {}\n\n"
+
+struct subscriber {
+    struct timer throttle;      // first, so a fired timer is its follower, see follow_send()
+    struct handoff conn;
+    int fd;
+    int file;                   // of a follower, -1 for a subscriber to ?events
+    uint64_t offset;            // of a follower, the bytes of file sent
+    bool blocked;               // a follower waits for its socket to take more
+    bool reopen;                // a follower's file was replaced at its path, see follow_send()
+    uint64_t wait;              // of a follower, nanoseconds until it may send more under the -B limits
+    struct shaper_bucket bucket;    // of a follower, its connection's limit, see net/shaper.c
+    uint32_t hash;              // of path
+    struct subscriber* next;    // in its bucket
+    struct subscriber** prev;   // what points to it
+    char path[];                // of the directory or file, relative to the root, "" for the root
+};
+
+static struct subscriber* events_buckets[EVENTS_BUCKETS];
+static struct subscriber** events_by_fd;
+static size_t events_size;
+size_t events_count;
+
+/* FNV-1a of the len bytes of path. */
+static inline
+uint32_t events_hash(const char* path, size_t len)
+{
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+        h = (h ^ (unsigned char) path[i]) * 16777619u;
+    return h;
+}
+
+/* Whether s is a subscriber to ?events or a follower (file not -1) of the len bytes of path. */
+static inline
+bool events_match(const struct subscriber* s, uint32_t hash, const char* path, size_t len, bool follower)
+{
+    return s->hash == hash && (s->file >= 0) == follower && !strncmp(s->path, path, len) && !s->path[len];
+}
+
+/*
+    Track connection fd as a subscriber to directory path, or as a
+    follower of file path if file is not -1. Return NULL if memory is
+    short.
+*/
+struct subscriber* events_add(int fd, const struct handoff* conn, const char* path, int file)
+{
+    if ((size_t) fd >= events_size) {
+        size_t size = events_size ? events_size : 1024;
+        while (size <= (size_t) fd)
+            size *= 2;
+        struct subscriber** tmp = realloc(events_by_fd, size * sizeof(struct subscriber*));
+        if (!tmp)
+            return NULL;
+        memset(tmp + events_size, 0, (size - events_size) * sizeof(struct subscriber*));
+        events_by_fd = tmp;
+        events_size = size;
+    }
+    size_t len = strlen(path);
+    struct subscriber* s = malloc(sizeof(struct subscriber) + len + 1);
+    if (!s)
+        return NULL;
+    s->conn = *conn;
+    s->fd = fd;
+    s->file = file;
+    s->offset = conn->since;
+    s->blocked = false;
+    s->reopen = false;
+    s->wait = 0;
+    s->bucket = (struct shaper_bucket) {0};
+    timer_init(&s->throttle);
+    s->hash = events_hash(path, len);
+    memcpy(s->path, path, len + 1);
+    struct subscriber** bucket = &events_buckets[s->hash & (EVENTS_BUCKETS - 1)];
+    s->next = *bucket;
+    s->prev = bucket;
+    if (*bucket)
+        (*bucket)->prev = &s->next;
+    *bucket = s;
+    events_by_fd[fd] = s;
+    events_count++;
+    return s;
+}
+
+/* The subscriber on descriptor fd, or NULL. */
+static inline
+struct subscriber* events_find(int fd)
+{
+    return (size_t) fd < events_size ? events_by_fd[fd] : NULL;
+}
+
+/* Stop tracking s. The caller closes its connection and frees it. */
+void events_remove(struct subscriber* s)
+{
+    *s->prev = s->next;
+    if (s->next)
+        s->next->prev = s->prev;
+    events_by_fd[s->fd] = NULL;
+    events_count--;
+}
+
+/* Send msg to s, return false unless all of it went out at once. */
+static inline
+bool events_send_one(const struct subscriber* s, const char* msg, size_t len)
+{
+    return send(s->fd, msg, len, MSG_DONTWAIT | MSG_NOSIGNAL) == (ssize_t) len;
+}
+
+/*
+    Send msg to the subscribers of the len bytes of dir, or to all of
+    them if dir is NULL. The ones it does not fit are passed to drop,
+    which removes them.
+*/
+void events_send(const char* dir, size_t len, const char* msg, size_t msg_len,
+                 void (*drop)(struct subscriber* s))
+{
+    if (!dir) {
+        for (size_t fd = 0; fd < events_size; fd++)
+            if (events_by_fd[fd] && events_by_fd[fd]->file < 0 && !events_send_one(events_by_fd[fd], msg, msg_len))
+                drop(events_by_fd[fd]);
+        return;
+    }
+    uint32_t hash = events_hash(dir, len);
+    struct subscriber* next;
+    for (struct subscriber* s = events_buckets[hash & (EVENTS_BUCKETS - 1)]; s; s = next) {
+        next = s->next;
+        if (events_match(s, hash, dir, len, false) && !events_send_one(s, msg, msg_len))
+            drop(s);
+    }
+}
+
+/* Whether the len bytes of path have a subscriber, or a follower if follower is true. */
+bool events_wanted(const char* path, size_t len, bool follower)
+{
+    uint32_t hash = events_hash(path, len);
+    for (struct subscriber* s = events_buckets[hash & (EVENTS_BUCKETS - 1)]; s; s = s->next)
+        if (events_match(s, hash, path, len, follower))
+            return true;
+    return false;
+}
+#endif
@@ -0,0 +1,151 @@
+#ifndef HTTPD_FOLLOW
+#define HTTPD_FOLLOW
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include "events.c"
+#include "../helpers/watch.c"
+
+/*
+    ?follow on a file: what it holds, from the start, from ?from=<offset>
+    or from where its last ?lines=<n> lines start, and then whatever is
+    appended to it, in a response that only ends with the connection,
+    like tail -F.
+
+    A child sends what the file holds when it is asked, then hands the
+    connection and the open file to the main process, which holds it as
+    a follower next to the subscribers to ?events (see net/events.c).
+    The inotify watch of the file's directory (see helpers/watch.c)
+    reports the file modified, and the main process sends the follower
+    everything from its offset to the end of the file with sendfile()
+    on the non-blocking socket. A socket that is full is waited on to
+    become writable, not the file to change again. Nothing is polled, so
+    a follower costs nothing while its file is quiet.
+
+    What is sent counts against the -B limits of the follower's
+    connection, of its client and of the total (see net/shaper.c) like
+    any response. When they are used up the follower waits, for the
+    time s->wait tells, on a timer of the main process rather than in a
+    sleep that would hold up every other connection.
+
+    A file that became shorter than the offset was truncated, and is
+    sent again from its start. A file replaced at its path, created anew
+    or renamed over, was rotated: the rest of the old file is sent, then
+    the new one from its start. A file that is removed is followed on
+    until one appears at its path again.
+*/
+
+#define FOLLOW_READ             65536
+
+/* Offset at which the last lines lines of the size bytes of file fd start, 0 if it has fewer. */
+off_t follow_tail(int fd, off_t size, uint64_t lines)
+{
+    char buf[FOLLOW_READ];
+    if (lines == 0)
+        return size;
+    /* A line ends at every newline but one that ends the file, which has no line after it. */
+    uint64_t seen = 0;
+    for (off_t end = size; end > 0;) {
+        size_t n = end < FOLLOW_READ ? (size_t) end : FOLLOW_READ;
+        if (pread(fd, buf, n, end - n) != (ssize_t) n)
+            return 0;
+        end -= n;
+        for (size_t i = n; i-- > 0;)
+            if (buf[i] == '\n' && end + (off_t) i != size - 1 && ++seen == lines)
+                return end + i + 1;
+    }
+    return 0;
+}
+
+/*
+    Send follower s what its file holds past its offset, starting over
+    if the file was truncated and going on with the file at its path if
+    it was replaced. Return false if the client has gone; if its socket
+    is full, s->blocked is set and the rest waits for it, and if the
+    bandwidth limits are used up, s->wait is set to how long to wait.
+*/
+bool follow_send(struct subscriber* s)
+{
+    s->blocked = false;
+    s->wait = 0;
+    for (;;) {
+        struct stat st;
+        if (fstat(s->file, &st) < 0)
+            return false;
+        if ((uint64_t) st.st_size < s->offset)
+            s->offset = 0;
+        while (s->offset < (uint64_t) st.st_size) {
+            size_t allowed = shaper_take(&s->bucket, s->conn.ip_slot, st.st_size - s->offset, &s->wait);
+            if (allowed == 0)
+                return true;
+            off_t at = s->offset;
+            ssize_t n = sendfile(s->fd, s->file, &at, allowed);
+            shaper_give(&s->bucket, s->conn.ip_slot, n > 0 ? allowed - n : allowed);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                s->blocked = true;
+                return true;
+            }
+            if (n < 0)
+                return false;
+            if (n == 0)
+                break;
+            s->offset += n;
+        }
+        if (!s->reopen)
+            return true;
+
+        s->reopen = false;
+        struct stat old;
+        int file = open(s->path, O_RDONLY | O_CLOEXEC);
+        if (file < 0 || fstat(file, &st) < 0 || !S_ISREG(st.st_mode)
+            || (fstat(s->file, &old) == 0 && old.st_dev == st.st_dev && old.st_ino == st.st_ino)) {
+            if (file >= 0)
+                close(file);
+            return true;
+        }
+        close(s->file);
+        s->file = file;
+        s->offset = 0;
+    }
+}
+
+/*
+    Pass a change helpers/watch.c reports at path to its followers, or
+    lost events (path NULL) to all of them: fn is called for the ones
+    that may have more to send, see follow_send(). A follower whose
+    socket is full is sent the rest when it drains instead, and one out
+    of bandwidth when its timer fires.
+*/
+void follow_watch(enum watch_change change, const char* path, void (*fn)(struct subscriber* s))
+{
+    if (!path) {
+        for (size_t fd = 0; fd < events_size; fd++) {
+            struct subscriber* s = events_by_fd[fd];
+            if (s && s->file >= 0) {
+                s->reopen = true;
+                if (!s->blocked && !timer_pending(&s->throttle))
+                    fn(s);
+            }
+        }
+        return;
+    }
+    size_t len = strlen(path);
+    uint32_t hash = events_hash(path, len);
+    struct subscriber* next;
+    for (struct subscriber* s = events_buckets[hash & (EVENTS_BUCKETS - 1)]; s; s = next) {
+        next = s->next;
+        if (!events_match(s, hash, path, len, true))
+            continue;
+        s->reopen |= change == WATCH_ADDED;
+        if (!s->blocked && !timer_pending(&s->throttle))
+            fn(s);
+    }
+}
+#endif
@@ -0,0 +1,138 @@
+#ifndef HTTPD_HANDOFF
+#define HTTPD_HANDOFF
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+/*
+    Passing idle connections from the children back to the main process.
+
+    A child that has answered a request and seen no next one within the
+    hold time (see net/timeouts.c) sends the connection to the main
+    process and exits, so an idle keep-alive client costs a descriptor
+    and a timer instead of a process. The descriptor travels as
+    SCM_RIGHTS ancillary data together with the state the next child
+    needs, over a datagram socketpair created before any child is
+    forked, so every message arrives whole.
+
+    Subscribers to ?events and followers of ?follow are handed over the
+    same way right after their response head, with the path of their
+    directory or file following the state in the message; a follower's
+    open file travels with its connection (see net/events.c and
+    net/follow.c).
+*/
+
+enum handoff_kind {
+    HANDOFF_IDLE,                       // an idle keep-alive connection
+    HANDOFF_EVENTS,                     // a subscriber to ?events
+    HANDOFF_FOLLOW,                     // a follower of ?follow, with its file
+};
+
+struct handoff {
+    uint32_t number;                    // connection number, see capture_begin()
+    uint16_t index;                     // requests served on the connection
+    uint64_t start;                     // access_now() when the last response was sent
+    uint32_t ip_slot;                   // see admission_open()
+    char client_ip[INET_ADDRSTRLEN];
+    uint8_t kind;                       // enum handoff_kind
+    uint64_t since;                     // the last journal version sent, or the bytes of the file sent
+};
+
+#define HANDOFF_DROPPED         -2      // see handoff_recv()
+
+/* [0] is read by the main process, children write to [1]. */
+int handoff_fds[2] = {-1, -1};
+
+bool handoff_init(void)
+{
+    if (socketpair(AF_UNIX, SOCK_DGRAM, 0, handoff_fds) < 0)
+        return false;
+    fcntl(handoff_fds[0], F_SETFL, O_NONBLOCK);
+    return true;
+}
+
+/*
+    Send connection c with its state to the main process, with the path
+    of a subscriber or follower if path is not NULL and the file of a
+    follower if file is not -1. The caller still closes c and file.
+*/
+bool handoff_send(int c, const struct handoff* h, const char* path, int file)
+{
+    char control[CMSG_SPACE(2 * sizeof(int))];
+    memset(control, 0, sizeof(control));
+    size_t len = path ? strlen(path) : 0;
+    int fds[2] = {c, file};
+    size_t nfds = file >= 0 ? 2 : 1;
+    struct iovec iov[2] = {{(void*) h, sizeof(*h)}, {(void*) path, len}};
+    struct msghdr msg = {
+        .msg_iov = iov,
+        .msg_iovlen = 2,
+        .msg_control = control,
+        .msg_controllen = CMSG_SPACE(nfds * sizeof(int)),
+    };
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+    return sendmsg(handoff_fds[1], &msg, 0) == (ssize_t) (sizeof(*h) + len);
+}
+
+/*
+    Receive a connection and its state, into path, which holds cap
+    bytes, the path of a subscriber or follower and into *file the file
+    of a follower, -1 if there is none. Return -1 if nothing is waiting.
+
+    A message whose descriptors or path did not fit whole, or that came
+    without the descriptors its kind needs, is dropped: the descriptors that did arrive
+    are closed and HANDOFF_DROPPED is returned, with the state in *h so
+    the caller can account for the connection as closed. A message too
+    short to hold the state is skipped.
+*/
+int handoff_recv(struct handoff* h, char* path, size_t cap, int* file)
+{
+    for (;;) {
+        char control[CMSG_SPACE(2 * sizeof(int))];
+        struct iovec iov[2] = {{h, sizeof(*h)}, {path, cap - 1}};
+        struct msghdr msg = {
+            .msg_iov = iov,
+            .msg_iovlen = 2,
+            .msg_control = control,
+            .msg_controllen = sizeof(control),
+        };
+        ssize_t n = recvmsg(handoff_fds[0], &msg, MSG_CMSG_CLOEXEC);
+        if (n <= 0)
+            return -1;
+        int fds[2] = {-1, -1};
+        size_t nfds = 0;
+        for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+                continue;
+            size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for (size_t i = 0; i < count; i++) {
+                int fd;
+                memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+                if (nfds < 2)
+                    fds[nfds++] = fd;
+                else
+                    close(fd);
+            }
+        }
+        if (n >= (ssize_t) sizeof(*h) && nfds == (h->kind == HANDOFF_FOLLOW ? 2u : 1u)
+            && !(msg.msg_flags & (MSG_CTRUNC | MSG_TRUNC))) {
+            path[n - sizeof(*h)] = 0;
+            *file = fds[1];
+            return fds[0];
+        }
+        for (size_t i = 0; i < nfds; i++)
+            close(fds[i]);
+        if (n >= (ssize_t) sizeof(*h))
+            return HANDOFF_DROPPED;
+    }
+}
+#endif
@@ -0,0 +1,417 @@
+#ifndef HTTPD_SHAPER
+#define HTTPD_SHAPER
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include "spec.c"
+#include "admission.c"
+#include "../logger/metrics.c"
+
+/*
+    Bandwidth limits, in MB/s, set with share -B.
+
+    total     all responses together, shared fairly between transfers
+    client    responses to one client address
+    conn      responses on one connection
+    quantum   KB a transfer may send per round, see below
+
+    Every limit is a token bucket holding at most SHAPER_BURST_MS worth
+    of its rate (and at least a quantum), refilled as time passes; a
+    write takes tokens from the buckets of its connection, its client
+    and the server and waits while any of them is empty. The client
+    buckets are indexed by the admission slot of the address (see
+    net/admission.c), the connection bucket is local to the child
+    serving it and starts full again after a handoff.
+
+    The total is shared by deficit round robin. Each child is a flow in
+    a shared table, backlogged from the first write of a response until
+    shaper_idle() at its end. Tokens of the total bucket are not taken
+    directly but dealt out in rounds: every backlogged flow holding less
+    than its next write gets up to that write, at most a quantum, added
+    to its deficit, and a flow sends only what its deficit covers. A
+    flow that goes idle gives what is left of its deficit back to the
+    bucket, so tokens dealt for a write that turned out shorter are not
+    lost. A listing or a small file needs a single quantum and so
+    goes out within one round however many large downloads are running,
+    and large downloads split the rest evenly.
+
+    Followers of ?follow are sent to by the main process, which cannot
+    wait for tokens: shaper_take() grants what the buckets of the
+    follower, its client and the total hold right away, taking from the
+    total bucket directly rather than by rounds, and tells how long to
+    wait when one of them is empty.
+
+    The state lives in shared memory behind a spinlock held for a few
+    arithmetic operations. The lock records its owner, so a child
+    killed while holding it does not stop the others. Without any limit
+    set shaper_init() maps nothing and writes are not delayed.
+*/
+
+#define SHAPER_FLOWS            1024
+#define SHAPER_BURST_MS         50
+#define SHAPER_MIN_SLEEP_NS     1000000
+#define SHAPER_MAX_SLEEP_NS     50000000
+
+struct shaper_limits {
+    double total;           // bytes per second, 0 for no limit
+    double client;
+    double conn;
+    uint32_t quantum;       // bytes
+};
+
+struct shaper_limits bandwidth = {
+    .quantum = 65536,
+};
+
+struct shaper_bucket {
+    double tokens;
+    uint64_t refilled;      // monotonic ns
+};
+
+struct shaper_flow {
+    pid_t pid;              // 0 for a free slot
+    uint32_t want;          // size of the last write, 0 if idle
+    double deficit;
+};
+
+struct shaper {
+    _Atomic pid_t lock;
+    uint32_t cursor;        // next flow a round starts at
+    struct shaper_bucket total;
+    struct shaper_bucket clients[ADMISSION_SLOTS];
+    struct shaper_flow flows[SHAPER_FLOWS];
+};
+
+static struct shaper* shaper;
+
+/* State of the connection this child serves. */
+static struct shaper_bucket shaper_conn;
+static uint32_t shaper_ip_slot = ADMISSION_NO_SLOT;
+static int shaper_flow = -1;
+static size_t shaper_credit;    // granted but not yet written
+
+/*
+    Apply the pairs of share -B, for example "total=50,client=10": rates
+    in MB/s, 0 for none, and the quantum in KB. Return false if the list
+    is malformed; limits set before the error are kept.
+*/
+bool shaper_parse(const char* spec)
+{
+    static const struct spec_name names[] = {
+        {"total",       NULL,               &bandwidth.total,   1e6,    0,  1e6},
+        {"client",      NULL,               &bandwidth.client,  1e6,    0,  1e6},
+        {"conn",        NULL,               &bandwidth.conn,    1e6,    0,  1e6},
+        {"quantum",     &bandwidth.quantum, NULL,               1024,   1,  1e6},
+    };
+    return spec_parse(spec, names, sizeof(names) / sizeof(names[0]));
+}
+
+static inline
+uint64_t shaper_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline
+double shaper_burst(double rate)
+{
+    double burst = rate * SHAPER_BURST_MS / 1000;
+    return burst > bandwidth.quantum ? burst : bandwidth.quantum;
+}
+
+static
+void shaper_refill(struct shaper_bucket* b, double rate, uint64_t now)
+{
+    if (b->refilled == 0) {
+        b->tokens = shaper_burst(rate);
+        b->refilled = now;
+        return;
+    }
+    /* Another child may have refilled with a later time than now. */
+    if (now <= b->refilled)
+        return;
+    b->tokens += rate * (now - b->refilled) / 1e9;
+    if (b->tokens > shaper_burst(rate))
+        b->tokens = shaper_burst(rate);
+    b->refilled = now;
+}
+
+/* Nanoseconds until b holds n tokens. */
+static inline
+uint64_t shaper_eta(const struct shaper_bucket* b, double rate, double n)
+{
+    return b->tokens >= n ? 0 : (uint64_t)((n - b->tokens) / rate * 1e9);
+}
+
+static
+void shaper_lock(void)
+{
+    pid_t self = getpid();
+    for (unsigned spins = 1;; spins++) {
+        pid_t owner = 0;
+        if (atomic_compare_exchange_weak_explicit(&shaper->lock, &owner, self,
+                                                  memory_order_acquire, memory_order_relaxed))
+            return;
+        if (spins % 64 == 0) {
+            /* The owner was killed while holding the lock. */
+            if (owner && kill(owner, 0) < 0 && errno == ESRCH)
+                atomic_compare_exchange_strong_explicit(&shaper->lock, &owner, 0,
+                                                        memory_order_relaxed, memory_order_relaxed);
+            sched_yield();
+        }
+    }
+}
+
+static inline
+void shaper_unlock(void)
+{
+    atomic_store_explicit(&shaper->lock, 0, memory_order_release);
+}
+
+/* Map the shared state if any limit is set. Return false if that fails; writes are then not limited. */
+bool shaper_init(void)
+{
+    if (bandwidth.total == 0 && bandwidth.client == 0 && bandwidth.conn == 0)
+        return true;
+    struct shaper* s = mmap(NULL, sizeof(struct shaper), PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (s == MAP_FAILED)
+        return false;
+    shaper = s;
+    return true;
+}
+
+/* Start limiting the connection this child serves, from the client of ip_slot. */
+void shaper_begin(uint32_t ip_slot)
+{
+    if (!shaper)
+        return;
+    shaper_conn.refilled = 0;
+    shaper_ip_slot = ip_slot;
+    shaper_credit = 0;
+    if (bandwidth.total == 0)
+        return;
+
+    pid_t self = getpid();
+    shaper_lock();
+    for (int i = 0; i < SHAPER_FLOWS && shaper_flow < 0; i++)
+        if (shaper->flows[i].pid == 0)
+            shaper_flow = i;
+    /* Reclaim the flow of a child that was killed. */
+    for (int i = 0; i < SHAPER_FLOWS && shaper_flow < 0; i++)
+        if (kill(shaper->flows[i].pid, 0) < 0 && errno == ESRCH)
+            shaper_flow = i;
+    if (shaper_flow >= 0)
+        shaper->flows[shaper_flow] = (struct shaper_flow) {.pid = self};
+    shaper_unlock();
+}
+
+/* The response is complete, the flow stops taking part in rounds until the next one. */
+void shaper_idle(void)
+{
+    if (!shaper || shaper_flow < 0)
+        return;
+    shaper_lock();
+    struct shaper_flow* f = &shaper->flows[shaper_flow];
+    if (bandwidth.total) {
+        shaper->total.tokens += f->deficit;
+        if (shaper->total.tokens > shaper_burst(bandwidth.total))
+            shaper->total.tokens = shaper_burst(bandwidth.total);
+    }
+    f->want = 0;
+    f->deficit = 0;
+    shaper_unlock();
+}
+
+void shaper_end(void)
+{
+    if (!shaper || shaper_flow < 0)
+        return;
+    shaper_lock();
+    shaper->flows[shaper_flow].pid = 0;
+    shaper_unlock();
+    shaper_flow = -1;
+}
+
+/* Deal out a round of the total bucket to the flows with data to send. */
+static
+void shaper_round(void)
+{
+    uint32_t start = shaper->cursor;
+    for (uint32_t k = 0; k < SHAPER_FLOWS && shaper->total.tokens >= 1; k++) {
+        struct shaper_flow* f = &shaper->flows[(start + k) % SHAPER_FLOWS];
+        if (f->pid == 0 || f->want == 0 || f->deficit >= f->want)
+            continue;
+        double q = f->want - f->deficit < shaper->total.tokens ? f->want - f->deficit : shaper->total.tokens;
+        f->deficit += q;
+        shaper->total.tokens -= q;
+        shaper->cursor = (start + k + 1) % SHAPER_FLOWS;
+    }
+}
+
+/*
+    Wait until up to want bytes may be sent on this child's connection,
+    return how many, at least one. What is returned and not written must
+    be given back with shaper_unused().
+*/
+size_t shaper_acquire(size_t want)
+{
+    if (!shaper || want == 0)
+        return want;
+    if (shaper_credit) {
+        size_t n = want < shaper_credit ? want : shaper_credit;
+        shaper_credit -= n;
+        return n;
+    }
+    if (want > bandwidth.quantum)
+        want = bandwidth.quantum;
+
+    uint64_t waited_from = 0;
+    while (1) {
+        uint64_t now = shaper_now();
+        double grant = want;
+        uint64_t eta = 0;
+
+        if (bandwidth.conn) {
+            shaper_refill(&shaper_conn, bandwidth.conn, now);
+            grant = grant < shaper_conn.tokens ? grant : shaper_conn.tokens;
+            uint64_t e = shaper_eta(&shaper_conn, bandwidth.conn, want);
+            eta = e > eta ? e : eta;
+        }
+
+        shaper_lock();
+        struct shaper_bucket* client = bandwidth.client && shaper_ip_slot != ADMISSION_NO_SLOT
+                                       ? &shaper->clients[shaper_ip_slot] : NULL;
+        if (client) {
+            shaper_refill(client, bandwidth.client, now);
+            grant = grant < client->tokens ? grant : client->tokens;
+            uint64_t e = shaper_eta(client, bandwidth.client, want);
+            eta = e > eta ? e : eta;
+        }
+        struct shaper_flow* f = shaper_flow >= 0 ? &shaper->flows[shaper_flow] : NULL;
+        if (bandwidth.total) {
+            shaper_refill(&shaper->total, bandwidth.total, now);
+            if (f) {
+                f->want = want;
+                if (f->deficit < want)
+                    shaper_round();
+                grant = grant < f->deficit ? grant : f->deficit;
+            } else
+                grant = grant < shaper->total.tokens ? grant : shaper->total.tokens;
+            uint64_t e = shaper_eta(&shaper->total, bandwidth.total, want);
+            eta = e > eta ? e : eta;
+        }
+
+        if (grant >= 1) {
+            size_t n = grant;
+            if (client)
+                client->tokens -= n;
+            if (f)
+                f->deficit -= n;
+            else if (bandwidth.total)
+                shaper->total.tokens -= n;
+            shaper_unlock();
+            if (bandwidth.conn)
+                shaper_conn.tokens -= n;
+            if (waited_from)
+                metrics_throttled((now - waited_from) / 1000);
+            return n;
+        }
+        shaper_unlock();
+
+        if (!waited_from)
+            waited_from = now;
+        eta = eta < SHAPER_MIN_SLEEP_NS ? SHAPER_MIN_SLEEP_NS : eta > SHAPER_MAX_SLEEP_NS ? SHAPER_MAX_SLEEP_NS : eta;
+        struct timespec ts = {eta / 1000000000ULL, eta % 1000000000ULL};
+        nanosleep(&ts, NULL);
+    }
+}
+
+/* Keep n bytes returned by shaper_acquire() that were not written for the next write. */
+void shaper_unused(size_t n)
+{
+    if (shaper)
+        shaper_credit += n;
+}
+
+/*
+    Take want bytes, or a quantum if that is less, from conn, the bucket
+    of a connection the main process sends on, and from the buckets of
+    its client, of ip_slot, and of the total, without waiting. Return
+    how many, 0 if a bucket holds too few; *wait is then set to the
+    nanoseconds until it holds enough.
+    What is taken and not sent must be given back with shaper_give().
+*/
+size_t shaper_take(struct shaper_bucket* conn, uint32_t ip_slot, size_t want, uint64_t* wait)
+{
+    *wait = 0;
+    if (!shaper || want == 0)
+        return want;
+    if (want > bandwidth.quantum)
+        want = bandwidth.quantum;
+    uint64_t now = shaper_now();
+    double grant = want;
+    uint64_t eta = 0;
+
+    if (bandwidth.conn) {
+        shaper_refill(conn, bandwidth.conn, now);
+        grant = grant < conn->tokens ? grant : conn->tokens;
+        eta = shaper_eta(conn, bandwidth.conn, want);
+    }
+    shaper_lock();
+    struct shaper_bucket* client = bandwidth.client && ip_slot != ADMISSION_NO_SLOT ? &shaper->clients[ip_slot] : NULL;
+    if (client) {
+        shaper_refill(client, bandwidth.client, now);
+        grant = grant < client->tokens ? grant : client->tokens;
+        uint64_t e = shaper_eta(client, bandwidth.client, want);
+        eta = e > eta ? e : eta;
+    }
+    if (bandwidth.total) {
+        shaper_refill(&shaper->total, bandwidth.total, now);
+        grant = grant < shaper->total.tokens ? grant : shaper->total.tokens;
+        uint64_t e = shaper_eta(&shaper->total, bandwidth.total, want);
+        eta = e > eta ? e : eta;
+    }
+    /* A part of want would have the caller send in slivers as tokens trickle in. */
+    if (grant < want) {
+        shaper_unlock();
+        *wait = eta < SHAPER_MIN_SLEEP_NS ? SHAPER_MIN_SLEEP_NS : eta > SHAPER_MAX_SLEEP_NS ? SHAPER_MAX_SLEEP_NS : eta;
+        return 0;
+    }
+    size_t n = grant;
+    if (client)
+        client->tokens -= n;
+    if (bandwidth.total)
+        shaper->total.tokens -= n;
+    shaper_unlock();
+    if (bandwidth.conn)
+        conn->tokens -= n;
+    return n;
+}
+
+/* Return n bytes taken with shaper_take() that were not sent. */
+void shaper_give(struct shaper_bucket* conn, uint32_t ip_slot, size_t n)
+{
+    if (!shaper || n == 0)
+        return;
+    if (bandwidth.conn)
+        conn->tokens += n;
+    shaper_lock();
+    if (bandwidth.client && ip_slot != ADMISSION_NO_SLOT)
+        shaper->clients[ip_slot].tokens += n;
+    if (bandwidth.total)
+        shaper->total.tokens += n;
+    shaper_unlock();
+}
+#endif
@@ -0,0 +1,56 @@
+#ifndef HTTPD_SPEC
+#define HTTPD_SPEC
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+    The lists of name=value pairs given to share -t, -A and -B.
+
+    A list is comma separated, for example "idle=30,hold=0.5". Each
+    option describes its names in a table: where a value goes, what it
+    is multiplied by to get the unit the server keeps, and the range it
+    must lie in as given. Names may come in any order and any number of
+    times, the last one counts.
+*/
+
+struct spec_name {
+    const char* name;
+    uint32_t* value;        // set to the value times scale, rounded down,
+    double* real;           // or this, if value is NULL
+    double scale;
+    double min, max;        // as given, before scaling
+};
+
+/*
+    Apply spec to the n names of table. Return false if a name is not in
+    it or its value is not a number in range; pairs before that are kept.
+*/
+bool spec_parse(const char* spec, const struct spec_name* table, size_t n)
+{
+    while (*spec) {
+        const char* eq = strchr(spec, '=');
+        if (!eq)
+            return false;
+        size_t i = 0;
+        while (i < n && (strlen(table[i].name) != (size_t)(eq - spec) || strncmp(table[i].name, spec, eq - spec)))
+            i++;
+        if (i == n)
+            return false;
+        const struct spec_name* t = &table[i];
+        char* end;
+        double value = strtod(eq + 1, &end);
+        if (end == eq + 1 || !(value >= t->min && value <= t->max) || (*end && *end != ',')
+            || (t->value && value * t->scale > UINT32_MAX))
+            return false;
+        if (t->value)
+            *t->value = value * t->scale;
+        else
+            *t->real = value * t->scale;
+        spec = *end ? end + 1 : end;
+    }
+    return true;
+}
+#endif
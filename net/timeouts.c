@@ -0,0 +1,58 @@
+#ifndef HTTPD_TIMEOUTS
+#define HTTPD_TIMEOUTS
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "spec.c"
+
+/*
+    Connection timeouts, in milliseconds, set with share -t.
+
+    header  a complete request head must arrive within this time of its
+            first byte, or of the accept for the first request, so a
+            client trickling bytes cannot hold a connection (slowloris)
+    idle    a kept-alive connection is closed if no next request starts
+            within this time of the last response
+    send    a write to a client may make no progress for this long
+    hold    after a response the child waits this long for the next
+            request before handing the connection back to the main
+            process, which parks it until the idle timeout
+
+    There is no separate body timeout: the body of a POST ?delta is read
+    under the header timeout, counted afresh for every read, so a body
+    may take longer than it as a whole but must not stall for as long
+    (see read_body()).
+*/
+
+struct timeouts {
+    uint32_t header;
+    uint32_t idle;
+    uint32_t send;
+    uint32_t hold;
+};
+
+struct timeouts timeouts = {
+    .header = 10000,
+    .idle = 10000,
+    .send = 60000,
+    .hold = 200,
+};
+
+/*
+    Apply the pairs of share -t, for example "idle=30,hold=0.5", each in
+    seconds up to a day. Return false if the list is malformed; timeouts
+    set before the error are kept.
+*/
+bool timeouts_parse(const char* spec)
+{
+    static const struct spec_name names[] = {
+        {"header",  &timeouts.header,   NULL,   1000,   0,  86400},
+        {"idle",    &timeouts.idle,     NULL,   1000,   0,  86400},
+        {"send",    &timeouts.send,     NULL,   1000,   0,  86400},
+        {"hold",    &timeouts.hold,     NULL,   1000,   0,  86400},
+    };
+    return spec_parse(spec, names, sizeof(names) / sizeof(names[0]));
+}
+#endif
@@ -0,0 +1,554 @@
+#ifndef HTTPD_URING
+#define HTTPD_URING
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <sys/types.h>
+
+/*
+    io_uring backend, built with make URING=1 and used if the kernel
+    supports what it needs (uring_detect()); share -U off turns it off.
+
+    The main process accepts with a single multishot accept: the ring's
+    descriptor sits in epoll in place of the listening socket, and every
+    accepted connection arrives as a completion, without accept() calls.
+
+    A child sets up its own ring once it has served a request and the
+    connection stays open, or when it is to send a file of at least
+    URING_MIN_FILE bytes; setting one up costs about as much as serving a
+    small request, so a connection closed after one small response never
+    pays for it. The connection is a registered file. Requests are then
+    read with a recv that picks one of the provided buffers, linked to a
+    timeout for the header or idle deadline, one system call where poll()
+    and read() took two. Files are opened into a registered slot and sent
+    in chains of registered-buffer reads each linked to the send of its
+    chunk, URING_BUFS chunks per io_uring_enter(). The chunk header is
+    written in front of the buffer and the trailer behind it, so each
+    chunk is one send. A short read breaks the chain, which cancels the
+    rest, so a file that shrinks fails the response as before.
+
+    The rings are driven with raw system calls, there is no liburing
+    dependency. Without SHARE_URING the functions are stubs and
+    uring_enabled stays false.
+*/
+
+/* Set by uring_detect(). */
+bool uring_enabled;
+
+#ifdef SHARE_URING
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+#include "shaper.c"
+#include "timeouts.c"
+
+#define URING_CHUNK             65536
+#define URING_BUFS              4
+#define URING_PREFIX            16          // room for a chunk header in front of the data
+#define URING_STRIDE            (URING_PREFIX + URING_CHUNK + 2)
+#define URING_RECV_BUFS         2
+#define URING_RECV_SIZE         16384
+#define URING_RECV_GROUP        1
+#define URING_MIN_FILE          (2 * URING_CHUNK)
+#define URING_SOCKET_SLOT       0
+#define URING_FILE_SLOT         1
+#define URING_ENTRIES           32          // a batch of sends takes 1 + 3 * URING_BUFS
+#define URING_ACCEPT_CQ         1024        // accepted connections the main process has not taken yet
+
+/* user_data of the requests a child submits. */
+enum {
+    UD_PROVIDE,
+    UD_RECV,
+    UD_OPEN,
+    UD_READ,
+    UD_SEND,
+    UD_TIMEOUT,
+};
+
+struct uring {
+    int fd;
+    unsigned sq_entries;
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* sq_flags;
+    struct io_uring_sqe* sqes;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_cqe* cqes;
+    unsigned queued;            // requests filled in since the last submit
+    void* ring;
+    size_t ring_len;
+    size_t sqes_len;
+};
+
+/* Set up ring r with entries submission entries and, if cq_entries is not 0, that many completion entries. */
+static
+bool uring_setup(struct uring* r, unsigned entries, unsigned cq_entries)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    if (cq_entries) {
+        p.flags = IORING_SETUP_CQSIZE;
+        p.cq_entries = cq_entries;
+    }
+    r->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0)
+        return false;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        close(r->fd);
+        r->fd = -1;
+        return false;
+    }
+
+    size_t sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->ring_len = sq_len > cq_len ? sq_len : cq_len;
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->ring = mmap(NULL, r->ring_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->ring == MAP_FAILED || r->sqes == MAP_FAILED) {
+        if (r->ring != MAP_FAILED)
+            munmap(r->ring, r->ring_len);
+        if (r->sqes != MAP_FAILED)
+            munmap(r->sqes, r->sqes_len);
+        close(r->fd);
+        r->fd = -1;
+        return false;
+    }
+
+    char* q = r->ring;
+    r->sq_entries = p.sq_entries;
+    r->sq_head = (unsigned*)(q + p.sq_off.head);
+    r->sq_tail = (unsigned*)(q + p.sq_off.tail);
+    r->sq_mask = (unsigned*)(q + p.sq_off.ring_mask);
+    r->sq_array = (unsigned*)(q + p.sq_off.array);
+    r->sq_flags = (unsigned*)(q + p.sq_off.flags);
+    r->cq_head = (unsigned*)(q + p.cq_off.head);
+    r->cq_tail = (unsigned*)(q + p.cq_off.tail);
+    r->cq_mask = (unsigned*)(q + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)(q + p.cq_off.cqes);
+    r->queued = 0;
+    return true;
+}
+
+static
+void uring_close(struct uring* r)
+{
+    if (r->fd < 0)
+        return;
+    munmap(r->ring, r->ring_len);
+    munmap(r->sqes, r->sqes_len);
+    close(r->fd);
+    r->fd = -1;
+}
+
+/* A cleared submission entry, NULL if the queue is full. */
+static
+struct io_uring_sqe* uring_sqe(struct uring* r)
+{
+    unsigned tail = *r->sq_tail + r->queued;
+    if (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) >= r->sq_entries)
+        return NULL;
+    unsigned i = tail & *r->sq_mask;
+    struct io_uring_sqe* sqe = &r->sqes[i];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_array[i] = i;
+    r->queued++;
+    return sqe;
+}
+
+/* Submit the queued entries and wait until wait completions are ready. */
+static
+int uring_submit(struct uring* r, unsigned wait)
+{
+    unsigned n = r->queued;
+    __atomic_store_n(r->sq_tail, *r->sq_tail + n, __ATOMIC_RELEASE);
+    r->queued = 0;
+    unsigned flags = wait ? IORING_ENTER_GETEVENTS : 0;
+    int ret = syscall(__NR_io_uring_enter, r->fd, n, wait, flags, NULL, 0);
+    /* Interrupted while waiting, the entries were submitted. */
+    while (ret < 0 && errno == EINTR)
+        ret = syscall(__NR_io_uring_enter, r->fd, 0, wait, flags, NULL, 0);
+    return ret;
+}
+
+/* The oldest completion, NULL if there is none; release it with uring_seen(). */
+static
+struct io_uring_cqe* uring_cqe(struct uring* r)
+{
+    unsigned head = *r->cq_head;
+    if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+        /*
+            Completions that found the queue full wait in the kernel,
+            which keeps the ring readable; they are only moved to the
+            queue by io_uring_enter().
+        */
+        if (!(__atomic_load_n(r->sq_flags, __ATOMIC_ACQUIRE) & IORING_SQ_CQ_OVERFLOW)
+            || syscall(__NR_io_uring_enter, r->fd, 0, 0, IORING_ENTER_GETEVENTS, NULL, 0) < 0
+            || head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+            return NULL;
+    }
+    return &r->cqes[head & *r->cq_mask];
+}
+
+static inline
+void uring_seen(struct uring* r)
+{
+    __atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/* Whether the kernel has everything the backend uses. Sets uring_enabled. */
+bool uring_detect(void)
+{
+    static const int needed[] = {
+        IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND, IORING_OP_READ_FIXED,
+        IORING_OP_LINK_TIMEOUT, IORING_OP_PROVIDE_BUFFERS, IORING_OP_OPENAT,
+        IORING_OP_SOCKET,       // 5.19, which brought multishot accept
+    };
+    struct uring r;
+    if (!uring_setup(&r, 4, 0))
+        return uring_enabled = false;
+    size_t size = sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe* probe = calloc(1, size);
+    bool ok = probe && syscall(__NR_io_uring_register, r.fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) == 0;
+    for (size_t i = 0; ok && i < sizeof(needed) / sizeof(needed[0]); i++)
+        ok = needed[i] < probe->ops_len && (probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    uring_close(&r);
+    return uring_enabled = ok;
+}
+
+/* The main process's accept ring. */
+static struct uring accept_ring = {.fd = -1};
+static int accept_listen_fd = -1;
+
+static
+bool uring_arm_accept(void)
+{
+    struct io_uring_sqe* sqe = uring_sqe(&accept_ring);
+    if (!sqe)
+        return false;
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = accept_listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    return uring_submit(&accept_ring, 0) >= 0;
+}
+
+/* Accept on listening socket s with a multishot accept. Return the descriptor to wait on, -1 on failure. */
+int uring_accept_start(int s)
+{
+    if (!uring_enabled || !uring_setup(&accept_ring, 8, URING_ACCEPT_CQ))
+        return -1;
+    accept_listen_fd = s;
+    if (!uring_arm_accept()) {
+        uring_close(&accept_ring);
+        return -1;
+    }
+    return accept_ring.fd;
+}
+
+void uring_accept_stop(void)
+{
+    uring_close(&accept_ring);
+}
+
+/*
+    The next accepted connection, or -1 with errno EAGAIN if there is
+    none yet, EINVAL if multishot accept turned out to be unsupported,
+    in which case the ring is closed and the caller must accept itself,
+    or the error accept() failed with.
+*/
+int uring_accept_next(void)
+{
+    struct io_uring_cqe* cqe = uring_cqe(&accept_ring);
+    if (!cqe) {
+        errno = EAGAIN;
+        return -1;
+    }
+    int res = cqe->res;
+    bool more = cqe->flags & IORING_CQE_F_MORE;
+    uring_seen(&accept_ring);
+    if (res == -EINVAL) {
+        uring_accept_stop();
+        errno = EINVAL;
+        return -1;
+    }
+    /* The kernel ends a multishot accept on errors such as EMFILE. */
+    if (!more && !uring_arm_accept()) {
+        uring_accept_stop();
+        errno = EINVAL;
+        return -1;
+    }
+    if (res < 0) {
+        errno = -res;
+        return -1;
+    }
+    return res;
+}
+
+/* A child's ring, with its buffers. */
+static struct uring conn_ring = {.fd = -1};
+static char* conn_bufs;                 // URING_BUFS registered buffers, then the provided ones
+
+static
+char* uring_recv_buf(unsigned bid)
+{
+    return conn_bufs + URING_BUFS * URING_STRIDE + bid * URING_RECV_SIZE;
+}
+
+static
+void uring_provide(unsigned bid, unsigned n)
+{
+    struct io_uring_sqe* sqe = uring_sqe(&conn_ring);
+    if (!sqe)
+        return;
+    sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+    sqe->fd = n;
+    sqe->addr = (uintptr_t) uring_recv_buf(bid);
+    sqe->len = URING_RECV_SIZE;
+    sqe->buf_group = URING_RECV_GROUP;
+    sqe->off = bid;
+    sqe->user_data = UD_PROVIDE;
+}
+
+/*
+    Set up the ring of this child for connection c, if it has none yet.
+    Return false if the backend is off or setting up fails; the child
+    then stays with plain system calls.
+*/
+bool uring_conn_open(int c)
+{
+    if (conn_ring.fd >= 0)
+        return true;
+    if (!uring_enabled)
+        return false;
+    size_t len = URING_BUFS * URING_STRIDE + URING_RECV_BUFS * URING_RECV_SIZE;
+    conn_bufs = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (conn_bufs == MAP_FAILED || !uring_setup(&conn_ring, URING_ENTRIES, 0))
+        goto fail;
+
+    struct iovec iov[URING_BUFS];
+    for (int i = 0; i < URING_BUFS; i++) {
+        iov[i].iov_base = conn_bufs + i * URING_STRIDE;
+        iov[i].iov_len = URING_STRIDE;
+    }
+    int files[2] = {c, -1};
+    if (syscall(__NR_io_uring_register, conn_ring.fd, IORING_REGISTER_BUFFERS, iov, URING_BUFS) < 0
+        || syscall(__NR_io_uring_register, conn_ring.fd, IORING_REGISTER_FILES, files, 2) < 0)
+        goto fail;
+
+    uring_provide(0, URING_RECV_BUFS);
+    if (uring_submit(&conn_ring, 1) < 0)
+        goto fail;
+    struct io_uring_cqe* cqe = uring_cqe(&conn_ring);
+    bool provided = cqe && cqe->res >= 0;
+    if (cqe)
+        uring_seen(&conn_ring);
+    if (provided)
+        return true;
+
+fail:
+    uring_close(&conn_ring);
+    if (conn_bufs != MAP_FAILED)
+        munmap(conn_bufs, len);
+    conn_bufs = NULL;
+    uring_enabled = false;
+    return false;
+}
+
+bool uring_conn_active(void)
+{
+    return conn_ring.fd >= 0;
+}
+
+/* Limit the request before to ms; link continues the chain past it. */
+static
+void uring_link_timeout(struct __kernel_timespec* ts, uint32_t ms, bool link)
+{
+    ts->tv_sec = ms / 1000;
+    ts->tv_nsec = ms % 1000 * 1000000LL;
+    struct io_uring_sqe* sqe = uring_sqe(&conn_ring);
+    sqe->opcode = IORING_OP_LINK_TIMEOUT;
+    sqe->flags = link ? IOSQE_IO_LINK : 0;
+    sqe->addr = (uintptr_t) ts;
+    sqe->len = 1;
+    sqe->user_data = UD_TIMEOUT;
+}
+
+/*
+    Read up to cap bytes from the connection into buf, waiting at most
+    timeout_ms. Return the number read, 0 at the end of the stream or on
+    timeout (then *timed_out is set) and -1 on errors, like poll() and
+    read() in read_request().
+*/
+ssize_t uring_recv(char* buf, size_t cap, uint32_t timeout_ms, bool* timed_out)
+{
+    struct io_uring_sqe* sqe = uring_sqe(&conn_ring);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = URING_SOCKET_SLOT;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT | IOSQE_IO_LINK;
+    sqe->len = cap < URING_RECV_SIZE ? cap : URING_RECV_SIZE;
+    sqe->buf_group = URING_RECV_GROUP;
+    sqe->user_data = UD_RECV;
+    struct __kernel_timespec ts;
+    uring_link_timeout(&ts, timeout_ms, false);
+
+    *timed_out = false;
+    ssize_t n = -1;
+    int expected = 2;
+    while (expected > 0) {
+        if (uring_submit(&conn_ring, 1) < 0)
+            return -1;
+        struct io_uring_cqe* cqe;
+        while ((cqe = uring_cqe(&conn_ring))) {
+            if (cqe->user_data == UD_RECV) {
+                n = cqe->res;
+                if (n > 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+                    unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+                    memcpy(buf, uring_recv_buf(bid), n);
+                    uring_provide(bid, 1);
+                } else if (n == -ECANCELED) {
+                    *timed_out = true;
+                    n = 0;
+                } else if (n < 0) {
+                    errno = -n;
+                    n = -1;
+                }
+                expected--;
+            } else if (cqe->user_data == UD_TIMEOUT)
+                expected--;
+            uring_seen(&conn_ring);
+        }
+    }
+    return n;
+}
+
+/*
+    Send the file at path, size bytes long, on the connection as the
+    chunks of a chunked response, leaving out the last one. Return false
+    if anything fails.
+*/
+bool uring_send_file(const char* path, off_t size)
+{
+    struct io_uring_sqe* sqe = uring_sqe(&conn_ring);
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uintptr_t) path;
+    sqe->open_flags = O_RDONLY;         // O_CLOEXEC is refused for a registered slot
+    sqe->file_index = URING_FILE_SLOT + 1;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = UD_OPEN;
+    int expected = 1;
+
+    struct __kernel_timespec ts[URING_BUFS];
+    size_t lens[URING_BUFS];
+    off_t off = 0;
+    while (off < size) {
+        size_t bytes = 0;
+        int chunks = 0;
+        for (; chunks < URING_BUFS && off < size; chunks++) {
+            size_t n = size - off < URING_CHUNK ? size - off : URING_CHUNK;
+            char* base = conn_bufs + chunks * URING_STRIDE;
+            char head[URING_PREFIX];
+            int head_len = snprintf(head, sizeof(head), "%zx\r\n", n);
+            memcpy(base + URING_PREFIX - head_len, head, head_len);
+            memcpy(base + URING_PREFIX + n, "\r\n", 2);
+            lens[chunks] = head_len + n + 2;
+
+            sqe = uring_sqe(&conn_ring);
+            sqe->opcode = IORING_OP_READ_FIXED;
+            sqe->fd = URING_FILE_SLOT;
+            sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+            sqe->addr = (uintptr_t)(base + URING_PREFIX);
+            sqe->len = n;
+            sqe->off = off;
+            sqe->buf_index = chunks;
+            sqe->user_data = UD_READ;
+
+            sqe = uring_sqe(&conn_ring);
+            sqe->opcode = IORING_OP_SEND;
+            sqe->fd = URING_SOCKET_SLOT;
+            sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+            sqe->addr = (uintptr_t)(base + URING_PREFIX - head_len);
+            sqe->len = lens[chunks];
+            sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+            sqe->user_data = UD_SEND | (uint64_t) chunks << 8;
+
+            off += n;
+            /* The chain goes on to the next chunk, unless this is the last of the batch. */
+            uring_link_timeout(&ts[chunks], timeouts.send, chunks + 1 < URING_BUFS && off < size);
+            bytes += lens[chunks];
+            expected += 3;
+        }
+
+        /* Wait for the bandwidth of the whole batch, see net/shaper.c. */
+        for (size_t granted = 0; granted < bytes; )
+            granted += shaper_acquire(bytes - granted);
+
+        bool ok = true;
+        while (expected > 0) {
+            if (uring_submit(&conn_ring, 1) < 0)
+                return false;
+            struct io_uring_cqe* cqe;
+            while ((cqe = uring_cqe(&conn_ring))) {
+                uint64_t kind = cqe->user_data & 0xff;
+                int res = cqe->res;
+                if (kind == UD_SEND) {
+                    if (res > 0)
+                        access_sent(res);
+                    ok = ok && res == (int) lens[cqe->user_data >> 8];
+                } else if (kind == UD_TIMEOUT) {
+                    if (res == -ETIME)
+                        metrics_timeout(MT_SEND);
+                } else if (kind != UD_PROVIDE)
+                    ok = ok && res >= 0;
+                if (kind != UD_PROVIDE)
+                    expected--;
+                uring_seen(&conn_ring);
+            }
+        }
+        if (!ok)
+            return false;
+    }
+    return true;
+}
+
+#else
+
+#define URING_MIN_FILE          0
+
+static inline bool uring_detect(void) { return false; }
+static inline int uring_accept_start(int s) { (void) s; return -1; }
+static inline void uring_accept_stop(void) {}
+static inline int uring_accept_next(void) { errno = EINVAL; return -1; }
+static inline bool uring_conn_open(int c) { (void) c; return false; }
+static inline bool uring_conn_active(void) { return false; }
+
+static inline
+ssize_t uring_recv(char* buf, size_t cap, uint32_t timeout_ms, bool* timed_out)
+{
+    (void) buf; (void) cap; (void) timeout_ms; (void) timed_out;
+    return -1;
+}
+
+static inline
+bool uring_send_file(const char* path, off_t size)
+{
+    (void) path; (void) size;
+    return false;
+}
+
+#endif
+#endif
@@ -0,0 +1,190 @@
+#ifndef HTTPD_WHEEL
+#define HTTPD_WHEEL
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+    Hierarchical timing wheel.
+
+    Time is counted in ticks of WHEEL_TICK_MS. Level 0 has a slot for
+    each of the next WHEEL_SLOTS ticks, and every level above covers
+    WHEEL_SLOTS times the span of the one below with slots as wide as
+    the whole level below. A timer goes into the level whose span holds
+    its expiry. Whenever level 0 wraps around, the current slot of the
+    next level is cascaded: its timers are added again and so move down
+    a level. Adding and removing a timer costs O(1), and so does firing
+    one, apart from the at most WHEEL_LEVELS - 1 times it is cascaded.
+
+    Timers are embedded in their owner's structure and linked into
+    circular lists, so the wheel never allocates. wheel_next() tells how
+    long the caller can sleep: a wheel holding only distant timers wakes
+    up when a slot of an upper level is cascaded, not per timer.
+*/
+
+#define WHEEL_TICK_MS           10
+#define WHEEL_BITS              6
+#define WHEEL_SLOTS             (1 << WHEEL_BITS)
+#define WHEEL_LEVELS            4
+#define WHEEL_MAX_TICKS         (((uint64_t) 1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+struct timer {
+    struct timer* next;
+    struct timer* prev;
+    uint64_t expires;           // tick
+};
+
+struct wheel {
+    uint64_t now;               // next tick to process
+    size_t count;
+    struct timer slots[WHEEL_LEVELS][WHEEL_SLOTS];
+};
+
+static inline
+void timer_init(struct timer* t)
+{
+    t->next = t->prev = t;
+}
+
+static inline
+bool timer_pending(const struct timer* t)
+{
+    return t->next != t;
+}
+
+void wheel_init(struct wheel* w, uint64_t now)
+{
+    w->now = now;
+    w->count = 0;
+    for (int l = 0; l < WHEEL_LEVELS; l++)
+        for (int s = 0; s < WHEEL_SLOTS; s++)
+            timer_init(&w->slots[l][s]);
+}
+
+static
+void wheel_link(struct wheel* w, struct timer* t)
+{
+    uint64_t delta = t->expires - w->now;
+    int l = 0;
+    while (l < WHEEL_LEVELS - 1 && delta >= (uint64_t) 1 << (WHEEL_BITS * (l + 1)))
+        l++;
+    struct timer* head = &w->slots[l][(t->expires >> (WHEEL_BITS * l)) & (WHEEL_SLOTS - 1)];
+    t->prev = head->prev;
+    t->next = head;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+static inline
+void timer_unlink(struct timer* t)
+{
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    timer_init(t);
+}
+
+/* Arm t to fire at tick expires, or at the next tick if that has passed. */
+void wheel_add(struct wheel* w, struct timer* t, uint64_t expires)
+{
+    if (timer_pending(t))
+        timer_unlink(t);
+    else
+        w->count++;
+    if (expires < w->now)
+        expires = w->now;
+    if (expires - w->now > WHEEL_MAX_TICKS)
+        expires = w->now + WHEEL_MAX_TICKS;
+    t->expires = expires;
+    wheel_link(w, t);
+}
+
+void wheel_del(struct wheel* w, struct timer* t)
+{
+    if (!timer_pending(t))
+        return;
+    timer_unlink(t);
+    w->count--;
+}
+
+/* Add the timers of slot s of level l again, which moves them down. */
+static
+void wheel_cascade(struct wheel* w, int l, int s)
+{
+    struct timer list = w->slots[l][s];
+    if (list.next == &w->slots[l][s])
+        return;
+    /* Detach the whole slot first, relinking may put timers back into it. */
+    list.next->prev = &list;
+    list.prev->next = &list;
+    timer_init(&w->slots[l][s]);
+    while (list.next != &list) {
+        struct timer* t = list.next;
+        timer_unlink(t);
+        wheel_link(w, t);
+    }
+}
+
+/*
+    Process every tick up to and including now, calling fire() for each
+    expired timer after removing it from the wheel. fire() may add and
+    delete timers. Return the number of timers fired.
+*/
+size_t wheel_advance(struct wheel* w, uint64_t now, void (*fire)(struct timer* t, void* arg), void* arg)
+{
+    size_t fired = 0;
+    if (w->count == 0) {
+        if (now >= w->now)
+            w->now = now + 1;
+        return 0;
+    }
+    while (w->now <= now) {
+        int s = w->now & (WHEEL_SLOTS - 1);
+        for (int l = 1; s == 0 && l < WHEEL_LEVELS; l++) {
+            s = (w->now >> (WHEEL_BITS * l)) & (WHEEL_SLOTS - 1);
+            wheel_cascade(w, l, s);
+        }
+        struct timer* head = &w->slots[0][w->now & (WHEEL_SLOTS - 1)];
+        while (head->next != head) {
+            struct timer* t = head->next;
+            timer_unlink(t);
+            w->count--;
+            fired++;
+            fire(t, arg);
+        }
+        w->now++;
+        if (w->count == 0 && now >= w->now) {
+            w->now = now + 1;
+            break;
+        }
+    }
+    return fired;
+}
+
+/*
+    Earliest tick at which wheel_advance() may have something to do, a
+    lower bound for timers on the upper levels. UINT64_MAX if the wheel
+    is empty.
+*/
+uint64_t wheel_next(const struct wheel* w)
+{
+    if (w->count == 0)
+        return UINT64_MAX;
+    uint64_t next = UINT64_MAX;
+    for (int l = 0; l < WHEEL_LEVELS; l++) {
+        int shift = WHEEL_BITS * l;
+        uint64_t pos = w->now >> shift;
+        /* The current slot of an upper level comes round again after a full turn, unless now is on its edge. */
+        int first = l == 0 || (w->now & (((uint64_t) 1 << shift) - 1)) == 0 ? 0 : 1;
+        for (int k = first; k < WHEEL_SLOTS + first; k++) {
+            const struct timer* head = &w->slots[l][(pos + k) & (WHEEL_SLOTS - 1)];
+            if (head->next == head)
+                continue;
+            uint64_t at = l == 0 ? w->now + k : (pos + k) << shift;
+            next = at < next ? at : next;
+            break;
+        }
+    }
+    return next;
+}
+#endif
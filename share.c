@@ -12,20 +12,42 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <unistd.h>
 #include <string.h>
 #include <stdlib.h>
 #include <signal.h>
 #include <sys/errno.h>
+#include <sys/epoll.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <fcntl.h>
 #include <stdbool.h>
 #include <ctype.h>
 
 /* Custom libraries */
 #include "logger/logger.c"
+#include "logger/metrics.c"
+#include "logger/capture.c"
 #include "helpers/helpers.c"
 #include "helpers/safe_string.h"
 #include "helpers/template.c"
-#include "htable/htable.c"
+#include "helpers/assets.c"
+#include "helpers/hashdb.c"
+#include "helpers/delta.c"
+#include "helpers/journal.c"
+#include "helpers/search.c"
+#include "htable/headers.c"
+#include "net/wheel.c"
+#include "net/timeouts.c"
+#include "net/handoff.c"
+#include "net/events.c"
+#include "net/follow.c"
+#include "net/admission.c"
+#include "net/uring.c"
 
 /* Definitions */
 #define LOCALHOST              "127.0.0.1"
@@ -34,20 +56,33 @@
 #define URI_SIZE                8000
 #define VERSION_SIZE            9
 #define MAX_REQUEST_SIZE        16384
-#define SECONDS_TO_WAIT         10
 #define SIMPLE_RESPONSE_SIZE    256
-#define PATH_TO_TEMPLATE_DIR    "static" // make sure it does not end with '/'
-#define TEMPLATE_FILE_NAME      "template.html"
+#define MAX_UNKNOWN_HEADERS     64
+#define MIME_TYPES_FILE         "/etc/mime.types" // NULL to use the built-in types only
+#define MAX_EVENTS              64
+#define LISTEN_BACKLOG          128
 
 #define OK                      200
+#define NOT_MODIFIED            304
 #define BAD_REQUEST             400
 #define NOT_FOUND               404
+#define METHOD_NOT_ALLOWED      405
+#define REQUEST_TIMEOUT         408
+#define LENGTH_REQUIRED         411
+#define PAYLOAD_TOO_LARGE       413
 #define URI_TOO_LONG            414
 #define INTERNAL_SERVER_ERROR   500
 #define NOT_IMPLEMENTED         501
+#define SERVICE_UNAVAILABLE     503
 #define VERSION_NOT_SUPPORTED   505
 
 #define NOTHING_TO_READ         600
+#define IDLE                    601
+
+/* Special content lengths for make_response_head(). */
+#define CHUNKED                 -1
+#define NO_BODY                 -2
+#define UNTIL_CLOSE             -3      // the body ends when the connection does
 
 #define SET_STATUS(request, code, error) \
     do { \
@@ -57,13 +92,31 @@
     } while (0)
 
 /* Structures */
+struct HeaderField
+{
+    slice name;
+    slice value;
+};
+
+/*
+    Header values are slices into the request buffer and stay valid
+    until the next request is read into it. Known fields are indexed
+    by header_id, anything else is only kept in 'unknown'.
+*/
 struct Request 
 {
     string method;
     string uri;
+    string query;
     string version;
     bool valid;
     size_t status_code;
+    slice headers[HEADER_COUNT];
+    struct HeaderField unknown[MAX_UNKNOWN_HEADERS];
+    size_t n_unknown;
+    uint8_t handoff;            // how the connection goes to the main process after ?events or ?follow
+    uint64_t since;             // the last journal version or the bytes of the file sent, see struct handoff
+    int file;                   // the file of ?follow
 };
 
 /* Global error variable */
@@ -93,9 +146,9 @@ int init_server(const char* ip, const int port)
         return 0;
     }
 
-    // A queue of incoming connections of size 128.
-    // There is a hard limit of 128.
-    if (listen(s, 128)) {
+    // A queue of incoming connections of size LISTEN_BACKLOG.
+    // How full it is feeds admission control, see net/admission.c.
+    if (listen(s, LISTEN_BACKLOG)) {
         close(s);
         error_desc = "listen() error";
         return 0;
@@ -105,10 +158,9 @@ int init_server(const char* ip, const int port)
     return s;
 }
 
-/* Accept a client and get their ip address. */
-int accept_client(const int s, char client_ip[INET_ADDRSTRLEN])
+/* Get the ip address of accepted client c and set it up. Return false on errors. */
+bool setup_client(const int c, char client_ip[INET_ADDRSTRLEN])
 {
-    int c;
     struct sockaddr_in cli;
     socklen_t addrlen;
 
@@ -116,48 +168,171 @@ int accept_client(const int s, char client_ip[INET_ADDRSTRLEN])
     memset(client_ip, 0, INET_ADDRSTRLEN);
     addrlen = sizeof(cli);
 
-    c = accept(s, (struct sockaddr*) &cli, &addrlen);
-    if (c < 0) {
-        error_desc = "accept() error";
-        return 0;
-    }
-
     if (getpeername(c, (struct sockaddr*)&cli, &addrlen) < 0) {
         error_desc = "getpeername() error";
-        return 0;
+        return false;
     }
     
     if (inet_ntop(AF_INET, &cli.sin_addr, client_ip, INET_ADDRSTRLEN) == NULL) {
         error_desc = "inet_ntop() error";
-        return 0;
+        return false;
     }
 
+    /*
+        Responses are written in several pieces. With Nagle's algorithm
+        the last one waits for the client's delayed ACK, about 40ms.
+    */
+    int one = 1;
+    setsockopt(c, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return true;
+}
+
+/* Accept a client and get their ip address. */
+int accept_client(const int s, char client_ip[INET_ADDRSTRLEN])
+{
+    int c = accept(s, NULL, NULL);
+    if (c < 0) {
+        error_desc = "accept() error";
+        return 0;
+    }
+    if (!setup_client(c, client_ip)) {
+        close(c);
+        return 0;
+    }
     return c;
 }
 
-void read_request(const int c, struct Request* request, string buffer)
+/* Offset just past the "\r\n\r\n" ending the request head, or -1. */
+static
+ssize_t head_end(string buffer)
 {
-    fd_set rfds;
-    ssize_t len = 0;
-    struct timeval tv = {.tv_sec = SECONDS_TO_WAIT, .tv_usec = 0};
+    size_t skip = 0;
+    size_t len = sgetlen(buffer);
+    while (skip < len && (buffer[skip] == '\r' || buffer[skip] == '\n'))
+        skip++;
+    char* p = buffer + skip;
+    while ((p = memchr(p, '\r', buffer + len - p)) && buffer + len - p >= 4) {
+        if (memcmp(p, "\r\n\r\n", 4) == 0)
+            return p + 4 - buffer;
+        p++;
+    }
+    return -1;
+}
 
-    FD_ZERO(&rfds);
-    FD_SET(c, &rfds);
-    /* 
-        The select function waits for the client to send 
-        data at most for SECONDS_TO_WAIT seconds. 
-    */
-    int ret = select(c + 1, &rfds, 0, 0, &tv);
+/* Milliseconds from now until the monotonic time deadline, see access_now(). */
+static
+int ms_until(uint64_t deadline)
+{
+    uint64_t now = access_now();
+    return deadline > now ? (deadline - now + 999999) / 1000000 : 0;
+}
+
+/*
+    Wait until c is readable, at most until the monotonic time deadline,
+    and read up to cap bytes into buf. Return the number read, 0 at the
+    end of the stream or on timeout (then *timed_out is set) and -1 on
+    errors.
+*/
+static
+ssize_t recv_some(int c, char* buf, size_t cap, uint64_t deadline, bool* timed_out)
+{
+    if (uring_conn_active())
+        return uring_recv(buf, cap, ms_until(deadline), timed_out);
+    struct pollfd pfd = {.fd = c, .events = POLLIN};
+    int ret = poll(&pfd, 1, ms_until(deadline));
+    *timed_out = ret == 0;
+    return ret > 0 ? read(c, buf, cap) : ret;
+}
+
+/*
+    Read until buffer holds a complete request head. Bytes that arrive
+    after it belong to pipelined requests; they are moved to pending and
+    read from there first by the next call.
+
+    Times are monotonic, see access_now(). head_start is when the head
+    started arriving, or 0 if no byte of it has arrived yet; then the
+    first one is awaited until idle_deadline. The whole head must arrive
+    within the header timeout of head_start.
+*/
+void read_request(const int c, struct Request* request, string buffer, string pending,
+                  uint64_t head_start, uint64_t idle_deadline)
+{
+    size_t len = sgetlen(pending);
+    memcpy(buffer, pending, len);
+    buffer[len] = 0;
+    supdatelen(buffer, len);
+    supdatelen(pending, 0);
+    if (len > 0) {
+        if (!head_start)
+            access_restart(head_start = access_now());
+        access_mark(AS_READ);
+    }
 
-    if (ret > 0 && FD_ISSET(c, &rfds)) {
-        memset(buffer, 0, MAX_REQUEST_SIZE);
-        len = read(c, buffer, MAX_REQUEST_SIZE);
-        supdatelen(buffer, (size_t) len);
+    ssize_t end;
+    bool timed_out = false;
+    while ((end = head_end(buffer)) == -1 && len < MAX_REQUEST_SIZE) {
+        uint64_t deadline = head_start ? head_start + timeouts.header * 1000000ULL : idle_deadline;
+        ssize_t n = recv_some(c, buffer + len, MAX_REQUEST_SIZE - len, deadline, &timed_out);
+        if (n <= 0)
+            break;
+
+        if (!head_start)
+            access_restart(head_start = access_now());
+        access_mark(AS_READ);
+        metrics_received(n);
+        capture_data(buffer + len, n);
+        len += n;
+        buffer[len] = 0;
+        supdatelen(buffer, len);
     }
 
-    if (len <= 0)
+    if (len == 0 && timed_out) {
+        SET_STATUS(request, IDLE, "Idle\n");
+        return;
+    }
+    if (len == 0) {
         SET_STATUS(request, NOTHING_TO_READ, "Nothing to read\n");
-    return;
+        return;
+    }
+    if (end == -1 && timed_out) {
+        metrics_timeout(MT_HEADER);
+        SET_STATUS(request, REQUEST_TIMEOUT, "Request head timed out\n");
+        return;
+    }
+    /* An incomplete head is left to parse_request() to reject. */
+    if (end != -1 && (size_t) end < len) {
+        memcpy(pending, buffer + end, len - end);
+        supdatelen(pending, len - end);
+        buffer[end] = 0;
+        supdatelen(buffer, end);
+    }
+}
+
+/*
+    Read the len bytes of a request body into body, first those already
+    in pending. Each read must arrive within the header timeout.
+*/
+static
+bool read_body(int c, string pending, char* body, size_t len)
+{
+    size_t have = sgetlen(pending) < len ? sgetlen(pending) : len;
+    memcpy(body, pending, have);
+    memmove(pending, pending + have, sgetlen(pending) - have);
+    supdatelen(pending, sgetlen(pending) - have);
+    while (have < len) {
+        bool timed_out;
+        ssize_t n = recv_some(c, body + have, len - have, access_now() + timeouts.header * 1000000ULL, &timed_out);
+        if (n <= 0) {
+            if (timed_out)
+                metrics_timeout(MT_HEADER);
+            return false;
+        }
+        access_mark(AS_READ);
+        metrics_received(n);
+        capture_data(body + have, n);
+        have += n;
+    }
+    return true;
 }
 
 void parse_request_line(struct Request* request, string buffer)
@@ -169,6 +344,14 @@ void parse_request_line(struct Request* request, string buffer)
     slower(request->method = sbite(buffer, 1, " "));
     request->uri = sbite(buffer, 1, " ");
     slower(request->version = sbite(buffer, 2, "\r\n"));
+
+    /* The query is split off, the uri keeps the path only. */
+    ssize_t q = sfind(request->uri, 1, "?");
+    if (q != -1) {
+        request->query = snewlen(request->uri + q + 1, sgetlen(request->uri) - q - 1);
+        request->uri[q] = 0;
+        supdatelen(request->uri, q);
+    }
 }
 
 void check_request_line(struct Request* request)
@@ -180,8 +363,8 @@ void check_request_line(struct Request* request)
         SET_STATUS(request, BAD_REQUEST, "Method, uri or version is NULL\n");
         return;
     }
-    /* Only supports GET requests. */
-    if (strncmp(request->method, "get", 4) != 0) {
+    /* Only supports GET requests, and POST for ?delta, see check_uri(). */
+    if (strncmp(request->method, "get", 4) != 0 && strncmp(request->method, "post", 5) != 0) {
         SET_STATUS(request, NOT_IMPLEMENTED, "Unknown method\n");
         return;
     }
@@ -191,7 +374,7 @@ void check_request_line(struct Request* request)
     }
 }
 
-void parse_headers(struct Request* request, ht_htable* headers, string buffer)
+void parse_headers(struct Request* request, string buffer)
 {
     if (!request->valid)
         return;
@@ -202,55 +385,88 @@ void parse_headers(struct Request* request, ht_htable* headers, string buffer)
         return;
     }
     
-    string key;
-    string value;
-    while (*buffer != '\r') {
-        slower(key = sbite(buffer, 1, ":"));
-        if (!key || sendswith(key, 1, " ")) {
-            SET_STATUS(request, BAD_REQUEST, "Whitespace after field name\n");
+    char* p = buffer;
+    char* end = buffer + sgetlen(buffer);
+    while (p < end && *p != '\r') {
+        char* eol = memchr(p, '\r', end - p);
+        if (!eol || eol + 1 == end || eol[1] != '\n') {
+            SET_STATUS(request, BAD_REQUEST, "Field line is not terminated\n");
             return;
         }
-        strim((value = sbite(buffer, 2, "\r\n")), 2, " \t");
-        if (!value) {
-            sfree(key);
-            SET_STATUS(request, BAD_REQUEST, "Field value is NULL\n");
+        char* colon = memchr(p, ':', eol - p);
+        if (!colon || colon == p || isspace(colon[-1])) {
+            SET_STATUS(request, BAD_REQUEST, "Whitespace after field name\n");
             return;
         }
-        if (ht_search(headers, key)) {
-            SET_STATUS(request, BAD_REQUEST, "Duplicate headers\n");
-            return;
+
+        slice name = {p, colon - p};
+        char* v = colon + 1;
+        char* v_end = eol;
+        while (v < v_end && (*v == ' ' || *v == '\t'))
+            v++;
+        while (v_end > v && (v_end[-1] == ' ' || v_end[-1] == '\t'))
+            v_end--;
+        slice value = {v, v_end - v};
+
+        header_id id = header_lookup(name.ptr, name.len);
+        if (id != H_UNKNOWN) {
+            if (request->headers[id].ptr) {
+                SET_STATUS(request, BAD_REQUEST, "Duplicate headers\n");
+                return;
+            }
+            request->headers[id] = value;
+        } else {
+            if (request->n_unknown == MAX_UNKNOWN_HEADERS) {
+                SET_STATUS(request, BAD_REQUEST, "Too many headers\n");
+                return;
+            }
+            request->unknown[request->n_unknown].name = name;
+            request->unknown[request->n_unknown].value = value;
+            request->n_unknown++;
         }
-        ht_insert(headers, key, value);
-        sfree(key);
-        sfree(value);
+        p = eol + 2;
     }
+    if (p == end) {
+        SET_STATUS(request, BAD_REQUEST, "Headers are not terminated\n");
+        return;
+    }
+
+    /* After headers, there must only be '\r\n', nothing else. */
+    if (end - p > 2)
+        SET_STATUS(request, BAD_REQUEST, "Malicious payload\n");
 }
 
-void check_headers(struct Request* request, ht_htable* headers)
+void check_headers(struct Request* request)
 {
     if (!request->valid)
         return;
     
     /* Host header must be present. */
-    if (!ht_search(headers, "host")) {
+    if (!request->headers[H_HOST].ptr) {
         SET_STATUS(request, BAD_REQUEST, "No Host field\n");
         return;
     }
     /* The presence of a message body in a request is signaled by a 
-       Content-Length or Transfer-Encoding header field. */
-    if (ht_search(headers, "content-length") || ht_search(headers, "transfer-encoding")) {
+       Content-Length or Transfer-Encoding header field. Only a POST may
+       have one, and only with a Content-Length. */
+    bool post = !strncmp(request->method, "post", 5);
+    if (request->headers[H_TRANSFER_ENCODING].ptr || (!post && request->headers[H_CONTENT_LENGTH].ptr)) {
         SET_STATUS(request, BAD_REQUEST, "Body is present\n");
         return;
     }
+    if (post && !request->headers[H_CONTENT_LENGTH].ptr) {
+        SET_STATUS(request, LENGTH_REQUIRED, "No Content-Length field\n");
+        return;
+    }
 
     /* Connection header must be present. */
-    // if (!ht_search(headers, "connection")) {
+    // if (!request->headers[H_CONNECTION].ptr) {
     //     SET_STATUS(request, BAD_REQUEST, "Connection is not specified\n");
     //     return;
     // }
 }
 
-void parse_request(struct Request* request, ht_htable* headers, string buffer)
+void parse_request(struct Request* request, string buffer)
 {
     if (!request->valid)
         return;
@@ -260,20 +476,18 @@ void parse_request(struct Request* request, ht_htable* headers, string buffer)
     parse_request_line(request, buffer);
     check_request_line(request);
 
-    parse_headers(request, headers, buffer);
-    check_headers(request, headers);
-
-    /* After headers, there must only be '\r\n', nothing else. */
-    if (sgetlen(buffer) > 2)
-        SET_STATUS(request, BAD_REQUEST, "Malicious payload\n");
+    parse_headers(request, buffer);
+    check_headers(request);
 }
 
-/* 
-    Constructs a response line and headers according
-    to the given arguments and sends them to the client.
+/*
+    Constructs a response line and headers according to the given
+    arguments. extra holds additional header lines separated by "\r\n"
+    without a trailing one, or is NULL. content_length may be CHUNKED
+    NO_BODY or UNTIL_CLOSE. Return NULL if memory could not be allocated.
 */
-ssize_t send_simple_response(int c, size_t code, char* msg,
-                          char* content_type, char* connection, char* body, bool is_chunked)
+string make_response_head(size_t code, char* msg, char* content_type,
+                          char* connection, char* extra, ssize_t content_length)
 {
     char code_str[100];
     snprintf(code_str, sizeof(code_str), "%zu ", code);
@@ -287,45 +501,67 @@ ssize_t send_simple_response(int c, size_t code, char* msg,
 
     buffer = scat(buffer, 15, "\r\nServer: httpd");
 
-    buffer = scat(buffer, 16, "\r\nContent-type: ");
-    buffer = scat(buffer, strlen(content_type), content_type);
+    if (content_length != NO_BODY) {
+        buffer = scat(buffer, 16, "\r\nContent-type: ");
+        buffer = scat(buffer, strlen(content_type), content_type);
+    }
 
-    if (!is_chunked)
+    if (content_length >= 0)
     {
         buffer = scat(buffer, 18, "\r\nContent-Length: ");
-        snprintf(code_str, sizeof(code_str), "%zu", strlen(body));
+        snprintf(code_str, sizeof(code_str), "%zd", content_length);
         buffer = scat(buffer, strlen(code_str), code_str);
     }
-    else
+    else if (content_length == CHUNKED)
         buffer = scat(buffer, 28, "\r\nTransfer-Encoding: chunked");
 
     buffer = scat(buffer, 14, "\r\nConnection: ");
     buffer = scat(buffer, strlen(connection), connection);
 
+    if (extra) {
+        buffer = scat(buffer, 2, "\r\n");
+        buffer = scat(buffer, strlen(extra), extra);
+    }
+
     buffer = scat(buffer, 4, "\r\n\r\n");
+    return buffer;
+}
+
+/* 
+    Constructs a response line and headers according
+    to the given arguments and sends them to the client.
+*/
+ssize_t send_simple_response(int c, size_t code, char* msg,
+                          char* content_type, char* connection, char* body, bool is_chunked)
+{
+    string buffer = make_response_head(code, msg, content_type, connection, NULL,
+                                       is_chunked ? CHUNKED : (ssize_t) strlen(body));
     if (!is_chunked)
         buffer = scat(buffer, strlen(body), body);
+    if (!buffer)
+        return -1;
 
-    ssize_t ret = write(c, buffer, sgetlen(buffer));
+    ssize_t ret = write_all(c, buffer, sgetlen(buffer)) ? (ssize_t) sgetlen(buffer) : -1;
     sfree(buffer);
     return ret;
 }
 
-/* If URI points to a file, the specified file is sent. */
-void send_file(int c, struct Request* request)
+/*
+    The given file is sent in chunks. Large files go through the
+    io_uring backend if it is available, see net/uring.c.
+*/
+void send_file(int c, struct Request* request, const char* file_name)
 {
-    bool alloc = false;
-
-    string file_name = request->uri;
     if (send_simple_response(c, 200, "OK", getconttype(getext(file_name)), "keep-alive", "", 1) < 0) {
         SET_STATUS(request, INTERNAL_SERVER_ERROR, "Error sending headers\n");
         return;
     }
 
-    if (sfind(file_name, 20, "PATH_TO_TEMPLATE_DIR") != -1) {
-        alloc = true;
-        file_name = sreplace(request->uri, 20, "PATH_TO_TEMPLATE_DIR",
-                                strlen(PATH_TO_TEMPLATE_DIR), PATH_TO_TEMPLATE_DIR);
+    struct stat st;
+    if (uring_enabled && stat(file_name, &st) == 0 && st.st_size >= URING_MIN_FILE && uring_conn_open(c)) {
+        if (!uring_send_file(file_name, st.st_size) || !write_all(c, "0\r\n\r\n", 5))
+            SET_STATUS(request, INTERNAL_SERVER_ERROR, "Error sending file\n");
+        return;
     }
 
     string file = read_file(file_name);
@@ -338,26 +574,86 @@ void send_file(int c, struct Request* request)
         SET_STATUS(request, INTERNAL_SERVER_ERROR, "Error sending chunked data\n");
     
     sfree(file);
-    if (alloc)
-        sfree(file_name);
 }
 
 /*
-    If URI points to a directory, a template is sent
-    listing the contents of the specified directory. 
+    Send an embedded asset from memory. The gzip variant is chosen if the
+    client accepts it. Versioned URLs, as written into the template by
+    assets_init(), are cacheable forever; plain ones must be revalidated.
 */
-void send_template(int c, struct Request* request)
+void send_asset(int c, struct Request* request, const char* name)
 {
-    string path = snew(PATH_TO_TEMPLATE_DIR);
-    path = scat(path, 1, "/");
-    path = scat(path, strlen(TEMPLATE_FILE_NAME), TEMPLATE_FILE_NAME);
-    if (!path) {
-        SET_STATUS(request, INTERNAL_SERVER_ERROR, "Error making path\n");
+    const struct Asset* asset = static_dir ? NULL : asset_find(name);
+    metrics_cache(MC_ASSET, asset != NULL);
+    if (!asset) {
+        string path = asset_path(name);
+        if (!path) {
+            SET_STATUS(request, INTERNAL_SERVER_ERROR, "Error making path\n");
+            return;
+        }
+        send_file(c, request, path);
+        sfree(path);
         return;
     }
 
-    string template = read_file(path);
-    sfree(path);
+    bool gzip = asset->gz && slice_has_token(request->headers[H_ACCEPT_ENCODING], "gzip");
+    bool versioned = request->query && sstartswith(request->query, 2, "v=");
+
+    char etag[32], extra[256];
+    snprintf(etag, sizeof(etag), "\"%s%s\"", asset->version, gzip ? "-gz" : "");
+    snprintf(extra, sizeof(extra), "ETag: %s\r\nCache-Control: %s\r\nVary: Accept-Encoding%s",
+             etag, versioned ? "public, max-age=31536000, immutable" : "no-cache",
+             gzip ? "\r\nContent-Encoding: gzip" : "");
+
+    string buffer;
+    slice inm = request->headers[H_IF_NONE_MATCH];
+    if (slice_has_token(inm, etag) || slice_eqi(inm, "*")) {
+        request->status_code = NOT_MODIFIED;
+        buffer = make_response_head(NOT_MODIFIED, "Not Modified", NULL, "keep-alive", extra, NO_BODY);
+    } else {
+        const unsigned char* body = gzip ? asset->gz : asset->data;
+        size_t len = gzip ? asset->gz_len : asset->len;
+        buffer = make_response_head(OK, "OK", getconttype(getext(name)), "keep-alive", extra, len);
+        buffer = scat(buffer, len, (char*) body);
+    }
+
+    if (!buffer || !write_all(c, buffer, sgetlen(buffer)))
+        SET_STATUS(request, INTERNAL_SERVER_ERROR, "Error sending asset\n");
+    sfree(buffer);
+}
+
+/*
+    The total size and number of files of every directory among the n
+    entries of directory uri, from the index (see helpers/search.c), to
+    show in its listing. NULL if there is no index yet.
+*/
+static
+string* dir_sizes(const char* uri, size_t n, string* names)
+{
+    const struct search_entry* dir = search_entry(uri);
+    string* notes = dir ? calloc(n ? n : 1, sizeof(string)) : NULL;
+    for (size_t i = 0; notes && i < n; i++) {
+        const struct search_entry* e = search_entry_in(dir, names[i]);
+        if (!e || !(e->flags & SEARCH_DIR))
+            continue;
+        string size = format_size(e->bytes);
+        char note[96];
+        snprintf(note, sizeof(note), " <small>(%s, %u file%s)</small>", size ? size : "", e->files,
+                 e->files == 1 ? "" : "s");
+        notes[i] = snew(note);
+        sfree(size);
+    }
+    return notes;
+}
+
+/*
+    If URI points to a directory, a template is sent
+    listing the contents of the specified directory. 
+*/
+void send_template(int c, struct Request* request)
+{
+    string template = asset_read(TEMPLATE_FILE_NAME);
+    metrics_cache(MC_ASSET, !static_dir);
     if (!template) {
         SET_STATUS(request, INTERNAL_SERVER_ERROR, "Error reading template\n");
         return;
@@ -367,8 +663,10 @@ void send_template(int c, struct Request* request)
 
     size_t n;
     string* dir_file = listdir(request->uri, &n);
-    string links = add_links(request->uri, n, dir_file);
-    sfreearr(dir_file, n);
+    string* notes = dir_sizes(request->uri, n, dir_file);
+    string links = add_links(request->uri, n, dir_file, notes);
+    if (notes)
+        sfreearr(notes, n);
     
     string to_return = sreplace(with_title, 8, "#LISTING", sgetlen(links), links);
     sfree(links); sfree(with_title);
@@ -376,12 +674,672 @@ void send_template(int c, struct Request* request)
     if (send_simple_response(c, 200, "OK", "text/html", "keep-alive", "", 1) < 0) {
         SET_STATUS(request, INTERNAL_SERVER_ERROR, "Error sending headers\n");
         sfree(to_return);
+        sfreearr(dir_file, n);
         return;
     }
 
     if (!send_chunked_file(c, to_return))
         SET_STATUS(request, INTERNAL_SERVER_ERROR, "Error sending chunked data\n");
+    else
+        prefetch_listed(request->uri, dir_file, n);
     sfree(to_return);
+    sfreearr(dir_file, n);
+}
+
+/* Value of parameter name in query, with ptr NULL if it is absent. */
+slice query_param(const char* query, const char* name)
+{
+    size_t len = strlen(name);
+    for (const char* p = query; p && *p; p += strcspn(p, "&"), p += *p == '&') {
+        size_t n = strcspn(p, "&=");
+        if (n != len || strncmp(p, name, len))
+            continue;
+        if (p[n] != '=')
+            return (slice) {p + n, 0};
+        return (slice) {p + n + 1, strcspn(p + n + 1, "&")};
+    }
+    return (slice) {NULL, 0};
+}
+
+/* The algorithm a ?hash query asks for, HASH_COUNT if it is unknown. */
+static
+enum hash_algo hash_algo_of(slice value)
+{
+    if (value.len == 0)
+        return HASH_SHA256;
+    for (int i = 0; i < HASH_COUNT; i++)
+        if (slice_eqi(value, hash_names[i]))
+            return i;
+    return HASH_COUNT;
+}
+
+static
+string hex_digest(string out, const uint8_t digest[HASH_LEN])
+{
+    char hex[2 * HASH_LEN + 1];
+    for (int i = 0; i < HASH_LEN; i++)
+        snprintf(hex + 2 * i, 3, "%02x", digest[i]);
+    return scat(out, 2 * HASH_LEN, hex);
+}
+
+/* Append s to out as the contents of a JSON string. */
+static
+string json_escape(string out, const char* s)
+{
+    for (; out && *s; s++) {
+        char esc[8];
+        unsigned char ch = *s;
+        if (ch == '"' || ch == '\\')
+            snprintf(esc, sizeof(esc), "\\%c", ch);
+        else if (ch < 0x20)
+            snprintf(esc, sizeof(esc), "\\u%04x", ch);
+        else {
+            out = scat(out, 1, (char*) s);
+            continue;
+        }
+        out = scat(out, strlen(esc), esc);
+    }
+    return out;
+}
+
+/* An entry of a directory whose digest is asked for. */
+struct hash_entry {
+    struct pool_task task;
+    int dir;
+    const char* name;
+    enum hash_algo algo;
+    bool ok;
+    struct stat st;
+    uint8_t digest[HASH_LEN];
+};
+
+static
+void hash_entry(struct pool_task* task)
+{
+    struct hash_entry* e = (struct hash_entry*) task;
+    e->ok = hash_file(e->dir, e->name, e->algo, e->digest, &e->st);
+}
+
+/*
+    The digest of every regular file in directory uri, one JSON object
+    per line, hashed in parallel on the thread pool.
+*/
+static
+string hash_listing(const char* uri, enum hash_algo algo)
+{
+    char path[MAX_PATH_LEN];
+    snprintf(path, sizeof(path), "./%s", uri);
+    int dir = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    size_t n = 0;
+    string* names = dir >= 0 ? listdir(uri, &n) : NULL;
+    struct hash_entry* entries = names ? calloc(n ? n : 1, sizeof(*entries)) : NULL;
+    if (!entries) {
+        sfreearr(names, n);
+        if (dir >= 0)
+            close(dir);
+        return NULL;
+    }
+
+    struct pool_group group = {0};
+    for (size_t i = 0; i < n; i++) {
+        entries[i] = (struct hash_entry) {.task.run = hash_entry, .dir = dir, .name = names[i], .algo = algo};
+        pool_submit(&group, &entries[i].task);
+    }
+    pool_wait(&group);
+
+    string body = snew("");
+    for (size_t i = 0; i < n && body; i++) {
+        if (!entries[i].ok)
+            continue;
+        char size[32];
+        snprintf(size, sizeof(size), "%lld", (long long) entries[i].st.st_size);
+        body = scat(body, 9, "{\"name\":\"");
+        body = json_escape(body, entries[i].name);
+        body = scat(body, 9, "\",\"size\":");
+        body = scat(body, strlen(size), size);
+        body = scat(body, 2, ",\"");
+        body = scat(body, strlen(hash_names[algo]), (char*) hash_names[algo]);
+        body = scat(body, 3, "\":\"");
+        body = hex_digest(body, entries[i].digest);
+        body = scat(body, 3, "\"}\n");
+    }
+    free(entries);
+    sfreearr(names, n);
+    close(dir);
+    return body;
+}
+
+/*
+    Answer ?hash[=algorithm]: the digest of a file in the format of
+    sha256sum, or of every file in a directory as NDJSON. Digests come
+    from the hash database while files are unchanged, see
+    helpers/hashdb.c.
+*/
+void send_hash(int c, struct Request* request)
+{
+    enum hash_algo algo = hash_algo_of(query_param(request->query, "hash"));
+    bool dir = isdir(request->uri) == 1;
+    string body;
+    if (dir)
+        body = hash_listing(request->uri, algo);
+    else {
+        uint8_t digest[HASH_LEN];
+        struct stat st;
+        const char* name = strrchr(request->uri, '/') ? strrchr(request->uri, '/') + 1 : request->uri;
+        body = hash_file(AT_FDCWD, request->uri, algo, digest, &st) ? hex_digest(snew(""), digest) : NULL;
+        body = body ? scat(body, 2, "  ") : NULL;
+        body = body ? scat(body, strlen(name), (char*) name) : NULL;
+        body = body ? scat(body, 1, "\n") : NULL;
+    }
+    if (!body) {
+        SET_STATUS(request, INTERNAL_SERVER_ERROR, "Error hashing\n");
+        send_simple_response(c, request->status_code, "", "text/plain", "close", "", false);
+        return;
+    }
+
+    string buffer = make_response_head(OK, "OK", dir ? "application/x-ndjson" : "text/plain; charset=utf-8",
+                                       "keep-alive", "Cache-Control: no-cache", sgetlen(body));
+    buffer = scat(buffer, sgetlen(body), body);
+    if (!buffer || !write_all(c, buffer, sgetlen(buffer)))
+        SET_STATUS(request, INTERNAL_SERVER_ERROR, "Error sending hash\n");
+    sfree(body);
+    sfree(buffer);
+}
+
+/* A response body being sent in chunks, of up to a buffer at a time (see send_delta(), send_search()). */
+struct chunk_out {
+    int c;
+    size_t len;
+    uint8_t buf[DELTA_LITERAL_MAX + 64];
+};
+
+static
+bool chunk_flush(struct chunk_out* o)
+{
+    char head[20];
+    snprintf(head, sizeof(head), "%zx\r\n", o->len);
+    bool ok = o->len == 0 || (write_all(o->c, head, strlen(head)) && write_all(o->c, (char*) o->buf, o->len)
+                              && write_all(o->c, "\r\n", 2));
+    o->len = 0;
+    return ok;
+}
+
+static
+bool chunk_put(struct chunk_out* o, const void* data, size_t len)
+{
+    while (o->len + len > sizeof(o->buf)) {
+        size_t n = sizeof(o->buf) - o->len;
+        memcpy(o->buf + o->len, data, n);
+        o->len += n;
+        data = (const uint8_t*) data + n;
+        len -= n;
+        if (!chunk_flush(o))
+            return false;
+    }
+    memcpy(o->buf + o->len, data, len);
+    o->len += len;
+    return true;
+}
+
+static
+bool delta_send_copy(void* ctx, uint32_t first, uint32_t count)
+{
+    uint8_t op[9] = {'C'};
+    delta_put32(op + 1, first);
+    delta_put32(op + 5, count);
+    return chunk_put(ctx, op, sizeof(op));
+}
+
+static
+bool delta_send_literal(void* ctx, const uint8_t* data, size_t len)
+{
+    uint8_t op[5] = {'L'};
+    delta_put32(op + 1, len);
+    return chunk_put(ctx, op, sizeof(op)) && chunk_put(ctx, data, len);
+}
+
+/*
+    The block signatures in a POST ?delta body of len bytes, see
+    helpers/delta.c. NULL if it is malformed.
+*/
+static
+struct delta_sig* delta_parse(const uint8_t* body, size_t len, uint32_t* block_size, uint32_t* count)
+{
+    if (len < DELTA_HEADER || memcmp(body, DELTA_REQUEST_MAGIC, 4))
+        return NULL;
+    *block_size = delta_get32(body + 4);
+    *count = delta_get32(body + 8);
+    if (*block_size < DELTA_MIN_BLOCK || *block_size > DELTA_MAX_BLOCK
+        || len != DELTA_HEADER + (size_t) *count * DELTA_SIG)
+        return NULL;
+    struct delta_sig* sigs = malloc((*count ? *count : 1) * sizeof(*sigs));
+    for (uint32_t i = 0; sigs && i < *count; i++) {
+        const uint8_t* p = body + DELTA_HEADER + (size_t) i * DELTA_SIG;
+        sigs[i].weak = delta_get32(p);
+        memcpy(sigs[i].strong, p + 4, DELTA_STRONG);
+    }
+    return sigs;
+}
+
+/*
+    Answer POST <file>?delta, whose body holds the block signatures of
+    the client's old version of the file, with the instructions that
+    rebuild the current one from it (see helpers/delta.c), streamed in
+    chunks. The BLAKE3 of the file comes from the hash database and the
+    server's block signatures from delta_cache_dir. A body that was not
+    read whole leaves the connection to be closed.
+*/
+void send_delta(int c, struct Request* request, string pending)
+{
+    slice length = request->headers[H_CONTENT_LENGTH];
+    size_t len = 0;
+    for (size_t i = 0; i < length.len && len <= DELTA_MAX_BODY; i++)
+        len = isdigit((unsigned char) length.ptr[i]) ? len * 10 + (length.ptr[i] - '0') : SIZE_MAX;
+    uint8_t* body = NULL;
+    struct delta_sig* sigs = NULL;
+    uint32_t block_size = 0, count = 0;
+    if (length.len == 0 || len == SIZE_MAX)
+        SET_STATUS(request, BAD_REQUEST, "Invalid Content-Length\n");
+    else if (len > DELTA_MAX_BODY)
+        SET_STATUS(request, PAYLOAD_TOO_LARGE, "Too many delta signatures\n");
+    else if (!(body = malloc(len ? len : 1)))
+        SET_STATUS(request, INTERNAL_SERVER_ERROR, "Error allocating the request body\n");
+    else if (!read_body(c, pending, (char*) body, len))
+        SET_STATUS(request, REQUEST_TIMEOUT, "Request body timed out\n");
+    else if (!(sigs = delta_parse(body, len, &block_size, &count)))
+        SET_STATUS(request, BAD_REQUEST, "Malformed delta signatures\n");
+    free(body);
+
+    uint8_t digest[HASH_LEN];
+    struct stat st, now;
+    int fd = -1;
+    if (request->valid && (!hash_file(AT_FDCWD, request->uri, HASH_BLAKE3, digest, &st)
+                           || (fd = open(request->uri, O_RDONLY | O_CLOEXEC)) < 0 || fstat(fd, &now) < 0
+                           || now.st_ino != st.st_ino || now.st_size != st.st_size
+                           || hashdb_mtime(&now) != hashdb_mtime(&st)))
+        SET_STATUS(request, INTERNAL_SERVER_ERROR, "Error hashing\n");
+    if (!request->valid) {
+        send_simple_response(c, request->status_code, "", "text/plain", "close", "", false);
+        if (fd >= 0)
+            close(fd);
+        free(sigs);
+        return;
+    }
+
+    uint64_t own_count = 0;
+    struct delta_sig* own = delta_signatures(fd, &st, block_size, &own_count);
+    struct chunk_out* out = malloc(sizeof(*out));
+    string head = make_response_head(OK, "OK", "application/octet-stream", "keep-alive",
+                                     "Cache-Control: no-store", CHUNKED);
+    bool ok = out && head && write_all(c, head, sgetlen(head));
+    if (ok) {
+        out->c = c;
+        out->len = DELTA_RESPONSE_HEADER;
+        memcpy(out->buf, DELTA_RESPONSE_MAGIC, 4);
+        delta_put32(out->buf + 4, block_size);
+        delta_put64(out->buf + 8, st.st_size);
+        memcpy(out->buf + 16, digest, HASH_LEN);
+        struct delta_sink sink = {.copy = delta_send_copy, .literal = delta_send_literal, .ctx = out};
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        ok = delta_match(fd, st.st_size, block_size, sigs, count, own, own_count, &sink)
+             && chunk_put(out, "E", 1) && chunk_flush(out) && write_all(c, "0\r\n\r\n", 5);
+    }
+    if (!ok)
+        SET_STATUS(request, INTERNAL_SERVER_ERROR, "Error sending delta\n");
+    sfree(head);
+    free(out);
+    free(own);
+    free(sigs);
+    close(fd);
+}
+
+/* Append a record of the change journal to a ?changes_since body. */
+static
+bool changes_line(void* ctx, const struct journal_record* r)
+{
+    string* body = ctx;
+    char head[64];
+    snprintf(head, sizeof(head), "{\"version\":%llu,\"change\":\"%s\",\"path\":\"",
+             (unsigned long long) r->version, journal_names[r->change]);
+    *body = scat(*body, strlen(head), head);
+    *body = json_escape(*body, r->path);
+    *body = r->dir ? scat(*body, 14, "\",\"dir\":true}\n") : scat(*body, 3, "\"}\n");
+    return *body != NULL;
+}
+
+/*
+    Answer ?changes_since=<version> on a directory with what changed
+    under it since version, from the change journal (see
+    helpers/journal.c). The first line holds the version to ask with
+    next time; "resync":true there means the journal does not reach
+    back to version and the directory has to be listed again. Every
+    other line is a change, oldest first.
+*/
+void send_changes(int c, struct Request* request)
+{
+    slice since = query_param(request->query, "changes_since");
+    uint64_t version = 0;
+    string changes = snew("");
+    bool resync = !journal_read(strtoull(since.ptr, NULL, 10), request->uri ? request->uri : "", &version,
+                                changes_line, &changes);
+    if (resync && changes)
+        supdatelen(changes, 0);
+
+    char head[96];
+    snprintf(head, sizeof(head), "{\"version\":%llu,\"resync\":%s}\n", (unsigned long long) version,
+             resync ? "true" : "false");
+    string body = changes ? scat(snew(head), sgetlen(changes), changes) : NULL;
+    string buffer = body ? make_response_head(OK, "OK", "application/x-ndjson", "keep-alive",
+                                              "Cache-Control: no-store", sgetlen(body)) : NULL;
+    buffer = buffer ? scat(buffer, sgetlen(body), body) : NULL;
+    if (!buffer || !write_all(c, buffer, sgetlen(buffer)))
+        SET_STATUS(request, INTERNAL_SERVER_ERROR, "Error sending changes\n");
+    sfree(changes);
+    sfree(body);
+    sfree(buffer);
+}
+
+/* Length of the directory part of path, the directory a change to path is published to. */
+static inline
+size_t parent_len(const char* path)
+{
+    const char* slash = strrchr(path, '/');
+    return slash ? (size_t) (slash - path) : 0;
+}
+
+/*
+    Append the server-sent event for record r of the change journal.
+    Its type is the change; its data the name in the directory and, if
+    the index has them, the size and the number of files of a directory.
+*/
+static
+string event_line(string out, const struct journal_record* r)
+{
+    const char* name = strrchr(r->path, '/');
+    char head[96];
+    snprintf(head, sizeof(head), "id: %llu\nevent: %s\ndata: {\"name\":\"", (unsigned long long) r->version,
+             journal_names[r->change]);
+    out = json_escape(scat(out, strlen(head), head), name ? name + 1 : r->path);
+    const struct search_entry* e = search_ready && r->change != JOURNAL_REMOVED ? search_entry(r->path) : NULL;
+    char tail[96];
+    if (e && e->flags & SEARCH_DIR)
+        snprintf(tail, sizeof(tail), "\",\"dir\":true,\"size\":%llu,\"files\":%u}\n\n",
+                 (unsigned long long) e->bytes, e->files);
+    else if (e)
+        snprintf(tail, sizeof(tail), "\",\"size\":%llu}\n\n", (unsigned long long) e->bytes);
+    else
+        snprintf(tail, sizeof(tail), r->dir ? "\",\"dir\":true}\n\n" : "\"}\n\n");
+    return out ? scat(out, strlen(tail), tail) : NULL;
+}
+
+/* Events collected for a subscriber, see send_events() and subscribe(). */
+struct event_replay {
+    string out;
+    const char* dir;
+    uint64_t until;             // later records are left to publish_events()
+};
+
+/* Append the event of record r if it happened in the directory of the replay, see journal_read(). */
+static
+bool replay_line(void* ctx, const struct journal_record* r)
+{
+    struct event_replay* replay = ctx;
+    if (r->version > replay->until || parent_len(r->path) != strlen(replay->dir))
+        return true;
+    replay->out = event_line(replay->out, r);
+    return replay->out != NULL;
+}
+
+/*
+    Answer ?events on a directory with the head of a stream of
+    server-sent events and, for a client that reconnects with a
+    Last-Event-ID, what changed in the directory since, from the change
+    journal; a resync event if the journal does not reach back that
+    far. The connection then goes to the main process, which sends the
+    rest (see net/events.c).
+*/
+void send_events(int c, struct Request* request)
+{
+    slice last = request->headers[H_LAST_EVENT_ID];
+    uint64_t since = 0;
+    bool known = last.ptr && last.len > 0 && last.len <= 19;
+    for (size_t i = 0; known && i < last.len; i++) {
+        known = isdigit((unsigned char) last.ptr[i]);
+        since = since * 10 + (last.ptr[i] - '0');
+    }
+
+    char retry[32];
+    snprintf(retry, sizeof(retry), "retry: %d\n\n", EVENTS_RETRY);
+    string head = make_response_head(OK, "OK", "text/event-stream", "close", "Cache-Control: no-store", UNTIL_CLOSE);
+    head = head ? scat(head, strlen(retry), retry) : NULL;
+    size_t head_len = head ? sgetlen(head) : 0;
+    struct event_replay replay = {.out = head, .dir = request->uri, .until = UINT64_MAX};
+    uint64_t version = atomic_load_explicit(&journal->version, memory_order_acquire);
+    if (head && last.ptr && !(known && journal_read(since, request->uri, &version, replay_line, &replay))
+        && replay.out) {
+        supdatelen(replay.out, head_len);
+        replay.out = scat(replay.out, strlen(EVENTS_RESYNC), EVENTS_RESYNC);
+    }
+    /* An event without data only sets the id a reconnecting client sends. */
+    char id[32];
+    snprintf(id, sizeof(id), "id: %llu\n\n", (unsigned long long) version);
+    replay.out = replay.out ? scat(replay.out, strlen(id), id) : NULL;
+    if (!replay.out || !write_all(c, replay.out, sgetlen(replay.out)))
+        SET_STATUS(request, INTERNAL_SERVER_ERROR, "Error sending events\n");
+    else {
+        request->handoff = HANDOFF_EVENTS;
+        request->since = version;
+    }
+    sfree(replay.out);
+}
+
+/*
+    Answer ?follow on a file with what it holds from ?from=<offset>, from
+    where its last ?lines=<n> lines start or from its start, in a
+    response that ends with the connection. The connection and the file
+    then go to the main process, which sends what is appended to it
+    (see net/follow.c).
+*/
+void send_follow(int c, struct Request* request)
+{
+    int fd = open(request->uri, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        SET_STATUS(request, INTERNAL_SERVER_ERROR, "Error opening file\n");
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+    slice from = query_param(request->query, "from");
+    slice lines = query_param(request->query, "lines");
+    off_t offset = from.ptr ? (off_t) strtoull(from.ptr, NULL, 10)
+                 : lines.ptr ? follow_tail(fd, st.st_size, strtoull(lines.ptr, NULL, 10)) : 0;
+    offset = offset < st.st_size ? offset : st.st_size;
+
+    string head = make_response_head(OK, "OK", getconttype(getext(request->uri)), "close",
+                                     "Cache-Control: no-store", UNTIL_CLOSE);
+    posix_fadvise(fd, offset, 0, POSIX_FADV_SEQUENTIAL);
+    if (!head || !write_all(c, head, sgetlen(head)) || !sendfile_all(c, fd, &offset, st.st_size)) {
+        SET_STATUS(request, INTERNAL_SERVER_ERROR, "Error sending file\n");
+        close(fd);
+    } else {
+        request->handoff = HANDOFF_FOLLOW;
+        request->since = offset;
+        request->file = fd;
+    }
+    sfree(head);
+}
+
+/* Append a line of JSON for the entry e of the index at path, for ?search and ?du. */
+static
+string entry_json(string out, const char* path, const struct search_entry* e)
+{
+    char tail[96];
+    if (e->flags & SEARCH_DIR)
+        snprintf(tail, sizeof(tail), "\",\"dir\":true,\"size\":%llu,\"files\":%u}\n", (unsigned long long) e->bytes,
+                 e->files);
+    else
+        snprintf(tail, sizeof(tail), "\",\"size\":%llu}\n", (unsigned long long) e->bytes);
+    out = json_escape(scat(out, 9, "{\"path\":\""), path);
+    return scat(out, strlen(tail), tail);
+}
+
+/*
+    Answer ?du on a directory with its total size and number of files
+    and those of every file and directory in it, a JSON object per
+    line, the directory first; from the index (see helpers/search.c),
+    as it was when this process was forked.
+*/
+void send_du(int c, struct Request* request)
+{
+    const struct search_entry* dir = search_entry(request->uri);
+    size_t n = 0;
+    string* names = dir ? listdir(request->uri, &n) : NULL;
+    string body = dir ? entry_json(snew(""), request->uri, dir) : NULL;
+    char path[PATH_MAX];
+    for (size_t i = 0; body && names && i < n; i++) {
+        const struct search_entry* e = search_entry_in(dir, names[i]);
+        if (e && snprintf(path, sizeof(path), "%s%s%s", request->uri, *request->uri ? "/" : "", names[i])
+                 < (int) sizeof(path))
+            body = entry_json(body, path, e);
+    }
+    if (names)
+        sfreearr(names, n);
+    string buffer = body ? make_response_head(OK, "OK", "application/x-ndjson", "keep-alive",
+                                              "Cache-Control: no-cache", sgetlen(body)) : NULL;
+    buffer = buffer ? scat(buffer, sgetlen(body), body) : NULL;
+    if (!buffer || !write_all(c, buffer, sgetlen(buffer)))
+        SET_STATUS(request, INTERNAL_SERVER_ERROR, "Error sending sizes\n");
+    sfree(body);
+    sfree(buffer);
+}
+
+/* A ?search response being streamed, see send_search(). */
+struct search_out {
+    struct chunk_out out;
+    bool html;
+    bool ok;
+};
+
+/* Append a path found by search_query() to a ?search response. */
+static
+bool search_line(void* ctx, const char* path, const struct search_entry* e)
+{
+    struct search_out* s = ctx;
+    bool dir = e->flags & SEARCH_DIR;
+    string line;
+    if (s->html) {
+        string esc = snew("");
+        for (const char* p = path; esc && *p; p++) {
+            const char* e = *p == '&' ? "&amp;" : *p == '<' ? "&lt;" : *p == '>' ? "&gt;" : *p == '"' ? "&quot;" : NULL;
+            esc = e ? scat(esc, strlen(e), (char*) e) : scat(esc, 1, (char*) p);
+        }
+        line = esc ? scat(snew("<li><a href=\"/"), sgetlen(esc), esc) : NULL;
+        line = scat(line, 2, "\">");
+        line = esc ? scat(line, sgetlen(esc), esc) : NULL;
+        line = scat(line, dir ? 11 : 10, dir ? "/</a></li>\n" : "</a></li>\n");
+        sfree(esc);
+    } else
+        line = entry_json(snew(""), path, e);
+    s->ok = line && chunk_put(&s->out, line, sgetlen(line));
+    sfree(line);
+    return s->ok;
+}
+
+/* Decode the %XX escapes and '+' of a query value into out, of at least value.len + 1 bytes. */
+static
+void query_decode(char* out, slice value)
+{
+    size_t n = 0;
+    for (size_t i = 0; i < value.len; i++) {
+        if (value.ptr[i] == '%' && i + 2 < value.len && isxdigit((unsigned char) value.ptr[i + 1])
+            && isxdigit((unsigned char) value.ptr[i + 2])) {
+            char hex[3] = {value.ptr[i + 1], value.ptr[i + 2], 0};
+            out[n++] = strtol(hex, NULL, 16);
+            i += 2;
+        } else
+            out[n++] = value.ptr[i] == '+' ? ' ' : value.ptr[i];
+    }
+    out[n] = 0;
+}
+
+/*
+    Answer ?search=<text>[&limit=<n>] on a directory with the files and
+    directories under it whose names contain text, ignoring ASCII case,
+    from the index built at startup (see helpers/search.c). A browser
+    gets the listing page with the matches as links, anything else a
+    JSON object per line. Matches are streamed as they are found, at
+    most limit of them.
+*/
+void send_search(int c, struct Request* request)
+{
+    slice q = query_param(request->query, "search");
+    slice limit_param = query_param(request->query, "limit");
+    uint32_t limit = limit_param.ptr ? strtoul(limit_param.ptr, NULL, 10) : SEARCH_LIMIT;
+    limit = limit > SEARCH_MAX_LIMIT ? SEARCH_MAX_LIMIT : limit;
+    char* text = malloc(q.len + 1);
+    struct search_out* s = malloc(sizeof(*s));
+    string page = NULL;
+    if (text && s) {
+        query_decode(text, q);
+        s->out.c = c;
+        s->out.len = 0;
+        slice accept = request->headers[H_ACCEPT];
+        s->html = false;
+        for (size_t i = 0; accept.ptr && i + 9 <= accept.len && !s->html; i++)
+            s->html = !strncasecmp(accept.ptr + i, "text/html", 9);
+        s->ok = true;
+    }
+    if (s && s->html) {
+        string template = asset_read(TEMPLATE_FILE_NAME);
+        page = template ? add_title(template, request->uri) : NULL;
+        sfree(template);
+    }
+    const char* listing = page ? strstr(page, "#LISTING") : NULL;
+    string head = make_response_head(OK, "OK", s && s->html ? "text/html" : "application/x-ndjson", "keep-alive",
+                                     "Cache-Control: no-store", CHUNKED);
+    bool ok = text && s && (!s->html || listing) && head && write_all(c, head, sgetlen(head));
+    if (ok && s->html)
+        ok = chunk_put(&s->out, page, listing - page);
+    if (ok) {
+        search_query(request->uri, text, limit, search_line, s);
+        ok = s->ok && (!s->html || chunk_put(&s->out, listing + 8, sgetlen(page) - (listing + 8 - page)))
+             && chunk_flush(&s->out) && write_all(c, "0\r\n\r\n", 5);
+    }
+    if (!ok)
+        SET_STATUS(request, INTERNAL_SERVER_ERROR, "Error sending search results\n");
+    sfree(head);
+    sfree(page);
+    free(text);
+    free(s);
+}
+
+/* Send the server metrics, see logger/metrics.c. */
+void send_metrics(int c, struct Request* request)
+{
+    string body = metrics_render();
+    string buffer = NULL;
+    if (body) {
+        buffer = make_response_head(OK, "OK", "text/plain; version=0.0.4; charset=utf-8", "keep-alive",
+                                    "Cache-Control: no-store", sgetlen(body));
+        buffer = scat(buffer, sgetlen(body), body);
+    }
+    if (!buffer || !write_all(c, buffer, sgetlen(buffer)))
+        SET_STATUS(request, INTERNAL_SERVER_ERROR, "Error sending metrics\n");
+    sfree(body);
+    sfree(buffer);
+}
+
+/* Whether the query parameter value v is absent or a decimal number below 10^19. */
+static
+bool optional_number(slice v)
+{
+    if (!v.ptr)
+        return true;
+    size_t digits = 0;
+    while (digits < v.len && isdigit((unsigned char) v.ptr[digits]))
+        digits++;
+    return digits > 0 && digits == v.len && digits <= 19;
 }
 
 void check_uri(struct Request* request)
@@ -389,152 +1347,1091 @@ void check_uri(struct Request* request)
     if (!request->valid)
         return;
 
+    /* Checked first: a POST answered without reading its body would leave the body to be parsed as the next request. */
     if (!request->uri)
         SET_STATUS(request, INTERNAL_SERVER_ERROR, "uri is NULL\n");
-    else if (sfind(request->uri, 1, "PATH_TO_TEMPLATE_DIR") != -1)
+    else if (!strncmp(request->method, "post", 5) && !query_param(request->query, "delta").ptr)
+        SET_STATUS(request, METHOD_NOT_ALLOWED, "Only ?delta takes a POST\n");
+    else if (metrics_is_path(request->uri))
+        return;
+    else if (asset_name(request->uri))
     {
-        string tmp = sreplace(request->uri, 20, "PATH_TO_TEMPLATE_DIR",
-                                strlen(PATH_TO_TEMPLATE_DIR), PATH_TO_TEMPLATE_DIR);
-
-        if (isdir(tmp) == ISDIR_INVALID)
+        if (!asset_exists(asset_name(request->uri)))
             SET_STATUS(request, NOT_FOUND, "Resource not found\n");
-        sfree(tmp);
     }
     else if (isdir(request->uri) == ISDIR_INVALID)
         SET_STATUS(request, NOT_FOUND, "Resource not found\n");
+    else if (query_param(request->query, "hash").ptr
+             && hash_algo_of(query_param(request->query, "hash")) == HASH_COUNT)
+        SET_STATUS(request, BAD_REQUEST, "Unknown hash algorithm\n");
+    else if ((query_param(request->query, "delta").ptr != NULL) != !strncmp(request->method, "post", 5)
+             || (query_param(request->query, "delta").ptr && isdir(request->uri) == 1))
+        SET_STATUS(request, METHOD_NOT_ALLOWED, "Delta needs a POST of a file\n");
+    else if (query_param(request->query, "changes_since").ptr) {
+        slice since = query_param(request->query, "changes_since");
+        size_t digits = 0;
+        while (digits < since.len && isdigit((unsigned char) since.ptr[digits]))
+            digits++;
+        if (!journal)
+            SET_STATUS(request, NOT_IMPLEMENTED, "The change journal is off\n");
+        else if (digits == 0 || digits != since.len || digits > 19 || isdir(request->uri) != 1)
+            SET_STATUS(request, BAD_REQUEST, "Bad changes_since version or not a directory\n");
+    }
+    else if (query_param(request->query, "follow").ptr) {
+        if (watch_fd < 0)
+            SET_STATUS(request, NOT_IMPLEMENTED, "Watching the shared files is off\n");
+        else if (isdir(request->uri) != 0)
+            SET_STATUS(request, BAD_REQUEST, "Not a file\n");
+        else if (!optional_number(query_param(request->query, "from"))
+                 || !optional_number(query_param(request->query, "lines")))
+            SET_STATUS(request, BAD_REQUEST, "Bad from offset or number of lines\n");
+    }
+    else if (query_param(request->query, "events").ptr) {
+        if (!journal)
+            SET_STATUS(request, NOT_IMPLEMENTED, "The change journal is off\n");
+        else if (isdir(request->uri) != 1)
+            SET_STATUS(request, BAD_REQUEST, "Not a directory\n");
+    }
+    else if (query_param(request->query, "du").ptr && isdir(request->uri) != 1)
+        SET_STATUS(request, BAD_REQUEST, "Not a directory\n");
+    else if (query_param(request->query, "search").ptr || query_param(request->query, "du").ptr) {
+        if (!search_on)
+            SET_STATUS(request, NOT_IMPLEMENTED, "The index for search and sizes is off\n");
+        else if (!search_ready)
+            SET_STATUS(request, SERVICE_UNAVAILABLE, "The search index is being built\n");
+        else if (query_param(request->query, "search").ptr
+                 && (query_param(request->query, "search").len == 0 || isdir(request->uri) != 1))
+            SET_STATUS(request, BAD_REQUEST, "Empty search or not a directory\n");
+    }
 }
 
-bool respond(int c, struct Request* request, ht_htable* headers)
+/* pending holds what arrived after the request head, the start of its body if it has one. */
+bool respond(int c, struct Request* request, string pending)
 {
-    if (request->status_code == NOTHING_TO_READ)
+    if (request->status_code == NOTHING_TO_READ || request->status_code == IDLE)
         return false;
     
     /* Normalize uri according to https://datatracker.ietf.org/doc/html/rfc3986#section-5.2.4 */
-    request->uri = normalize_uri(request->uri);
+    if (request->uri)
+        request->uri = normalize_uri(request->uri);
     check_uri(request);
+    access_mark(AS_LOOKUP);
 
     if (!request->valid)
         send_simple_response(c, request->status_code, "", "text/plain", "close", "", false);
     else 
     {
-        if (isdir(request->uri) == 1)
+        if (metrics_is_path(request->uri))
+            send_metrics(c, request);
+        else if (asset_name(request->uri))
+            send_asset(c, request, asset_name(request->uri));
+        else if (query_param(request->query, "hash").ptr)
+            send_hash(c, request);
+        else if (query_param(request->query, "delta").ptr)
+            send_delta(c, request, pending);
+        else if (query_param(request->query, "changes_since").ptr)
+            send_changes(c, request);
+        else if (query_param(request->query, "events").ptr)
+            send_events(c, request);
+        else if (query_param(request->query, "follow").ptr)
+            send_follow(c, request);
+        else if (query_param(request->query, "search").ptr)
+            send_search(c, request);
+        else if (query_param(request->query, "du").ptr)
+            send_du(c, request);
+        else if (isdir(request->uri) == 1)
             send_template(c, request);
-        else
-            send_file(c, request);
+        else {
+            prefetch_served(request->uri);
+            send_file(c, request, request->uri);
+        }
     }
-    return request->valid && strncmp(ht_search(headers, "connection"), "close", 5);
+    return request->valid && !request->handoff && !slice_has_token(request->headers[H_CONNECTION], "close");
 }
 
 void free_request(struct Request* request)
 {
     sfree(request->method);
     sfree(request->uri);
+    sfree(request->query);
     sfree(request->version);
 }
 
-void handle_client(const int c) 
+/*
+    Serve the requests on connection c, whose first request head started
+    arriving at monotonic time head_start (see access_now()), until the
+    connection is closed or goes idle. An idle connection is handed back
+    to the main process; return true if it was.
+*/
+bool handle_client(const int c, struct handoff* conn, uint64_t head_start)
 {
     struct Request request;
-    ht_htable* headers = ht_new();
-    if (!headers) return;
-
     string buffer = snewlen(NULL, MAX_REQUEST_SIZE);
-    if (!buffer) {
-        ht_del_htable(headers);
-        return;
+    string pending = snewlen(NULL, MAX_REQUEST_SIZE);
+    if (!buffer || !pending) {
+        sfree(buffer);
+        sfree(pending);
+        return false;
     }
+    supdatelen(pending, 0);
+
+    struct timeval send_timeout = {timeouts.send / 1000, timeouts.send % 1000 * 1000};
+    setsockopt(c, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(send_timeout));
 
     /*
-        To increase the performance a connection is not closed if a 
-        client sends requests within SECONDS_TO_WAIT interval.
+        To increase the performance a connection is not closed after a
+        response. The next request is awaited here for the hold time;
+        after that the connection is parked in the main process until
+        the idle timeout.
     */
+    uint32_t hold = timeouts.hold < timeouts.idle ? timeouts.hold : timeouts.idle;
+    shaper_begin(conn->ip_slot);
     bool keep_alive = true;
+    bool handed_off = false;
     while (keep_alive) 
     {
+        memset(&request, 0, sizeof(request));
         request.valid = true;
         request.status_code = OK;
 
-        read_request(c, &request, buffer);
-        parse_request(&request, headers, buffer);
-        if (request.valid)
-            log_info("%s %s\n", request.method, request.uri);
+        access_begin(head_start, conn->client_ip, conn->index);
+        read_request(c, &request, buffer, pending, head_start, conn->start + hold * 1000000ULL);
+        if (request.status_code == IDLE) {
+            if (hold < timeouts.idle)
+                handed_off = handoff_send(c, conn, NULL, -1);
+            else
+                metrics_timeout(MT_IDLE);
+            break;
+        }
+        parse_request(&request, buffer);
+        access_mark(AS_PARSE);
         /*
             A connection is closed if the server treats a request as invalid,
             a client sends a 'Connection: close' header field or an internal
             server error occurs.
          */
-        keep_alive = respond(c, &request, headers);
+        keep_alive = respond(c, &request, pending);
+        shaper_idle();
         if (!request.valid && strncmp(error_desc, "Nothing to read", 15))
             log_err(stderr, error_desc);
         if (request.status_code != NOTHING_TO_READ) {
-            ht_clear(headers);
+            const struct access_record* record = access_end(request.status_code, request.method, request.uri);
+            metrics_request(record, request.method);
+            prefetch_end(record->stages[AS_FIRST_SENT]);
+            if (request.handoff) {
+                conn->kind = request.handoff;
+                conn->since = request.since;
+                handed_off = handoff_send(c, conn, request.uri,
+                                          request.handoff == HANDOFF_FOLLOW ? request.file : -1);
+                if (request.handoff == HANDOFF_FOLLOW)
+                    close(request.file);
+            }
             free_request(&request);
         }
+        /* The connection is kept alive, later requests are worth a ring. */
+        if (keep_alive && uring_enabled)
+            uring_conn_open(c);
+        head_start = 0;
+        conn->start = access_now();
+        if (conn->index < UINT16_MAX)
+            conn->index++;
     }
 
+    shaper_end();
     sfree(buffer);
-    ht_del_htable(headers);
-    return;
+    sfree(pending);
+    return handed_off;
+}
+
+/*
+    State of the main process. Connections without a request to serve
+    are parked: registered with epoll for input and with the timer wheel
+    for their header or idle timeout, and indexed by descriptor.
+    Readable connections that find limits.children children busy wait
+    in a queue instead, with a timer for the wait limit.
+*/
+struct parked
+{
+    struct timer timer;         // first, so a fired timer is its connection
+    struct handoff conn;
+    int fd;
+    bool fresh;                 // no request has been read yet
+    bool waiting;               // in the queue for a child, not parked
+    struct parked* next;        // queue links while waiting
+    struct parked* prev;
+};
+
+static struct parked** parked;
+static size_t parked_size;
+static size_t parked_count;
+static struct parked* waiting_head;
+static struct parked* waiting_tail;
+static size_t waiting_count;
+static uint32_t children;
+static sigset_t wait_mask;      // signal mask while waiting for events, SIGCHLD is blocked otherwise
+static struct wheel wheel;
+static int epoll_fd = -1;
+static int listen_fd = -1;
+static int accept_fd = -1;      // what epoll waits on for new clients, listen_fd or the accept ring
+static int first_conn_fd;       // every descriptor from here on is a connection
+static uint32_t connections;
+static uint64_t events_version; // the last journal version published to subscribers
+static bool events_lost;        // inotify dropped events, subscribers list their directories again
+static struct timer ping_timer; // see ping_subscribers()
+static struct wheel throttled;  // followers waiting for bandwidth, see follow()
+
+static
+uint64_t now_ticks(void)
+{
+    return access_now() / (WHEEL_TICK_MS * 1000000ULL);
+}
+
+/* Tick at which the monotonic time t has passed. */
+static
+uint64_t ticks_at(uint64_t t)
+{
+    return t / (WHEEL_TICK_MS * 1000000ULL) + 1;
+}
+
+/* Close a connection the main process holds, or only account for it if fd is -1 because it is gone. */
+static
+void close_connection(int fd, const struct handoff* conn)
+{
+    capture_use(getpid(), conn->number);
+    capture_end();
+    metrics_connection(-1);
+    admission_close(conn->ip_slot);
+    if (fd >= 0)
+        close(fd);
+}
+
+/* Answer a connection the main process holds with 503 and close it. */
+static
+void shed(int fd, const struct handoff* conn, enum metrics_shed reason)
+{
+    metrics_shed(reason);
+    admission_shed(fd);
+    close_connection(fd, conn);
+}
+
+/* Track connection fd, return NULL and close it if memory is short. */
+static
+struct parked* parked_new(int fd, const struct handoff* conn, bool fresh)
+{
+    if ((size_t) fd >= parked_size) {
+        size_t size = parked_size ? parked_size : 1024;
+        while (size <= (size_t) fd)
+            size *= 2;
+        struct parked** tmp = realloc(parked, size * sizeof(struct parked*));
+        if (!tmp) {
+            close_connection(fd, conn);
+            return NULL;
+        }
+        memset(tmp + parked_size, 0, (size - parked_size) * sizeof(struct parked*));
+        parked = tmp;
+        parked_size = size;
+    }
+
+    struct parked* p = malloc(sizeof(struct parked));
+    if (!p) {
+        close_connection(fd, conn);
+        return NULL;
+    }
+    p->conn = *conn;
+    p->fd = fd;
+    p->fresh = fresh;
+    p->waiting = false;
+    timer_init(&p->timer);
+    return p;
+}
+
+/* Park p until it becomes readable or the monotonic time deadline passes. */
+static
+void park(struct parked* p, uint64_t deadline)
+{
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLRDHUP, .data.fd = p->fd};
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, p->fd, &ev) < 0) {
+        close_connection(p->fd, &p->conn);
+        free(p);
+        return;
+    }
+    wheel_add(&wheel, &p->timer, ticks_at(deadline));
+    parked[p->fd] = p;
+    metrics_gauge(MG_PARKED, ++parked_count);
+}
+
+static
+struct parked* unpark(int fd)
+{
+    struct parked* p = parked[fd];
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    wheel_del(&wheel, &p->timer);
+    parked[fd] = NULL;
+    metrics_gauge(MG_PARKED, --parked_count);
+    return p;
+}
+
+/* Queue the readable connection p until a child is free or the wait limit passes. */
+static
+void enqueue(struct parked* p)
+{
+    p->waiting = true;
+    p->next = NULL;
+    p->prev = waiting_tail;
+    if (waiting_tail)
+        waiting_tail->next = p;
+    else
+        waiting_head = p;
+    waiting_tail = p;
+    wheel_add(&wheel, &p->timer, ticks_at(access_now() + limits.wait * 1000000ULL));
+    parked[p->fd] = p;
+    metrics_gauge(MG_WAITING, ++waiting_count);
+}
+
+static
+void dequeue(struct parked* p)
+{
+    if (p->prev)
+        p->prev->next = p->next;
+    else
+        waiting_head = p->next;
+    if (p->next)
+        p->next->prev = p->prev;
+    else
+        waiting_tail = p->prev;
+    wheel_del(&wheel, &p->timer);
+    parked[p->fd] = NULL;
+    p->waiting = false;
+    metrics_gauge(MG_WAITING, --waiting_count);
+}
+
+/* Stop sending to subscriber or follower s and close its connection. */
+static
+void unsubscribe(struct subscriber* s)
+{
+    events_remove(s);
+    wheel_del(&throttled, &s->throttle);
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, s->fd, NULL);
+    close_connection(s->fd, &s->conn);
+    if (s->file >= 0)
+        close(s->file);
+    metrics_gauge(MG_SUBSCRIBERS, events_count);
+    free(s);
+}
+
+/* Send a comment line to the subscribers every EVENTS_PING seconds while there are any. */
+static
+void ping_subscribers(void)
+{
+    events_send(NULL, 0, ":\n\n", 3, unsubscribe);
+    if (events_count)
+        wheel_add(&wheel, &ping_timer, now_ticks() + EVENTS_PING * 1000 / WHEEL_TICK_MS);
+}
+
+/*
+    Send follower s what was appended to its file; if its socket is full,
+    wait for it to be writable instead, and if the bandwidth limits are
+    used up, for its timer in the wheel of throttled followers, see
+    follow_send().
+*/
+static
+void follow(struct subscriber* s)
+{
+    bool blocked = s->blocked;
+    if (!follow_send(s)) {
+        unsubscribe(s);
+        return;
+    }
+    if (s->wait) {
+        metrics_throttled(s->wait / 1000);
+        wheel_add(&throttled, &s->throttle, ticks_at(access_now() + s->wait));
+    }
+    if (s->blocked != blocked) {
+        struct epoll_event ev = {.events = EPOLLIN | EPOLLRDHUP | (s->blocked ? EPOLLOUT : 0), .data.fd = s->fd};
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, s->fd, &ev);
+    }
+}
+
+/*
+    Hold connection c, which a child answered with the head of an ?events
+    stream or with a file for ?follow, as a subscriber to directory path
+    or as a follower of file path, whose open file is file. What was
+    published or appended after the child looked is sent to it first.
+*/
+static
+void subscribe(int c, const struct handoff* conn, const char* path, int file)
+{
+    struct subscriber* s = events_add(c, conn, path, file);
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLRDHUP, .data.fd = c};
+    if (!s || fcntl(c, F_SETFL, O_NONBLOCK) < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, c, &ev) < 0) {
+        if (s) {
+            events_remove(s);
+            free(s);
+        }
+        if (file >= 0)
+            close(file);
+        close_connection(c, conn);
+        return;
+    }
+    metrics_gauge(MG_SUBSCRIBERS, events_count);
+    if (file >= 0) {
+        follow(s);
+        return;
+    }
+    if (!timer_pending(&ping_timer))
+        wheel_add(&wheel, &ping_timer, now_ticks() + EVENTS_PING * 1000 / WHEEL_TICK_MS);
+    if (conn->since >= events_version)
+        return;
+
+    struct event_replay replay = {.out = snew(""), .dir = path, .until = events_version};
+    uint64_t version;
+    if (!journal_read(conn->since, path, &version, replay_line, &replay) && replay.out) {
+        supdatelen(replay.out, 0);
+        replay.out = scat(replay.out, strlen(EVENTS_RESYNC), EVENTS_RESYNC);
+    }
+    if (!replay.out || (sgetlen(replay.out) && !events_send_one(s, replay.out, sgetlen(replay.out))))
+        unsubscribe(s);
+    sfree(replay.out);
+}
+
+/* Send the event of record r to the subscribers of the directory it happened in. */
+static
+bool publish_line(void* ctx, const struct journal_record* r)
+{
+    (void) ctx;
+    size_t len = parent_len(r->path);
+    if (!events_wanted(r->path, len, false))
+        return true;
+    string line = event_line(snew(""), r);
+    if (line)
+        events_send(r->path, len, line, sgetlen(line), unsubscribe);
+    sfree(line);
+    return true;
+}
+
+/*
+    Send the records the change journal got since the last call to the
+    subscribers, after every batch of inotify events. If events were
+    lost, every subscriber is told to list its directory again.
+*/
+static
+void publish_events(void)
+{
+    uint64_t version = atomic_load_explicit(&journal->version, memory_order_relaxed);
+    if (events_count && version != events_version
+        && !journal_read(events_version, "", &version, publish_line, NULL))
+        events_lost = true;
+    if (events_count && events_lost)
+        events_send(NULL, 0, EVENTS_RESYNC, strlen(EVENTS_RESYNC), unsubscribe);
+    events_lost = false;
+    events_version = version;
+}
+
+/* The follower of a timer of the wheel of throttled followers may send again. */
+static
+void unthrottle(struct timer* t, void* arg)
+{
+    (void) arg;
+    follow((struct subscriber*) t);
+}
+
+/* A parked connection timed out, or a queued one waited too long for a child. */
+static
+void expire(struct timer* t, void* arg)
+{
+    (void) arg;
+    if (t == &ping_timer) {
+        ping_subscribers();
+        return;
+    }
+    struct parked* p = (struct parked*) t;
+    if (p->waiting) {
+        dequeue(p);
+        shed(p->fd, &p->conn, MS_WAIT);
+        free(p);
+        return;
+    }
+    metrics_timeout(p->fresh ? MT_HEADER : MT_IDLE);
+    unpark(p->fd);
+    close_connection(p->fd, &p->conn);
+    free(p);
+}
+
+/* Return 1 if fd has input, 0 if not, -1 if the client has gone. */
+static
+int peek(int fd)
+{
+    char byte;
+    ssize_t n = recv(fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        return 0;
+    return n > 0 ? 1 : -1;
+}
+
+/* Close the descriptors of parked connections and subscribers a child inherited, all but c. */
+static
+void close_inherited(int c)
+{
+    if ((c <= first_conn_fd || syscall(SYS_close_range, first_conn_fd, c - 1, 0) == 0)
+        && syscall(SYS_close_range, c + 1, ~0U, 0) == 0)
+        return;
+    size_t size = parked_size > events_size ? parked_size : events_size;
+    for (size_t fd = first_conn_fd; fd < size; fd++)
+        if (((fd < parked_size && parked[fd]) || events_find(fd)) && (int) fd != c)
+            close(fd);
+}
+
+/*
+    Fork a child to serve the readable connection p, or queue it if
+    limits.children are busy. If fork() fails the connection is shed, and
+    the error is logged at most once a second.
+*/
+static
+void serve(struct parked* p)
+{
+    if (children >= limits.children) {
+        enqueue(p);
+        return;
+    }
+    uint64_t head_start = p->fresh ? p->conn.start : access_now();
+    pid_t f = fork();
+    if (f == 0) {
+        signal(SIGCHLD, SIG_DFL);
+        sigprocmask(SIG_SETMASK, &wait_mask, NULL);
+        close(listen_fd);
+        close(epoll_fd);
+        close(handoff_fds[0]);
+        uring_accept_stop();
+        close_inherited(p->fd);
+        capture_use(getppid(), p->conn.number);
+        if (!handle_client(p->fd, &p->conn, head_start)) {
+            capture_end();
+            metrics_connection(-1);
+            admission_close(p->conn.ip_slot);
+        }
+        close(p->fd);
+        prefetch_wait();
+        exit(0);
+    }
+    if (f == -1) {
+        static time_t logged_at;
+        time_t now = time(NULL);
+        if (now != logged_at) {
+            log_err(stderr, "Fork() error: %d, shedding connections\n", errno);
+            logged_at = now;
+        }
+        shed(p->fd, &p->conn, MS_FORK);
+    } else {
+        children++;
+        metrics_gauge(MG_CHILDREN, children);
+        close(p->fd);
+    }
+    free(p);
+}
+
+/* Reap finished children and serve queued connections in their place. */
+static
+void reap_children(void)
+{
+    pid_t pid;
+    while ((pid = waitpid(-1, NULL, WNOHANG)) > 0)
+        if (pid != log_writer_pid && children > 0)
+            children--;
+    metrics_gauge(MG_CHILDREN, children);
+    while (waiting_head && children < limits.children) {
+        struct parked* p = waiting_head;
+        dequeue(p);
+        serve(p);
+    }
+}
+
+/* A parked connection is readable: serve it, or close it if the client has gone. */
+static
+void wake(int fd)
+{
+    int input = peek(fd);
+    if (input == 0)
+        return;
+    struct parked* p = unpark(fd);
+    if (input > 0) {
+        serve(p);
+        return;
+    }
+    close_connection(fd, &p->conn);
+    free(p);
+}
+
+/* Reason to shed a new connection, or MS_COUNT to admit it. */
+static
+enum metrics_shed admit(const struct handoff* conn, bool backlog_full)
+{
+    if (limits.conns && admission_open_count() > limits.conns)
+        return MS_CONNS;
+    if (limits.per_ip && admission_count(conn->ip_slot) > (int32_t) limits.per_ip)
+        return MS_PER_IP;
+    if (backlog_full)
+        return MS_BACKLOG;
+    if (admission_memory_low(conn->start))
+        return MS_MEMORY;
+    return MS_COUNT;
+}
+
+/* The next new client, 0 if there is none or accepting failed (see errno). */
+static
+int next_client(char client_ip[INET_ADDRSTRLEN])
+{
+    if (accept_fd == listen_fd)
+        return accept_client(listen_fd, client_ip);
+    int c;
+    while ((c = uring_accept_next()) >= 0) {
+        if (setup_client(c, client_ip))
+            return c;
+        close(c);
+    }
+    if (errno == EINVAL) {
+        /* The accept ring is closed, so epoll forgot it. */
+        log_info("Multishot accept is not supported, accepting with accept()\n");
+        struct epoll_event ev = {.events = EPOLLIN, .data.fd = listen_fd};
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev);
+        accept_fd = listen_fd;
+        return accept_client(listen_fd, client_ip);
+    }
+    error_desc = "accept() error";
+    return 0;
+}
+
+/*
+    Accept every waiting client. With TCP_DEFER_ACCEPT most have sent
+    their request by now and are served at once; the rest are parked
+    until their first request or the header timeout. Clients over a
+    limit are shed, see net/admission.c. If the accept queue is longer
+    than limits.backlog, the clients that have waited in it longest are
+    shed until it is back at the limit.
+*/
+static
+void accept_clients(void)
+{
+    uint32_t backlog = admission_backlog(listen_fd);
+    metrics_gauge(MG_BACKLOG, backlog);
+    uint32_t excess = limits.backlog && backlog > limits.backlog ? backlog - limits.backlog : 0;
+
+    struct handoff conn = {0};
+    int c;
+    while ((c = next_client(conn.client_ip))) {
+        conn.number = connections++;
+        conn.start = access_now();
+        struct in_addr addr = {0};
+        inet_pton(AF_INET, conn.client_ip, &addr);
+        conn.ip_slot = admission_open(addr.s_addr);
+        metrics_connection(1);
+        capture_begin(getpid(), conn.number);
+        enum metrics_shed reason = admit(&conn, excess > 0);
+        if (excess > 0)
+            excess--;
+        if (reason != MS_COUNT) {
+            shed(c, &conn, reason);
+            continue;
+        }
+        struct parked* p = parked_new(c, &conn, true);
+        if (p && peek(c) > 0)
+            serve(p);
+        else if (p)
+            park(p, conn.start + timeouts.header * 1000000ULL);
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+        log_err(stderr, "%s: %d\n", error_desc, errno);
+}
+
+/*
+    Park the idle connections children handed back until their idle
+    timeout, and hold the subscribers to ?events and the followers of
+    ?follow they handed over.
+*/
+static
+void receive_handoffs(void)
+{
+    struct handoff conn;
+    char path[PATH_MAX];
+    int c, file;
+    while ((c = handoff_recv(&conn, path, sizeof(path), &file)) != -1) {
+        if (c == HANDOFF_DROPPED) {
+            close_connection(-1, &conn);
+            continue;
+        }
+        if (conn.kind != HANDOFF_IDLE) {
+            subscribe(c, &conn, path, conn.kind == HANDOFF_FOLLOW ? file : -1);
+            continue;
+        }
+        struct parked* p = parked_new(c, &conn, false);
+        if (p)
+            park(p, conn.start + timeouts.idle * 1000000ULL);
+    }
+}
+
+/* Interrupts epoll_pwait() so finished children are reaped. */
+static
+void on_child(int sig)
+{
+    (void) sig;
+}
+
+void usage(char* name)
+{
+    fprintf(stderr, "Usage: %s [options] <ip> <port>\n"
+                    "where <ip> can be one of the following: \n"
+                    " - 'localhost' sets the listen address to 127.0.0.1\n"
+                    " - 'npa' which stands for no particular address, sets the listen address to 0.0.0.0\n"
+                    " - some other address chosen by the user\n"
+                    "and <port> is chosen by the user\n"
+                    "Options:\n"
+                    " -s <dir>   serve the UI files from <dir> instead of the built-in copies\n"
+                    " -l <level> log messages of at least <level>: debug, info (default) or error\n"
+                    " -a <file>  append the access log to <file> instead of printing it\n"
+                    " -b         write the access log file in binary records, see logger/access.c\n"
+                    " -c <file>  append the raw traffic of all connections to <file>, see tools/replay.c\n"
+                    " -m <path>  serve the metrics at <path> instead of /" METRICS_PATH ", 'off' to disable them\n"
+                    " -t <list>  set timeouts in seconds, e.g. header=10,idle=10,send=60,hold=0.2, see net/timeouts.c\n"
+                    " -A <list>  set admission limits, e.g. conns=4096,per_ip=64,children=256,wait=2, see net/admission.c\n"
+                    " -B <list>  limit bandwidth in MB/s, e.g. total=50,client=10,conn=5, see net/shaper.c\n"
+                    " -U on|off  use the io_uring backend if it was built in (make URING=1), on by default\n"
+                    " -P <n>     threads a child uses for file system work, 4 by default, see helpers/pool.c\n"
+                    " -H <file>  keep the digests computed for ?hash in <file>, see helpers/hashdb.c\n"
+                    " -W on|off  keep a journal of changes to the shared files for ?changes_since and ?events, on by\n"
+                    "            default, see helpers/journal.c\n"
+                    " -I on|off  index the names of the shared files for ?search, on by default, see helpers/search.c\n"
+                    " -X <dir>   save the search index in <dir>, " SEARCH_SNAPSHOT_DIR "-<uid> by default, 'off' to walk\n"
+                    "            the tree before searches are answered, see helpers/search.c\n"
+                    " -S <dir>   cache the block signatures for ?delta in <dir>, " DELTA_CACHE_DIR "-<uid> by default,\n"
+                    "            'off' to compute them for every request, see helpers/delta.c\n"
+                    "            Both must be directories of this user of mode 0700, or are not used\n"
+                    " -R on|off  warm the page cache for the files of a directory when it is listed, on by default,\n"
+                    "            see helpers/prefetch.c\n"
+                    "E.g. %s localhost 8080\n", name, name);
+}
+
+/*
+    Pass what helpers/watch.c reports to the change journal, the search
+    index and the followers of ?follow; the subscribers to ?events get
+    it from the journal, see publish_events().
+*/
+static
+void on_watch(enum watch_change change, const char* path, bool dir)
+{
+    events_lost |= change == WATCH_OVERFLOW;
+    journal_watch(change, path, dir);
+    search_watch(change, path, dir);
+    if (events_count && !dir)
+        follow_watch(change, path, follow);
+}
+
+/* Set *value from an on|off option. Return false for anything else, so a typo is not taken as off. */
+static
+bool parse_switch(const char* arg, bool* value)
+{
+    if (strcmp(arg, "on") && strcmp(arg, "off"))
+        return false;
+    *value = !strcmp(arg, "on");
+    return true;
 }
 
 /* Start the main server process, spawn child processes for clients. */
 int main(int argc, char* argv[]) 
 {
-    int s, c, f;
+    int opt;
+    char* access_file = NULL;
+    bool access_bin = false;
+    char* capture_file = NULL;
+    char* hash_file_path = NULL;
+    bool use_uring = true;
+    bool use_journal = true;
+    bool use_search = true;
+    bool use_prefetch = true;
     char* ip;
     char* port;
-    char client_ip[INET_ADDRSTRLEN];
-
-    if (argc < 3) {
-        fprintf(stderr, "Usage: %s <ip> <port>\n"
-                        "where <ip> can be one of the following: \n"
-                        " - 'localhost' sets the listen address to 127.0.0.1\n"
-                        " - 'npa' which stands for no particular address, sets the listen address to 0.0.0.0\n"
-                        " - some other address chosen by the user\n"
-                        "and <port> is chosen by the user\n"
-                        "E.g. %s localhost 8080\n", argv[0], argv[0]);
+    char snapshot_dir[64], cache_dir[64];
+    snprintf(snapshot_dir, sizeof(snapshot_dir), "%s-%u", SEARCH_SNAPSHOT_DIR, (unsigned) geteuid());
+    snprintf(cache_dir, sizeof(cache_dir), "%s-%u", DELTA_CACHE_DIR, (unsigned) geteuid());
+    search_snapshot_dir = snapshot_dir;
+    delta_cache_dir = cache_dir;
+
+    while ((opt = getopt(argc, argv, "s:l:a:bc:m:t:A:B:U:P:H:S:W:I:X:R:")) != -1) {
+        switch (opt) {
+            case 's':
+                static_dir = optarg;
+                break;
+            case 'l':
+                if (!strcmp(optarg, "debug"))
+                    log_level = LOG_LEVEL_DEBUG;
+                else if (!strcmp(optarg, "info"))
+                    log_level = LOG_LEVEL_INFO;
+                else if (!strcmp(optarg, "error"))
+                    log_level = LOG_LEVEL_ERR;
+                else {
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'a':
+                access_file = optarg;
+                break;
+            case 'b':
+                access_bin = true;
+                break;
+            case 'c':
+                capture_file = optarg;
+                break;
+            case 'm':
+                /* Compared to the normalized uri, which has no leading slash. */
+                metrics_path = strcmp(optarg, "off") ? optarg + strspn(optarg, "/") : NULL;
+                break;
+            case 't':
+                if (!timeouts_parse(optarg)) {
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'A':
+                if (!admission_parse(optarg)) {
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'B':
+                if (!shaper_parse(optarg)) {
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'U':
+                if (!parse_switch(optarg, &use_uring)) {
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'H':
+                hash_file_path = optarg;
+                break;
+            case 'W':
+                if (!parse_switch(optarg, &use_journal)) {
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'I':
+                if (!parse_switch(optarg, &use_search)) {
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'R':
+                if (!parse_switch(optarg, &use_prefetch)) {
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'X':
+                search_snapshot_dir = strcmp(optarg, "off") ? optarg : NULL;
+                break;
+            case 'S':
+                delta_cache_dir = strcmp(optarg, "off") ? optarg : NULL;
+                break;
+            case 'P': {
+                char* end;
+                unsigned long n = strtoul(optarg, &end, 10);
+                if (end == optarg || *end || n > POOL_MAX_THREADS) {
+                    usage(argv[0]);
+                    return -1;
+                }
+                pool_threads = n;
+                break;
+            }
+            default:
+                usage(argv[0]);
+                return -1;
+        }
+    }
+    if (argc - optind < 2) {
+        usage(argv[0]);
         return -1;
     }
 
-    ip = argv[1];
+    if (access_file && !access_open(access_file, access_bin)) {
+        log_err(stderr, "Could not open the access log %s\n", access_file);
+        return -1;
+    }
+    if (capture_file && !capture_open(capture_file)) {
+        log_err(stderr, "Could not open the capture file %s\n", capture_file);
+        return -1;
+    }
+    if (metrics_path && !metrics_init())
+        log_err(stderr, "Could not map the metrics, they are disabled\n");
+    if (!hashdb_open(hash_file_path))
+        log_err(stderr, "Could not map the hash database %s, digests are not kept\n",
+                hash_file_path ? hash_file_path : "in memory");
+    if (delta_cache_dir && !private_dir(delta_cache_dir)) {
+        log_err(stderr, "%s is not a private directory, block signatures are not cached\n", delta_cache_dir);
+        delta_cache_dir = NULL;
+    }
+    if (!admission_init())
+        log_err(stderr, "Could not map the connection counts, only children are limited\n");
+    if (use_uring)
+        uring_detect();
+    if (!shaper_init())
+        log_err(stderr, "Could not map the bandwidth state, bandwidth is not limited\n");
+    if (!log_start())
+        log_err(stderr, "Could not start the log writer, logging synchronously\n");
+
+    ip = argv[optind];
     if (!strncmp(ip, "localhost", 9))
         ip = LOCALHOST;
     else if (!strncmp(ip, "npa", 3))
         ip = NPA;
 
-    port = argv[2];
-    s = init_server(ip, atoi(port));
-    if (!s) {
+    if (!mime_init(MIME_TYPES_FILE)) {
+        log_err(stderr, "Not enough memory for the content type table\n");
+        return -1;
+    }
+    if (!assets_init()) {
+        log_err(stderr, "The template is missing from the built-in files\n");
+        return -1;
+    }
+
+    port = argv[optind + 1];
+    listen_fd = init_server(ip, atoi(port));
+    if (!listen_fd) {
         log_err(stderr, "%s\n", error_desc);
         return -1;
     }
+    fcntl(listen_fd, F_SETFL, O_NONBLOCK);
+    int defer = (timeouts.header + 999) / 1000;
+    setsockopt(listen_fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &defer, sizeof(defer));
+
+    /*
+        SIGCHLD is only let through while waiting for events, so one that
+        arrives while the loop is busy is not lost but ends the next wait.
+    */
+    struct sigaction sa = {.sa_handler = on_child};
+    sigaction(SIGCHLD, &sa, NULL);
+    sigset_t chld;
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld, &wait_mask);
+    signal(SIGPIPE, SIG_IGN);
+
+    if (!handoff_init() || (epoll_fd = epoll_create1(0)) < 0) {
+        log_err(stderr, "Could not set up the event loop: %d\n", errno);
+        return -1;
+    }
+    if (uring_enabled && (accept_fd = uring_accept_start(listen_fd)) >= 0)
+        log_info("Accepting with io_uring\n");
+    else
+        accept_fd = listen_fd;
+    if (use_prefetch && !prefetch_init())
+        log_err(stderr, "Could not map the prefetch history, listed files are not warmed\n");
+    if (use_journal && !journal_init())
+        log_err(stderr, "Could not start the change journal, ?changes_since and ?events are off\n");
+    /* With the index, the watches are added by the walk that builds it, in the background. */
+    if ((journal || use_search) && !(use_search ? watch_open() : watch_start())) {
+        log_err(stderr, "Could not watch the shared files, ?changes_since, ?events and ?search are off\n");
+        journal = NULL;
+        use_search = false;
+    }
+    bool full_logged = false;
+    if (use_search && search_snapshot_dir && !private_dir(search_snapshot_dir)) {
+        log_err(stderr, "%s is not a private directory, the search index is not saved\n", search_snapshot_dir);
+        search_snapshot_dir = NULL;
+    }
+    struct timespec load_start, load_end;
+    clock_gettime(CLOCK_MONOTONIC, &load_start);
+    bool loaded = false;
+    if (use_search && !search_start(&loaded))
+        log_err(stderr, "Could not index the shared files, ?search is off\n");
+    else if (loaded) {
+        clock_gettime(CLOCK_MONOTONIC, &load_end);
+        log_info("Loaded the search index of %u files and directories in %.0f ms, checking it in the background\n",
+                 search_index.count - 1,
+                 (load_end.tv_sec - load_start.tv_sec) * 1e3 + (load_end.tv_nsec - load_start.tv_nsec) / 1e6);
+    }
+    struct epoll_event watch_ev = {.events = EPOLLIN, .data.fd = watch_fd};
+    struct epoll_event search_ev = {.events = EPOLLIN, .data.fd = search_done_fd};
+    if ((watch_fd >= 0 && epoll_ctl(epoll_fd, EPOLL_CTL_ADD, watch_fd, &watch_ev) < 0)
+        || (search_done_fd >= 0 && epoll_ctl(epoll_fd, EPOLL_CTL_ADD, search_done_fd, &search_ev) < 0)) {
+        log_err(stderr, "Could not set up the event loop: %d\n", errno);
+        return -1;
+    }
+    struct epoll_event listen_ev = {.events = EPOLLIN, .data.fd = accept_fd};
+    struct epoll_event handoff_ev = {.events = EPOLLIN, .data.fd = handoff_fds[0]};
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, accept_fd, &listen_ev) < 0
+        || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, handoff_fds[0], &handoff_ev) < 0) {
+        log_err(stderr, "Could not set up the event loop: %d\n", errno);
+        return -1;
+    }
+    /* Nothing is opened after this, so connections get the descriptors above. */
+    first_conn_fd = (epoll_fd > accept_fd ? epoll_fd : accept_fd) + 1;
+    first_conn_fd = watch_fd >= first_conn_fd ? watch_fd + 1 : first_conn_fd;
+    first_conn_fd = search_done_fd >= first_conn_fd ? search_done_fd + 1 : first_conn_fd;
+    wheel_init(&wheel, now_ticks());
+    wheel_init(&throttled, now_ticks());
+    timer_init(&ping_timer);
+    events_version = journal ? atomic_load(&journal->version) : 0;
 
     /* 
-        Main loop for the main server process.
-        Accepts clients, creates child processes for them,
-        and handles them separately.
+        Main loop for the main server process. Accepted clients and idle
+        connections handed back by children are parked until they have
+        a request to read, then a child process is forked to serve them.
+        Parked connections cost no wakeups; the loop sleeps until the
+        next event or the next timer of the wheel.
     */
+    struct epoll_event events[MAX_EVENTS];
     while (1) 
     {
-        c = accept_client(s, client_ip);
-        if (!c) {
-            log_err(stderr, "%s: %d\n", error_desc, errno);
-            continue;
+        int timeout = -1;
+        uint64_t next = wheel_next(&wheel);
+        next = wheel_next(&throttled) < next ? wheel_next(&throttled) : next;
+        if (next != UINT64_MAX) {
+            uint64_t now = now_ticks();
+            uint64_t ms = next > now ? (next - now) * WHEEL_TICK_MS : 0;
+            timeout = ms < 3600000 ? ms : 3600000;
         }
-
-        /* If > 2000 calls then fork EAGAIN error (35). */
-        f = fork();
-        if (f == 0) {
-            handle_client(c);
-            close(c);
-            close(s);
-            exit(0);
-        } 
-        else if (f == -1) 
-            log_err(stderr, "Fork() error: %d\n", errno);
-        close(c);
+        int n = epoll_pwait(epoll_fd, events, MAX_EVENTS, timeout, &wait_mask);
+        reap_children();
+
+        /* Parked connections and subscribers first, new ones may reuse their descriptors. */
+        bool new_clients = false, handoffs = false;
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            if (fd == accept_fd)
+                new_clients = true;
+            else if (fd == handoff_fds[0])
+                handoffs = true;
+            else if (fd == watch_fd) {
+                watch_read(on_watch);
+                journal_publish();
+                if (journal)
+                    publish_events();
+            }
+            else if (fd == search_done_fd && search_walked())
+                log_info("Indexed %u files and directories in %.0f ms\n", search_index.count - 1, search_walk_ms);
+            else if (events_find(fd) && !(events[i].events & ~EPOLLOUT))
+                follow(events_find(fd));
+            else if (events_find(fd))
+                unsubscribe(events_find(fd));
+            else if ((size_t) fd < parked_size && parked[fd] && !parked[fd]->waiting)
+                wake(fd);
+        }
+        if (watch_full && !full_logged) {
+            log_err(stderr, "Out of inotify watches, the change journal and the search index miss some directories; "
+                            "raise fs.inotify.max_user_watches\n");
+            full_logged = true;
+        }
+        if (handoffs)
+            receive_handoffs();
+        if (new_clients)
+            accept_clients();
+        wheel_advance(&wheel, now_ticks(), expire, NULL);
+        wheel_advance(&throttled, now_ticks(), unthrottle, NULL);
     }
 
-    close(s);
+    close(listen_fd);
     return -1;
 }
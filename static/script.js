@@ -4,3 +4,71 @@ document.getElementById('clickButton').addEventListener('click', function() {
     count++;
     document.getElementById('counter').textContent = count;
 });
+
+/*
+    Keep the listing up to date with the changes the server pushes for
+    ?events on this directory, instead of reloading the page. A resync
+    means changes were lost, so the listing is loaded again.
+*/
+const listing = document.querySelector('ul');
+const base = location.pathname.endsWith('/') ? location.pathname : location.pathname + '/';
+
+/* Bytes with a unit, as format_size() in helpers/template.c writes them. */
+function formatSize(bytes) {
+    const units = ['B', 'KB', 'MB', 'GB', 'TB', 'PB', 'EB'];
+    let unit = 0;
+    while (bytes >= 1024 && unit < 6) {
+        bytes /= 1024;
+        unit++;
+    }
+    return (unit && bytes < 10 ? bytes.toFixed(1) : bytes.toFixed(0)) + ' ' + units[unit];
+}
+
+function findEntry(name) {
+    for (const a of listing.querySelectorAll('li > a'))
+        if (a.textContent === name)
+            return a.parentNode;
+    return null;
+}
+
+/* The entry of the listing for an event, as add_links() in helpers/template.c writes it. */
+function showEntry(li, entry) {
+    li.textContent = '';
+    const a = document.createElement('a');
+    a.href = base + entry.name;
+    a.textContent = entry.name;
+    li.appendChild(a);
+    if (entry.dir && entry.size !== undefined) {
+        const note = document.createElement('small');
+        note.textContent = '(' + formatSize(entry.size) + ', ' + entry.files + ' file' + (entry.files === 1 ? '' : 's') + ')';
+        li.append(' ', note);
+    }
+}
+
+if (listing && window.EventSource) {
+    const events = new EventSource(base + '?events');
+    events.addEventListener('added', function(e) {
+        const entry = JSON.parse(e.data);
+        let li = findEntry(entry.name);
+        if (!li) {
+            li = document.createElement('li');
+            listing.appendChild(li);
+        }
+        showEntry(li, entry);
+    });
+    events.addEventListener('modified', function(e) {
+        const entry = JSON.parse(e.data);
+        const li = findEntry(entry.name);
+        if (li)
+            showEntry(li, entry);
+    });
+    events.addEventListener('removed', function(e) {
+        const li = findEntry(JSON.parse(e.data).name);
+        if (li)
+            li.remove();
+    });
+    events.addEventListener('resync', function() {
+        events.close();
+        location.reload();
+    });
+}
@@ -0,0 +1,94 @@
+/* accessdump.c */
+
+/*
+    Print a binary access log, see logger/access.c.
+
+    Usage: accessdump [-s] <file>
+
+    Without -s every record is printed as a text line, the same as the
+    server writes in text mode. With -s the 50th, 99th and 99.9th
+    percentiles of the time to reach each stage are printed instead.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../logger/access.c"
+
+static int cmp_u32(const void* a, const void* b)
+{
+    uint32_t x = *(const uint32_t*) a, y = *(const uint32_t*) b;
+    return (x > y) - (x < y);
+}
+
+static void summary(struct access_record* records, size_t n)
+{
+    uint32_t* values = malloc((n ? n : 1) * sizeof(uint32_t));
+    if (!values)
+        return;
+    printf("%zu requests\n%-8s %10s %10s %10s %10s\n", n, "stage", "count", "p50", "p99", "p999");
+    for (int s = 0; s < AS_COUNT; s++) {
+        size_t m = 0;
+        for (size_t i = 0; i < n; i++)
+            if (records[i].stages[s] != ACCESS_NONE)
+                values[m++] = records[i].stages[s];
+        qsort(values, m, sizeof(uint32_t), cmp_u32);
+        printf("%-8s %10zu", access_stage_names[s], m);
+        const double quantiles[] = {0.5, 0.99, 0.999};
+        for (int q = 0; q < 3; q++) {
+            if (m)
+                printf(" %8uus", values[(size_t)(quantiles[q] * (m - 1))]);
+            else
+                printf(" %10s", "-");
+        }
+        printf("\n");
+    }
+    free(values);
+}
+
+int main(int argc, char* argv[])
+{
+    bool sum = argc == 3 && strcmp(argv[1], "-s") == 0;
+    if (argc != 2 && !sum) {
+        fprintf(stderr, "Usage: %s [-s] <file>\n", argv[0]);
+        return 1;
+    }
+    const char* path = argv[argc - 1];
+    FILE* f = fopen(path, "rb");
+    if (!f) {
+        perror(path);
+        return 1;
+    }
+
+    struct access_header header;
+    if (fread(&header, sizeof(header), 1, f) != 1
+        || memcmp(header.magic, ACCESS_MAGIC, sizeof(header.magic)) != 0
+        || header.version != ACCESS_VERSION
+        || header.record_size != sizeof(struct access_record)) {
+        fprintf(stderr, "%s: not a version %d access log\n", path, ACCESS_VERSION);
+        fclose(f);
+        return 1;
+    }
+
+    size_t n = 0, cap = 1024;
+    struct access_record* records = malloc(cap * sizeof(*records));
+    char line[ACCESS_TEXT_SIZE];
+    while (records && fread(&records[n], sizeof(*records), 1, f) == 1) {
+        if (!sum) {
+            fwrite(line, 1, access_text(&records[n], NULL, true, line, sizeof(line)), stdout);
+            continue;
+        }
+        if (++n == cap) {
+            struct access_record* tmp = realloc(records, cap * 2 * sizeof(*records));
+            if (!tmp)
+                break;
+            records = tmp;
+            cap *= 2;
+        }
+    }
+    fclose(f);
+    if (sum)
+        summary(records, n);
+    free(records);
+    return 0;
+}
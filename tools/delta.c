@@ -0,0 +1,326 @@
+/* delta.c */
+
+/*
+    share-delta: bring a local copy of a shared file up to date by
+    fetching only what changed, with POST <path>?delta (see
+    helpers/delta.c).
+
+    Usage: share-delta [-b block_size] <host> <port> <path> <old> [<new>]
+
+    The old file is split into blocks whose signatures are sent to the
+    server, which answers with the blocks to copy from the old file and
+    the bytes it does not have. The new file is written next to <new>,
+    checked against the BLAKE3 the server sent and renamed over it;
+    <new> is <old> by default, so the old file is replaced.
+
+    The block size is chosen from the size of the old file, between
+    2 KB and 64 KB, keeping the signatures under about a megabyte; a
+    smaller block finds more of a file that was edited in many places,
+    at the price of more signatures to send.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <ctype.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include "../helpers/delta.c"
+
+#define READ_SIZE       65536
+#define MIN_BLOCK       2048
+#define MAX_BLOCK       65536
+#define TARGET_BLOCKS   65536
+
+/* The response, read through a buffer and de-chunked. */
+struct reader {
+    int fd;
+    uint8_t buf[READ_SIZE];
+    size_t pos, len;
+    uint64_t chunk;             // bytes left in the current chunk
+    bool chunked, done;
+    uint64_t received;          // bytes read from the socket
+};
+
+static
+bool fill(struct reader* r)
+{
+    if (r->pos < r->len)
+        return true;
+    ssize_t n;
+    while ((n = read(r->fd, r->buf, sizeof(r->buf))) < 0 && errno == EINTR) {}
+    if (n <= 0)
+        return false;
+    r->pos = 0;
+    r->len = n;
+    r->received += n;
+    return true;
+}
+
+/* A line of the response head or of the chunk framing, without its "\r\n". */
+static
+bool read_line(struct reader* r, char* line, size_t cap)
+{
+    size_t n = 0;
+    while (fill(r)) {
+        char ch = r->buf[r->pos++];
+        if (ch == '\n') {
+            line[n > 0 && line[n - 1] == '\r' ? n - 1 : n] = 0;
+            return true;
+        }
+        if (n + 1 < cap)
+            line[n++] = ch;
+    }
+    return false;
+}
+
+/* Read len bytes of the body. */
+static
+bool read_body(struct reader* r, void* out, size_t len)
+{
+    uint8_t* p = out;
+    char line[64];
+    while (len > 0) {
+        if (r->chunked && r->chunk == 0) {
+            if (r->done || !read_line(r, line, sizeof(line)))
+                return false;
+            r->chunk = strtoull(line, NULL, 16);
+            r->done = r->chunk == 0;
+            if (r->done)
+                return false;
+        }
+        if (!fill(r))
+            return false;
+        size_t n = r->len - r->pos;
+        n = n < len ? n : len;
+        if (r->chunked) {
+            n = n < r->chunk ? n : r->chunk;
+            r->chunk -= n;
+        }
+        memcpy(p, r->buf + r->pos, n);
+        r->pos += n;
+        p += n;
+        len -= n;
+        /* The "\r\n" after a chunk. */
+        if (r->chunked && r->chunk == 0 && !read_line(r, line, sizeof(line)))
+            return false;
+    }
+    return true;
+}
+
+static
+bool write_all(int fd, const void* buf, size_t len)
+{
+    const char* p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static
+int connect_to(const char* host, const char* port)
+{
+    struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM}, *res;
+    if (getaddrinfo(host, port, &hints, &res) != 0)
+        return -1;
+    int fd = -1;
+    for (struct addrinfo* a = res; a && fd < 0; a = a->ai_next) {
+        fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+        if (fd >= 0 && connect(fd, a->ai_addr, a->ai_addrlen) < 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+/* The request head, with path percent-encoded. */
+static
+int format_head(char* out, size_t cap, const char* host, const char* path, size_t body_len)
+{
+    char uri[3 * 4096 + 1];
+    size_t n = 0;
+    if (*path != '/')
+        uri[n++] = '/';
+    for (const unsigned char* p = (const unsigned char*) path; *p && n + 4 < sizeof(uri); p++) {
+        if (isalnum(*p) || strchr("/-._~", *p))
+            uri[n++] = *p;
+        else
+            n += snprintf(uri + n, 4, "%%%02X", *p);
+    }
+    uri[n] = 0;
+    return snprintf(out, cap, "POST %s?delta HTTP/1.1\r\nHost: %s\r\nContent-Type: application/octet-stream\r\n"
+                              "Content-Length: %zu\r\nConnection: close\r\n\r\n", uri, host, body_len);
+}
+
+/* Copy count blocks of old from block first to out, feeding them to the hash. */
+static
+bool copy_blocks(int old, int out, uint32_t block_size, uint32_t first, uint32_t count, struct blake3* b,
+                 uint8_t* buf)
+{
+    off_t from = (off_t) first * block_size, to = from + (off_t) count * block_size;
+    while (from < to) {
+        ssize_t n = pread(old, buf, to - from < READ_SIZE ? to - from : READ_SIZE, from);
+        if (n <= 0 || !write_all(out, buf, n))
+            return false;
+        blake3_update(b, buf, n);
+        from += n;
+    }
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    uint32_t block_size = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "b:")) != -1) {
+        if (opt == 'b' && (block_size = atoi(optarg)) >= DELTA_MIN_BLOCK && block_size <= DELTA_MAX_BLOCK)
+            continue;
+        optind = argc + 1;
+        break;
+    }
+    if (argc - optind != 4 && argc - optind != 5) {
+        fprintf(stderr, "Usage: %s [-b block_size] <host> <port> <path> <old> [<new>]\n", argv[0]);
+        return 1;
+    }
+    const char* host = argv[optind];
+    const char* port = argv[optind + 1];
+    const char* path = argv[optind + 2];
+    const char* old_path = argv[optind + 3];
+    const char* new_path = argc - optind == 5 ? argv[optind + 4] : old_path;
+
+    int old = open(old_path, O_RDONLY);
+    struct stat st;
+    if (old < 0 || fstat(old, &st) < 0) {
+        fprintf(stderr, "Could not open %s\n", old_path);
+        return 1;
+    }
+    if (!block_size)
+        for (block_size = MIN_BLOCK; block_size < MAX_BLOCK && st.st_size / block_size > TARGET_BLOCKS;)
+            block_size *= 2;
+
+    /* The signatures. */
+    uint64_t count = st.st_size / block_size;
+    size_t body_len = DELTA_HEADER + count * DELTA_SIG;
+    struct delta_sig* sigs = malloc((count ? count : 1) * sizeof(*sigs));
+    uint8_t* body = malloc(body_len);
+    if (!sigs || !body || count > UINT32_MAX || body_len > DELTA_MAX_BODY) {
+        fprintf(stderr, "%s is too large, try a larger -b\n", old_path);
+        return 1;
+    }
+    if (!delta_sign(old, block_size, sigs, count)) {
+        fprintf(stderr, "Could not read %s\n", old_path);
+        return 1;
+    }
+    memcpy(body, DELTA_REQUEST_MAGIC, 4);
+    delta_put32(body + 4, block_size);
+    delta_put32(body + 8, count);
+    delta_put32(body + 12, 0);
+    for (uint64_t i = 0; i < count; i++) {
+        uint8_t* p = body + DELTA_HEADER + i * DELTA_SIG;
+        delta_put32(p, sigs[i].weak);
+        memcpy(p + 4, sigs[i].strong, DELTA_STRONG);
+    }
+    free(sigs);
+
+    /* The request. */
+    char head[16384];
+    int head_len = format_head(head, sizeof(head), host, path, body_len);
+    struct reader* r = calloc(1, sizeof(*r));
+    if (!r || (r->fd = connect_to(host, port)) < 0) {
+        fprintf(stderr, "Could not connect to %s:%s\n", host, port);
+        return 1;
+    }
+    if (!write_all(r->fd, head, head_len) || !write_all(r->fd, body, body_len)) {
+        fprintf(stderr, "Could not send the signatures\n");
+        return 1;
+    }
+    free(body);
+
+    /* The response head. */
+    char line[8192];
+    int status = 0;
+    if (!read_line(r, line, sizeof(line)) || sscanf(line, "HTTP/1.1 %d", &status) != 1) {
+        fprintf(stderr, "No response\n");
+        return 1;
+    }
+    while (read_line(r, line, sizeof(line)) && line[0])
+        if (!strncasecmp(line, "Transfer-Encoding:", 18) && strstr(line, "chunked"))
+            r->chunked = true;
+    if (status != 200) {
+        fprintf(stderr, "The server answered %d\n", status);
+        return 1;
+    }
+
+    uint8_t header[DELTA_RESPONSE_HEADER];
+    if (!read_body(r, header, sizeof(header)) || memcmp(header, DELTA_RESPONSE_MAGIC, 4)
+        || delta_get32(header + 4) != block_size) {
+        fprintf(stderr, "Malformed response\n");
+        return 1;
+    }
+    uint64_t size = delta_get64(header + 8);
+
+    char tmp_path[4096];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.delta.%d", new_path, (int) getpid());
+    int out = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, st.st_mode & 0777);
+    uint8_t* buf = malloc(READ_SIZE > DELTA_LITERAL_MAX ? READ_SIZE : DELTA_LITERAL_MAX);
+    if (out < 0 || !buf) {
+        fprintf(stderr, "Could not create %s\n", tmp_path);
+        return 1;
+    }
+
+    /* The instructions. */
+    struct blake3 b;
+    blake3_init(&b);
+    uint64_t copied = 0, literal = 0;
+    bool ok = true;
+    for (;;) {
+        uint8_t op[9];
+        if (!(ok = read_body(r, op, 1)) || op[0] == 'E')
+            break;
+        if (op[0] == 'C') {
+            ok = read_body(r, op + 1, 8) && delta_get32(op + 1) + (uint64_t) delta_get32(op + 5) <= count
+                 && copy_blocks(old, out, block_size, delta_get32(op + 1), delta_get32(op + 5), &b, buf);
+            copied += (uint64_t) delta_get32(op + 5) * block_size;
+        } else if (op[0] == 'L') {
+            ok = read_body(r, op + 1, 4) && delta_get32(op + 1) <= DELTA_LITERAL_MAX
+                 && read_body(r, buf, delta_get32(op + 1)) && write_all(out, buf, delta_get32(op + 1));
+            blake3_update(&b, buf, delta_get32(op + 1));
+            literal += delta_get32(op + 1);
+        } else
+            ok = false;
+        if (!ok)
+            break;
+    }
+    uint8_t digest[BLAKE3_LEN];
+    blake3_final(&b, digest);
+    ok = ok && copied + literal == size && memcmp(digest, header + 16, BLAKE3_LEN) == 0;
+    if (close(out) < 0 || !ok || rename(tmp_path, new_path) < 0) {
+        unlink(tmp_path);
+        fprintf(stderr, ok ? "Could not write %s\n" : "The rebuilt file does not match, %s is unchanged\n",
+                new_path);
+        return 1;
+    }
+
+    printf("%s: %llu bytes, %llu copied from %s, %llu literal; sent %zu, received %llu (%.2f%% of the file)\n",
+           new_path, (unsigned long long) size, (unsigned long long) copied, old_path,
+           (unsigned long long) literal, head_len + body_len, (unsigned long long) r->received,
+           size ? 100.0 * r->received / size : 0.0);
+    return 0;
+}
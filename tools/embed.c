@@ -0,0 +1,126 @@
+/* embed.c */
+
+/*
+    Build-time generator for the embedded static assets.
+
+    Usage: embed <output.c> <gzip dir> <file>...
+
+    Every file is emitted as a byte array together with its precompressed
+    variant <gzip dir>/<basename>.gz (if it exists and is smaller) and an
+    ETag derived from the content, see helpers/assets.h.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+static unsigned char* slurp(const char* path, size_t* len)
+{
+    FILE* f = fopen(path, "rb");
+    if (!f) return NULL;
+    size_t cap = 4096, n = 0, r;
+    unsigned char* buf = malloc(cap);
+    while (buf && (r = fread(buf + n, 1, cap - n, f)) > 0) {
+        n += r;
+        if (n == cap) {
+            unsigned char* tmp = realloc(buf, cap * 2);
+            if (!tmp) {
+                free(buf);
+                fclose(f);
+                return NULL;
+            }
+            buf = tmp;
+            cap *= 2;
+        }
+    }
+    fclose(f);
+    *len = n;
+    return buf;
+}
+
+static uint64_t fnv1a(const unsigned char* data, size_t len)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+static void emit_array(FILE* out, const char* name, const unsigned char* data, size_t len)
+{
+    fprintf(out, "static const unsigned char %s[] = {", name);
+    for (size_t i = 0; i < len; i++)
+        fprintf(out, "%s0x%02x,", i % 16 ? " " : "\n    ", data[i]);
+    fprintf(out, "\n    0x00\n};\n\n");
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s <output.c> <gzip dir> <file>...\n", argv[0]);
+        return 1;
+    }
+    FILE* out = fopen(argv[1], "w");
+    if (!out) {
+        perror(argv[1]);
+        return 1;
+    }
+    fprintf(out, "/* Generated by tools/embed.c, do not edit. */\n\n"
+                 "#include \"../helpers/assets.h\"\n\n");
+
+    int n = argc - 3;
+    uint64_t* etags = calloc(n > 0 ? n : 1, sizeof(uint64_t));
+    int* has_gz = calloc(n > 0 ? n : 1, sizeof(int));
+    size_t* lens = calloc(n > 0 ? n : 1, sizeof(size_t));
+    size_t* gz_lens = calloc(n > 0 ? n : 1, sizeof(size_t));
+
+    for (int i = 0; i < n; i++) {
+        const char* path = argv[i + 3];
+        const char* base = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+        char name[64];
+
+        unsigned char* data = slurp(path, &lens[i]);
+        if (!data) {
+            perror(path);
+            return 1;
+        }
+        etags[i] = fnv1a(data, lens[i]);
+        snprintf(name, sizeof(name), "asset_%d", i);
+        emit_array(out, name, data, lens[i]);
+        free(data);
+
+        char gz_path[4096];
+        snprintf(gz_path, sizeof(gz_path), "%s/%s.gz", argv[2], base);
+        unsigned char* gz = slurp(gz_path, &gz_lens[i]);
+        if (gz && gz_lens[i] < lens[i]) {
+            has_gz[i] = 1;
+            snprintf(name, sizeof(name), "asset_%d_gz", i);
+            emit_array(out, name, gz, gz_lens[i]);
+        }
+        free(gz);
+    }
+
+    fprintf(out, "const struct Asset assets[] = {\n");
+    for (int i = 0; i < n; i++) {
+        const char* path = argv[i + 3];
+        const char* base = strrchr(path, '/') ? strrchr(path, '/') + 1 : path;
+        fprintf(out, "    {\"%s\", asset_%d, %zu, ", base, i, lens[i]);
+        if (has_gz[i])
+            fprintf(out, "asset_%d_gz, %zu, ", i, gz_lens[i]);
+        else
+            fprintf(out, "0, 0, ");
+        fprintf(out, "\"%016llx\"},\n", (unsigned long long) etags[i]);
+    }
+    if (n == 0)
+        fprintf(out, "    {0, 0, 0, 0, 0, 0},\n");
+    fprintf(out, "};\n\nconst size_t n_assets = %d;\n", n);
+
+    free(etags);
+    free(has_gz);
+    free(lens);
+    free(gz_lens);
+    return fclose(out) != 0;
+}
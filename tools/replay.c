@@ -0,0 +1,927 @@
+/* replay.c */
+
+/*
+    share-replay: play traffic captured with share -c <file> back
+    against a server.
+
+    Usage: share-replay [-s speed] <capture> <host> <port>
+           share-replay -J <workload.jsonl> <capture>
+
+    Every captured connection is opened again and sent the same bytes,
+    chunk by chunk, as it received from its client.
+
+    With speed > 0 connections open, send and close at the captured
+    times divided by speed: 1 (the default) is the original pace, 10 is
+    ten times faster. The original concurrency then follows from the
+    timing.
+
+    With speed 0 there are no pauses. A connection opens as soon as
+    fewer connections are open than were open in the capture when it
+    was accepted, and sends its next chunk once a response to the
+    previous one has started to arrive.
+
+    Responses are read and framed as bench/loadgen.c does, by their
+    status line and Content-Length or chunked encoding, and discarded.
+    Only the first byte of a new response after a chunk was sent counts
+    as its first response byte, not the rest of an earlier one still
+    arriving. The results are the time to it after each chunk, bytes
+    and errors.
+
+    -J converts a JSON Lines workload into a capture file. Each line
+    must be an object with a "path" (or "uri" or "url") field. It may
+    also have:
+    - "method" (default GET)
+    - "time", in seconds; by default each line is 1ms after the last
+    - "conn", a number; lines with the same number share a connection,
+      otherwise each line gets its own
+    Lines without a path are skipped and counted.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <strings.h>
+#include <errno.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <netdb.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "../logger/capture.c"
+
+#define READ_SIZE       65536
+#define MAX_LINE        65536
+#define HEAD_SIZE       8192
+
+struct chunk {
+    uint64_t time;              // microseconds since the start of the capture
+    const char* data;
+    uint32_t len;
+};
+
+enum parse_state {
+    P_HEAD,
+    P_BODY,             // Content-Length bytes left
+    P_UNTIL_CLOSE,      // no length, the body ends with the connection
+    P_CHUNK_SIZE,
+    P_CHUNK_DATA,
+    P_CHUNK_END,        // "\r\n" after the chunk data
+    P_TRAILER,
+};
+
+enum conn_state {
+    C_WAITING,
+    C_OPEN,
+    C_DONE,
+};
+
+struct conn {
+    uint64_t id;
+    uint64_t open_time;
+    uint64_t close_time;
+    int level;                  // connections open in the capture when this one opened
+    struct chunk* chunks;
+    size_t n_chunks, cap_chunks;
+
+    enum conn_state state;
+    int fd;
+    bool connected;
+    size_t next;                // chunk being or to be sent
+    size_t written;             // bytes of it written so far
+    bool awaiting;              // a chunk was sent and no response started since
+    bool shut;
+    bool blocked;               // a send would block, EPOLLOUT is set
+    uint64_t sent_at;
+
+    /* The response being received. */
+    enum parse_state parse;
+    char head[HEAD_SIZE];
+    size_t head_len;
+    char line[32];              // chunk size line
+    size_t line_len;
+    uint64_t left;
+};
+
+static struct conn* conns;
+static size_t n_conns, cap_conns;
+static size_t* conn_index;      // open addressing, id -> conns index + 1
+static size_t index_mask;
+
+static struct addrinfo* addr;
+static double speed = 1;
+
+static uint32_t* latencies;
+static size_t n_latencies, cap_latencies;
+static uint64_t chunks_sent, bytes_out, bytes_in, errors;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static struct conn* find_conn(uint64_t id)
+{
+    if (!conn_index || n_conns * 2 >= index_mask + 1) {
+        size_t size = index_mask ? (index_mask + 1) * 2 : 1024;
+        size_t* index = calloc(size, sizeof(size_t));
+        if (!index)
+            return NULL;
+        for (size_t i = 0; i < n_conns; i++) {
+            size_t h = (conns[i].id * 0x9e3779b97f4a7c15ULL) >> 20 & (size - 1);
+            while (index[h])
+                h = (h + 1) & (size - 1);
+            index[h] = i + 1;
+        }
+        free(conn_index);
+        conn_index = index;
+        index_mask = size - 1;
+    }
+    size_t h = (id * 0x9e3779b97f4a7c15ULL) >> 20 & index_mask;
+    while (conn_index[h]) {
+        if (conns[conn_index[h] - 1].id == id)
+            return &conns[conn_index[h] - 1];
+        h = (h + 1) & index_mask;
+    }
+    if (n_conns == cap_conns) {
+        size_t cap = cap_conns ? cap_conns * 2 : 256;
+        struct conn* tmp = realloc(conns, cap * sizeof(struct conn));
+        if (!tmp)
+            return NULL;
+        conns = tmp;
+        cap_conns = cap;
+    }
+    struct conn* c = &conns[n_conns];
+    memset(c, 0, sizeof(*c));
+    c->id = id;
+    c->open_time = c->close_time = UINT64_MAX;
+    c->fd = -1;
+    conn_index[h] = ++n_conns;
+    return c;
+}
+
+static bool add_chunk(struct conn* c, uint64_t time, const char* data, uint32_t len)
+{
+    if (c->n_chunks == c->cap_chunks) {
+        size_t cap = c->cap_chunks ? c->cap_chunks * 2 : 4;
+        struct chunk* tmp = realloc(c->chunks, cap * sizeof(struct chunk));
+        if (!tmp)
+            return false;
+        c->chunks = tmp;
+        c->cap_chunks = cap;
+    }
+    c->chunks[c->n_chunks++] = (struct chunk){time, data, len};
+    return true;
+}
+
+/* Map the capture and index its events by connection. */
+static bool load(const char* path)
+{
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(path);
+        return false;
+    }
+    if ((size_t) st.st_size < sizeof(struct capture_header)) {
+        fprintf(stderr, "%s: not a capture\n", path);
+        return false;
+    }
+    const char* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror(path);
+        return false;
+    }
+    const struct capture_header* header = (const void*) map;
+    if (memcmp(header->magic, CAPTURE_MAGIC, sizeof(header->magic)) != 0
+        || header->version != CAPTURE_VERSION) {
+        fprintf(stderr, "%s: not a version %d capture\n", path, CAPTURE_VERSION);
+        return false;
+    }
+
+    uint64_t base = UINT64_MAX;
+    const char* end = map + st.st_size;
+    for (int pass = 0; pass < 2; pass++) {
+        const char* p = map + sizeof(struct capture_header);
+        while (end - p >= (ssize_t) sizeof(struct capture_record)) {
+            struct capture_record r;
+            memcpy(&r, p, sizeof(r));
+            p += sizeof(r);
+            if ((size_t)(end - p) < r.len)
+                break;
+            if (pass == 0) {
+                base = r.time < base ? r.time : base;
+                p += r.len;
+                continue;
+            }
+            uint64_t t = r.time - base;
+            struct conn* c = find_conn(r.conn);
+            if (!c)
+                return false;
+            if (r.type == CAPTURE_OPEN || c->open_time == UINT64_MAX)
+                c->open_time = c->open_time < t ? c->open_time : t;
+            if (r.type == CAPTURE_DATA && r.len && !add_chunk(c, t, p, r.len))
+                return false;
+            if (r.type == CAPTURE_CLOSE)
+                c->close_time = t;
+            p += r.len;
+        }
+    }
+    return true;
+}
+
+static int cmp_open(const void* a, const void* b)
+{
+    const struct conn* x = a;
+    const struct conn* y = b;
+    return (x->open_time > y->open_time) - (x->open_time < y->open_time);
+}
+
+struct edge {
+    uint64_t time;
+    int delta;
+    size_t conn;
+};
+
+static int cmp_edge(const void* a, const void* b)
+{
+    const struct edge* x = a;
+    const struct edge* y = b;
+    if (x->time != y->time)
+        return (x->time > y->time) - (x->time < y->time);
+    return x->delta - y->delta;     // closes before opens at the same time
+}
+
+/* Sort connections by open time and note the concurrency each one opened at. */
+static bool compute_levels(void)
+{
+    free(conn_index);
+    conn_index = NULL;
+    qsort(conns, n_conns, sizeof(struct conn), cmp_open);
+
+    struct edge* edges = malloc((n_conns ? n_conns : 1) * 2 * sizeof(struct edge));
+    if (!edges)
+        return false;
+    for (size_t i = 0; i < n_conns; i++) {
+        struct conn* c = &conns[i];
+        if (c->close_time == UINT64_MAX)
+            c->close_time = c->n_chunks ? c->chunks[c->n_chunks - 1].time : c->open_time;
+        edges[2 * i] = (struct edge){c->open_time, 1, i};
+        edges[2 * i + 1] = (struct edge){c->close_time, -1, i};
+    }
+    qsort(edges, n_conns * 2, sizeof(struct edge), cmp_edge);
+    int open = 0;
+    for (size_t i = 0; i < n_conns * 2; i++) {
+        open += edges[i].delta;
+        if (edges[i].delta > 0)
+            conns[edges[i].conn].level = open;
+    }
+    free(edges);
+    return true;
+}
+
+static void record_latency(uint64_t ns)
+{
+    if (n_latencies == cap_latencies) {
+        size_t cap = cap_latencies ? cap_latencies * 2 : 4096;
+        uint32_t* tmp = realloc(latencies, cap * sizeof(uint32_t));
+        if (!tmp)
+            return;
+        latencies = tmp;
+        cap_latencies = cap;
+    }
+    uint64_t us = ns / 1000;
+    latencies[n_latencies++] = us > UINT32_MAX ? UINT32_MAX : us;
+}
+
+/* Monotonic time at which an event captured at t is due. */
+static uint64_t due(uint64_t start, uint64_t t)
+{
+    return speed > 0 ? start + (uint64_t)(t * 1000 / speed) : start;
+}
+
+static void finish(int ep, struct conn* c, bool error, size_t* active)
+{
+    if (error)
+        errors++;
+    epoll_ctl(ep, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->fd = -1;
+    c->state = C_DONE;
+    (*active)--;
+}
+
+static bool open_conn(int ep, struct conn* c)
+{
+    c->fd = socket(addr->ai_family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (c->fd < 0)
+        return false;
+    int one = 1;
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(c->fd, addr->ai_addr, addr->ai_addrlen) < 0 && errno != EINPROGRESS) {
+        close(c->fd);
+        c->fd = -1;
+        return false;
+    }
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLOUT, .data.ptr = c};
+    if (epoll_ctl(ep, EPOLL_CTL_ADD, c->fd, &ev) < 0) {
+        close(c->fd);
+        c->fd = -1;
+        return false;
+    }
+    c->state = C_OPEN;
+    return true;
+}
+
+/* Wait for c to be writable as well as readable while a send would block. */
+static void set_blocked(int ep, struct conn* c, bool blocked)
+{
+    if (c->blocked == blocked)
+        return;
+    c->blocked = blocked;
+    struct epoll_event ev = {.events = EPOLLIN | (blocked ? EPOLLOUT : 0), .data.ptr = c};
+    epoll_ctl(ep, EPOLL_CTL_MOD, c->fd, &ev);
+}
+
+/*
+    Send whatever is due on c. Return the time its next event is due,
+    UINT64_MAX if it only waits for the server.
+*/
+static uint64_t progress(int ep, struct conn* c, uint64_t start, uint64_t now, size_t* active)
+{
+    if (!c->connected)
+        return UINT64_MAX;
+    while (c->next < c->n_chunks) {
+        struct chunk* ch = &c->chunks[c->next];
+        if (c->written == 0) {
+            if (due(start, ch->time) > now)
+                return due(start, ch->time);
+            if (speed == 0 && c->awaiting)
+                return UINT64_MAX;
+        }
+        ssize_t w = send(c->fd, ch->data + c->written, ch->len - c->written, MSG_NOSIGNAL);
+        if (w < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            set_blocked(ep, c, true);
+            return UINT64_MAX;
+        }
+        set_blocked(ep, c, false);
+        if (w < 0) {
+            finish(ep, c, true, active);
+            return UINT64_MAX;
+        }
+        bytes_out += w;
+        c->written += w;
+        if (c->written < ch->len)
+            return UINT64_MAX;
+        c->written = 0;
+        c->next++;
+        c->awaiting = true;
+        c->sent_at = now_ns();
+        chunks_sent++;
+    }
+    if (!c->shut) {
+        if (due(start, c->close_time) > now)
+            return due(start, c->close_time);
+        if (speed == 0 && c->awaiting)
+            return UINT64_MAX;
+        /* The server closes once it has answered everything. */
+        shutdown(c->fd, SHUT_WR);
+        c->shut = true;
+    }
+    return UINT64_MAX;
+}
+
+/* Parse the head in c->head, which ends with "\r\n\r\n". */
+static void parse_head(struct conn* c)
+{
+    c->head[c->head_len] = 0;
+    int status = 0;
+    sscanf(c->head, "HTTP/%*d.%*d %d", &status);
+
+    bool chunked = false, has_length = false;
+    char* line = strstr(c->head, "\r\n");
+    while (line && line[2] != '\r') {
+        line += 2;
+        char* colon = strchr(line, ':');
+        char* eol = strstr(line, "\r\n");
+        if (colon && colon < eol) {
+            char* v = colon + 1;
+            while (*v == ' ')
+                v++;
+            size_t name_len = colon - line;
+            if (name_len == 14 && strncasecmp(line, "Content-Length", 14) == 0) {
+                has_length = true;
+                c->left = strtoull(v, NULL, 10);
+            } else if (name_len == 17 && strncasecmp(line, "Transfer-Encoding", 17) == 0)
+                chunked = strncasecmp(v, "chunked", 7) == 0;
+        }
+        line = eol;
+    }
+
+    c->line_len = 0;
+    if (status == 304 || status == 204 || status < 200)
+        c->left = 0, c->parse = P_BODY;
+    else if (chunked)
+        c->parse = P_CHUNK_SIZE;
+    else if (has_length)
+        c->parse = P_BODY;
+    else
+        c->parse = P_UNTIL_CLOSE;
+}
+
+/*
+    Consume n received bytes. Return 1 if a new response starts in them,
+    0 if not and -1 if a head does not fit.
+*/
+static int parse(struct conn* c, const char* data, size_t n)
+{
+    int started = 0;
+    while (n > 0 || (c->parse == P_BODY && c->left == 0)) {
+        switch (c->parse) {
+        case P_HEAD: {
+            /* Copy up to the end of the head; the terminator may span reads. */
+            started |= c->head_len == 0;
+            size_t i = 0;
+            while (i < n) {
+                if (c->head_len == HEAD_SIZE - 1)
+                    return -1;
+                c->head[c->head_len++] = data[i++];
+                if (c->head_len >= 4 && memcmp(c->head + c->head_len - 4, "\r\n\r\n", 4) == 0) {
+                    parse_head(c);
+                    break;
+                }
+            }
+            data += i;
+            n -= i;
+            break;
+        }
+        case P_BODY: {
+            size_t take = n < c->left ? n : c->left;
+            data += take;
+            n -= take;
+            c->left -= take;
+            if (c->left == 0) {
+                c->parse = P_HEAD;
+                c->head_len = 0;
+            }
+            break;
+        }
+        case P_UNTIL_CLOSE:
+            return started;
+        case P_CHUNK_SIZE:
+        case P_TRAILER: {
+            char ch = *data++;
+            n--;
+            if (ch != '\n') {
+                if (c->line_len < sizeof(c->line) - 1)
+                    c->line[c->line_len++] = ch;
+                break;
+            }
+            c->line[c->line_len] = 0;
+            bool empty = c->line_len == 0 || (c->line_len == 1 && c->line[0] == '\r');
+            c->line_len = 0;
+            if (c->parse == P_TRAILER) {
+                if (empty)
+                    c->left = 0, c->parse = P_BODY;
+                break;
+            }
+            c->left = strtoull(c->line, NULL, 16);
+            c->parse = c->left ? P_CHUNK_DATA : P_TRAILER;
+            break;
+        }
+        case P_CHUNK_DATA:
+        case P_CHUNK_END: {
+            size_t take = n < c->left ? n : c->left;
+            data += take;
+            n -= take;
+            c->left -= take;
+            if (c->left == 0 && c->parse == P_CHUNK_DATA)
+                c->left = 2, c->parse = P_CHUNK_END;
+            else if (c->left == 0)
+                c->parse = P_CHUNK_SIZE;
+            break;
+        }
+        }
+    }
+    return started;
+}
+
+static void readable(int ep, struct conn* c, size_t* active)
+{
+    static char buf[READ_SIZE];
+    for (;;) {
+        ssize_t r = recv(c->fd, buf, sizeof(buf), 0);
+        if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (r <= 0) {
+            /* Closed by the server before all chunks were sent counts as an error. */
+            finish(ep, c, r < 0 || c->next < c->n_chunks, active);
+            return;
+        }
+        bytes_in += r;
+        int started = parse(c, buf, r);
+        if (started < 0) {
+            finish(ep, c, true, active);
+            return;
+        }
+        if (started && c->awaiting) {
+            record_latency(now_ns() - c->sent_at);
+            c->awaiting = false;
+        }
+    }
+}
+
+static int cmp_u32(const void* a, const void* b)
+{
+    uint32_t x = *(const uint32_t*) a, y = *(const uint32_t*) b;
+    return (x > y) - (x < y);
+}
+
+/* The nearest rank: the smallest latency that at least q of them do not exceed. */
+static double percentile(double q)
+{
+    if (n_latencies == 0)
+        return 0;
+    size_t rank = (size_t) ceil(q * n_latencies);
+    return latencies[rank > 0 ? rank - 1 : 0] / 1000.0;
+}
+
+static int replay(void)
+{
+    signal(SIGPIPE, SIG_IGN);
+    int ep = epoll_create1(0);
+    struct conn** open_list = malloc((n_conns ? n_conns : 1) * sizeof(struct conn*));
+    if (ep < 0 || !open_list) {
+        perror("share-replay");
+        return 1;
+    }
+
+    size_t next_open = 0, n_open = 0, active = 0;
+    uint64_t start = now_ns();
+    struct epoll_event events[256];
+    while (next_open < n_conns || active > 0) {
+        uint64_t now = now_ns();
+        uint64_t wake = UINT64_MAX;
+
+        while (next_open < n_conns) {
+            struct conn* c = &conns[next_open];
+            if (speed > 0 && due(start, c->open_time) > now) {
+                wake = due(start, c->open_time);
+                break;
+            }
+            if (speed == 0 && active >= (size_t) c->level)
+                break;
+            next_open++;
+            if (!open_conn(ep, c)) {
+                errors++;
+                c->state = C_DONE;
+                continue;
+            }
+            active++;
+            open_list[n_open++] = c;
+        }
+
+        for (size_t i = 0; i < n_open; ) {
+            struct conn* c = open_list[i];
+            uint64_t t = c->state == C_OPEN ? progress(ep, c, start, now, &active) : UINT64_MAX;
+            if (c->state == C_DONE) {
+                open_list[i] = open_list[--n_open];
+                continue;
+            }
+            wake = t < wake ? t : wake;
+            i++;
+        }
+
+        int timeout = 100;
+        if (wake != UINT64_MAX)
+            timeout = wake > now ? (int)((wake - now) / 1000000) : 0;
+        timeout = timeout > 100 ? 100 : timeout;
+        int n = epoll_wait(ep, events, 256, timeout);
+        for (int i = 0; i < n; i++) {
+            struct conn* c = events[i].data.ptr;
+            if (c->state != C_OPEN)
+                continue;
+            if (events[i].events & EPOLLOUT && !c->connected) {
+                /* Connected: wait for writability again only when a send would block. */
+                c->connected = true;
+                c->blocked = true;
+                set_blocked(ep, c, false);
+            }
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+                readable(ep, c, &active);
+        }
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+
+    uint64_t captured = 0;
+    for (size_t i = 0; i < n_conns; i++)
+        captured = conns[i].close_time > captured ? conns[i].close_time : captured;
+
+    qsort(latencies, n_latencies, sizeof(uint32_t), cmp_u32);
+    printf("%zu connections, %llu chunks in %.3fs (captured %.3fs)\n"
+           "sent %llu bytes, received %llu bytes, %llu errors\n"
+           "first response byte: p50 %.3fms  p99 %.3fms  p999 %.3fms\n",
+           n_conns, (unsigned long long) chunks_sent, elapsed, captured / 1e6,
+           (unsigned long long) bytes_out, (unsigned long long) bytes_in,
+           (unsigned long long) errors, percentile(0.5), percentile(0.99), percentile(0.999));
+    free(open_list);
+    return 0;
+}
+
+/* JSON Lines import. */
+
+static const char* json_ws(const char* p)
+{
+    while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+        p++;
+    return p;
+}
+
+/* Decode the string starting at the quote p into out, return the end or NULL. */
+static const char* json_string(const char* p, char* out, size_t size)
+{
+    size_t n = 0;
+    for (p++; *p && *p != '"'; p++) {
+        unsigned c = (unsigned char) *p;
+        if (c == '\\') {
+            p++;
+            switch (*p) {
+                case 'n': c = '\n'; break;
+                case 't': c = '\t'; break;
+                case 'r': c = '\r'; break;
+                case 'b': c = '\b'; break;
+                case 'f': c = '\f'; break;
+                case 'u': {
+                    char hex[5] = {0};
+                    for (int i = 0; i < 4 && p[1]; i++)
+                        hex[i] = *++p;
+                    c = strtoul(hex, NULL, 16);
+                    if (c >= 0x80) {
+                        /* Encode as UTF-8, surrogates are not combined. */
+                        char utf8[3];
+                        int len = c < 0x800 ? 2 : 3;
+                        if (len == 2) {
+                            utf8[0] = 0xc0 | c >> 6;
+                            utf8[1] = 0x80 | (c & 0x3f);
+                        } else {
+                            utf8[0] = 0xe0 | c >> 12;
+                            utf8[1] = 0x80 | (c >> 6 & 0x3f);
+                            utf8[2] = 0x80 | (c & 0x3f);
+                        }
+                        for (int i = 0; i < len; i++)
+                            if (n + 1 < size)
+                                out[n++] = utf8[i];
+                        continue;
+                    }
+                    break;
+                }
+                case 0: return NULL;
+                default: c = (unsigned char) *p; break;
+            }
+        }
+        if (n + 1 < size)
+            out[n++] = c;
+    }
+    out[n] = 0;
+    return *p == '"' ? p + 1 : NULL;
+}
+
+/* Skip any value starting at p, return its end or NULL. */
+static const char* json_skip(const char* p)
+{
+    char tmp[1];
+    if (*p == '"')
+        return json_string(p, tmp, sizeof(tmp));
+    int depth = 0;
+    for (; *p; p++) {
+        if (*p == '"') {
+            if (!(p = json_string(p, tmp, sizeof(tmp))))
+                return NULL;
+            p--;
+        } else if (*p == '{' || *p == '[')
+            depth++;
+        else if (*p == '}' || *p == ']') {
+            if (depth == 0)
+                return p;
+            if (--depth == 0)
+                return p + 1;
+        } else if (*p == ',' && depth == 0)
+            return p;
+    }
+    return depth == 0 ? p : NULL;
+}
+
+struct workload_line {
+    char path[8192];
+    char method[16];
+    double time;
+    bool has_time;
+    long long conn;
+    bool has_conn;
+};
+
+/* Read the top level fields of one object, return false if it is malformed. */
+static bool json_line(const char* p, struct workload_line* w)
+{
+    char key[64], value[8192];
+    p = json_ws(p);
+    if (*p++ != '{')
+        return false;
+    for (;;) {
+        p = json_ws(p);
+        if (*p == '}')
+            return true;
+        if (*p != '"' || !(p = json_string(p, key, sizeof(key))))
+            return false;
+        p = json_ws(p);
+        if (*p++ != ':')
+            return false;
+        p = json_ws(p);
+        if (*p == '"') {
+            if (!(p = json_string(p, value, sizeof(value))))
+                return false;
+            if (!strcmp(key, "path") || !strcmp(key, "uri") || !strcmp(key, "url"))
+                snprintf(w->path, sizeof(w->path), "%s", value);
+            else if (!strcmp(key, "method"))
+                snprintf(w->method, sizeof(w->method), "%.15s", value);
+        } else {
+            const char* end = json_skip(p);
+            if (!end)
+                return false;
+            char* num_end;
+            double num = strtod(p, &num_end);
+            if (num_end != p && (!strcmp(key, "time") || !strcmp(key, "ts"))) {
+                w->time = num;
+                w->has_time = true;
+            } else if (num_end != p && !strcmp(key, "conn")) {
+                w->conn = (long long) num;
+                w->has_conn = true;
+            }
+            p = end;
+        }
+        p = json_ws(p);
+        if (*p == ',')
+            p++;
+        else if (*p != '}')
+            return false;
+    }
+}
+
+/* Write "<method> <path> HTTP/1.1" with unsafe bytes of path percent-encoded. */
+static int make_request(const struct workload_line* w, char* out, size_t size)
+{
+    const char* path = w->path;
+    const char* scheme = strstr(path, "://");
+    if (scheme) {
+        path = strchr(scheme + 3, '/');
+        path = path ? path : "/";
+    }
+    char encoded[8192 * 3 + 2];
+    size_t n = 0;
+    if (*path != '/')
+        encoded[n++] = '/';
+    for (; *path && n + 4 < sizeof(encoded); path++) {
+        unsigned char c = *path;
+        if (c <= ' ' || c >= 0x7f || c == '"' || c == '#')
+            n += snprintf(encoded + n, 4, "%%%02X", c);
+        else
+            encoded[n++] = c;
+    }
+    encoded[n] = 0;
+    return snprintf(out, size, "%s %s HTTP/1.1\r\nHost: share-replay\r\n\r\n",
+                    w->method[0] ? w->method : "GET", encoded);
+}
+
+static void write_record(FILE* out, uint64_t time, uint64_t conn, uint32_t type,
+                         const char* data, uint32_t len)
+{
+    struct capture_record r = {.time = time, .conn = conn, .type = type, .len = len};
+    fwrite(&r, sizeof(r), 1, out);
+    if (len)
+        fwrite(data, 1, len, out);
+}
+
+static int import_jsonl(const char* in_path, const char* out_path)
+{
+    FILE* in = fopen(in_path, "r");
+    if (!in) {
+        perror(in_path);
+        return 1;
+    }
+    FILE* out = fopen(out_path, "wb");
+    if (!out) {
+        perror(out_path);
+        fclose(in);
+        return 1;
+    }
+    struct capture_header header = {.version = CAPTURE_VERSION};
+    memcpy(header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+    fwrite(&header, sizeof(header), 1, out);
+
+    /* Connections that were opened, to close them at their last request. */
+    struct { long long id; uint64_t last; } *open_conns = NULL;
+    size_t n_open = 0;
+
+    char* line = malloc(MAX_LINE);
+    static struct workload_line w;
+    static char request[8192 * 3 + 64];
+    size_t imported = 0, skipped = 0, lines = 0;
+    uint64_t t = 0;
+    while (line && fgets(line, MAX_LINE, in)) {
+        if (*json_ws(line) == 0)
+            continue;
+        memset(&w, 0, sizeof(w));
+        if (!json_line(line, &w) || !w.path[0]) {
+            skipped++;
+            lines++;
+            continue;
+        }
+        t = w.has_time ? (uint64_t)(w.time * 1e6) : lines * 1000;
+        long long id = w.has_conn ? w.conn : -(long long) lines - 1;
+        lines++;
+
+        size_t i = 0;
+        while (i < n_open && open_conns[i].id != id)
+            i++;
+        if (i == n_open) {
+            void* tmp = realloc(open_conns, (n_open + 1) * sizeof(*open_conns));
+            if (!tmp)
+                break;
+            open_conns = tmp;
+            open_conns[n_open].id = id;
+            n_open++;
+            write_record(out, t, (uint64_t) id, CAPTURE_OPEN, NULL, 0);
+        }
+        open_conns[i].last = t;
+        int len = make_request(&w, request, sizeof(request));
+        if (len > 0 && (size_t) len < sizeof(request)) {
+            write_record(out, t, (uint64_t) id, CAPTURE_DATA, request, len);
+            imported++;
+        }
+    }
+    for (size_t i = 0; i < n_open; i++)
+        write_record(out, open_conns[i].last + 1000, (uint64_t) open_conns[i].id, CAPTURE_CLOSE, NULL, 0);
+
+    printf("%zu requests on %zu connections imported, %zu lines without a path skipped\n",
+           imported, n_open, skipped);
+    free(open_conns);
+    free(line);
+    fclose(in);
+    return fclose(out) != 0;
+}
+
+static void usage(const char* name)
+{
+    fprintf(stderr, "Usage: %s [-s speed] <capture> <host> <port>\n"
+                    "       %s -J <workload.jsonl> <capture>\n", name, name);
+}
+
+int main(int argc, char* argv[])
+{
+    int opt;
+    const char* jsonl = NULL;
+    while ((opt = getopt(argc, argv, "s:J:")) != -1) {
+        switch (opt) {
+            case 's': speed = atof(optarg); break;
+            case 'J': jsonl = optarg; break;
+            default: usage(argv[0]); return 1;
+        }
+    }
+    if (jsonl) {
+        if (argc - optind != 1) {
+            usage(argv[0]);
+            return 1;
+        }
+        return import_jsonl(jsonl, argv[optind]);
+    }
+    if (argc - optind != 3 || speed < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    struct addrinfo hints = {.ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM};
+    int err = getaddrinfo(argv[optind + 1], argv[optind + 2], &hints, &addr);
+    if (err) {
+        fprintf(stderr, "%s: %s\n", argv[optind + 1], gai_strerror(err));
+        return 1;
+    }
+    if (!load(argv[optind]) || !compute_levels()) {
+        fprintf(stderr, "Could not load %s\n", argv[optind]);
+        return 1;
+    }
+    int ret = replay();
+    freeaddrinfo(addr);
+    return ret;
+}